@@ -0,0 +1,114 @@
+/**
+ * Programmatic construction of binary ECL files
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_BUILDER_H__
+#define __ECLI_BUILDER_H__
+
+#include "ecli.h"
+
+/*
+ * Usage, in this order:
+ *   ecl_builder_init()
+ *   ecl_builder_add_include()      any number of times
+ *   ecl_builder_begin_subs()       declares every sub name up front
+ *   ecl_builder_begin_sub()        then instructions, labels, ...
+ *   ecl_builder_end_sub()          for each declared sub, in any order
+ *   ecl_builder_finish()
+ *
+ * Everything except the sub currently being built is written out as soon as
+ * it is known, so the memory used does not grow with the size of the file.
+ * The sub offset table is patched in by ecl_builder_finish().
+ */
+
+#define BUILDER_NO_LABEL 0xFFFFFFFF
+
+typedef struct {
+    uint32_t offset; /* offset within the sub, BUILDER_NO_LABEL if unbound */
+    uint32_t time; /* time label in effect where the label was bound */
+} ecl_builder_label_t;
+
+typedef struct {
+    uint32_t at; /* offset of the jump instruction within the sub */
+    uint32_t label;
+} ecl_builder_fixup_t;
+
+typedef struct {
+    // Output: a seekable file, or a growable memory buffer if f is NULL
+    FILE* f;
+    uint8_t* mem;
+    size_t mem_cap;
+    uint32_t pos; /* bytes written so far */
+
+    // Include lists, buffered until ecl_builder_begin_subs()
+    char* includes[INCLUDE_MAX];
+    uint32_t include_size[INCLUDE_MAX];
+    uint32_t include_count[INCLUDE_MAX];
+
+    // Sub table, sorted by name as the loader expects
+    uint32_t sub_count;
+    char** names;
+    uint32_t* offsets;
+    uint32_t table_pos;
+    int32_t cur_sub;
+    uint32_t subs_done;
+
+    // The sub currently being built
+    uint8_t* buf;
+    uint32_t len;
+    uint32_t cap;
+    uint32_t time;
+    uint8_t rank_mask;
+    ecl_builder_label_t* labels;
+    uint32_t label_count;
+    uint32_t label_cap;
+    ecl_builder_fixup_t* fixups;
+    uint32_t fixup_count;
+    uint32_t fixup_cap;
+} ecl_builder_t;
+
+extern ecli_result_t ecl_builder_init(ecl_builder_t* b, FILE* f);
+extern void ecl_builder_free(ecl_builder_t* b);
+extern ecli_result_t ecl_builder_add_include(ecl_builder_t* b, include_t include, const char* name);
+extern ecli_result_t ecl_builder_begin_subs(ecl_builder_t* b, const char** names, uint32_t count);
+
+extern ecli_result_t ecl_builder_begin_sub(ecl_builder_t* b, const char* name);
+extern ecli_result_t ecl_builder_end_sub(ecl_builder_t* b);
+extern void ecl_builder_set_time(ecl_builder_t* b, uint32_t time);
+extern void ecl_builder_set_rank(ecl_builder_t* b, uint8_t rank_mask);
+
+extern uint32_t ecl_builder_new_label(ecl_builder_t* b);
+extern ecli_result_t ecl_builder_bind_label(ecl_builder_t* b, uint32_t label);
+extern ecli_result_t ecl_builder_ins(ecl_builder_t* b, uint16_t id, uint16_t param_mask, const char* format, ...);
+extern ecli_result_t ecl_builder_jump(ecl_builder_t* b, uint16_t id, uint32_t label);
+
+extern ecli_result_t ecl_builder_finish(ecl_builder_t* b);
+extern uint8_t* ecl_builder_get_buffer(ecl_builder_t* b, size_t* size);
+
+#endif
@@ -0,0 +1,138 @@
+/**
+ * Bullet manager: bullet emitters of enemies and the bullets they fire
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_BULLET_H__
+#define __ECLI_BULLET_H__
+
+#include <stdint.h>
+
+#include "value.h"
+
+/*
+ * Every enemy has BULLET_EMITTERS emitters, set up by the et* instructions
+ * and fired by etOn from the enemy's position. The bullets themselves belong
+ * to the runtime's manager, which keeps each property in its own array
+ * (structure of arrays), so the per-frame update is a few vector loops over
+ * the whole pool. Slots of dead bullets are reused through a free list; a
+ * dead bullet has a lifetime of 0 and no velocity, so the loops don't need
+ * to skip it.
+ *
+ * After moving, bullets are sorted into a uniform grid over the playfield,
+ * and only those in the cells around the player are tested for hits.
+ */
+
+#define BULLET_EMITTERS 16
+#define BULLET_WIDTH 8 // floats per vector, the pool grows in whole vectors
+#define BULLET_LIFETIME (60 * 60 * 10) // frames before a bullet is culled anyway
+
+// Playfield, in game coordinates, and how far out bullets live
+#define PLAYFIELD_LEFT (-192.0f)
+#define PLAYFIELD_RIGHT 192.0f
+#define PLAYFIELD_TOP 0.0f
+#define PLAYFIELD_BOTTOM 448.0f
+#define PLAYFIELD_MARGIN 32.0f
+
+#define BULLET_CELL_SIZE 32.0f
+#define BULLET_HIT_RADIUS 4.0f // bullet and player hitbox together
+
+// etAim modes
+enum {
+    AIM_FAN_AIMED=0, // count1 bullets around the angle to the player, angle2 apart
+    AIM_FAN=1, // the same around angle1
+    AIM_RING_AIMED=2, // count1 bullets spread evenly around the circle
+    AIM_RING=3,
+    AIM_RING_AIMED_AWAY=4, // rings turned by half their spacing
+    AIM_RING_AWAY=5,
+    AIM_RANDOM_ANGLE=6, // random angle within angle2 of angle1, random speed
+    AIM_RANDOM=7 // random angle and speed
+};
+
+typedef struct _bullet_emitter {
+    float offset_x, offset_y;
+    float angle1, angle2;
+    float speed1, speed2;
+    int32_t count1, count2; // bullets per layer, layers
+    int32_t aim;
+    int32_t sprite, color;
+} bullet_emitter_t;
+
+typedef struct {
+    // Last frame
+    uint32_t live;
+    uint32_t spawned;
+    uint32_t culled;
+    uint32_t hits;
+    
+    // Whole run
+    uint32_t peak;
+    uint64_t total_spawned;
+    uint64_t total_culled;
+    uint64_t total_hits;
+} bullet_stats_t;
+
+typedef struct {
+    // Pools, each aligned to a vector and capacity entries long
+    float* x;
+    float* y;
+    float* vx;
+    float* vy;
+    float* angle;
+    float* speed;
+    int32_t* life; // frames left, 0 if the slot is free
+    void* mem; // all of the above
+    uint32_t capacity;
+    uint32_t used; // slots below this have been handed out at some point
+    
+    uint32_t* free; // free slots below used
+    uint32_t free_count;
+    uint32_t spawns; // since the last update
+    
+    // Grid: the bullets of cell c are order[start[c]] to order[start[c + 1] - 1]
+    uint32_t* start;
+    uint32_t* order;
+    uint16_t* cell; // per slot
+    
+    bullet_stats_t stats;
+} bullet_manager_t;
+
+struct _ecl_state;
+
+/* bullet.c */
+extern void bullet_init(bullet_manager_t* bm);
+extern void bullet_free(bullet_manager_t* bm);
+extern void bullet_clear(bullet_manager_t* bm);
+extern uint32_t bullet_spawn(bullet_manager_t* bm, float x, float y, float angle, float speed);
+extern void bullet_update(bullet_manager_t* bm, float player_x, float player_y);
+extern bullet_emitter_t* bullet_emitter(struct _ecl_state* state, int32_t et);
+extern void bullet_emitter_reset(bullet_emitter_t* et);
+extern void bullet_fire(struct _ecl_state* state, bullet_emitter_t* et);
+extern ecli_result_t bullet_run_ins(struct _ecl_state* state, uint16_t id, ecl_value_t* v);
+
+#endif
@@ -0,0 +1,223 @@
+/**
+ * Decoded subs and the load-time stack verifier
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_CODE_H__
+#define __ECLI_CODE_H__
+
+#include "ecl.h"
+
+/*
+ * Every sub is decoded when its file is loaded into an array of ops: the
+ * parameters are parsed, variable slots become integers, jump offsets become
+ * pointers to the target op and call targets pointers to the callee's code.
+ * Each array ends with an INS_INVALID op, so running off the end of a sub
+ * fails instead of reading into the next one.
+ *
+ * The verifier then runs an abstract interpretation of each sub for every
+ * difficulty, following the stack depth through every reachable op. A sub
+ * passes if the stack never underflows its frame, every local it touches is
+ * inside the frame, the depth agrees wherever paths join and no path runs off
+ * its end. Stack and call stack needs are then summed along the call graph.
+ * A VM started on a sub with bounded needs gets a stack of exactly that size
+ * and runs without bounds checks; any other VM gets STACK_SIZE and is checked.
+ *
+ * Call arguments are written straight into the locals of the callee's frame:
+ * a call puts them just above the caller's stack, where the callee's
+ * stackAlloc makes its frame, and callAsync into the fresh stack of the new
+ * VM. Neither needs a copy of the arguments anywhere else.
+ *
+ * VMs don't run those ops directly but a stream per difficulty, built from
+ * them the first time a difficulty is used. A stream leaves out the ops the
+ * difficulty skips, so the interpreter never tests rank masks. Jumps point
+ * into the same stream and calls to the start of the callee's stream.
+ * Shared runs (see ranks.h) use streams for sets of difficulties, in which an
+ * op the difficulties don't agree on becomes an INS_SPLIT.
+ *
+ * At -O2, calls to small leaf subs are replaced by a copy of the callee
+ * before the peephole optimizer runs, see inline.c. The copy's locals are
+ * moved to where the call would have put the callee's frame, so the stack
+ * looks the same as after a real call, only without the call stack entry.
+ *
+ * After the peephole optimizer, -O2 also translates runs of stack arithmetic
+ * into register blocks, see regir.c. Each run becomes one op which runs
+ * three-address register ops: the positions of the operand stack become
+ * registers kept in the stack slots they would have used, so push a; push b;
+ * addi; set c is the single register op c = a + b.
+ */
+
+#define DIFFICULTY_COUNT 4
+#define difficulty_index(d) __builtin_ctz(d)
+
+// Streams are indexed by the set of difficulties they are for, a mask of
+// DIFF_* values
+#define RANK_SETS 16
+
+// Upper bound on the parameters of a decoded op
+#define OP_MAX_PARAMS 16
+
+#define STACK_UNBOUNDED 0xFFFFFFFF
+
+// Largest sub, in ops, inlined at -O2 unless told otherwise
+#define INLINE_DEFAULT_LIMIT 16
+
+// Most I and F variables a pure sub writes, see memo.h
+#define MEMO_MAX_VARS 8
+
+// ecl_code_t flags
+#define CODE_VERIFIED 0x01 // the sub's own stack use is safe on every difficulty
+#define CODE_TYPE_MISMATCH 0x02 // a local is read as a type it is never written as
+#define CODE_PURE 0x04 // calls can be memoized, see memo.h
+
+// Where an operand of a register op is
+typedef enum {
+    REG_CONST, // the value in the op
+    REG_LOCAL, // a local, by index from the base pointer
+    REG_TEMP, // a stack slot, by index from the stack pointer at the start of the block
+    REG_VAR // a global or per-VM variable, by slot
+} ecl_reg_kind_t;
+
+typedef struct {
+    uint8_t kind;
+    char format; // 'i' or 'f', how the stack op it came from read or wrote a local
+    int32_t index;
+    ecl_value_t value;
+} ecl_reg_operand_t;
+
+// dst = a op b, where op is the stack instruction computing it (INS_ADDI...)
+// or INS_SET for a copy; unary ops ignore b
+typedef struct {
+    uint16_t id;
+    ecl_reg_operand_t dst;
+    ecl_reg_operand_t a;
+    ecl_reg_operand_t b;
+} ecl_reg_op_t;
+
+// A run of stack ops translated into register ops, run by one INS_BLOCK op
+typedef struct {
+    ecl_reg_op_t* ops;
+    uint32_t count;
+    int32_t low; // lowest stack slot read, from the stack pointer at the start
+    int32_t high; // one past the highest stack slot written
+    int32_t delta; // how far the stack pointer moves
+    th10_instr_t** src; // instructions of the stack ops, for traces
+    uint32_t nsrc;
+} ecl_block_t;
+
+typedef struct _ecl_op {
+    uint16_t id;
+    uint16_t param_mask;
+    uint8_t rank_mask;
+    uint8_t nparams;
+    uint8_t nargs; // arguments a call passes, see code_resolve_args()
+    uint32_t time;
+    uint32_t index; // in a stream, the position of the op it was made from
+    uint32_t site; // for an op inlined from another sub, offset of the call + 1
+    ecl_value_t* params; // variable slots are always ECL_INT32, except in call
+                         // arguments, whose type is the one the callee gets
+    struct _ecl_op* target; // jump target, NULL if it is not an op of the sub;
+                            // in streams, also the entry of a called sub
+    struct _ecl_code* callee; // sub called, NULL if it doesn't exist
+    ecl_block_t* block; // register ops of an INS_BLOCK
+    th10_instr_t* src; // instruction this was decoded from, NULL for the end
+} ecl_op_t;
+
+// A call made by a sub, with the stack depth of the caller when it is made
+typedef struct {
+    ecl_op_t* op;
+    uint32_t depth; // deepest over the difficulties
+    uint32_t low; // shallowest, the same unless the difficulties disagree
+} ecl_call_site_t;
+
+typedef struct _ecl_code {
+    th10_ecl_sub_t* sub;
+    ecl_op_t* ops;
+    uint32_t count; // ops, not counting the end marker
+    ecl_value_t* params;
+    uint32_t flags;
+    
+    // Filled in by the verifier
+    uint32_t depth; // stack slots used by the sub itself
+    uint32_t stack; // stack slots used including callees, or STACK_UNBOUNDED
+    uint32_t calls; // call stack entries used, or STACK_UNBOUNDED
+    ecl_call_site_t* sites;
+    uint32_t site_count;
+    
+    // Filled in by the purity analysis of a CODE_PURE sub
+    uint32_t pure_args; // arguments a call must pass for the sub to be pure
+    int32_t pure_vars[MEMO_MAX_VARS]; // slots of the I and F variables it writes
+    uint32_t pure_var_count;
+    
+    // Register blocks made at -O2
+    ecl_block_t* blocks;
+    uint32_t block_count;
+    ecl_reg_op_t* regs;
+    th10_instr_t** block_src;
+    
+    // Streams per difficulty or set of difficulties, built by ecl_code_entry()
+    ecl_op_t* stream[RANK_SETS];
+    uint32_t* stream_map[RANK_SETS]; // op position -> position in the stream
+} ecl_code_t;
+
+// What the optimizer did, summed over every sub
+typedef struct {
+    uint32_t ops; // ops before optimizing
+    uint32_t removed;
+    uint32_t folded; // constant expressions folded
+    uint32_t branches; // conditional branches on constants resolved
+    uint32_t jumps; // jumps to the next op removed
+    uint32_t nops; // nops removed
+    uint32_t moves; // push/set pairs merged
+    uint32_t inlined; // calls replaced by a copy of the callee
+    uint32_t blocks; // register blocks made
+    uint32_t block_ops; // stack ops they replaced
+    uint32_t regs; // register ops they run
+} ecl_opt_stats_t;
+
+/* code.c */
+extern ecli_result_t ecl_code_build(th10_ecl_t* ecl);
+extern void ecl_code_free(th10_ecl_t* ecl);
+extern ecl_code_t* ecl_code_for_sub(th10_ecl_t* ecl, th10_ecl_sub_t* sub);
+extern uint32_t ecl_code_verify(th10_ecl_t* ecl, strbuf_t* report);
+extern uint32_t ecl_op_offset(ecl_code_t* code, ecl_op_t* op);
+extern ecl_op_t* ecl_code_entry(th10_ecl_t* ecl, ecl_code_t* code, uint8_t difficulty);
+extern ecl_op_t* ecl_code_remap(th10_ecl_t* ecl, ecl_op_t* op, uint8_t from, uint8_t to);
+extern void ecl_code_free_streams(th10_ecl_t* ecl);
+
+/* optimize.c */
+extern void ecl_code_optimize(th10_ecl_t* ecl, int level, uint32_t inline_limit, ecl_opt_stats_t* stats);
+
+/* inline.c */
+extern void ecl_code_inline(th10_ecl_t* ecl, uint32_t limit, ecl_opt_stats_t* stats);
+extern void ecl_code_print_callgraph(th10_ecl_t* ecl, FILE* f);
+
+/* regir.c */
+extern void ecl_code_regir(th10_ecl_t* ecl, ecl_opt_stats_t* stats);
+
+#endif
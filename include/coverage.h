@@ -0,0 +1,96 @@
+/**
+ * Definitions for instruction coverage maps
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_COVERAGE_H__
+#define __ECLI_COVERAGE_H__
+
+#include "ecli.h"
+
+/*
+ * A coverage map keeps one bit per instruction of an ECL file for each
+ * difficulty, set when a VM running on that difficulty runs the instruction.
+ * An instruction is identified by its offset in the file: no instruction is
+ * shorter than its 16 byte header, so the offset shifted right by
+ * COVERAGE_SHIFT is unique, and a map takes 1/128 of the file's size per
+ * difficulty.
+ *
+ * The interpreter loop of ECLI_MODE_COVERAGE doesn't set the bits itself:
+ * neighbouring instructions share a word, so each op would have to wait for
+ * the OR of the op before it. It stores a flag per instruction instead, with
+ * no tests and nothing to wait for, and coverage_pack() folds the flags into
+ * the map when it is read. The flags are 16 bits wide because the compiler
+ * has to assume a byte store changes anything, and would reload the VM's
+ * state after every op.
+ *
+ * A map records the size and a hash of the file it was made for, and maps of
+ * the same file are merged with a bitwise OR, so runs over any number of
+ * difficulties, seeds and processes can be recorded apart and combined. Maps
+ * are saved as text:
+ *
+ *     ecli-coverage 1 size=<bytes> hash=<fnv-1a>
+ *     <difficulty> <the map, as 64 bit words in hex>
+ *
+ * with one line per difficulty. The optimizer removes and merges
+ * instructions, and those never run, so coverage is meant for unoptimized
+ * code.
+ */
+
+#define COVERAGE_SHIFT 4
+#define COVERAGE_VERSION 1
+
+typedef struct _ecli_coverage {
+    uint64_t size; // of the file the map is for
+    uint32_t hash;
+    size_t words; // per difficulty
+    uint64_t* bits; // the map of difficulty d starts at bits + d * words
+    size_t slots; // instruction slots per difficulty, words * 64 at most
+    uint16_t* hits; // a flag per slot set by the interpreter, NULL unless recording
+} ecli_coverage_t;
+
+// Mark the instruction at a byte offset as run, in the hits of a difficulty
+#define coverage_hit(hits, offset) ((hits)[(offset) >> COVERAGE_SHIFT] = 1)
+
+/* coverage.c */
+extern ecli_coverage_t* coverage_create(th10_ecl_t* ecl);
+extern void coverage_free(ecli_coverage_t* cov);
+extern void coverage_clear(ecli_coverage_t* cov);
+extern void coverage_record(ecli_coverage_t* cov);
+extern void coverage_pack(ecli_coverage_t* cov);
+extern int coverage_matches(ecli_coverage_t* cov, th10_ecl_t* ecl);
+extern int coverage_test(ecli_coverage_t* cov, unsigned int d, th10_ecl_t* ecl, th10_instr_t* ins);
+extern ecli_result_t coverage_merge(ecli_coverage_t* dst, ecli_coverage_t* src);
+extern ecli_result_t coverage_save(ecli_coverage_t* cov, FILE* f);
+extern ecli_coverage_t* coverage_load(FILE* f);
+extern ecli_result_t coverage_merge_file(ecli_coverage_t* cov, const char* path);
+extern ecli_result_t coverage_save_file(ecli_coverage_t* cov, const char* path);
+extern void coverage_write_summary(ecli_coverage_t* cov, th10_ecl_t* ecl, FILE* f);
+extern ecli_result_t coverage_annotate(ecli_coverage_t* cov, th10_ecl_t* ecl, int fd, unsigned int threads);
+
+#endif
@@ -0,0 +1,87 @@
+/**
+ * Reading ECL files out of the games' .dat archives
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_DAT_H__
+#define __ECLI_DAT_H__
+
+#include "ecli.h"
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+/*
+ * The games since Shoot the Bullet pack their data in THA1 archives. The
+ * archive starts with a 16 byte header and ends with the list of entries,
+ * both encrypted, the list also LZSS compressed. Each entry is encrypted with
+ * one of eight parameter sets, picked from the sum of its name's characters,
+ * and compressed unless that would make it bigger. The parameter sets changed
+ * between games, so the archive is opened by trying each game's sets on its
+ * first ECL file until one gives an ECL header.
+ *
+ * Opening an archive reads only the header and the list. An entry is read,
+ * decrypted and decompressed the first time it is asked for, straight into
+ * the buffer that then holds it, and kept in memory for later requests.
+ * dat_read_all() does that for many entries at once on several threads;
+ * only reading from the file is serialized.
+ *
+ * The formats are those thtk's thdat reads and writes.
+ */
+
+#define DAT_BLOCK_MAX 0x400 // largest encryption block of any game
+
+typedef struct {
+    char* name;
+    uint32_t offset; // in the archive
+    uint32_t zsize; // stored size
+    uint32_t size; // decompressed size
+    uint8_t* data; // contents once read, NULL before
+} dat_entry_t;
+
+typedef struct _ecli_dat {
+    FILE* f;
+    uint64_t size; // of the archive
+    int variant; // the game's encryption parameters, -1 until known
+    dat_entry_t* entries;
+    uint32_t count;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock; // the file position and the entries' data
+#endif
+} ecli_dat_t;
+
+/* dat.c */
+extern ecli_dat_t* dat_open(const char* path);
+extern void dat_close(ecli_dat_t* dat);
+extern dat_entry_t* dat_find(ecli_dat_t* dat, const char* name);
+extern const uint8_t* dat_read(ecli_dat_t* dat, dat_entry_t* entry);
+extern ecli_result_t dat_read_all(ecli_dat_t* dat, const char* suffix, unsigned int threads);
+extern int dat_is_ecl(dat_entry_t* entry);
+
+#endif
@@ -0,0 +1,86 @@
+/**
+ * Interactive debugger: breakpoints patched into the op streams
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_DEBUGGER_H__
+#define __ECLI_DEBUGGER_H__
+
+#include "ecli.h"
+
+/*
+ * Breakpoints are not checked for: the debugger overwrites the id of the op
+ * in the current difficulty's stream with INS_TRAP and keeps a copy of the
+ * op. The interpreter loop only calls into the debugger when it reaches a
+ * trap, and then runs the copy, so the rest of the code runs at full speed.
+ *
+ * Stepping works the same way. "step" plants temporary traps on every op the
+ * stopped one can continue at (the next op, a jump or call target, or the
+ * return address), and "finish" on the return address; these only stop the
+ * VM being stepped. "next" runs whole frames, which needs no traps at all.
+ *
+ * Commands are read from a file, normally stdin, whenever the runtime stops:
+ * at the start of the first frame, at a breakpoint or after a step. At the
+ * end of the input the debugger removes its traps and lets the run finish.
+ */
+
+typedef struct {
+    ecl_op_t* op; // patched op of a stream
+    ecl_op_t orig; // the op as it was, run in its place
+    ecl_code_t* code;
+    uint32_t index; // position of the op in the sub's code
+    uint32_t number; // breakpoint number, 0 if it is only a step trap
+    int step; // stops the VM being stepped
+} debug_trap_t;
+
+typedef struct _ecli_debugger {
+    FILE* in;
+    debug_trap_t* traps;
+    uint32_t trap_count;
+    uint32_t trap_cap;
+    uint32_t numbers; // breakpoints set so far
+    
+    uint32_t stop_frame; // stop at the start of this frame
+    uint32_t step_vm; // id of the VM being stepped, 0 if none
+    uint32_t step_depth; // call depth at or below which a step trap stops
+    uint32_t vm; // id of the VM the dump commands look at
+    int quit; // stop running at the start of the next frame
+    
+    ecl_op_t current; // copy of the op being run from a trap
+    char last[256]; // command repeated by an empty line
+} ecli_debugger_t;
+
+/* debugger.c */
+extern ecli_debugger_t* debug_create(FILE* in, uint32_t frame);
+extern void debug_free(ecli_debugger_t* dbg);
+extern ecl_op_t* debug_trap(ecl_state_t* state, ecl_op_t* op);
+extern ecli_result_t debug_frame(struct _ecli_runtime* rt);
+extern void debug_remove_traps(ecli_debugger_t* dbg);
+extern void debug_set_difficulty(struct _ecli_runtime* rt, uint8_t difficulty);
+
+#endif
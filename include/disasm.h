@@ -0,0 +1,55 @@
+/**
+ * ECL disassembler
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_DISASM_H__
+#define __ECLI_DISASM_H__
+
+#include "ecli.h"
+
+// Writes what goes before an instruction in place of its indent, for
+// annotated disassembly; called from several threads at once
+typedef void (*disasm_annotate_t)(strbuf_t* out, th10_instr_t* ins, void* user);
+
+// Where the disassembler is within a sub
+typedef struct {
+    th10_instr_t* base; // first instruction of the sub; labels are relative to it
+    const uint32_t* labels; // sorted offsets of the jump targets in the sub
+    uint32_t label_count;
+    uint8_t rank_mask; // rank mask in effect
+    uint32_t time; // time label in effect
+    disasm_annotate_t annotate; // NULL to indent instructions
+    void* user;
+} disasm_ctx_t;
+
+extern void disasm_format_instruction(strbuf_t* out, th10_instr_t* ins, disasm_ctx_t* ctx);
+extern ecli_result_t disasm_sub(th10_ecl_sub_t* sub, strbuf_t* out, disasm_annotate_t annotate, void* user);
+extern ecli_result_t disasm_ecl(th10_ecl_t* ecl, int fd, unsigned int threads, disasm_annotate_t annotate, void* user);
+
+#endif
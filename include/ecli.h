@@ -1,57 +1,71 @@
-/**
- * Main header for ECLI
- *
- * Redistribution and use in source and binary forms, with
- * or without modification, are permitted provided that the
- * following conditions are met:
- *
- * 1. Redistributions of source code must retain this list
- *    of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce this
- *    list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the
- *    distribution.
- *
- * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
- * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
- * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
- * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
- * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
- * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
- * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
- * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
- * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
- * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
- * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
- * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
- * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
- * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
- * DAMAGE.
- **/
-#ifndef __ECLI_H__
-#define __ECLI_H__
-
-#include "config.h"
-
-#ifdef HAVE_STRING_H
-# include <string.h>
-#elif defined(HAVE_MEMORY_H)
-# include <memory.h>
-#endif
-
-typedef enum {
-    ECLI_FAILURE=0,
-    ECLI_SUCCESS=1,
-    ECLI_DONE
-} ecli_result_t;
-
-#define SUCCESS(expr) ((expr) == (ECLI_SUCCESS))
-#define FAILURE(expr) ((expr) == (ECLI_FAILURE))
-
-#include "util.h"
-#include "ecl.h"
-#include "ins.h"
-#include "value.h"
-#include "state.h"
-
-#endif
+/**
+ * Main header for ECLI
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_H__
+#define __ECLI_H__
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+# include <string.h>
+#elif defined(HAVE_MEMORY_H)
+# include <memory.h>
+#endif
+
+typedef enum {
+    ECLI_FAILURE=0,
+    ECLI_SUCCESS=1,
+    ECLI_DONE,
+    ECLI_PREEMPTED // a VM used up its instruction budget, see ecli_budget_t
+} ecli_result_t;
+
+#define SUCCESS(expr) ((expr) == (ECLI_SUCCESS))
+#define FAILURE(expr) ((expr) == (ECLI_FAILURE))
+
+#include "util.h"
+#include "ecl.h"
+#include "ins.h"
+#include "fmath.h"
+#include "value.h"
+#include "code.h"
+#include "output.h"
+#include "lockstep.h"
+#include "bullet.h"
+#include "enemy.h"
+#include "state.h"
+#include "memo.h"
+#include "ranks.h"
+#include "debugger.h"
+#include "sampler.h"
+#include "coverage.h"
+#include "dat.h"
+#include "disasm.h"
+
+#endif
@@ -0,0 +1,142 @@
+/**
+ * Enemy manager: the enemies ECL VMs run for
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_ENEMY_H__
+#define __ECLI_ENEMY_H__
+
+#include <stdint.h>
+
+#include "bullet.h"
+
+/*
+ * Every VM runs for an enemy. ecli_spawn() and enmCreate make a new enemy
+ * with one VM, and VMs started with callAsync run for their parent's enemy.
+ * An enemy lives until its last VM ends, or until one of them runs delete,
+ * which ends them all.
+ *
+ * Enemies are kept in a pool which only grows, by doubling, and reuses the
+ * slots of dead enemies through a free list. The kinematic state is kept as
+ * one float array per field (structure of arrays) so the per-frame movement
+ * pass runs as vector loops over the whole pool; the rest of an enemy is an
+ * enemy_t record in a parallel array. Slots of dead enemies are zeroed, so
+ * the pass doesn't need to skip them.
+ *
+ * Enemies are referred to by handles, which hold the slot and the slot's
+ * generation when the enemy was made. Freeing a slot moves its generation on,
+ * so a handle to an enemy goes stale as soon as its last VM ends, and stays
+ * stale after the slot is reused. There are at most ENEMY_INDEX_MASK + 1
+ * slots.
+ */
+
+#define ENEMY_INDEX_BITS 20
+#define ENEMY_INDEX_MASK ((1 << ENEMY_INDEX_BITS) - 1)
+#define ENEMY_GENERATION_MASK 0xFFF
+#define ENEMY_NONE 0 // never a valid handle, generations start at 1
+#define ENEMY_WIDTH 8 // floats per vector, the pool grows in whole vectors
+
+#define enemy_index(handle) ((handle) & ENEMY_INDEX_MASK)
+
+typedef uint32_t enemy_handle_t;
+
+// Kinematic fields, each an array over the pool
+enum {
+    ENEMY_ABS_X=0,
+    ENEMY_ABS_Y,
+    ENEMY_REL_X, // offset from the absolute position
+    ENEMY_REL_Y,
+    ENEMY_VEL_X, // velocity of the absolute position, per frame
+    ENEMY_VEL_Y,
+    ENEMY_FIELDS
+};
+
+// Interpolated movements, set up by the move*Time instructions
+enum {
+    MOVE_ABS=0, // absolute position, x and y
+    MOVE_REL, // relative position, x and y
+    MOVE_VEL, // velocity, as angle and speed
+    MOVE_KINDS
+};
+
+// Interpolation modes
+enum {
+    MODE_LINEAR=0,
+    MODE_ACCEL1, // t^2
+    MODE_ACCEL2, // t^3
+    MODE_ACCEL3, // t^4
+    MODE_DECEL1, // 1 - (1 - t)^2
+    MODE_DECEL2,
+    MODE_DECEL3
+};
+
+typedef struct {
+    int32_t time; // frames run so far
+    int32_t duration; // 0 if not moving
+    int32_t mode;
+    float from[2];
+    float to[2];
+} enemy_move_t;
+
+typedef struct {
+    uint16_t generation;
+    uint8_t alive; // cleared by delete, the slot is freed with its last VM
+    uint8_t moving; // bit per MOVE_* kind with an interpolation running
+    uint32_t vms; // VMs running for the enemy
+    uint32_t flags; // set by flagSet
+    int32_t hp;
+    int32_t score;
+    int32_t item;
+    bullet_emitter_t* emitters; // BULLET_EMITTERS of them, once one is used
+    enemy_move_t move[MOVE_KINDS];
+} enemy_t;
+
+typedef struct {
+    float* field[ENEMY_FIELDS]; // each aligned to a vector and capacity entries long
+    void* mem;
+    enemy_t* enemies;
+    uint32_t capacity;
+    uint32_t used; // slots below this have been handed out at some point
+    uint32_t* free;
+    uint32_t free_count;
+    uint32_t live;
+} enemy_manager_t;
+
+struct _ecl_state;
+
+/* enemy.c */
+extern void enemy_init(enemy_manager_t* em);
+extern void enemy_free(enemy_manager_t* em);
+extern enemy_handle_t enemy_create(enemy_manager_t* em, float x, float y);
+extern enemy_t* enemy_get(enemy_manager_t* em, enemy_handle_t handle);
+extern void enemy_attach(enemy_manager_t* em, enemy_handle_t handle);
+extern void enemy_detach(enemy_manager_t* em, enemy_handle_t handle);
+extern void enemy_update(enemy_manager_t* em);
+extern ecli_result_t enemy_run_ins(struct _ecl_state* state, ecl_op_t* op, ecl_value_t* v);
+
+#endif
@@ -0,0 +1,67 @@
+/**
+ * Deterministic float math for angles and positions
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_FMATH_H__
+#define __ECLI_FMATH_H__
+
+#include <stddef.h>
+
+/*
+ * The trigonometry the ECL instructions and variables need, done with
+ * nothing but float additions, multiplications and divisions: a Cody-Waite
+ * range reduction followed by minimax polynomials. Angles too large for
+ * that are reduced in integer fixed point instead. Unlike the C library's
+ * functions, which differ between platforms and versions, these give the
+ * same bits everywhere, so a replay comes out the same on any machine,
+ * thread count or lockstep setting. That also needs the compiler to leave
+ * the float operations alone, which is why the build turns off contraction
+ * into fused multiply-adds.
+ *
+ * The batch variants work on arrays, one element at a time with the same
+ * operations as the scalar functions, so that the compiler can vectorize
+ * them without changing any result. The output may be the input.
+ */
+
+#define PI 3.14159265f
+
+/* fmath.c */
+extern float fmath_sin(float a);
+extern float fmath_cos(float a);
+extern void fmath_sincos(float a, float* s, float* c);
+extern float fmath_atan2(float y, float x);
+extern float fmath_sqrt(float x);
+extern float fmath_norm_rad(float a);
+
+extern void fmath_sin_n(const float* a, float* s, size_t n);
+extern void fmath_cos_n(const float* a, float* c, size_t n);
+extern void fmath_sincos_n(const float* a, float* s, float* c, size_t n);
+extern void fmath_atan2_n(const float* y, const float* x, float* a, size_t n);
+
+#endif
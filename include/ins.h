@@ -1,98 +1,160 @@
-/**
- * ECL instructions
- *
- * Redistribution and use in source and binary forms, with
- * or without modification, are permitted provided that the
- * following conditions are met:
- *
- * 1. Redistributions of source code must retain this list
- *    of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce this
- *    list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the
- *    distribution.
- *
- * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
- * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
- * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
- * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
- * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
- * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
- * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
- * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
- * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
- * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
- * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
- * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
- * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
- * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
- * DAMAGE.
- **/
-#ifndef __ECLI_INS_H__
-#define __ECLI_INS_H__
-
-#include "config.h"
-#include <stdint.h>
-
-//th17 ins IDs
-typedef enum {
-    //system instructions
-    INS_NOP=0,
-    INS_DELETE=1,
-    INS_RET=10,
-    INS_CALL=11,
-    INS_JMP=12,
-    INS_JMPEQ=13,
-    INS_JMPNEQ=14,
-    INS_CALLASYNC=15,
-    INS_UNKNOWN21=21,
-    INS_DEBUG22=22,
-    INS_WAIT=23,
-    INS_UNKNOWN30=30,
-    INS_STACKALLOC=40,
-    INS_PUSH=42,
-    INS_SET=43,
-    INS_PUSHF=44,
-    INS_SETF=45,
-    INS_ADDI=50,
-    INS_ADDF=51,
-    INS_SUBF=53,
-    INS_MULI=54,
-    INS_MODI=58,
-    INS_EQI=59,
-    INS_LESSI=63,
-    INS_LEQI=65,
-    INS_GEQI=69,
-    INS_DECI=78,
-    // Enemy property management and other miscellaneous things
-    INS_FLAGSET=502,
-    INS_SETCHAPTER=524,
-    // Custom instructions for debugging
-    INS_PUTS=2000,
-    INS_PUTI=2001,
-    INS_PUTF=2002,
-    INS_ENDL=2003,
-    INS_INVALID=0xFFFF
-} ecl_ins_id;
-
-typedef struct {
-PACK_BEGIN
-    uint32_t time;
-    uint16_t id;
-    uint16_t size;
-    uint16_t param_mask;
-    /* The rank bitmask.
-     *   1111LHNE
-     * Bits mean: easy, normal, hard, lunatic. The rest are always set to 1. */
-    uint8_t rank_mask;
-    /* There doesn't seem to be a way of telling how many parameters there are
-     * from the additional data. */
-    uint8_t param_count;
-    /* From TH13 on, this field stores the number of current stack references
-     * in the parameter list. */
-    uint32_t zero;
-    unsigned char data[];
-PACK_END
-} PACK_ATTRIBUTE th10_instr_t;
-
-#endif
+/**
+ * ECL instructions
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_INS_H__
+#define __ECLI_INS_H__
+
+#include "config.h"
+#include <stdint.h>
+
+//th17 ins IDs
+typedef enum {
+    //system instructions
+    INS_NOP=0,
+    INS_DELETE=1,
+    INS_RET=10,
+    INS_CALL=11,
+    INS_JMP=12,
+    INS_JMPEQ=13,
+    INS_JMPNEQ=14,
+    INS_CALLASYNC=15,
+    INS_UNKNOWN21=21,
+    INS_DEBUG22=22,
+    INS_WAIT=23,
+    INS_UNKNOWN30=30,
+    INS_STACKALLOC=40,
+    INS_PUSH=42,
+    INS_SET=43,
+    INS_PUSHF=44,
+    INS_SETF=45,
+    INS_ADDI=50,
+    INS_ADDF=51,
+    INS_SUBF=53,
+    INS_MULI=54,
+    INS_MULF=55,
+    INS_DIVF=57,
+    INS_MODI=58,
+    INS_EQI=59,
+    INS_LESSI=63,
+    INS_LEQI=65,
+    INS_GEQI=69,
+    INS_DECI=78,
+    INS_SIN=79,
+    INS_COS=80,
+    INS_CIRCLEPOS=81,
+    INS_VALIDRAD=82,
+    INS_NEGI=83,
+    INS_NEGF=84,
+    INS_GETANG=87,
+    INS_SQRT=88,
+    // Enemy creation
+    INS_ENMCREATE=300,
+    INS_ENMCREATEA=301,
+    // Enemy movement
+    INS_MOVEPOS=400,
+    INS_MOVEPOSTIME=401,
+    INS_MOVEPOSREL=402,
+    INS_MOVEPOSRELTIME=403,
+    INS_MOVEVEL=404,
+    INS_MOVEVELTIME=405,
+    // Enemy property management and other miscellaneous things
+    INS_FLAGSET=502,
+    INS_SETCHAPTER=524,
+    // Bullet emitters
+    INS_ETNEW=600,
+    INS_ETON=601,
+    INS_ETSPRITE=602,
+    INS_ETOFFSET=603,
+    INS_ETANGLE=604,
+    INS_ETSPEED=605,
+    INS_ETCOUNT=606,
+    INS_ETAIM=607,
+    INS_ETSOUND=608,
+    // Custom instructions for debugging
+    INS_PUTS=2000,
+    INS_PUTI=2001,
+    INS_PUTF=2002,
+    INS_ENDL=2003,
+    // Internal instructions made by the optimizer, never loaded from files
+    INS_INTERNAL=0xF000,
+    INS_JMPTIME=0xF000, // jump and set the time, like a taken jmpEq
+    INS_MOVE=0xF001, // push followed by set
+    INS_MOVEF=0xF002, // push followed by setf
+    INS_ENTER=0xF003, // call and stackAlloc of an inlined sub, see inline.c
+    INS_LEAVE=0xF004, // return from an inlined sub
+    INS_BLOCK=0xF005, // register ops translated from stack ops, see regir.c
+    INS_SPLIT=0xF006, // the difficulties of a shared run stop agreeing, see ranks.h
+    INS_TRAP=0xFFFE, // patched over an op by the debugger, see debugger.h
+    INS_INVALID=0xFFFF
+} ecl_ins_id;
+
+typedef struct {
+PACK_BEGIN
+    uint32_t time;
+    uint16_t id;
+    uint16_t size;
+    uint16_t param_mask;
+    /* The rank bitmask.
+     *   1111LHNE
+     * Bits mean: easy, normal, hard, lunatic. The rest are always set to 1. */
+    uint8_t rank_mask;
+    /* There doesn't seem to be a way of telling how many parameters there are
+     * from the additional data. */
+    uint8_t param_count;
+    /* From TH13 on, this field stores the number of current stack references
+     * in the parameter list. */
+    uint32_t zero;
+    unsigned char data[];
+PACK_END
+} PACK_ATTRIBUTE th10_instr_t;
+
+// Instruction parameter format strings: 'i' (int32_t), 'u' (uint32_t), 'f'
+// (float), 's' (string) and 'D', an argument of a call. A 'D' is 8 bytes: the
+// type the callee gets and the type of the value ('i' or 'f'), two bytes of
+// padding and the value. A final 'D' stands for any number of them, including
+// none, up to the end of the instruction.
+typedef struct {
+    uint16_t id;
+    const char* format;
+    const char* opcode;
+    uint8_t pops; // stack effect, not counting stack references in parameters
+    uint8_t pushes;
+} ins_format_t;
+
+/* ins.c */
+extern const ins_format_t* ins_get_format(uint16_t id);
+extern unsigned int ins_get_format_count(void);
+extern unsigned int ins_get_index(uint16_t id);
+extern const ins_format_t* ins_get_format_at(unsigned int index);
+extern const char* ins_get_variable_name(int32_t id);
+extern int ins_writes_param(uint16_t id, unsigned int i);
+extern unsigned int ins_get_param_count(th10_instr_t* ins, const ins_format_t* format);
+
+#endif
@@ -0,0 +1,131 @@
+/**
+ * Public interface of libecli, the embeddable ECL interpreter
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __LIBECLI_H__
+#define __LIBECLI_H__
+
+#include "ecli.h"
+
+/*
+ * A runtime owns one loaded ECL file, the VMs running it and the global
+ * variables they share. Runtimes are independent of each other; a host can
+ * create as many as it likes and drive each from its own loop:
+ *
+ *     ecli_runtime_t* rt = ecli_runtime_create();
+ *     ecli_load_file(rt, "st01.ecl");
+ *     ecli_spawn(rt, "main");
+ *     while(ecli_step(rt) == ECLI_SUCCESS) {
+ *         ecli_globals(rt)->player_x = ...;
+ *     }
+ *     ecli_runtime_free(rt);
+ */
+
+// Called for each VM by ecli_foreach_vm(). Return nonzero to stop early.
+typedef int (*ecli_vm_callback_t)(ecl_state_t* vm, void* user);
+typedef int (*ecli_enemy_callback_t)(enemy_handle_t handle, const enemy_t* enemy, float x, float y, void* user);
+
+/* Runtime lifetime */
+extern ecli_runtime_t* ecli_runtime_create(void);
+extern void ecli_runtime_free(ecli_runtime_t* rt);
+
+/* Loading. A runtime holds a single ECL file; loading replaces it.
+ * Archives for ecli_load_dat() are opened with dat_open(), see dat.h. */
+extern ecli_result_t ecli_load_file(ecli_runtime_t* rt, const char* path);
+extern ecli_result_t ecli_load_memory(ecli_runtime_t* rt, const void* data, size_t size);
+extern ecli_result_t ecli_load_dat(ecli_runtime_t* rt, ecli_dat_t* dat, const char* name);
+extern ecli_result_t ecli_attach_ecl(ecli_runtime_t* rt, th10_ecl_t* ecl);
+extern th10_ecl_t* ecli_get_ecl(ecli_runtime_t* rt);
+
+/* Execution */
+extern ecli_result_t ecli_spawn(ecli_runtime_t* rt, const char* sub);
+extern ecli_result_t ecli_step(ecli_runtime_t* rt);
+extern ecli_result_t ecli_step_frames(ecli_runtime_t* rt, uint32_t frames, uint32_t* done);
+extern uint32_t ecli_frame(ecli_runtime_t* rt);
+
+/* Instruction budgets, see ecli_budget_t in state.h */
+extern void ecli_set_budget(ecli_runtime_t* rt, const ecli_budget_t* budget);
+extern ecli_result_t ecli_parse_budget(const char* spec, ecli_budget_t* budget);
+
+/* Globals */
+extern ecl_global_state_t* ecli_globals(ecli_runtime_t* rt);
+extern ecli_result_t ecli_set_difficulty(ecli_runtime_t* rt, uint8_t difficulty);
+extern void ecli_set_seed(ecli_runtime_t* rt, uint32_t seed);
+extern void ecli_set_player_position(ecli_runtime_t* rt, float x, float y);
+
+/* Output of the debug print instructions. Discarding it with
+ * ecli_set_output(rt, NULL) skips the formatting entirely. */
+extern void ecli_set_output(ecli_runtime_t* rt, FILE* f);
+extern void ecli_set_output_memory(ecli_runtime_t* rt);
+extern const char* ecli_get_output(ecli_runtime_t* rt, size_t* size);
+extern void ecli_clear_output(ecli_runtime_t* rt);
+extern ecli_result_t ecli_set_output_thread(ecli_runtime_t* rt, int enable);
+extern void ecli_flush_output(ecli_runtime_t* rt);
+
+/* Optimization, applied by ecli_load_file() and ecli_load_memory() */
+extern void ecli_set_optimization(ecli_runtime_t* rt, int level);
+extern void ecli_set_inline_limit(ecli_runtime_t* rt, uint32_t ops);
+extern const ecl_opt_stats_t* ecli_optimizer_stats(ecli_runtime_t* rt);
+
+/* Memoization of pure subs, see memo.h */
+extern void ecli_set_memo(ecli_runtime_t* rt, uint32_t entries);
+extern const ecli_memo_stats_t* ecli_memo_stats(ecli_runtime_t* rt);
+
+/* Shared runs over several difficulties, see ranks.h */
+extern ecli_result_t ecli_set_ranks(ecli_runtime_t* rt, uint8_t ranks, FILE** files);
+extern uint8_t ecli_get_ranks(ecli_runtime_t* rt);
+extern int ecli_ranks_wait(ecli_runtime_t* rt, int* failed);
+
+/* Instrumentation */
+extern void ecli_set_mode(ecli_runtime_t* rt, ecli_mode_t mode);
+extern void ecli_print_profile(ecli_runtime_t* rt, FILE* f);
+extern ecli_result_t ecli_set_sampling(ecli_runtime_t* rt, unsigned int hz);
+extern void ecli_print_samples(ecli_runtime_t* rt, FILE* f);
+extern void ecli_write_folded(ecli_runtime_t* rt, FILE* f);
+extern ecli_result_t ecli_set_coverage(ecli_runtime_t* rt, int enable);
+extern ecli_coverage_t* ecli_get_coverage(ecli_runtime_t* rt);
+
+/* Enemies the VMs run for, see enemy.h */
+extern uint32_t ecli_enemy_count(ecli_runtime_t* rt);
+extern int ecli_foreach_enemy(ecli_runtime_t* rt, ecli_enemy_callback_t callback, void* user);
+
+/* Bullets fired by the VMs, see bullet.h */
+extern const bullet_stats_t* ecli_bullet_stats(ecli_runtime_t* rt);
+
+/* Interactive debugger, see debugger.h */
+extern void ecli_set_debugger(ecli_runtime_t* rt, FILE* in);
+
+/* Lockstep batches of VMs, see lockstep.h */
+extern void ecli_set_lockstep(ecli_runtime_t* rt, int enable);
+
+/* VM enumeration */
+extern uint32_t ecli_vm_count(ecli_runtime_t* rt);
+extern int ecli_foreach_vm(ecli_runtime_t* rt, ecli_vm_callback_t callback, void* user);
+
+#endif
@@ -0,0 +1,71 @@
+/**
+ * Lockstep execution of VMs running the same code
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_LOCKSTEP_H__
+#define __ECLI_LOCKSTEP_H__
+
+#include <stdint.h>
+
+/*
+ * Bullet patterns callAsync the same sub many times in one frame, and the
+ * VMs spawned then run the same ops with different values. In lockstep mode
+ * the VMs which are about to run the same op at the same time, with the same
+ * stack layout, are gathered into a batch before they run. The batch keeps
+ * each stack slot as an array over its lanes (one lane per VM) and runs the
+ * arithmetic, compare, push and set ops on all lanes at once with vector
+ * instructions.
+ *
+ * A batch only runs ops which touch nothing but the VMs' own stacks and
+ * clocks, so running it before the VMs' turn in the list changes nothing
+ * that can be seen. It stops at the first other op, at a branch the lanes
+ * don't agree on, or when the VMs wait, and each VM then carries on on its
+ * own from there.
+ */
+
+// Lanes per vector, and the fewest VMs worth gathering into a batch
+#define LOCKSTEP_WIDTH 4
+#define LOCKSTEP_MIN_LANES 4
+
+struct _ecl_state;
+struct _ecli_runtime;
+
+// Memory reused by the batches of a runtime
+typedef struct {
+    struct _ecl_state** vms; // VMs considered together, sorted into batches
+    uint32_t cap;
+    void* mem; // lanes of the current batch
+    size_t mem_size;
+} ecli_lockstep_t;
+
+/* lockstep.c */
+extern void lockstep_run(struct _ecli_runtime* rt, uint32_t from, uint64_t* left);
+extern void lockstep_free(ecli_lockstep_t* ls);
+
+#endif
@@ -0,0 +1,111 @@
+/**
+ * Memoization of pure subs
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_MEMO_H__
+#define __ECLI_MEMO_H__
+
+#include "ecli.h"
+
+/*
+ * After verifying a file, each sub is checked for purity: it must run the
+ * same way wherever it is called from, given the same arguments on the same
+ * difficulty. A pure sub starts with a stackAlloc on every difficulty, has
+ * no time labels, never waits, calls or spawns anything, reads nothing but
+ * its locals and the variables which only depend on the difficulty, and
+ * writes nothing but its locals and the VM's I0-I3 and F0-F3. Any of those
+ * it reads must have been written first, except for the locals filled in
+ * by arguments.
+ *
+ * ECL subs don't return values: a caller sees what a sub did through the
+ * I and F variables it wrote, the time its jumps set and what it left in
+ * the stack slots above the caller's. When memoization is enabled with
+ * ecli_set_memo(), a call to a pure sub which passes enough arguments looks
+ * up (sub, difficulty, arguments) in a cache of the effects of earlier
+ * calls. A hit writes them back and goes on after the call without running
+ * the sub. A miss runs the sub with the time set to MEMO_TIME_UNSET, which
+ * tells whether one of its jumps set the time, and records its effects
+ * when it returns.
+ *
+ * The cache holds a bounded number of entries in a hash table, and evicts
+ * the least recently used one when it is full. It is emptied whenever the
+ * runtime's file changes. A hit doesn't run the sub's instructions, so they
+ * don't show up in traces, profiles and coverage, or stop at breakpoints.
+ */
+
+// Time a memoized call starts with, which pure subs never jump to
+#define MEMO_TIME_UNSET 0xFFFFFFFF
+
+// Locals the purity analysis follows, in a 64 bit mask with the variables
+#define MEMO_MAX_LOCALS (64 - MEMO_MAX_VARS)
+
+typedef struct _memo_entry {
+    struct _memo_entry* prev; // towards the most recently used entry
+    struct _memo_entry* next;
+    struct _memo_entry* chain; // next entry in the same hash bucket
+    uint32_t hash;
+    ecl_code_t* code;
+    uint8_t difficulty;
+    uint8_t nargs;
+    uint8_t time_set; // a jump set the time, to time
+    uint32_t time;
+    uint32_t csp; // while the call runs, the call stack depth it returns to
+    uint32_t caller_time; // and the time of the caller
+    ecl_value_t* values; // the arguments, then the frame after the return,
+                         // then the variables the sub writes
+} memo_entry_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint32_t entries;
+    uint32_t pure; // pure subs in the file loaded
+} ecli_memo_stats_t;
+
+typedef struct _ecli_memo {
+    uint32_t capacity; // entries kept at most
+    uint32_t count;
+    memo_entry_t** buckets;
+    uint32_t bucket_mask;
+    memo_entry_t* head; // most recently used
+    memo_entry_t* tail; // evicted next
+    ecli_memo_stats_t stats;
+} ecli_memo_t;
+
+/* memo.c */
+extern void ecl_code_purity(th10_ecl_t* ecl);
+extern ecli_memo_t* memo_create(uint32_t capacity);
+extern void memo_free(ecli_memo_t* memo);
+extern void memo_clear(ecli_memo_t* memo);
+extern int memo_call(ecl_state_t* state, ecl_op_t* op);
+extern void memo_return(ecl_state_t* state);
+extern void memo_rekey(ecli_runtime_t* rt, uint8_t difficulty);
+
+#endif
@@ -0,0 +1,95 @@
+/**
+ * Buffered sink for the output of the debug print instructions
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_OUTPUT_H__
+#define __ECLI_OUTPUT_H__
+
+#include "util.h"
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+/*
+ * The print instructions format into one buffer per runtime. A runtime runs
+ * its VMs in a fixed order on one thread, so the buffer holds their output in
+ * exactly the order it was produced. The buffer is handed to the sink at the
+ * end of a frame once it grows past OUTPUT_FLUSH_SIZE, and whenever the
+ * runtime stops, so nothing is written from the middle of the interpreter.
+ *
+ * With a writer thread the full buffer is swapped with an empty one and
+ * written while the interpreter carries on (double buffering). Only one
+ * buffer is ever in flight, so the order is kept.
+ */
+
+#define OUTPUT_FLUSH_SIZE (256 * 1024)
+
+// Most files a sink writes the same output to
+#define OUTPUT_MAX_FILES 4
+
+typedef enum {
+    OUTPUT_NULL, // discard everything
+    OUTPUT_FILE, // write to a FILE*
+    OUTPUT_MEMORY // keep everything in memory for the host to read
+} output_kind_t;
+
+typedef struct {
+    output_kind_t kind;
+    FILE* f;
+    FILE* more[OUTPUT_MAX_FILES - 1]; // more files getting copies, see output_set_files()
+    unsigned int more_count;
+    strbuf_t buf; // output of the frames since the last flush
+    
+#ifdef HAVE_PTHREAD
+    // Writer thread, if started
+    int threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    strbuf_t pending; // buffer being written by the thread
+    int busy; // pending holds data not yet written
+    int stop;
+#endif
+} ecli_output_t;
+
+// Whether the print instructions should format anything at all
+#define output_enabled(o) ((o)->kind != OUTPUT_NULL)
+
+/* output.c */
+extern void output_init(ecli_output_t* o);
+extern void output_close(ecli_output_t* o);
+extern void output_set_file(ecli_output_t* o, FILE* f);
+extern void output_set_files(ecli_output_t* o, FILE** files, unsigned int count);
+extern void output_set_memory(ecli_output_t* o);
+extern ecli_result_t output_set_threaded(ecli_output_t* o, int threaded);
+extern void output_flush(ecli_output_t* o);
+extern void output_end_frame(ecli_output_t* o);
+
+#endif
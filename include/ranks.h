@@ -0,0 +1,72 @@
+/**
+ * Shared runs over several difficulties
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_RANKS_H__
+#define __ECLI_RANKS_H__
+
+#include "ecli.h"
+
+/*
+ * A shared run stands for several difficulties at once. Most instructions
+ * run on every difficulty, so the difficulties behave the same until one of
+ * them skips an op the others run, or an op reads a variable which tells
+ * them apart (DIFF, EASY, ...). Until then one process runs the VMs for all
+ * of them, on streams built for the set (see code.h), and reports the lowest
+ * difficulty of the set as the one it runs on.
+ *
+ * Where the difficulties stop agreeing the stream has an INS_SPLIT. It
+ * divides the set into groups which agree on the op and fork()s a process
+ * for each group but the first. Everything is copied on write, so each
+ * process carries on with its group exactly where the split happened, after
+ * moving its VMs to the streams of the group, and then runs the op itself.
+ * What ran before the split was only run once for all of them.
+ *
+ * Each process writes the output of the print instructions to the files of
+ * every difficulty it stands for, so each file gets the whole output of its
+ * difficulty. When a process is done it waits for the processes split from
+ * it with ecli_ranks_wait(). Anything a process counted before a split, like
+ * bullet stats or the profile, is in every process after it.
+ */
+
+typedef struct _ecli_ranks {
+    uint8_t ranks; // difficulties this process stands for
+    FILE* files[DIFFICULTY_COUNT]; // output of each difficulty, NULL to discard it
+    int child; // this process was split from another
+    long pids[DIFFICULTY_COUNT]; // processes split from this one
+    unsigned int pid_count;
+} ecli_ranks_t;
+
+/* ranks.c */
+extern int ranks_agree(ecl_op_t* op, uint8_t a, uint8_t b);
+extern void ranks_apply(ecli_runtime_t* rt);
+extern ecl_op_t* ranks_split(ecl_state_t* state, ecl_op_t* op);
+extern int ranks_wait(ecli_ranks_t* ranks, int* failed);
+
+#endif
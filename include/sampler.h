@@ -0,0 +1,93 @@
+/**
+ * Sampling profiler
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_SAMPLER_H__
+#define __ECLI_SAMPLER_H__
+
+#include "ecli.h"
+
+/*
+ * Counting every instruction (ECLI_MODE_PROFILE) slows down exactly the hot
+ * loops it is meant to find. The sampler instead lets a SIGPROF interval
+ * timer interrupt the run. The interpreter loop it uses (ECLI_MODE_SAMPLE)
+ * publishes the VM it is running and the op it is at in the runtime, one
+ * store per op and no tests, and the signal handler copies that op and the
+ * VM's call stack into a ring buffer. The handler is the only writer of the
+ * ring's head and the runtime the only writer of its tail, so neither needs
+ * a lock; once a frame the runtime drains the ring into a table counting
+ * each distinct stack. Samples taken while no VM was running (enemy and
+ * bullet updates, lockstep batches) are counted apart.
+ *
+ * Samples refer to the instructions of the loaded file, so loading another
+ * one starts over. Only one runtime of a process can sample at a time.
+ */
+
+#define SAMPLE_DEPTH 8 // frames kept per sample: the op, then the calls it is in
+#define SAMPLE_RING 4096 // samples between two drains, a power of two
+
+typedef struct {
+    th10_instr_t* frames[SAMPLE_DEPTH]; // innermost first
+    uint32_t depth;
+} ecl_sample_t;
+
+typedef struct {
+    ecl_sample_t stack;
+    uint64_t count; // 0 for a free bucket
+} sample_bucket_t;
+
+typedef struct _ecli_sampler {
+    struct _ecli_runtime* rt;
+    unsigned int hz;
+    int running;
+    
+    // Accessed with atomics, as the handler may interrupt the runtime anywhere
+    ecl_sample_t ring[SAMPLE_RING];
+    uint32_t head; // written by the signal handler
+    uint32_t tail; // written by sampler_drain()
+    uint32_t dropped; // ring was full
+    
+    sample_bucket_t* table; // open addressing, keyed by the whole stack
+    uint32_t table_size; // a power of two
+    uint32_t table_count;
+    uint64_t total;
+    uint64_t outside; // no VM was running
+} ecli_sampler_t;
+
+/* sampler.c */
+extern ecli_sampler_t* sampler_create(struct _ecli_runtime* rt);
+extern void sampler_free(ecli_sampler_t* s);
+extern ecli_result_t sampler_start(ecli_sampler_t* s, unsigned int hz);
+extern void sampler_stop(ecli_sampler_t* s);
+extern void sampler_drain(ecli_sampler_t* s);
+extern void sampler_reset(ecli_sampler_t* s);
+extern void sampler_print(ecli_sampler_t* s, FILE* f);
+extern void sampler_write_folded(ecli_sampler_t* s, FILE* f);
+
+#endif
@@ -0,0 +1,72 @@
+/**
+ * Persistent server mode for running many short ECL jobs
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_SERVER_H__
+#define __ECLI_SERVER_H__
+
+#include "ecli.h"
+
+/*
+ * Protocol: one request per line, one response line per request. Responses
+ * are written as jobs finish, so they can come back out of order; the id
+ * given in the request is echoed back.
+ *
+ *   run <id> <file> [sub=main] [difficulty=lunatic] [seed=1] [frames=0] [coverage=<path>]
+ *       Run sub of file until every VM finishes or frames frames have run
+ *       (0 means no limit). With coverage, the instructions run are added to
+ *       the coverage file at path (see coverage.h); jobs on several workers
+ *       can share one file. Serve with -O0 for exact coverage. Answered with
+ *           <id> ok status=done|limit frames=<n> vms=<n> usec=<n>
+ *       or
+ *           <id> error <message>
+ *   quit
+ *       Close the connection (end the server when serving stdin).
+ *   shutdown
+ *       Stop accepting connections and exit once running jobs are done.
+ *
+ * Script output (puts, puti, ...) is discarded. Every job runs under the
+ * server's instruction budget (see ecli_budget_t); a VM running 100000000
+ * instructions without waiting fails its job unless the budget says
+ * otherwise.
+ */
+
+typedef struct {
+    const char* socket_path; // Unix domain socket to listen on, NULL for stdin/stdout
+    unsigned int workers; // number of worker threads, 0 for one per CPU
+    unsigned int cache_size; // number of loaded ECL files kept in memory
+    int optimize; // optimization level applied to loaded files
+    uint32_t inline_limit; // largest sub inlined at level 2
+    ecli_budget_t budget; // instruction budgets of the workers' runtimes
+    uint32_t memo; // entries each worker memoizes pure subs in, 0 for none
+} ecli_server_config_t;
+
+extern ecli_result_t ecli_serve(ecli_server_config_t* config);
+
+#endif
@@ -1,98 +1,225 @@
-/**
- * Definitions for the ECL interpreter state
- *
- * Redistribution and use in source and binary forms, with
- * or without modification, are permitted provided that the
- * following conditions are met:
- *
- * 1. Redistributions of source code must retain this list
- *    of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce this
- *    list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the
- *    distribution.
- *
- * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
- * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
- * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
- * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
- * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
- * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
- * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
- * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
- * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
- * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
- * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
- * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
- * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
- * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
- * DAMAGE.
- **/
-#ifndef __ECLI_STATE_H__
-#define __ECLI_STATE_H__
-
-#include "ecli.h"
-
-enum {
-    DIFF_EASY=1,
-    DIFF_NORMAL=2,
-    DIFF_HARD=4,
-    DIFF_LUNATIC=8
-};
-
-typedef struct _ecl_state {
-    // Data stack
-    size_t stack_size;
-    uint32_t sp; // Stack pointer
-    uint32_t bp; // Base pointer
-    ecl_value_t* stack;
-
-    // Call stack
-    th10_instr_t** callstack;
-    uint32_t csp;
-    
-    // Extra information used
-    th10_ecl_t* ecl; // ECL data
-    th10_instr_t* ip; // Instruction pointer
-    
-    // Internal state
-    uint32_t flags;
-    int32_t wait; // frames to wait
-    uint32_t time;
-    
-    // For handling interpretation
-    struct _ecl_state* next;
-} ecl_state_t;
-
-// Global state shared amont *all* interpreters
-typedef struct {
-    float player_x;
-    float player_y;
-    int32_t timeout;
-    uint8_t difficulty;
-    uint32_t chapter;
-    int verbose;
-} ecl_global_state_t;
-
-extern ecl_global_state_t global;
-
-/* state.c */
-extern ecli_result_t allocate_ecl_state(ecl_state_t** statep, th10_ecl_t* ecl);
-extern ecli_result_t initialize_ecl_state(ecl_state_t* state, th10_ecl_t* ecl);
-extern ecli_result_t initialize_globals();
-extern void free_ecl_state(ecl_state_t* state);
-
-extern ecli_result_t state_setup_frame(ecl_state_t* state, uint32_t nvars);
-extern ecli_result_t state_push(ecl_state_t* state, ecl_value_t* value);
-extern ecl_value_t* state_pop(ecl_state_t* state);
-extern ecl_value_t* state_peek(ecl_state_t* state);
-
-extern ecli_result_t state_get_variable(ecl_state_t* state, int32_t slot, ecl_value_t* result);
-extern ecli_result_t state_set_variable(ecl_state_t* state, int32_t slot, ecl_value_t* value);
-
-/* interpreter.c */
-extern ecli_result_t run_all_ecl_instances(ecl_state_t* state);
-extern ecli_result_t run_interpreter_until_wait(ecl_state_t* state);
-extern ecli_result_t run_th10_instruction(ecl_state_t* state);
-
-#endif 
+/**
+ * Definitions for the ECL interpreter state
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_STATE_H__
+#define __ECLI_STATE_H__
+
+#include "ecli.h"
+
+enum {
+    DIFF_EASY=1,
+    DIFF_NORMAL=2,
+    DIFF_HARD=4,
+    DIFF_LUNATIC=8
+};
+
+// Number of executed instructions each VM remembers, a power of two
+#define ECL_HISTORY_SIZE 16
+
+// Global and per-VM variables have slots -10000 to -9907, and are looked up
+// in a table indexed by slot + VARIABLE_BASE
+#define VARIABLE_BASE 10000
+#define VARIABLE_COUNT 94
+#define VARIABLE_LOCALS 4 // I0-I3 and F0-F3
+
+struct _ecli_runtime;
+struct _ecli_debugger;
+struct _ecli_sampler;
+struct _ecli_coverage;
+struct _ecli_memo;
+struct _memo_entry;
+struct _ecli_ranks;
+
+typedef struct _ecl_state {
+    // What the scheduler and the dispatch loop touch on every VM, kept
+    // together in the first cache line of each slot
+    ecl_op_t* ip; // Instruction pointer, NULL once the VM has finished
+    ecl_value_t* stack;
+    uint32_t sp; // Stack pointer
+    uint32_t bp; // Base pointer
+    int32_t wait; // frames to wait
+    uint32_t time;
+    int checked; // the verifier couldn't bound the stacks, run with checks
+    enemy_handle_t enemy; // the enemy the VM runs for
+    size_t stack_size;
+    uint32_t lockstep_frame; // frame + 1 when last considered for a batch
+    uint32_t csp;
+    ecl_op_t** callstack;
+    
+    // Extra information used
+    struct _ecli_runtime* rt; // Runtime owning this VM
+    th10_ecl_t* ecl; // ECL data
+    uint32_t callstack_size;
+    uint32_t args; // locals a call has filled in, kept by the callee's stackAlloc
+    
+    // Per-VM variables
+    int32_t ivars[VARIABLE_LOCALS];
+    float fvars[VARIABLE_LOCALS];
+    
+    // Ring buffer of the last instructions run, for crash reports
+    ecl_op_t* history[ECL_HISTORY_SIZE];
+    uint32_t history_pos; // also counts the instructions run
+    
+    // Scheduling under instruction budgets, see run_all_ecl_instances()
+    uint32_t budget_end; // history_pos at which the VM yields at the next jump or call
+    uint32_t run_start; // history_pos when the VM last started running after a wait
+    uint32_t batched; // ops run in lockstep batches ahead of its turn, see lockstep.h
+    uint32_t turn_frame; // frame + 1 once the VM had its turn
+    int preempted; // stopped by a budget before it waited, its clocks stand still
+    
+    uint32_t id; // numbered from 1 in the order VMs are made, for the debugger
+    struct _memo_entry* memo_pending; // call to a pure sub being recorded, see memo.h
+} ecl_state_t;
+
+#define vm_finished(state) ((state)->ip == NULL)
+
+// VMs in execution order, stored in fixed-size chunks so that spawning one
+// never moves the others. Finished VMs stay in place until the table is
+// compacted at the end of the frame.
+#define VM_CHUNK_SIZE 256 // a power of two
+
+typedef struct {
+    ecl_state_t** chunks;
+    uint32_t chunk_count; // chunks allocated
+    uint32_t chunk_cap;
+    uint32_t count; // slots in use, finished VMs included
+    uint32_t live; // running VMs
+} ecl_vm_table_t;
+
+#define vm_table_at(table, i) (&(table)->chunks[(i) / VM_CHUNK_SIZE][(i) % VM_CHUNK_SIZE])
+
+// Global state shared among all interpreters of a runtime
+typedef struct {
+    float player_x;
+    float player_y;
+    int32_t timeout;
+    uint8_t difficulty;
+    uint32_t chapter;
+    uint32_t rng; // random number generator state
+} ecl_global_state_t;
+
+// Interpreter loop variants, see interpreter_loop.h
+typedef enum {
+    ECLI_MODE_PLAIN,
+    ECLI_MODE_TRACE, // print every instruction to the output
+    ECLI_MODE_PROFILE, // count the instructions run per opcode
+    ECLI_MODE_SAMPLE, // publish the op being run for the sampler, see sampler.h
+    ECLI_MODE_COVERAGE // mark the instructions run, see coverage.h
+} ecli_mode_t;
+
+typedef ecli_result_t (*ecli_loop_t)(ecl_state_t* state);
+
+// Instruction budgets, 0 for no limit. A VM that runs through its slice is
+// preempted at its next jump or call, so a budget can overrun by at most the
+// straight-line code before one.
+typedef struct {
+    uint32_t slice; // instructions a VM runs before the others get a turn
+    uint64_t frame; // instructions all VMs run in a frame, the rest wait for the next
+    uint32_t loop; // instructions a VM may run without waiting before it is reported as stuck
+    int defer; // a VM whose slice runs out continues next frame, not after the others
+} ecli_budget_t;
+
+// Slice of a VM when there is no per-VM budget
+#define BUDGET_SLICE_MAX 0x40000000
+
+// Everything needed to run one ECL file: the file, its VMs and the globals
+typedef struct _ecli_runtime {
+    ecl_global_state_t global;
+    th10_ecl_t* ecl;
+    th10_ecl_t ecl_storage; // used when the runtime loaded the file itself
+    ecl_vm_table_t vms; // running VMs
+    uint32_t vm_ids; // VMs made so far
+    uint32_t frame;
+    ecli_output_t output; // output of the debug print instructions
+    ecli_mode_t mode;
+    ecli_loop_t loop[2]; // runs a VM until it waits, without and with checks
+    int lockstep; // run VMs at the same op in batches, plain mode only
+    ecli_lockstep_t lockstep_mem;
+    enemy_manager_t enemies;
+    bullet_manager_t bullets;
+    struct _ecli_debugger* debugger; // NULL unless debugging
+    uint64_t* profile; // per-opcode counts, indexed by ins_get_index()
+    struct _ecli_sampler* sampler; // NULL unless sampling
+    ecl_state_t* volatile sample_vm; // VM being run in ECLI_MODE_SAMPLE
+    ecl_op_t* volatile sample_op; // op being run, NULL between VMs
+    struct _ecli_coverage* coverage; // instructions run, NULL unless recorded
+    ecli_budget_t budget;
+    uint32_t preempted; // VMs a budget stopped last frame, they go first in this one
+    ecl_state_t** requeue; // VMs preempted this frame, waiting for another slice
+    uint32_t requeue_cap;
+    int optimize; // optimization level for files the runtime loads
+    uint32_t inline_limit; // largest sub inlined at level 2
+    ecl_opt_stats_t opt_stats; // what the optimizer did to the loaded file
+    struct _ecli_memo* memo; // effects of calls to pure subs, NULL unless memoizing
+    uint8_t streams; // what the VMs' streams are for: the difficulty, or in a
+                     // shared run every difficulty it stands for
+    struct _ecli_ranks* ranks; // NULL unless this is a shared run, see ranks.h
+} ecli_runtime_t;
+
+// How a pure sub may use a global or per-VM variable, see memo.h
+typedef enum {
+    PURITY_NONE, // not at all
+    PURITY_DIFFICULTY, // read it, it only depends on the difficulty
+    PURITY_VM // read and write it, it is a cell of the VM
+} variable_purity_t;
+
+/* state.c */
+extern ecli_result_t allocate_ecl_state(ecl_state_t** statep, ecli_runtime_t* rt, ecl_code_t* code, enemy_handle_t enemy);
+extern ecli_result_t initialize_ecl_state(ecl_state_t* state, ecli_runtime_t* rt, ecl_code_t* code, enemy_handle_t enemy);
+extern ecli_result_t initialize_globals(ecl_global_state_t* global);
+extern void state_seed_random(ecl_global_state_t* global, uint32_t seed);
+extern uint32_t state_random(ecl_global_state_t* global);
+extern float state_random_float(ecl_global_state_t* global);
+extern void free_ecl_state(ecl_state_t* state);
+
+extern ecl_state_t* vm_table_add(ecl_vm_table_t* table);
+extern void vm_table_compact(ecl_vm_table_t* table);
+extern void vm_table_free(ecl_vm_table_t* table);
+
+extern ecli_result_t state_setup_frame(ecl_state_t* state, uint32_t nvars);
+
+extern ecli_result_t state_get_variable(ecl_state_t* state, int32_t slot, ecl_value_t* result);
+extern ecli_result_t state_set_variable(ecl_state_t* state, int32_t slot, ecl_value_t* value);
+extern variable_purity_t state_variable_purity(int32_t slot);
+extern int state_difficulty_variable(int32_t slot, uint8_t difficulty, int32_t* value);
+
+/* regir.c */
+extern ecli_result_t regir_run(ecl_state_t* state, const ecl_block_t* block);
+
+/* runtime.c */
+extern void runtime_remap(ecli_runtime_t* rt, uint8_t streams);
+
+/* interpreter.c */
+extern ecli_loop_t get_interpreter_loop(ecli_mode_t mode, int checked);
+extern ecli_result_t run_all_ecl_instances(ecli_runtime_t* rt);
+extern ecli_result_t run_interpreter_until_wait(ecl_state_t* state);
+extern void dump_ecl_state_history(ecl_state_t* state, FILE* f);
+
+#endif 
@@ -1,56 +1,75 @@
-/**
- * Utility functions for ECLI
- *
- * Redistribution and use in source and binary forms, with
- * or without modification, are permitted provided that the
- * following conditions are met:
- *
- * 1. Redistributions of source code must retain this list
- *    of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce this
- *    list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the
- *    distribution.
- *
- * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
- * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
- * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
- * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
- * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
- * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
- * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
- * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
- * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
- * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
- * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
- * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
- * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
- * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
- * DAMAGE.
- **/
-#ifndef __ECLI_UTIL_H__
-#define __ECLI_UTIL_H__
-
-#include "config.h"
-
-#include <stdio.h>
-#include <stdlib.h>
-
-/* Memory management and allocation */
-#define xfree(p) { free((p)); (p) = NULL;}
-extern void* xmalloc(size_t amt);
-
-/* Command-line arguments */
-typedef struct {
-    char shortname;
-    char* longname;
-    int* flag;
-    int has_arg;
-    char *desc;
-} param_t;
-
-extern void args_set(int _argc, char** _argv);
-extern int arg_get(param_t* params);
-extern const char* arg_get_param();
-extern void arg_print_usage(const char* description, const char* pos, param_t* params, const char* long_description);
-#endif
+/**
+ * Utility functions for ECLI
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_UTIL_H__
+#define __ECLI_UTIL_H__
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Memory management and allocation */
+#define xfree(p) { free((p)); (p) = NULL;}
+extern void* xmalloc(size_t amt);
+extern void* xrealloc(void* p, size_t amt);
+
+/* System information */
+extern unsigned int cpu_count(void);
+
+/* Growable text buffers */
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} strbuf_t;
+
+extern void strbuf_init(strbuf_t* buf);
+extern void strbuf_free(strbuf_t* buf);
+extern void strbuf_reserve(strbuf_t* buf, size_t amt);
+extern void strbuf_append(strbuf_t* buf, const char* s, size_t len);
+extern void strbuf_puts(strbuf_t* buf, const char* s);
+extern void strbuf_printf(strbuf_t* buf, const char* format, ...);
+#define strbuf_putc(buf, c) { strbuf_reserve((buf), 1); (buf)->data[(buf)->len++] = (c); }
+
+/* Command-line arguments */
+typedef struct {
+    char shortname;
+    char* longname;
+    int* flag;
+    int has_arg;
+    char *desc;
+} param_t;
+
+extern void args_set(int _argc, char** _argv);
+extern int arg_get(param_t* params);
+extern const char* arg_get_param();
+extern void arg_print_usage(const char* description, const char* pos, param_t* params, const char* long_description);
+#endif
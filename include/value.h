@@ -1,58 +1,59 @@
-/**
- * ECL value handling for instruction parameters
- *
- * Redistribution and use in source and binary forms, with
- * or without modification, are permitted provided that the
- * following conditions are met:
- *
- * 1. Redistributions of source code must retain this list
- *    of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce this
- *    list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the
- *    distribution.
- *
- * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
- * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
- * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
- * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
- * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
- * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
- * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
- * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
- * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
- * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
- * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
- * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
- * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
- * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
- * DAMAGE.
- **/
-#ifndef __ECLI_VALUE_H__
-#define __ECLI_VALUE_H__
-
-#include <stdint.h>
-
-// Possible data types in an ECL instruction parameter list
-typedef enum {
-    ECL_INVALID=0,
-    ECL_INT32,
-    ECL_UINT32,
-    ECL_FLOAT32,
-    ECL_STRING
-} ecl_type_t;
-
-typedef struct {
-    ecl_type_t type;
-    union {
-        int32_t i;
-        uint32_t u;
-        float f;
-        char* s;
-    };
-} ecl_value_t;
-
-extern ecli_result_t value_get_parameters(ecl_value_t* values, const char* format, uint8_t* data);
-extern void value_print(ecl_value_t* v);
-
-#endif
+/**
+ * ECL value handling for instruction parameters
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#ifndef __ECLI_VALUE_H__
+#define __ECLI_VALUE_H__
+
+#include <stdint.h>
+
+// Possible data types in an ECL instruction parameter list
+typedef enum {
+    ECL_INVALID=0,
+    ECL_INT32,
+    ECL_UINT32,
+    ECL_FLOAT32,
+    ECL_STRING
+} ecl_type_t;
+
+typedef struct {
+    ecl_type_t type;
+    union {
+        int32_t i;
+        uint32_t u;
+        float f;
+        char* s;
+    };
+} ecl_value_t;
+
+extern ecli_result_t value_get_parameters(ecl_value_t* values, const char* format, uint8_t* data, unsigned int count);
+extern void value_convert(ecl_value_t* v, ecl_type_t type);
+extern void value_print(ecl_value_t* v);
+
+#endif
@@ -0,0 +1,490 @@
+/**
+ * Programmatic construction of binary ECL files
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include <stdarg.h>
+
+#include "ecli.h"
+#include "builder.h"
+
+static const uint8_t zeros[4] = {0, 0, 0, 0};
+
+/**
+ * Write raw bytes to the builder's output
+ **/
+static ecli_result_t
+builder_write(ecl_builder_t* b, const void* data, size_t len)
+{
+    if(b->f) {
+        if(len && (fwrite(data, len, 1, b->f) != 1)) {
+            fprintf(stderr, "builder: write failed\n");
+            return ECLI_FAILURE;
+        }
+    } else {
+        if(b->pos + len > b->mem_cap) {
+            size_t cap = b->mem_cap ? b->mem_cap : 4096;
+            while(cap < b->pos + len) { cap <<= 1; }
+            b->mem = xrealloc(b->mem, cap);
+            b->mem_cap = cap;
+        }
+        memcpy(b->mem + b->pos, data, len);
+    }
+    b->pos += len;
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Pad the output with zeros so the next write is 4-byte aligned with respect
+ * to the start of the file
+ **/
+static ecli_result_t
+builder_align(ecl_builder_t* b)
+{
+    return builder_write(b, zeros, (4 - (b->pos & 0x03)) & 0x03);
+}
+
+/**
+ * Reserve len bytes at the end of the sub being built
+ **/
+static uint8_t*
+builder_reserve(ecl_builder_t* b, uint32_t len)
+{
+    if(b->len + len > b->cap) {
+        uint32_t cap = b->cap ? b->cap : 1024;
+        while(cap < b->len + len) { cap <<= 1; }
+        b->buf = xrealloc(b->buf, cap);
+        b->cap = cap;
+    }
+    uint8_t* p = b->buf + b->len;
+    b->len += len;
+    return p;
+}
+
+static int
+compare_names(const void* a, const void* b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+/**
+ * Set up a builder writing to f, or to memory if f is NULL
+ **/
+ecli_result_t
+ecl_builder_init(ecl_builder_t* b, FILE* f)
+{
+    memset(b, 0, sizeof(ecl_builder_t));
+    b->f = f;
+    b->cur_sub = -1;
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Free everything owned by a builder
+ **/
+void
+ecl_builder_free(ecl_builder_t* b)
+{
+    for(unsigned int i = 0; i < INCLUDE_MAX; i++) {
+        xfree(b->includes[i]);
+    }
+    if(b->names) {
+        for(unsigned int i = 0; i < b->sub_count; i++) {
+            xfree(b->names[i]);
+        }
+    }
+    xfree(b->names);
+    xfree(b->offsets);
+    xfree(b->buf);
+    xfree(b->labels);
+    xfree(b->fixups);
+    xfree(b->mem);
+    memset(b, 0, sizeof(ecl_builder_t));
+}
+
+/**
+ * Add a file name to one of the include lists
+ **/
+ecli_result_t
+ecl_builder_add_include(ecl_builder_t* b, include_t include, const char* name)
+{
+    if((include >= INCLUDE_MAX) || (b->names != NULL)) {
+        return ECLI_FAILURE;
+    }
+
+    uint32_t len = strlen(name) + 1;
+    b->includes[include] = xrealloc(b->includes[include], b->include_size[include] + len);
+    memcpy(b->includes[include] + b->include_size[include], name, len);
+    b->include_size[include] += len;
+    b->include_count[include]++;
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Write the header, include lists and sub names. The names can be given in any
+ * order; they are written sorted so get_th10_ecl_sub_by_name() works.
+ **/
+ecli_result_t
+ecl_builder_begin_subs(ecl_builder_t* b, const char** names, uint32_t count)
+{
+    if(b->names != NULL) {
+        return ECLI_FAILURE;
+    }
+
+    b->sub_count = count;
+    b->names = xmalloc(sizeof(char*) * count);
+    b->offsets = xmalloc(sizeof(uint32_t) * count);
+    memset(b->offsets, 0, sizeof(uint32_t) * count);
+    for(unsigned int i = 0; i < count; i++) {
+        b->names[i] = xmalloc(strlen(names[i]) + 1);
+        strcpy(b->names[i], names[i]);
+    }
+    qsort(b->names, count, sizeof(char*), compare_names);
+    for(unsigned int i = 1; i < count; i++) {
+        if(strcmp(b->names[i-1], b->names[i]) == 0) {
+            fprintf(stderr, "builder: duplicate sub name \"%s\"\n", b->names[i]);
+            return ECLI_FAILURE;
+        }
+    }
+
+    // Header
+    th10_header_t header;
+    memset(&header, 0, sizeof(th10_header_t));
+    memcpy(&header.magic[0], "SCPT", 4);
+    header.unknown1 = 1;
+    header.include_offset = sizeof(th10_header_t);
+    header.sub_count = count;
+    for(unsigned int i = 0; i < INCLUDE_MAX; i++) {
+        uint32_t len = sizeof(th10_include_list_t) + b->include_size[i];
+        header.include_length += (len + 3) & ~0x03;
+    }
+    if(!SUCCESS(builder_write(b, &header, sizeof(th10_header_t)))) {
+        return ECLI_FAILURE;
+    }
+
+    // Include lists, each padded to a 4-byte boundary
+    static const char* list_names[INCLUDE_MAX] = {"ANIM", "ECLI"};
+    for(unsigned int i = 0; i < INCLUDE_MAX; i++) {
+        th10_include_list_t list;
+        memcpy(&list.name[0], list_names[i], 4);
+        list.count = b->include_count[i];
+        if(!SUCCESS(builder_write(b, &list, sizeof(th10_include_list_t))) ||
+           !SUCCESS(builder_write(b, b->includes[i], b->include_size[i])) ||
+           !SUCCESS(builder_align(b))) {
+            return ECLI_FAILURE;
+        }
+    }
+
+    // Sub offsets (patched by ecl_builder_finish) followed by the names
+    b->table_pos = b->pos;
+    for(unsigned int i = 0; i < count; i++) {
+        if(!SUCCESS(builder_write(b, zeros, sizeof(uint32_t)))) {
+            return ECLI_FAILURE;
+        }
+    }
+    for(unsigned int i = 0; i < count; i++) {
+        if(!SUCCESS(builder_write(b, b->names[i], strlen(b->names[i]) + 1))) {
+            return ECLI_FAILURE;
+        }
+    }
+
+    return builder_align(b);
+}
+
+/**
+ * Start building the sub with the given (previously declared) name
+ **/
+ecli_result_t
+ecl_builder_begin_sub(ecl_builder_t* b, const char* name)
+{
+    if((b->names == NULL) || (b->cur_sub >= 0)) {
+        return ECLI_FAILURE;
+    }
+
+    char** found = bsearch(&name, b->names, b->sub_count, sizeof(char*), compare_names);
+    if(found == NULL) {
+        fprintf(stderr, "builder: sub \"%s\" was not declared\n", name);
+        return ECLI_FAILURE;
+    }
+    b->cur_sub = found - b->names;
+    if(b->offsets[b->cur_sub] != 0) {
+        fprintf(stderr, "builder: sub \"%s\" was already built\n", name);
+        b->cur_sub = -1;
+        return ECLI_FAILURE;
+    }
+
+    b->len = 0;
+    b->time = 0;
+    b->rank_mask = RANK_ALL;
+    b->label_count = 0;
+    b->fixup_count = 0;
+
+    th10_sub_t* sub = (th10_sub_t*)builder_reserve(b, sizeof(th10_sub_t));
+    memcpy(&sub->magic[0], "ECLH", 4);
+    sub->data_offset = sizeof(th10_sub_t);
+    sub->zero[0] = sub->zero[1] = 0;
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Resolve the jumps in the current sub and write it out
+ **/
+ecli_result_t
+ecl_builder_end_sub(ecl_builder_t* b)
+{
+    if(b->cur_sub < 0) {
+        return ECLI_FAILURE;
+    }
+
+    for(unsigned int i = 0; i < b->fixup_count; i++) {
+        ecl_builder_fixup_t* fix = &b->fixups[i];
+        ecl_builder_label_t* label = &b->labels[fix->label];
+        if(label->offset == BUILDER_NO_LABEL) {
+            fprintf(stderr, "builder: unbound label %u in sub \"%s\"\n",
+                    fix->label, b->names[b->cur_sub]);
+            return ECLI_FAILURE;
+        }
+        th10_instr_t* ins = (th10_instr_t*)(b->buf + fix->at);
+        int32_t offset = (int32_t)label->offset - (int32_t)fix->at;
+        memcpy(&ins->data[0], &offset, sizeof(int32_t));
+        memcpy(&ins->data[4], &label->time, sizeof(uint32_t));
+    }
+
+    b->offsets[b->cur_sub] = b->pos;
+    b->cur_sub = -1;
+    b->subs_done++;
+    return builder_write(b, b->buf, b->len);
+}
+
+/**
+ * Set the time label for the following instructions
+ **/
+void
+ecl_builder_set_time(ecl_builder_t* b, uint32_t time)
+{
+    b->time = time;
+}
+
+/**
+ * Set the rank mask (RANK_* in ecl.h) for the following instructions
+ **/
+void
+ecl_builder_set_rank(ecl_builder_t* b, uint8_t rank_mask)
+{
+    b->rank_mask = rank_mask | 0xF0;
+}
+
+/**
+ * Create a new, unbound label in the current sub
+ **/
+uint32_t
+ecl_builder_new_label(ecl_builder_t* b)
+{
+    if(b->label_count == b->label_cap) {
+        b->label_cap = b->label_cap ? (b->label_cap << 1) : 16;
+        b->labels = xrealloc(b->labels, sizeof(ecl_builder_label_t) * b->label_cap);
+    }
+    b->labels[b->label_count].offset = BUILDER_NO_LABEL;
+    b->labels[b->label_count].time = 0;
+    return b->label_count++;
+}
+
+/**
+ * Bind a label to the position of the next instruction
+ **/
+ecli_result_t
+ecl_builder_bind_label(ecl_builder_t* b, uint32_t label)
+{
+    if((b->cur_sub < 0) || (label >= b->label_count)) {
+        return ECLI_FAILURE;
+    }
+    b->labels[label].offset = b->len;
+    b->labels[label].time = b->time;
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Append an instruction. The format uses the same characters as the
+ * instruction table in ins.c: 'i' (int32_t), 'u' (uint32_t), 'f' (double,
+ * stored as a float), 's' (const char*) and 'D' (a call argument: a const
+ * char* of two type chars, the callee's then the given one, followed by an
+ * int or a double to match the given type). param_mask marks the parameters
+ * which are variable references.
+ **/
+ecli_result_t
+ecl_builder_ins(ecl_builder_t* b, uint16_t id, uint16_t param_mask, const char* format, ...)
+{
+    if(b->cur_sub < 0) {
+        return ECLI_FAILURE;
+    }
+
+    uint32_t start = b->len;
+    th10_instr_t* ins = (th10_instr_t*)builder_reserve(b, sizeof(th10_instr_t));
+    ins->time = b->time;
+    ins->id = id;
+    ins->param_mask = param_mask;
+    ins->rank_mask = b->rank_mask;
+    ins->param_count = strlen(format);
+    ins->zero = 0;
+
+    va_list args;
+    va_start(args, format);
+    for(const char* c = format; *c; c++) {
+        switch(*c) {
+            case 'i': {
+                int32_t i = va_arg(args, int);
+                memcpy(builder_reserve(b, 4), &i, 4);
+            }   break;
+
+            case 'u': {
+                uint32_t u = va_arg(args, unsigned int);
+                memcpy(builder_reserve(b, 4), &u, 4);
+            }   break;
+
+            case 'f': {
+                float f = (float)va_arg(args, double);
+                memcpy(builder_reserve(b, 4), &f, 4);
+            }   break;
+
+            case 's': { // length, then the string zero-padded to 4 bytes
+                const char* s = va_arg(args, const char*);
+                uint32_t len = strlen(s);
+                uint32_t padded = (len + 4) & ~0x03;
+                memcpy(builder_reserve(b, 4), &padded, 4);
+                uint8_t* p = builder_reserve(b, padded);
+                memset(p, 0, padded);
+                memcpy(p, s, len);
+            }   break;
+
+            case 'D': { // callee type, given type, two bytes padding, value
+                const char* types = va_arg(args, const char*);
+                uint8_t* p = builder_reserve(b, 8);
+                p[0] = types[0];
+                p[1] = types[1];
+                p[2] = p[3] = 0;
+                if(types[1] == 'f') {
+                    float f = (float)va_arg(args, double);
+                    memcpy(p + 4, &f, 4);
+                } else {
+                    int32_t i = va_arg(args, int);
+                    memcpy(p + 4, &i, 4);
+                }
+            }   break;
+
+            default:
+                fprintf(stderr, "builder: unrecognized format char: %c\n", *c);
+                va_end(args);
+                b->len = start;
+                return ECLI_FAILURE;
+        }
+    }
+    va_end(args);
+
+    // The size is stored in 16 bits
+    if(b->len - start > 0xFFFF) {
+        fprintf(stderr, "builder: instruction of %u bytes is too large\n", b->len - start);
+        b->len = start;
+        return ECLI_FAILURE;
+    }
+    
+    // builder_reserve() may have moved the buffer
+    ins = (th10_instr_t*)(b->buf + start);
+    ins->size = b->len - start;
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Append a jump (jmp, jmpEq or jmpNeq) to a label. The offset and time label
+ * parameters are filled in when the sub is finished.
+ **/
+ecli_result_t
+ecl_builder_jump(ecl_builder_t* b, uint16_t id, uint32_t label)
+{
+    if(label >= b->label_count) {
+        return ECLI_FAILURE;
+    }
+
+    if(b->fixup_count == b->fixup_cap) {
+        b->fixup_cap = b->fixup_cap ? (b->fixup_cap << 1) : 16;
+        b->fixups = xrealloc(b->fixups, sizeof(ecl_builder_fixup_t) * b->fixup_cap);
+    }
+    b->fixups[b->fixup_count].at = b->len;
+    b->fixups[b->fixup_count].label = label;
+    b->fixup_count++;
+
+    return ecl_builder_ins(b, id, 0, "iu", 0, 0);
+}
+
+/**
+ * Patch the sub offset table once every sub has been written
+ **/
+ecli_result_t
+ecl_builder_finish(ecl_builder_t* b)
+{
+    if((b->names == NULL) || (b->cur_sub >= 0)) {
+        return ECLI_FAILURE;
+    }
+    if(b->subs_done != b->sub_count) {
+        for(unsigned int i = 0; i < b->sub_count; i++) {
+            if(b->offsets[i] == 0) {
+                fprintf(stderr, "builder: sub \"%s\" was never built\n", b->names[i]);
+            }
+        }
+        return ECLI_FAILURE;
+    }
+
+    size_t len = sizeof(uint32_t) * b->sub_count;
+    if(b->f) {
+        if((0 != fseek(b->f, b->table_pos, SEEK_SET)) ||
+           (len && (fwrite(b->offsets, len, 1, b->f) != 1)) ||
+           (0 != fseek(b->f, 0, SEEK_END))) {
+            fprintf(stderr, "builder: failed to write the sub table\n");
+            return ECLI_FAILURE;
+        }
+    } else {
+        memcpy(b->mem + b->table_pos, b->offsets, len);
+    }
+
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Take the finished file from a builder writing to memory. The caller owns the
+ * returned buffer and must free() it.
+ **/
+uint8_t*
+ecl_builder_get_buffer(ecl_builder_t* b, size_t* size)
+{
+    uint8_t* mem = b->mem;
+    if(size) {
+        *size = b->pos;
+    }
+    b->mem = NULL;
+    b->mem_cap = 0;
+    return mem;
+}
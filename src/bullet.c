@@ -0,0 +1,433 @@
+/**
+ * Bullet manager: bullet emitters of enemies and the bullets they fire
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include <math.h>
+
+#include "ecli.h"
+
+// Bullets an emitter turns into velocities at once
+#define FIRE_BATCH 64
+
+// Grid over the playfield and its margin, in BULLET_CELL_SIZE cells
+#define GRID_LEFT (PLAYFIELD_LEFT - PLAYFIELD_MARGIN)
+#define GRID_TOP (PLAYFIELD_TOP - PLAYFIELD_MARGIN)
+#define GRID_W 14
+#define GRID_H 16
+#define GRID_CELLS (GRID_W * GRID_H)
+
+#define POOL_ARRAYS 7 // x, y, vx, vy, angle, speed, life
+#define POOL_ALIGN (BULLET_WIDTH * sizeof(float))
+
+typedef float vf __attribute__((vector_size(BULLET_WIDTH * sizeof(float))));
+typedef int32_t vi __attribute__((vector_size(BULLET_WIDTH * sizeof(int32_t))));
+
+/**
+ * Set up an empty bullet manager
+ **/
+void
+bullet_init(bullet_manager_t* bm)
+{
+    memset(bm, 0, sizeof(bullet_manager_t));
+    bm->start = xmalloc(sizeof(uint32_t) * (GRID_CELLS + 1));
+    memset(bm->start, 0, sizeof(uint32_t) * (GRID_CELLS + 1));
+}
+
+/**
+ * Free the pools of a bullet manager
+ **/
+void
+bullet_free(bullet_manager_t* bm)
+{
+    xfree(bm->mem);
+    xfree(bm->free);
+    xfree(bm->start);
+    xfree(bm->order);
+    xfree(bm->cell);
+    memset(bm, 0, sizeof(bullet_manager_t));
+}
+
+/**
+ * Remove every bullet and reset the statistics, keeping the pools
+ **/
+void
+bullet_clear(bullet_manager_t* bm)
+{
+    if(bm->capacity > 0) {
+        memset(bm->x, 0, sizeof(float) * POOL_ARRAYS * bm->capacity);
+    }
+    bm->used = 0;
+    bm->free_count = 0;
+    bm->spawns = 0;
+    memset(&bm->stats, 0, sizeof(bullet_stats_t));
+}
+
+/**
+ * Double the size of the pools. New slots are zeroed, which makes them dead.
+ **/
+static void
+bullet_grow(bullet_manager_t* bm)
+{
+    uint32_t capacity = bm->capacity ? bm->capacity * 2 : 1024;
+    void* mem = xmalloc(sizeof(float) * POOL_ARRAYS * capacity + POOL_ALIGN);
+    float* base = (float*)(((uintptr_t)mem + POOL_ALIGN - 1) & ~(uintptr_t)(POOL_ALIGN - 1));
+    float* old[POOL_ARRAYS] = {bm->x, bm->y, bm->vx, bm->vy, bm->angle, bm->speed, (float*)bm->life};
+    
+    memset(base, 0, sizeof(float) * POOL_ARRAYS * capacity);
+    for(unsigned int i = 0; i < POOL_ARRAYS && bm->capacity > 0; i++) {
+        memcpy(base + i * capacity, old[i], sizeof(float) * bm->capacity);
+    }
+    bm->x = base;
+    bm->y = base + capacity;
+    bm->vx = base + 2 * capacity;
+    bm->vy = base + 3 * capacity;
+    bm->angle = base + 4 * capacity;
+    bm->speed = base + 5 * capacity;
+    bm->life = (int32_t*)(base + 6 * capacity);
+    
+    xfree(bm->mem);
+    bm->mem = mem;
+    bm->capacity = capacity;
+    bm->free = xrealloc(bm->free, sizeof(uint32_t) * capacity);
+    bm->order = xrealloc(bm->order, sizeof(uint32_t) * capacity);
+    bm->cell = xrealloc(bm->cell, sizeof(uint16_t) * capacity);
+}
+
+/**
+ * Add a bullet whose direction is already worked out, reusing a free slot
+ * if there is one. Returns its slot.
+ **/
+static uint32_t
+bullet_add(bullet_manager_t* bm, float x, float y, float angle, float speed, float s, float c)
+{
+    uint32_t i;
+    if(bm->free_count > 0) {
+        i = bm->free[--bm->free_count];
+    } else {
+        if(bm->used == bm->capacity) {
+            bullet_grow(bm);
+        }
+        i = bm->used++;
+    }
+    
+    bm->x[i] = x;
+    bm->y[i] = y;
+    bm->angle[i] = angle;
+    bm->speed[i] = speed;
+    bm->vx[i] = c * speed;
+    bm->vy[i] = s * speed;
+    bm->life[i] = BULLET_LIFETIME;
+    bm->spawns++;
+    return i;
+}
+
+/**
+ * Add a bullet. Returns its slot.
+ **/
+uint32_t
+bullet_spawn(bullet_manager_t* bm, float x, float y, float angle, float speed)
+{
+    float s, c;
+    fmath_sincos(angle, &s, &c);
+    return bullet_add(bm, x, y, angle, speed, s, c);
+}
+
+/**
+ * Add bullets from one point, taking the sines and cosines of all of their
+ * angles in one go
+ **/
+static void
+bullet_spawn_n(bullet_manager_t* bm, float x, float y, float* angle, float* speed, uint32_t n)
+{
+    float s[FIRE_BATCH], c[FIRE_BATCH];
+    fmath_sincos_n(angle, s, c, n);
+    for(uint32_t i = 0; i < n; i++) {
+        bullet_add(bm, x, y, angle[i], speed[i], s[i], c[i]);
+    }
+}
+
+/**
+ * Sort the live bullets into the grid cells, counting sort style
+ **/
+static void
+bullet_build_grid(bullet_manager_t* bm)
+{
+    uint32_t* start = bm->start;
+    
+    memset(start, 0, sizeof(uint32_t) * (GRID_CELLS + 1));
+    for(uint32_t i = 0; i < bm->used; i++) {
+        if(bm->life[i] > 0) {
+            int cx = (int)((bm->x[i] - GRID_LEFT) / BULLET_CELL_SIZE);
+            int cy = (int)((bm->y[i] - GRID_TOP) / BULLET_CELL_SIZE);
+            cx = (cx < 0) ? 0 : (cx >= GRID_W) ? GRID_W - 1 : cx;
+            cy = (cy < 0) ? 0 : (cy >= GRID_H) ? GRID_H - 1 : cy;
+            bm->cell[i] = cy * GRID_W + cx;
+            start[bm->cell[i] + 1]++;
+        }
+    }
+    for(unsigned int c = 0; c < GRID_CELLS; c++) {
+        start[c + 1] += start[c];
+    }
+    
+    // Fill the cells, using start[c] as the cursor of cell c for now
+    for(uint32_t i = 0; i < bm->used; i++) {
+        if(bm->life[i] > 0) {
+            bm->order[start[bm->cell[i]]++] = i;
+        }
+    }
+    for(unsigned int c = GRID_CELLS; c > 0; c--) {
+        start[c] = start[c - 1];
+    }
+    start[0] = 0;
+}
+
+/**
+ * Count the bullets touching the player, looking only at the cells around it
+ **/
+static uint32_t
+bullet_hit_test(bullet_manager_t* bm, float player_x, float player_y)
+{
+    int px = (int)floorf((player_x - GRID_LEFT) / BULLET_CELL_SIZE);
+    int py = (int)floorf((player_y - GRID_TOP) / BULLET_CELL_SIZE);
+    uint32_t hits = 0;
+    
+    for(int cy = py - 1; cy <= py + 1; cy++) {
+        for(int cx = px - 1; cx <= px + 1; cx++) {
+            if(cx < 0 || cx >= GRID_W || cy < 0 || cy >= GRID_H) {
+                continue;
+            }
+            int c = cy * GRID_W + cx;
+            for(uint32_t k = bm->start[c]; k < bm->start[c + 1]; k++) {
+                uint32_t i = bm->order[k];
+                float dx = bm->x[i] - player_x;
+                float dy = bm->y[i] - player_y;
+                hits += (dx * dx + dy * dy < BULLET_HIT_RADIUS * BULLET_HIT_RADIUS) ? 1 : 0;
+            }
+        }
+    }
+    return hits;
+}
+
+/**
+ * Move every bullet, cull the ones which left the playfield or expired, and
+ * test the rest against the player. Runs once per frame, after the VMs.
+ **/
+void
+bullet_update(bullet_manager_t* bm, float player_x, float player_y)
+{
+    const vf left = (vf){} + (PLAYFIELD_LEFT - PLAYFIELD_MARGIN);
+    const vf right = (vf){} + (PLAYFIELD_RIGHT + PLAYFIELD_MARGIN);
+    const vf top = (vf){} + (PLAYFIELD_TOP - PLAYFIELD_MARGIN);
+    const vf bottom = (vf){} + (PLAYFIELD_BOTTOM + PLAYFIELD_MARGIN);
+    uint32_t culled = 0;
+    
+    // Slots past used are zero, so whole vectors can run to the end
+    for(uint32_t i = 0; i < bm->used; i += BULLET_WIDTH) {
+        vf* x = (vf*)&bm->x[i];
+        vf* y = (vf*)&bm->y[i];
+        vi* life = (vi*)&bm->life[i];
+        
+        *x += *(vf*)&bm->vx[i];
+        *y += *(vf*)&bm->vy[i];
+        vi alive = (*life > 0); // -1 where alive
+        *life += alive;
+        vi dying = alive & ((*x < left) | (*x > right) | (*y < top) | (*y > bottom) | (*life == 0));
+        
+        int32_t any = 0;
+        for(unsigned int l = 0; l < BULLET_WIDTH; l++) {
+            any |= dying[l];
+        }
+        if(!any) {
+            continue;
+        }
+        for(unsigned int l = 0; l < BULLET_WIDTH; l++) {
+            if(dying[l]) {
+                bm->life[i + l] = 0;
+                bm->vx[i + l] = 0.0f;
+                bm->vy[i + l] = 0.0f;
+                bm->free[bm->free_count++] = i + l;
+                culled++;
+            }
+        }
+    }
+    
+    bullet_build_grid(bm);
+    
+    bullet_stats_t* s = &bm->stats;
+    s->spawned = bm->spawns;
+    s->culled = culled;
+    s->hits = bullet_hit_test(bm, player_x, player_y);
+    s->live = bm->used - bm->free_count;
+    s->peak = (s->live > s->peak) ? s->live : s->peak;
+    s->total_spawned += s->spawned;
+    s->total_culled += s->culled;
+    s->total_hits += s->hits;
+    bm->spawns = 0;
+}
+
+/**
+ * Put an emitter back to its defaults: one bullet aimed at the player
+ **/
+void
+bullet_emitter_reset(bullet_emitter_t* et)
+{
+    memset(et, 0, sizeof(bullet_emitter_t));
+    et->speed1 = 1.0f;
+    et->speed2 = 1.0f;
+    et->count1 = 1;
+    et->count2 = 1;
+    et->aim = AIM_FAN_AIMED;
+}
+
+/**
+ * Get an emitter of a VM's enemy, or NULL if et is out of range
+ **/
+bullet_emitter_t*
+bullet_emitter(ecl_state_t* state, int32_t et)
+{
+    if(et < 0 || et >= BULLET_EMITTERS) {
+        return NULL;
+    }
+    enemy_t* enemy = &state->rt->enemies.enemies[enemy_index(state->enemy)];
+    if(enemy->emitters == NULL) {
+        enemy->emitters = xmalloc(sizeof(bullet_emitter_t) * BULLET_EMITTERS);
+        for(unsigned int i = 0; i < BULLET_EMITTERS; i++) {
+            bullet_emitter_reset(&enemy->emitters[i]);
+        }
+    }
+    return &enemy->emitters[et];
+}
+
+/**
+ * Run one of the et* instructions, the emitter number being v[0]
+ **/
+ecli_result_t
+bullet_run_ins(ecl_state_t* state, uint16_t id, ecl_value_t* v)
+{
+    bullet_emitter_t* et = bullet_emitter(state, v[0].i);
+    if(et == NULL) {
+        fprintf(stderr, "%s: no bullet emitter %d\n", ins_get_format(id)->opcode, v[0].i);
+        return ECLI_FAILURE;
+    }
+    
+    switch(id) {
+        case INS_ETNEW:
+            bullet_emitter_reset(et);
+            break;
+        case INS_ETON:
+            bullet_fire(state, et);
+            break;
+        case INS_ETSPRITE:
+            et->sprite = v[1].i;
+            et->color = v[2].i;
+            break;
+        case INS_ETOFFSET:
+            et->offset_x = v[1].f;
+            et->offset_y = v[2].f;
+            break;
+        case INS_ETANGLE:
+            et->angle1 = v[1].f;
+            et->angle2 = v[2].f;
+            break;
+        case INS_ETSPEED:
+            et->speed1 = v[1].f;
+            et->speed2 = v[2].f;
+            break;
+        case INS_ETCOUNT:
+            et->count1 = v[1].i;
+            et->count2 = v[2].i;
+            break;
+        case INS_ETAIM:
+            et->aim = v[1].i;
+            break;
+        default: // etSound, nothing to simulate
+            break;
+    }
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Fire an emitter from the VM's position: count2 layers of count1 bullets,
+ * the layers' speeds going from speed1 to speed2
+ **/
+void
+bullet_fire(ecl_state_t* state, bullet_emitter_t* et)
+{
+    ecl_global_state_t* global = &state->rt->global;
+    bullet_manager_t* bm = &state->rt->bullets;
+    enemy_manager_t* em = &state->rt->enemies;
+    uint32_t e = enemy_index(state->enemy);
+    float x = em->field[ENEMY_ABS_X][e] + em->field[ENEMY_REL_X][e] + et->offset_x;
+    float y = em->field[ENEMY_ABS_Y][e] + em->field[ENEMY_REL_Y][e] + et->offset_y;
+    float aimed = fmath_atan2(global->player_y - y, global->player_x - x);
+    int32_t count1 = (et->count1 > 0) ? et->count1 : 1;
+    int32_t count2 = (et->count2 > 0) ? et->count2 : 1;
+    float angles[FIRE_BATCH], speeds[FIRE_BATCH];
+    uint32_t n = 0;
+    
+    for(int32_t j = 0; j < count2; j++) {
+        float speed = (count2 == 1) ? et->speed1 : et->speed1 + (et->speed2 - et->speed1) * j / (count2 - 1);
+        for(int32_t i = 0; i < count1; i++) {
+            float angle, s = speed;
+            switch(et->aim) {
+                case AIM_FAN_AIMED:
+                    angle = aimed + et->angle1 + (i - (count1 - 1) / 2.0f) * et->angle2;
+                    break;
+                case AIM_RING_AIMED:
+                case AIM_RING_AIMED_AWAY:
+                    angle = aimed + et->angle1 + i * 2.0f * PI / count1;
+                    angle += (et->aim == AIM_RING_AIMED_AWAY) ? PI / count1 : 0.0f;
+                    break;
+                case AIM_RING:
+                case AIM_RING_AWAY:
+                    angle = et->angle1 + i * 2.0f * PI / count1;
+                    angle += (et->aim == AIM_RING_AWAY) ? PI / count1 : 0.0f;
+                    break;
+                case AIM_RANDOM_ANGLE:
+                    angle = et->angle1 + (state_random_float(global) * 2.0f - 1.0f) * et->angle2;
+                    s = et->speed2 + state_random_float(global) * (et->speed1 - et->speed2);
+                    break;
+                case AIM_RANDOM:
+                    angle = (state_random_float(global) * 2.0f - 1.0f) * PI;
+                    s = et->speed2 + state_random_float(global) * (et->speed1 - et->speed2);
+                    break;
+                default: // AIM_FAN and modes not simulated
+                    angle = et->angle1 + (i - (count1 - 1) / 2.0f) * et->angle2;
+                    break;
+            }
+            angles[n] = angle;
+            speeds[n++] = s;
+            if(n == FIRE_BATCH) {
+                bullet_spawn_n(bm, x, y, angles, speeds, n);
+                n = 0;
+            }
+        }
+    }
+    bullet_spawn_n(bm, x, y, angles, speeds, n);
+}
@@ -0,0 +1,776 @@
+/**
+ * Decoding of subs and the load-time stack verifier
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+
+// Values of the verifier's per-slot type masks
+#define TYPE_INT 0x01
+#define TYPE_FLOAT 0x02
+
+// Abstract state before an op
+typedef struct {
+    int32_t depth; // stack slots used by the sub, -1 if the op wasn't reached
+    int32_t nvars; // locals of the frame, -1 before stackAlloc
+    int32_t frame; // depth the frame being run ends at, the sub's or an inlined one's
+} verify_state_t;
+
+/**
+ * Check that an instruction lies entirely within its sub
+ **/
+static int
+instruction_fits(uint8_t* p, uint8_t* end)
+{
+    th10_instr_t* ins = (th10_instr_t*)p;
+    return (p + sizeof(th10_instr_t) <= end) &&
+           (ins->size >= sizeof(th10_instr_t)) &&
+           (p + ins->size <= end);
+}
+
+static int
+compare_op_src(const void* key, const void* entry)
+{
+    const uint8_t* p = key;
+    const uint8_t* q = (const uint8_t*)((const ecl_op_t*)entry)->src;
+    return (p > q) - (p < q);
+}
+
+/**
+ * Give the arguments of a call the type the callee gets them as. Constants
+ * are converted now, variables when the call runs.
+ **/
+static void
+code_decode_args(ecl_op_t* op, th10_instr_t* ins)
+{
+    uint8_t* end = (uint8_t*)ins + ins->size;
+    
+    for(unsigned int i = 1; i < op->nparams; i++) {
+        ecl_value_t* arg = &op->params[i];
+        ecl_type_t type = (end[-8 * (int)(op->nparams - i)] == 'f') ? ECL_FLOAT32 : ECL_INT32;
+        if(!(op->param_mask & (1 << i))) {
+            value_convert(arg, type);
+        }
+        arg->type = type;
+    }
+}
+
+/**
+ * Decode one sub into an array of ops
+ **/
+static void
+code_decode_sub(th10_ecl_t* ecl, ecl_code_t* code)
+{
+    uint8_t* start = (uint8_t*)code->sub->start;
+    uint8_t* end = (uint8_t*)code->sub->end;
+    uint32_t count = 0, nparams = 0;
+    uint8_t* p;
+    
+    // Count the instructions and parameters first
+    for(p = start; instruction_fits(p, end); p += ((th10_instr_t*)p)->size) {
+        const ins_format_t* format = ins_get_format(((th10_instr_t*)p)->id);
+        if(format && ins_get_param_count((th10_instr_t*)p, format) <= OP_MAX_PARAMS) {
+            nparams += ins_get_param_count((th10_instr_t*)p, format);
+        }
+        count++;
+    }
+    
+    code->count = count;
+    code->ops = xmalloc(sizeof(ecl_op_t) * (count + 1));
+    code->params = xmalloc(sizeof(ecl_value_t) * (nparams ? nparams : 1));
+    memset(code->ops, 0, sizeof(ecl_op_t) * (count + 1));
+    
+    ecl_value_t* params = code->params;
+    ecl_op_t* op = code->ops;
+    for(p = start; op != code->ops + count; p += op->src->size, op++) {
+        th10_instr_t* ins = (th10_instr_t*)p;
+        const ins_format_t* format = ins_get_format(ins->id);
+        
+        op->id = ins->id;
+        op->param_mask = ins->param_mask;
+        op->rank_mask = ins->rank_mask;
+        op->time = ins->time;
+        op->src = ins;
+        op->params = params;
+        
+        // Unknown instructions are kept without parameters and fail when run
+        unsigned int nparams = format ? ins_get_param_count(ins, format) : 0;
+        if(format == NULL || ins->id >= INS_INTERNAL || nparams > OP_MAX_PARAMS ||
+           !SUCCESS(value_get_parameters(params, format->format, &ins->data[0], nparams))) {
+            continue;
+        }
+        op->nparams = nparams;
+        params += op->nparams;
+        
+        // Variable references may be encoded as floats, the variables of setf
+        // and the float math instructions always are
+        for(unsigned int i = 0; i < op->nparams; i++) {
+            if(((op->param_mask & (1 << i)) || ins_writes_param(op->id, i)) &&
+               (op->params[i].type == ECL_FLOAT32)) {
+                op->params[i].i = (int32_t)op->params[i].f;
+                op->params[i].type = ECL_INT32;
+            }
+        }
+        
+        if(op->id == INS_CALL || op->id == INS_CALLASYNC) {
+            code_decode_args(op, ins);
+        }
+    }
+    
+    // End marker, which runs on every difficulty
+    op->id = INS_INVALID;
+    op->rank_mask = 0xFF;
+    op->params = params;
+    
+    // Resolve jumps and calls now that every op exists
+    for(op = code->ops; op != code->ops + count; op++) {
+        switch(op->id) {
+            case INS_JMP:
+            case INS_JMPEQ:
+            case INS_JMPNEQ:
+                if(op->nparams > 0) {
+                    op->target = bsearch((uint8_t*)op->src + op->params[0].i, code->ops, count,
+                                         sizeof(ecl_op_t), compare_op_src);
+                }
+                break;
+            
+            case INS_CALL:
+            case INS_CALLASYNC:
+            case INS_ENMCREATE:
+            case INS_ENMCREATEA:
+                if(op->nparams > 0) {
+                    th10_ecl_sub_t* sub = get_th10_ecl_sub_by_name(ecl, op->params[0].s);
+                    op->callee = sub ? ecl_code_for_sub(ecl, sub) : NULL;
+                }
+                break;
+            
+            default:
+                break;
+        }
+    }
+}
+
+/**
+ * Work out how many arguments each call passes: all it has, up to the number
+ * of locals the callee's stackAlloc makes. A callee which doesn't start with
+ * a stackAlloc on every difficulty gets none, as they would land outside its
+ * frame.
+ **/
+static void
+code_resolve_args(th10_ecl_t* ecl)
+{
+    for(uint32_t i = 0; i < ecl->header->sub_count; i++) {
+        ecl_code_t* code = &ecl->code[i];
+        for(ecl_op_t* op = code->ops; op != code->ops + code->count; op++) {
+            if((op->id != INS_CALL && op->id != INS_CALLASYNC) || op->callee == NULL || op->nparams == 0) {
+                continue;
+            }
+            ecl_op_t* entry = &op->callee->ops[0];
+            uint32_t room = 0;
+            if(op->callee->count > 0 && entry->id == INS_STACKALLOC && entry->nparams > 0 &&
+               (entry->rank_mask & 0x0F) == 0x0F) {
+                room = entry->params[0].u >> 2;
+            }
+            uint32_t given = (uint32_t)op->nparams - 1; // after the sub name, nparams > 0 here
+            op->nargs = (given < room) ? given : room;
+        }
+    }
+}
+
+/**
+ * Decode and verify every sub of a loaded file
+ **/
+ecli_result_t
+ecl_code_build(th10_ecl_t* ecl)
+{
+    uint32_t count = ecl->header->sub_count;
+    
+    ecl->code = xmalloc(sizeof(ecl_code_t) * (count ? count : 1));
+    memset(ecl->code, 0, sizeof(ecl_code_t) * (count ? count : 1));
+    for(uint32_t i = 0; i < count; i++) {
+        ecl->code[i].sub = &ecl->subs[i];
+    }
+    for(uint32_t i = 0; i < count; i++) {
+        code_decode_sub(ecl, &ecl->code[i]);
+    }
+    code_resolve_args(ecl);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&ecl->stream_lock, NULL);
+#endif
+    
+    ecl_code_verify(ecl, NULL);
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Free the decoded subs of a file
+ **/
+void
+ecl_code_free(th10_ecl_t* ecl)
+{
+    if(ecl->code == NULL) {
+        return;
+    }
+    ecl_code_free_streams(ecl);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&ecl->stream_lock);
+#endif
+    for(uint32_t i = 0; i < ecl->header->sub_count; i++) {
+        xfree(ecl->code[i].ops);
+        xfree(ecl->code[i].params);
+        xfree(ecl->code[i].sites);
+        xfree(ecl->code[i].blocks);
+        xfree(ecl->code[i].regs);
+        xfree(ecl->code[i].block_src);
+    }
+    xfree(ecl->code);
+}
+
+/**
+ * Get the decoded form of a sub
+ **/
+ecl_code_t*
+ecl_code_for_sub(th10_ecl_t* ecl, th10_ecl_sub_t* sub)
+{
+    return &ecl->code[sub - ecl->subs];
+}
+
+/**
+ * Offset of an op's instruction within its sub, for messages. Ops inlined
+ * from another sub are at their call.
+ **/
+uint32_t
+ecl_op_offset(ecl_code_t* code, ecl_op_t* op)
+{
+    if(op->site) {
+        return op->site - 1;
+    }
+    uint8_t* p = op->src ? (uint8_t*)op->src : (uint8_t*)code->sub->end;
+    return (uint32_t)(p - (uint8_t*)code->sub->start);
+}
+
+/**
+ * Build one sub's stream for a difficulty, or a set of them. An op they all
+ * skip is left out if the next op kept runs no earlier; otherwise a nop keeps
+ * its time. An op they don't agree on becomes a split, which keeps a pointer
+ * to the op in its target.
+ **/
+static void
+code_build_stream(ecl_code_t* code, uint8_t difficulty)
+{
+    uint8_t lowest = difficulty & -difficulty;
+    uint32_t* map = xmalloc(sizeof(uint32_t) * (code->count + 1));
+    uint8_t* keep = xmalloc(code->count + 1);
+    uint32_t kept = 0, next_time = 0;
+    
+    // Walk backwards, so the time of the next op kept is known
+    for(uint32_t i = code->count + 1; i-- > 0; ) {
+        ecl_op_t* op = &code->ops[i];
+        if(difficulty & op->rank_mask) {
+            keep[i] = 1; // the op itself
+            next_time = op->time;
+        } else {
+            keep[i] = (op->time > next_time) ? 2 : 0; // 2: as a nop
+            if(keep[i]) {
+                next_time = op->time;
+            }
+        }
+    }
+    for(uint32_t i = 0; i <= code->count; i++) {
+        map[i] = kept;
+        kept += keep[i] ? 1 : 0;
+    }
+    
+    ecl_op_t* stream = xmalloc(sizeof(ecl_op_t) * kept);
+    for(uint32_t i = 0; i <= code->count; i++) {
+        if(!keep[i]) {
+            continue;
+        }
+        ecl_op_t* op = &stream[map[i]];
+        *op = code->ops[i];
+        op->index = i;
+        if(keep[i] == 2) {
+            op->id = INS_NOP;
+            op->param_mask = 0;
+            op->nparams = 0;
+            op->target = NULL;
+            op->callee = NULL;
+        }
+        op->rank_mask = 0xFF;
+        if(op->target) {
+            op->target = &stream[map[op->target - code->ops]];
+        }
+        for(uint8_t d = lowest << 1; keep[i] == 1 && d <= difficulty; d <<= 1) {
+            if((difficulty & d) && !ranks_agree(&code->ops[i], lowest, d)) {
+                op->id = INS_SPLIT;
+                op->param_mask = 0; // nothing is read until it runs as the op
+                op->target = &code->ops[i];
+                break;
+            }
+        }
+    }
+    
+    code->stream[difficulty] = stream;
+    code->stream_map[difficulty] = map;
+    xfree(keep);
+}
+
+/**
+ * Build the streams of every sub of a file for a difficulty or set
+ **/
+static void
+code_build_streams(th10_ecl_t* ecl, uint8_t difficulty)
+{
+    unsigned int d = difficulty;
+    
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&ecl->stream_lock);
+#endif
+    if(!(ecl->streams & (1 << d))) {
+        for(uint32_t i = 0; i < ecl->header->sub_count; i++) {
+            code_build_stream(&ecl->code[i], difficulty);
+        }
+        
+        // Calls enter the callee's stream for the same difficulty
+        for(uint32_t i = 0; i < ecl->header->sub_count; i++) {
+            ecl_code_t* code = &ecl->code[i];
+            for(ecl_op_t* op = code->stream[d]; op->src != NULL; op++) {
+                if(op->id == INS_CALL && op->callee) {
+                    op->target = op->callee->stream[d];
+                }
+            }
+        }
+        __atomic_or_fetch(&ecl->streams, 1 << d, __ATOMIC_RELEASE);
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&ecl->stream_lock);
+#endif
+}
+
+/**
+ * Get where a VM starting on a sub begins for a difficulty (one of the
+ * DIFF_* values) or a set of them, building the file's streams for it first
+ * if needed
+ **/
+ecl_op_t*
+ecl_code_entry(th10_ecl_t* ecl, ecl_code_t* code, uint8_t difficulty)
+{
+    if(!(__atomic_load_n(&ecl->streams, __ATOMIC_ACQUIRE) & (1 << difficulty))) {
+        code_build_streams(ecl, difficulty);
+    }
+    return code->stream[difficulty];
+}
+
+/**
+ * Find the op of another difficulty's (or set's) stream where execution
+ * continues the same way, for VMs which are running when the difficulty
+ * changes
+ **/
+ecl_op_t*
+ecl_code_remap(th10_ecl_t* ecl, ecl_op_t* op, uint8_t from, uint8_t to)
+{
+    unsigned int f = from, t = to;
+    
+    for(uint32_t i = 0; i < ecl->header->sub_count; i++) {
+        ecl_code_t* code = &ecl->code[i];
+        if(code->stream[f] && op >= code->stream[f] && op <= code->stream[f] + code->stream_map[f][code->count]) {
+            // Ops the old difficulty left out just before this one have not
+            // run yet, and may run on the new one
+            uint32_t index = (op == code->stream[f]) ? 0 : (op - 1)->index + 1;
+            ecl_code_entry(ecl, code, to);
+            return &code->stream[t][code->stream_map[t][index]];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Free the streams of every sub, for when the ops they were built from change
+ **/
+void
+ecl_code_free_streams(th10_ecl_t* ecl)
+{
+    for(uint32_t i = 0; i < ecl->header->sub_count; i++) {
+        for(unsigned int d = 0; d < RANK_SETS; d++) {
+            xfree(ecl->code[i].stream[d]);
+            xfree(ecl->code[i].stream_map[d]);
+        }
+    }
+    ecl->streams = 0;
+}
+
+/**
+ * Add a problem found in a sub to the report, if there is one
+ **/
+static void
+verify_error(strbuf_t* report, ecl_code_t* code, ecl_op_t* op, uint8_t difficulty, const char* message)
+{
+    static const char* names[] = {"easy", "normal", "hard", "lunatic"};
+    if(report) {
+        strbuf_printf(report, "%s+%u (%s): %s\n", code->sub->name, ecl_op_offset(code, op),
+                      names[__builtin_ctz(difficulty)], message);
+    }
+}
+
+/**
+ * Merge the state flowing into an op with the one already recorded there.
+ * Returns 0 if they disagree.
+ **/
+static int
+verify_merge(verify_state_t* states, uint32_t* work, uint32_t* nwork, uint32_t idx, verify_state_t in)
+{
+    if(states[idx].depth < 0) {
+        states[idx] = in;
+        work[(*nwork)++] = idx;
+        return 1;
+    }
+    return (states[idx].depth == in.depth) && (states[idx].nvars == in.nvars) && (states[idx].frame == in.frame);
+}
+
+/**
+ * Add a call site to a sub, keeping the deepest and shallowest depth per op
+ **/
+static void
+verify_add_site(ecl_code_t* code, ecl_op_t* op, uint32_t depth)
+{
+    for(uint32_t i = 0; i < code->site_count; i++) {
+        if(code->sites[i].op == op) {
+            if(code->sites[i].depth < depth) {
+                code->sites[i].depth = depth;
+            }
+            if(code->sites[i].low > depth) {
+                code->sites[i].low = depth;
+            }
+            return;
+        }
+    }
+    code->sites = xrealloc(code->sites, sizeof(ecl_call_site_t) * (code->site_count + 1));
+    code->sites[code->site_count].op = op;
+    code->sites[code->site_count].depth = depth;
+    code->sites[code->site_count].low = depth;
+    code->site_count++;
+}
+
+/**
+ * Check the locals a register block uses against the frame, recording the
+ * types they are read and written as like the stack ops it was made from
+ **/
+static int
+verify_block(ecl_block_t* block, verify_state_t s, uint8_t* reads, uint8_t* writes, uint32_t nslots)
+{
+    for(uint32_t i = 0; i < block->count; i++) {
+        ecl_reg_operand_t* operands[3] = {&block->ops[i].a, &block->ops[i].b, &block->ops[i].dst};
+        for(unsigned int j = 0; j < 3; j++) {
+            ecl_reg_operand_t* o = operands[j];
+            if(o->kind != REG_LOCAL) {
+                continue;
+            }
+            if(o->index >= s.frame - 1) {
+                return 0;
+            }
+            if((uint32_t)o->index < nslots) {
+                uint8_t* types = (j == 2) ? writes : reads;
+                types[o->index] |= (o->format == 'f') ? TYPE_FLOAT : TYPE_INT;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Run the abstract interpretation of one sub for one difficulty
+ **/
+static int
+verify_sub(ecl_code_t* code, uint8_t difficulty, verify_state_t* states, uint32_t* work,
+           uint8_t* reads, uint8_t* writes, uint32_t nslots, strbuf_t* report)
+{
+    uint32_t nwork = 0;
+    
+    for(uint32_t i = 0; i <= code->count; i++) {
+        states[i].depth = -1;
+    }
+    verify_state_t entry = {0, -1, 0};
+    verify_merge(states, work, &nwork, 0, entry);
+    
+    while(nwork > 0) {
+        uint32_t idx = work[--nwork];
+        ecl_op_t* op = &code->ops[idx];
+        verify_state_t s = states[idx];
+        int32_t base = s.frame;
+        ecl_op_t* succ[2] = {op + 1, NULL};
+        
+        if(op->src == NULL) {
+            verify_error(report, code, op, difficulty, "runs off the end of the sub");
+            return 0;
+        }
+        
+        if(difficulty & op->rank_mask) {
+            const ins_format_t* format = ins_get_format(op->id);
+            if(format == NULL || (op->nparams == 0 && format->format[0] != '\0')) {
+                continue; // fails when run, so nothing after it is reached
+            }
+            
+            // Variable parameters: -1 pops the stack, others >= 0 are locals
+            for(unsigned int i = 0; i < op->nparams; i++) {
+                int written = ins_writes_param(op->id, i);
+                if(!(op->param_mask & (1 << i)) && !written) {
+                    continue;
+                }
+                int32_t slot = op->params[i].i;
+                if(slot == -1 && !written) {
+                    s.depth--;
+                } else if(slot >= 0) {
+                    if((slot >> 2) >= s.frame - 1) {
+                        verify_error(report, code, op, difficulty, "local variable outside of the frame");
+                        return 0;
+                    }
+                    // Call arguments convert whatever they read
+                    int arg = (op->id == INS_CALL || op->id == INS_CALLASYNC || op->id == INS_ENTER) && (i > 0);
+                    if((uint32_t)(slot >> 2) < nslots && !arg) {
+                        uint8_t type = (format->format[i] == 'f') ? TYPE_FLOAT : TYPE_INT;
+                        if(written) {
+                            writes[slot >> 2] |= (op->id == INS_SET || op->id == INS_MOVE || op->id == INS_DECI) ?
+                                                 TYPE_INT : TYPE_FLOAT;
+                        }
+                        if(!written || op->id == INS_DECI || op->id == INS_VALIDRAD) {
+                            reads[slot >> 2] |= type;
+                        }
+                    }
+                }
+            }
+            
+            s.depth -= format->pops;
+            if(s.depth < base) {
+                verify_error(report, code, op, difficulty, "stack underflow");
+                return 0;
+            }
+            s.depth += format->pushes;
+            
+            switch(op->id) {
+                case INS_RET:
+                    if(s.nvars < 0) {
+                        verify_error(report, code, op, difficulty, "return without a stack frame");
+                        return 0;
+                    }
+                    succ[0] = NULL;
+                    break;
+                
+                case INS_STACKALLOC:
+                    if(s.nvars >= 0 || s.depth != 0) {
+                        verify_error(report, code, op, difficulty, "stackAlloc with a frame or values on the stack");
+                        return 0;
+                    }
+                    s.nvars = op->params[0].u >> 2;
+                    s.depth = s.nvars + 1;
+                    s.frame = s.depth;
+                    break;
+                
+                case INS_ENTER: // the inlined sub's frame goes on top of the stack
+                    s.depth += 1 + op->params[0].u;
+                    s.frame = s.depth;
+                    break;
+                
+                case INS_BLOCK:
+                    if(s.depth + op->block->low < base) {
+                        verify_error(report, code, op, difficulty, "stack underflow");
+                        return 0;
+                    }
+                    if(!verify_block(op->block, s, reads, writes, nslots)) {
+                        verify_error(report, code, op, difficulty, "local variable outside of the frame");
+                        return 0;
+                    }
+                    if((uint32_t)(s.depth + op->block->high) > code->depth) {
+                        code->depth = s.depth + op->block->high;
+                    }
+                    s.depth += op->block->delta;
+                    break;
+                
+                case INS_LEAVE:
+                    if(s.nvars < 0 || op->target == NULL || (int32_t)op->params[0].u > s.depth - 1) {
+                        verify_error(report, code, op, difficulty, "leave without an inlined frame");
+                        return 0;
+                    }
+                    s.depth = op->params[0].u + 1;
+                    s.frame = s.nvars + 1;
+                    succ[0] = op->target;
+                    break;
+                
+                case INS_CALL:
+                    if(op->callee == NULL) {
+                        continue; // fails when run
+                    }
+                    verify_add_site(code, op, s.depth);
+                    break;
+                
+                case INS_JMP:
+                case INS_JMPTIME:
+                    succ[0] = op->target;
+                    if(op->target == NULL) {
+                        verify_error(report, code, op, difficulty, "jump to an invalid offset");
+                        return 0;
+                    }
+                    break;
+                
+                case INS_JMPEQ:
+                case INS_JMPNEQ:
+                    succ[1] = op->target;
+                    if(op->target == NULL) {
+                        verify_error(report, code, op, difficulty, "jump to an invalid offset");
+                        return 0;
+                    }
+                    break;
+                
+                default:
+                    break;
+            }
+        }
+        
+        if((uint32_t)s.depth > code->depth) {
+            code->depth = s.depth;
+        }
+        for(unsigned int i = 0; i < 2; i++) {
+            if(succ[i] && !verify_merge(states, work, &nwork, succ[i] - code->ops, s)) {
+                verify_error(report, code, succ[i], difficulty, "stack depth differs where paths join");
+                return 0;
+            }
+        }
+    }
+    
+    return 1;
+}
+
+/**
+ * Work out the stack and call stack a sub needs including everything it
+ * calls. Recursion makes both unbounded.
+ **/
+static void
+verify_needs(ecl_code_t* code, uint8_t* marks, ecl_code_t* all)
+{
+    uint8_t* mark = &marks[code - all];
+    if(*mark == 2) {
+        return;
+    }
+    if(*mark == 1 || !(code->flags & CODE_VERIFIED)) {
+        code->stack = STACK_UNBOUNDED;
+        code->calls = STACK_UNBOUNDED;
+        return; // recursion; the sub on the cycle is finished by its first visit
+    }
+    
+    *mark = 1;
+    code->stack = code->depth;
+    code->calls = 0;
+    for(uint32_t i = 0; i < code->site_count; i++) {
+        ecl_code_t* callee = code->sites[i].op->callee;
+        verify_needs(callee, marks, all);
+        if(callee->stack == STACK_UNBOUNDED || code->stack == STACK_UNBOUNDED) {
+            code->stack = STACK_UNBOUNDED;
+            code->calls = STACK_UNBOUNDED;
+            continue;
+        }
+        if(code->sites[i].depth + callee->stack > code->stack) {
+            code->stack = code->sites[i].depth + callee->stack;
+        }
+        if(callee->calls + 1 > code->calls) {
+            code->calls = callee->calls + 1;
+        }
+    }
+    *mark = 2;
+}
+
+/**
+ * Verify every sub of a file, recording what each needs to run without
+ * checks and which are pure. Problems are added to report if it is given. Returns the number
+ * of subs which failed.
+ **/
+uint32_t
+ecl_code_verify(th10_ecl_t* ecl, strbuf_t* report)
+{
+    uint32_t count = ecl->header->sub_count;
+    uint32_t failed = 0;
+    uint32_t max_ops = 0;
+    
+    for(uint32_t i = 0; i < count; i++) {
+        if(ecl->code[i].count > max_ops) {
+            max_ops = ecl->code[i].count;
+        }
+    }
+    
+    verify_state_t* states = xmalloc(sizeof(verify_state_t) * (max_ops + 1));
+    uint32_t* work = xmalloc(sizeof(uint32_t) * (max_ops + 1));
+    uint8_t* marks = xmalloc(count ? count : 1);
+    
+    for(uint32_t i = 0; i < count; i++) {
+        ecl_code_t* code = &ecl->code[i];
+        code->flags = CODE_VERIFIED;
+        code->depth = 0;
+        code->site_count = 0;
+        
+        // Only locals of the stackAlloc size at the start are type checked
+        uint32_t nslots = 0;
+        if(code->count > 0 && code->ops[0].id == INS_STACKALLOC && code->ops[0].nparams > 0) {
+            nslots = code->ops[0].params[0].u >> 2;
+        }
+        uint8_t* reads = xmalloc(nslots ? nslots : 1);
+        uint8_t* writes = xmalloc(nslots ? nslots : 1);
+        memset(reads, 0, nslots);
+        memset(writes, 0, nslots);
+        
+        for(uint8_t d = DIFF_EASY; d <= DIFF_LUNATIC; d <<= 1) {
+            if(!verify_sub(code, d, states, work, reads, writes, nslots, report)) {
+                code->flags &= ~CODE_VERIFIED;
+                failed++;
+                break;
+            }
+        }
+        
+        for(uint32_t j = 0; j < nslots; j++) {
+            if(writes[j] && (reads[j] & ~writes[j])) {
+                code->flags |= CODE_TYPE_MISMATCH;
+                if(report) {
+                    strbuf_printf(report, "%s: local %u is read as %s but only written as %s\n",
+                                  code->sub->name, j << 2,
+                                  (reads[j] & ~writes[j] & TYPE_FLOAT) ? "float" : "int",
+                                  (writes[j] & TYPE_FLOAT) ? "float" : "int");
+                }
+            }
+        }
+        xfree(reads);
+        xfree(writes);
+    }
+    
+    memset(marks, 0, count);
+    for(uint32_t i = 0; i < count; i++) {
+        verify_needs(&ecl->code[i], marks, ecl->code);
+    }
+    ecl_code_purity(ecl);
+    
+    xfree(states);
+    xfree(work);
+    xfree(marks);
+    return failed;
+}
@@ -0,0 +1,361 @@
+/**
+ * Instruction coverage maps
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "ecli.h"
+
+static const char* coverage_names[DIFFICULTY_COUNT] = {"easy", "normal", "hard", "lunatic"};
+
+/**
+ * FNV-1a hash of a whole file
+ **/
+static uint32_t
+coverage_hash(const uint8_t* data, size_t size)
+{
+    uint32_t h = 2166136261U;
+    for(size_t i = 0; i < size; i++) {
+        h = (h ^ data[i]) * 16777619U;
+    }
+    return h;
+}
+
+/**
+ * Make an empty map of the right size for size bytes of file
+ **/
+static ecli_coverage_t*
+coverage_alloc(uint64_t size, uint32_t hash)
+{
+    ecli_coverage_t* cov = xmalloc(sizeof(ecli_coverage_t));
+    cov->size = size;
+    cov->hash = hash;
+    cov->slots = (size >> COVERAGE_SHIFT) + 1;
+    cov->words = (cov->slots + 63) / 64;
+    cov->bits = xmalloc(sizeof(uint64_t) * cov->words * DIFFICULTY_COUNT);
+    cov->hits = NULL;
+    coverage_clear(cov);
+    return cov;
+}
+
+/**
+ * Make an empty map for an ECL file
+ **/
+ecli_coverage_t*
+coverage_create(th10_ecl_t* ecl)
+{
+    return coverage_alloc(ecl->size, coverage_hash((const uint8_t*)ecl->header, ecl->size));
+}
+
+void
+coverage_free(ecli_coverage_t* cov)
+{
+    xfree(cov->bits);
+    xfree(cov->hits);
+    xfree(cov);
+}
+
+/**
+ * Forget every instruction run
+ **/
+void
+coverage_clear(ecli_coverage_t* cov)
+{
+    memset(cov->bits, 0, sizeof(uint64_t) * cov->words * DIFFICULTY_COUNT);
+    if(cov->hits) {
+        memset(cov->hits, 0, sizeof(uint16_t) * cov->slots * DIFFICULTY_COUNT);
+    }
+}
+
+/**
+ * Get a map ready for the interpreter to record into
+ **/
+void
+coverage_record(ecli_coverage_t* cov)
+{
+    if(cov->hits == NULL) {
+        cov->hits = xmalloc(sizeof(uint16_t) * cov->slots * DIFFICULTY_COUNT);
+        memset(cov->hits, 0, sizeof(uint16_t) * cov->slots * DIFFICULTY_COUNT);
+    }
+}
+
+/**
+ * Add the instructions the interpreter recorded to the map
+ **/
+void
+coverage_pack(ecli_coverage_t* cov)
+{
+    if(cov->hits == NULL) {
+        return;
+    }
+    for(unsigned int d = 0; d < DIFFICULTY_COUNT; d++) {
+        uint16_t* hits = cov->hits + d * cov->slots;
+        uint64_t* bits = cov->bits + d * cov->words;
+        for(size_t i = 0; i < cov->slots; i++) {
+            bits[i >> 6] |= (uint64_t)(hits[i] != 0) << (i & 63);
+        }
+    }
+}
+
+/**
+ * Is the map for this file?
+ **/
+int
+coverage_matches(ecli_coverage_t* cov, th10_ecl_t* ecl)
+{
+    return (cov->size == ecl->size) && (cov->hash == coverage_hash((const uint8_t*)ecl->header, ecl->size));
+}
+
+/**
+ * Has an instruction of the file been run on a difficulty (given as an index)?
+ **/
+int
+coverage_test(ecli_coverage_t* cov, unsigned int d, th10_ecl_t* ecl, th10_instr_t* ins)
+{
+    size_t bit = (size_t)((uint8_t*)ins - (uint8_t*)ecl->header) >> COVERAGE_SHIFT;
+    return (cov->bits[d * cov->words + (bit >> 6)] >> (bit & 63)) & 1;
+}
+
+/**
+ * Add the instructions run in src to dst. Both must be for the same file.
+ **/
+ecli_result_t
+coverage_merge(ecli_coverage_t* dst, ecli_coverage_t* src)
+{
+    if((dst->size != src->size) || (dst->hash != src->hash)) {
+        return ECLI_FAILURE;
+    }
+    for(size_t i = 0; i < dst->words * DIFFICULTY_COUNT; i++) {
+        dst->bits[i] |= src->bits[i];
+    }
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Write a map in the text format described in coverage.h
+ **/
+ecli_result_t
+coverage_save(ecli_coverage_t* cov, FILE* f)
+{
+    fprintf(f, "ecli-coverage %d size=%" PRIu64 " hash=%08x\n", COVERAGE_VERSION, cov->size, cov->hash);
+    for(unsigned int d = 0; d < DIFFICULTY_COUNT; d++) {
+        fprintf(f, "%s ", coverage_names[d]);
+        for(size_t i = 0; i < cov->words; i++) {
+            fprintf(f, "%016" PRIx64, cov->bits[d * cov->words + i]);
+        }
+        fputc('\n', f);
+    }
+    return ferror(f) ? ECLI_FAILURE : ECLI_SUCCESS;
+}
+
+/**
+ * Read a map written by coverage_save(), NULL if it is malformed
+ **/
+ecli_coverage_t*
+coverage_load(FILE* f)
+{
+    int version;
+    uint64_t size;
+    uint32_t hash;
+    if((fscanf(f, "ecli-coverage %d size=%" SCNu64 " hash=%" SCNx32, &version, &size, &hash) != 3) ||
+       (version != COVERAGE_VERSION)) {
+        return NULL;
+    }
+    
+    ecli_coverage_t* cov = coverage_alloc(size, hash);
+    for(unsigned int n = 0; n < DIFFICULTY_COUNT; n++) {
+        char name[16];
+        unsigned int d = 0;
+        if(fscanf(f, "%15s", name) != 1) {
+            break;
+        }
+        while((d < DIFFICULTY_COUNT) && (strcmp(name, coverage_names[d]) != 0)) {
+            d++;
+        }
+        for(size_t i = 0; (d < DIFFICULTY_COUNT) && (i < cov->words); i++) {
+            if(fscanf(f, "%16" SCNx64, &cov->bits[d * cov->words + i]) != 1) {
+                d = DIFFICULTY_COUNT;
+            }
+        }
+        if(d == DIFFICULTY_COUNT) {
+            coverage_free(cov);
+            return NULL;
+        }
+    }
+    return cov;
+}
+
+/**
+ * Add the map saved in a file to cov. A file that doesn't exist adds
+ * nothing; one for another ECL file is an error.
+ **/
+ecli_result_t
+coverage_merge_file(ecli_coverage_t* cov, const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if(f == NULL) {
+        return ECLI_SUCCESS;
+    }
+    ecli_coverage_t* saved = coverage_load(f);
+    fclose(f);
+    if(saved == NULL) {
+        fprintf(stderr, "%s is not a coverage file\n", path);
+        return ECLI_FAILURE;
+    }
+    
+    ecli_result_t result = coverage_merge(cov, saved);
+    if(!SUCCESS(result)) {
+        fprintf(stderr, "%s is the coverage of another ECL file\n", path);
+    }
+    coverage_free(saved);
+    return result;
+}
+
+/**
+ * Write a map to a file, replacing it
+ **/
+ecli_result_t
+coverage_save_file(ecli_coverage_t* cov, const char* path)
+{
+    FILE* f = fopen(path, "w");
+    ecli_result_t result = ECLI_FAILURE;
+    if(f != NULL) {
+        result = coverage_save(cov, f);
+        if(fclose(f) != 0) {
+            result = ECLI_FAILURE;
+        }
+    }
+    if(!SUCCESS(result)) {
+        fprintf(stderr, "Failed to write coverage file %s\n", path);
+    }
+    return result;
+}
+
+/**
+ * The instruction at ins if it lies entirely within its sub, NULL at the end
+ * of the sub or at a malformed instruction
+ **/
+static th10_instr_t*
+coverage_instruction(th10_ecl_sub_t* sub, th10_instr_t* ins)
+{
+    uint8_t* end = (uint8_t*)sub->end;
+    if(((uint8_t*)ins + sizeof(th10_instr_t) > end) || (ins->size < sizeof(th10_instr_t)) ||
+       ((uint8_t*)ins + ins->size > end)) {
+        return NULL;
+    }
+    return ins;
+}
+
+/**
+ * Write how many of each sub's instructions were run on each difficulty, out
+ * of those the difficulty has, one line per sub:
+ *
+ *     <sub> easy=<run>/<count> normal=<run>/<count> hard=... lunatic=...
+ *
+ * followed by the same for the whole file on a line starting with "total"
+ **/
+void
+coverage_write_summary(ecli_coverage_t* cov, th10_ecl_t* ecl, FILE* f)
+{
+    uint32_t total_run[DIFFICULTY_COUNT] = {0};
+    uint32_t total_count[DIFFICULTY_COUNT] = {0};
+    
+    for(uint32_t i = 0; i < ecl->header->sub_count; i++) {
+        th10_ecl_sub_t* sub = &ecl->subs[i];
+        uint32_t run[DIFFICULTY_COUNT] = {0};
+        uint32_t count[DIFFICULTY_COUNT] = {0};
+        
+        for(th10_instr_t* ins = coverage_instruction(sub, sub->start); ins != NULL;
+            ins = coverage_instruction(sub, (th10_instr_t*)((uint8_t*)ins + ins->size))) {
+            for(unsigned int d = 0; d < DIFFICULTY_COUNT; d++) {
+                if(ins->rank_mask & (1 << d)) {
+                    count[d]++;
+                    run[d] += coverage_test(cov, d, ecl, ins);
+                }
+            }
+        }
+        
+        fprintf(f, "%s", sub->name);
+        for(unsigned int d = 0; d < DIFFICULTY_COUNT; d++) {
+            fprintf(f, " %s=%u/%u", coverage_names[d], run[d], count[d]);
+            total_run[d] += run[d];
+            total_count[d] += count[d];
+        }
+        fputc('\n', f);
+    }
+    
+    fprintf(f, "total");
+    for(unsigned int d = 0; d < DIFFICULTY_COUNT; d++) {
+        fprintf(f, " %s=%u/%u", coverage_names[d], total_run[d], total_count[d]);
+    }
+    fputc('\n', f);
+}
+
+// What coverage_annotate() hands to the disassembler
+typedef struct {
+    ecli_coverage_t* cov;
+    th10_ecl_t* ecl;
+} coverage_annotation_t;
+
+/**
+ * Start an instruction line with a comment telling, for each difficulty,
+ * whether it was run (the difficulty's letter), not run ('-') or isn't on
+ * the difficulty at all ('.')
+ **/
+static void
+coverage_annotate_instruction(strbuf_t* out, th10_instr_t* ins, void* user)
+{
+    coverage_annotation_t* a = user;
+    static const char letters[DIFFICULTY_COUNT] = {'E', 'N', 'H', 'L'};
+    
+    strbuf_puts(out, "/*");
+    for(unsigned int d = 0; d < DIFFICULTY_COUNT; d++) {
+        if(!(ins->rank_mask & (1 << d))) {
+            strbuf_putc(out, '.');
+        } else if(coverage_test(a->cov, d, a->ecl, ins)) {
+            strbuf_putc(out, letters[d]);
+        } else {
+            strbuf_putc(out, '-');
+        }
+    }
+    strbuf_puts(out, "*/ ");
+}
+
+/**
+ * Disassemble a file to a file descriptor, marking which instructions were
+ * run on which difficulty
+ **/
+ecli_result_t
+coverage_annotate(ecli_coverage_t* cov, th10_ecl_t* ecl, int fd, unsigned int threads)
+{
+    coverage_annotation_t a = {cov, ecl};
+    return disasm_ecl(ecl, fd, threads, coverage_annotate_instruction, &a);
+}
@@ -0,0 +1,532 @@
+/**
+ * Reading ECL files out of the games' .dat archives
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ecli.h"
+
+// Header fields are stored with these added
+#define DAT_SIZE_KEY 123456789
+#define DAT_ZSIZE_KEY 987654321
+#define DAT_COUNT_KEY 135792468
+
+#define DAT_HEADER_SIZE 16
+#define DAT_LIST_MAX (64 * 1024 * 1024) // sanity limit on the decompressed entry list
+
+#define LZSS_DICT_SIZE 0x2000 // a power of two
+#define LZSS_MIN_MATCH 3
+#define LZSS_MIN_SIZE 2 // the end marker alone takes 14 bits
+
+typedef struct {
+    uint8_t key;
+    uint8_t step; // added to the key after each byte
+    uint32_t block; // bytes shuffled together
+    uint32_t limit; // only the first limit bytes are encrypted
+} dat_crypt_t;
+
+// Parameters per game, indexed by dat_crypt_index() of an entry's name
+static const dat_crypt_t dat_crypt[][8] = {
+    { // Shoot the Bullet, Mountain of Faith, Subterranean Animism
+        {0x1b, 0x37, 0x40, 0x2800}, {0x51, 0xe9, 0x40, 0x3000},
+        {0xc1, 0x51, 0x80, 0x3200}, {0x03, 0x19, 0x400, 0x7800},
+        {0xab, 0xcd, 0x200, 0x2800}, {0x12, 0x34, 0x80, 0x3200},
+        {0x35, 0x97, 0x80, 0x2800}, {0x99, 0x37, 0x400, 0x2000}
+    },
+    { // Undefined Fantastic Object, Double Spoiler, Fairy Wars
+        {0x1b, 0x73, 0x40, 0x3800}, {0x51, 0x9e, 0x40, 0x4000},
+        {0xc1, 0x15, 0x400, 0x2c00}, {0x03, 0x91, 0x80, 0x6400},
+        {0xab, 0xdc, 0x80, 0x6e00}, {0x12, 0x43, 0x200, 0x3c00},
+        {0x35, 0x79, 0x400, 0x3c00}, {0x99, 0x7d, 0x80, 0x2800}
+    },
+    { // Ten Desires and later
+        {0x1b, 0x73, 0x100, 0x3800}, {0x12, 0x43, 0x200, 0x3e00},
+        {0x35, 0x79, 0x400, 0x3c00}, {0x03, 0x91, 0x80, 0x6400},
+        {0xab, 0xdc, 0x80, 0x6e00}, {0x51, 0x9e, 0x100, 0x4000},
+        {0xc1, 0x15, 0x400, 0x2c00}, {0x99, 0x7d, 0x80, 0x4400}
+    }
+};
+#define DAT_VARIANTS (int)(sizeof(dat_crypt) / sizeof(dat_crypt[0]))
+
+/**
+ * Decrypt data in place. Each block was shuffled and XORed with a running
+ * key: its first half holds the odd bytes counted from the end of the
+ * block, the second half the even ones. A short tail (under a quarter
+ * block) and everything past limit are stored as they are.
+ **/
+static void
+dat_decrypt(uint8_t* data, uint32_t size, uint8_t key, uint8_t step, uint32_t block, uint32_t limit)
+{
+    uint8_t temp[DAT_BLOCK_MAX];
+    uint32_t left = size;
+    
+    if(size < block / 4) {
+        return; // all tail, and dropping an odd byte from nothing would wrap
+    }
+    if(left % block < block / 4) {
+        left -= left % block;
+    }
+    left -= size & 1;
+    for(uint32_t i = 0; (i < left) && (i < limit); i += block) {
+        uint32_t n = (left - i < block) ? (left - i) : block;
+        uint8_t* in = data + i;
+        for(int32_t j = n - 1; j >= 0; j -= 2) {
+            temp[j] = *in++ ^ key;
+            key += step;
+        }
+        for(int32_t j = n - 2; j >= 0; j -= 2) {
+            temp[j] = *in++ ^ key;
+            key += step;
+        }
+        memcpy(data + i, temp, n);
+    }
+}
+
+/**
+ * Decompress LZSS data: a bit stream, most significant bit first, of
+ * literals (1, then 8 bits) and matches (0, then a 13 bit position in the
+ * dictionary and 4 bits of length), ended by a match at position 0. Returns
+ * the number of bytes written.
+ **/
+static uint32_t
+dat_unlzss(const uint8_t* in, uint32_t in_size, uint8_t* out, uint32_t out_size)
+{
+    uint8_t dict[LZSS_DICT_SIZE];
+    uint32_t dict_pos = 1;
+    uint32_t written = 0;
+    uint32_t bits = 0, nbits = 0, pos = 0;
+    
+    memset(dict, 0, sizeof(dict));
+    while(written < out_size) {
+        while((nbits <= 24) && (pos < in_size)) {
+            bits = (bits << 8) | in[pos++];
+            nbits += 8;
+        }
+        if(nbits == 0) {
+            break;
+        }
+        
+        if((bits >> --nbits) & 1) {
+            if(nbits < 8) {
+                break;
+            }
+            nbits -= 8;
+            uint8_t c = (bits >> nbits) & 0xFF;
+            out[written++] = c;
+            dict[dict_pos++ & (LZSS_DICT_SIZE - 1)] = c;
+        } else {
+            if(nbits < 17) {
+                break;
+            }
+            nbits -= 13;
+            uint32_t offset = (bits >> nbits) & (LZSS_DICT_SIZE - 1);
+            if(offset == 0) {
+                break;
+            }
+            nbits -= 4;
+            uint32_t len = ((bits >> nbits) & 0xF) + LZSS_MIN_MATCH;
+            for(uint32_t k = 0; (k < len) && (written < out_size); k++) {
+                uint8_t c = dict[(offset + k) & (LZSS_DICT_SIZE - 1)];
+                out[written++] = c;
+                dict[dict_pos++ & (LZSS_DICT_SIZE - 1)] = c;
+            }
+        }
+    }
+    return written;
+}
+
+/**
+ * Which of a game's parameter sets an entry is encrypted with
+ **/
+static unsigned int
+dat_crypt_index(const char* name)
+{
+    unsigned int sum = 0;
+    for(; *name; name++) {
+        sum += (uint8_t)*name;
+    }
+    return sum & 7;
+}
+
+static uint32_t
+dat_u32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * Read size bytes at offset into a new buffer
+ **/
+static uint8_t*
+dat_read_raw(ecli_dat_t* dat, uint64_t offset, uint32_t size)
+{
+    uint8_t* buf = xmalloc(size ? size : 1);
+    int ok;
+    
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&dat->lock);
+#endif
+    ok = (0 == fseek(dat->f, (long)offset, SEEK_SET)) && ((size == 0) || (fread(buf, size, 1, dat->f) == 1));
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&dat->lock);
+#endif
+    if(!ok) {
+        xfree(buf);
+    }
+    return buf;
+}
+
+/**
+ * Decrypt and decompress an entry read from the archive with a game's
+ * parameters. Takes the packed buffer; an entry stored uncompressed is
+ * decrypted in place and returned in it.
+ **/
+static uint8_t*
+dat_unpack(dat_entry_t* entry, uint8_t* packed, int variant)
+{
+    const dat_crypt_t* c = &dat_crypt[variant][dat_crypt_index(entry->name)];
+    
+    dat_decrypt(packed, entry->zsize, c->key, c->step, c->block, c->limit);
+    if(entry->zsize == entry->size) {
+        return packed;
+    }
+    
+    uint8_t* data = xmalloc(entry->size ? entry->size : 1);
+    if(dat_unlzss(packed, entry->zsize, data, entry->size) != entry->size) {
+        xfree(data);
+    }
+    xfree(packed);
+    return data;
+}
+
+/**
+ * Does an entry hold an ECL file, going by its name?
+ **/
+int
+dat_is_ecl(dat_entry_t* entry)
+{
+    size_t len = strlen(entry->name);
+    return (len >= 4) && (strcmp(entry->name + len - 4, ".ecl") == 0);
+}
+
+/**
+ * Find the game's parameters by unpacking the first ECL file with each set
+ * until one gives an ECL header. The file is kept.
+ **/
+static void
+dat_detect(ecli_dat_t* dat)
+{
+    dat_entry_t* entry = NULL;
+    for(uint32_t i = 0; (i < dat->count) && (entry == NULL); i++) {
+        if(dat_is_ecl(&dat->entries[i]) && (dat->entries[i].size >= sizeof(th10_header_t))) {
+            entry = &dat->entries[i];
+        }
+    }
+    uint8_t* packed = entry ? dat_read_raw(dat, entry->offset, entry->zsize) : NULL;
+    if(packed == NULL) {
+        return;
+    }
+    
+    for(int v = 0; v < DAT_VARIANTS; v++) {
+        uint8_t* copy = xmalloc(entry->zsize ? entry->zsize : 1);
+        memcpy(copy, packed, entry->zsize);
+        uint8_t* data = dat_unpack(entry, copy, v);
+        if((data != NULL) && (memcmp(data, "SCPT", 4) == 0)) {
+            dat->variant = v;
+            entry->data = data;
+            break;
+        }
+        xfree(data);
+    }
+    xfree(packed);
+}
+
+/**
+ * Parse the decompressed entry list: per entry, its name padded with zeros
+ * to a multiple of four bytes, then its offset, its size and a zero
+ **/
+static ecli_result_t
+dat_parse_list(ecli_dat_t* dat, const uint8_t* list, uint32_t size, uint64_t list_offset)
+{
+    const uint8_t* p = list;
+    const uint8_t* end = list + size;
+    
+    dat->entries = xmalloc(sizeof(dat_entry_t) * (dat->count ? dat->count : 1));
+    memset(dat->entries, 0, sizeof(dat_entry_t) * dat->count);
+    for(uint32_t i = 0; i < dat->count; i++) {
+        dat_entry_t* e = &dat->entries[i];
+        const uint8_t* nul = memchr(p, 0, end - p);
+        if(nul == NULL) {
+            return ECLI_FAILURE;
+        }
+        size_t len = nul - p;
+        size_t padded = (len + 4) & ~(size_t)3;
+        if((size_t)(end - p) < padded + 3 * sizeof(uint32_t)) {
+            return ECLI_FAILURE;
+        }
+        e->name = xmalloc(len + 1);
+        memcpy(e->name, p, len + 1);
+        p += padded;
+        e->offset = dat_u32(p);
+        e->size = dat_u32(p + 4);
+        p += 3 * sizeof(uint32_t);
+    }
+    
+    // Entries are stored in order, each up to the next or the list
+    for(uint32_t i = 0; i < dat->count; i++) {
+        uint64_t next = (i + 1 < dat->count) ? dat->entries[i + 1].offset : list_offset;
+        if((dat->entries[i].offset < DAT_HEADER_SIZE) || (next < dat->entries[i].offset)) {
+            return ECLI_FAILURE;
+        }
+        dat->entries[i].zsize = next - dat->entries[i].offset;
+    }
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Open an archive, reading its header and entry list
+ **/
+ecli_dat_t*
+dat_open(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) {
+        fprintf(stderr, "Failed to open archive %s\n", path);
+        return NULL;
+    }
+    
+    ecli_dat_t* dat = xmalloc(sizeof(ecli_dat_t));
+    memset(dat, 0, sizeof(ecli_dat_t));
+    dat->f = f;
+    dat->variant = -1;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&dat->lock, NULL);
+#endif
+    
+    uint8_t header[DAT_HEADER_SIZE] = {0};
+    long size = -1;
+    if((0 == fseek(f, 0, SEEK_END)) && ((size = ftell(f)) >= DAT_HEADER_SIZE) &&
+       (0 == fseek(f, 0, SEEK_SET)) && (fread(header, sizeof(header), 1, f) == 1)) {
+        dat_decrypt(header, sizeof(header), 0x1b, 0x37, sizeof(header), sizeof(header));
+    }
+    if((size < DAT_HEADER_SIZE) || (memcmp(header, "THA1", 4) != 0)) {
+        fprintf(stderr, "%s is not a THA1 archive\n", path);
+        dat_close(dat);
+        return NULL;
+    }
+    dat->size = size;
+    
+    uint32_t list_size = dat_u32(header + 4) - DAT_SIZE_KEY;
+    uint32_t list_zsize = dat_u32(header + 8) - DAT_ZSIZE_KEY;
+    dat->count = dat_u32(header + 12) - DAT_COUNT_KEY;
+    uint8_t* packed = NULL;
+    uint8_t* list = NULL;
+    ecli_result_t result = ECLI_FAILURE;
+    if((list_zsize >= LZSS_MIN_SIZE) && (list_zsize <= dat->size - DAT_HEADER_SIZE) &&
+       (list_size <= DAT_LIST_MAX) && (dat->count <= list_size / 16)) {
+        packed = dat_read_raw(dat, dat->size - list_zsize, list_zsize);
+    }
+    if(packed != NULL) {
+        dat_decrypt(packed, list_zsize, 0x3e, 0x9b, 0x80, list_zsize);
+        list = xmalloc(list_size ? list_size : 1);
+        if(dat_unlzss(packed, list_zsize, list, list_size) == list_size) {
+            result = dat_parse_list(dat, list, list_size, dat->size - list_zsize);
+        }
+        xfree(packed);
+        xfree(list);
+    }
+    if(!SUCCESS(result)) {
+        fprintf(stderr, "Malformed entry list in %s\n", path);
+        dat_close(dat);
+        return NULL;
+    }
+    
+    dat_detect(dat);
+    return dat;
+}
+
+/**
+ * Close an archive, freeing every entry read from it
+ **/
+void
+dat_close(ecli_dat_t* dat)
+{
+    for(uint32_t i = 0; dat->entries && (i < dat->count); i++) {
+        xfree(dat->entries[i].name);
+        xfree(dat->entries[i].data);
+    }
+    xfree(dat->entries);
+    fclose(dat->f);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&dat->lock);
+#endif
+    xfree(dat);
+}
+
+/**
+ * Look up an entry by name
+ **/
+dat_entry_t*
+dat_find(ecli_dat_t* dat, const char* name)
+{
+    for(uint32_t i = 0; i < dat->count; i++) {
+        if(strcmp(dat->entries[i].name, name) == 0) {
+            return &dat->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get the contents of an entry (entry->size bytes), reading it the first
+ * time. Safe to call from several threads.
+ **/
+const uint8_t*
+dat_read(ecli_dat_t* dat, dat_entry_t* entry)
+{
+    uint8_t* data;
+    
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&dat->lock);
+    data = entry->data;
+    pthread_mutex_unlock(&dat->lock);
+#else
+    data = entry->data;
+#endif
+    if(data != NULL) {
+        return data;
+    }
+    if(dat->variant < 0) {
+        fprintf(stderr, "Unknown archive encryption, can't read %s\n", entry->name);
+        return NULL;
+    }
+    
+    uint8_t* packed = dat_read_raw(dat, entry->offset, entry->zsize);
+    data = packed ? dat_unpack(entry, packed, dat->variant) : NULL;
+    if(data == NULL) {
+        fprintf(stderr, "Failed to read %s from the archive\n", entry->name);
+        return NULL;
+    }
+    
+    // Another thread may have read it meanwhile
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&dat->lock);
+#endif
+    if(entry->data == NULL) {
+        entry->data = data;
+    } else {
+        xfree(data);
+    }
+    data = entry->data;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&dat->lock);
+#endif
+    return data;
+}
+
+// Entries shared by the threads of dat_read_all()
+typedef struct {
+    ecli_dat_t* dat;
+    const char* suffix;
+    uint32_t next; // next entry to take
+    int failed;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+} dat_batch_t;
+
+static void*
+dat_worker(void* arg)
+{
+    dat_batch_t* batch = arg;
+    size_t suffix_len = strlen(batch->suffix);
+    while(1) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&batch->lock);
+#endif
+        uint32_t i = batch->next++;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&batch->lock);
+#endif
+        if(i >= batch->dat->count) {
+            break;
+        }
+        dat_entry_t* e = &batch->dat->entries[i];
+        size_t len = strlen(e->name);
+        if((len < suffix_len) || (strcmp(e->name + len - suffix_len, batch->suffix) != 0)) {
+            continue;
+        }
+        if(dat_read(batch->dat, e) == NULL) {
+#ifdef HAVE_PTHREAD
+            pthread_mutex_lock(&batch->lock);
+#endif
+            batch->failed = 1;
+#ifdef HAVE_PTHREAD
+            pthread_mutex_unlock(&batch->lock);
+#endif
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Read every entry whose name ends with suffix (all of them for NULL) on the
+ * given number of threads, 0 for one per CPU
+ **/
+ecli_result_t
+dat_read_all(ecli_dat_t* dat, const char* suffix, unsigned int threads)
+{
+    dat_batch_t batch;
+    batch.dat = dat;
+    batch.suffix = suffix ? suffix : "";
+    batch.next = 0;
+    batch.failed = 0;
+    if(threads == 0) {
+        threads = cpu_count();
+    }
+    
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_t* workers = xmalloc(sizeof(pthread_t) * threads);
+    unsigned int started = 0;
+    while((started + 1 < threads) && (0 == pthread_create(&workers[started], NULL, dat_worker, &batch))) {
+        started++;
+    }
+    dat_worker(&batch);
+    for(unsigned int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    xfree(workers);
+    pthread_mutex_destroy(&batch.lock);
+#else
+    dat_worker(&batch);
+#endif
+    return batch.failed ? ECLI_FAILURE : ECLI_SUCCESS;
+}
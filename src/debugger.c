@@ -0,0 +1,684 @@
+/**
+ * Interactive debugger: breakpoints patched into the op streams
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ecli.h"
+
+#define DEBUG_NEVER 0xFFFFFFFF
+
+// Where the runtime stopped: state and op are NULL at the start of a frame
+typedef struct {
+    ecli_runtime_t* rt;
+    ecl_state_t* state;
+    ecl_op_t* op;
+} debug_stop_t;
+
+// Returns 1 if the run should go on, 0 to read another command
+typedef int (*debug_command_fn)(debug_stop_t* stop, char* args);
+
+typedef struct {
+    const char* name;
+    const char* abbrev;
+    debug_command_fn run;
+    const char* args;
+    const char* help;
+} debug_command_t;
+
+/**
+ * Create a debugger reading commands from a file, which stops at the start of
+ * the given frame
+ **/
+ecli_debugger_t*
+debug_create(FILE* in, uint32_t frame)
+{
+    ecli_debugger_t* dbg = xmalloc(sizeof(ecli_debugger_t));
+    memset(dbg, 0, sizeof(ecli_debugger_t));
+    dbg->in = in;
+    dbg->stop_frame = frame;
+    return dbg;
+}
+
+/**
+ * Free a debugger, restoring every op it patched
+ **/
+void
+debug_free(ecli_debugger_t* dbg)
+{
+    debug_remove_traps(dbg);
+    xfree(dbg->traps);
+    xfree(dbg);
+}
+
+/**
+ * Find the trap patched into an op, or -1
+ **/
+static int32_t
+debug_find_trap(ecli_debugger_t* dbg, ecl_op_t* op)
+{
+    for(uint32_t i = 0; i < dbg->trap_count; i++) {
+        if(dbg->traps[i].op == op) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Patch a trap into an op of a stream, or get the one already there
+ **/
+static debug_trap_t*
+debug_add_trap(ecli_debugger_t* dbg, ecl_code_t* code, ecl_op_t* op)
+{
+    int32_t i = debug_find_trap(dbg, op);
+    if(i >= 0) {
+        return &dbg->traps[i];
+    }
+    
+    if(dbg->trap_count == dbg->trap_cap) {
+        dbg->trap_cap = dbg->trap_cap ? dbg->trap_cap * 2 : 16;
+        dbg->traps = xrealloc(dbg->traps, sizeof(debug_trap_t) * dbg->trap_cap);
+    }
+    debug_trap_t* trap = &dbg->traps[dbg->trap_count++];
+    memset(trap, 0, sizeof(debug_trap_t));
+    trap->op = op;
+    trap->orig = *op;
+    trap->code = code;
+    trap->index = op->index;
+    op->id = INS_TRAP;
+    return trap;
+}
+
+/**
+ * Restore the op of a trap and forget it
+ **/
+static void
+debug_drop_trap(ecli_debugger_t* dbg, uint32_t i)
+{
+    dbg->traps[i].op->id = dbg->traps[i].orig.id;
+    dbg->traps[i] = dbg->traps[--dbg->trap_count];
+}
+
+/**
+ * Restore every op the debugger patched
+ **/
+void
+debug_remove_traps(ecli_debugger_t* dbg)
+{
+    while(dbg->trap_count > 0) {
+        debug_drop_trap(dbg, dbg->trap_count - 1);
+    }
+    dbg->step_vm = 0;
+}
+
+/**
+ * Remove the traps planted for a step, keeping the breakpoints
+ **/
+static void
+debug_clear_steps(ecli_debugger_t* dbg)
+{
+    for(uint32_t i = dbg->trap_count; i-- > 0;) {
+        if(dbg->traps[i].number != 0) {
+            dbg->traps[i].step = 0;
+        } else {
+            debug_drop_trap(dbg, i);
+        }
+    }
+    dbg->step_vm = 0;
+}
+
+/**
+ * Find the sub whose stream for the current difficulty holds an op
+ **/
+static ecl_code_t*
+debug_find_code(ecli_runtime_t* rt, ecl_op_t* op)
+{
+    th10_ecl_t* ecl = rt->ecl;
+    unsigned int d = rt->global.difficulty;
+    
+    for(uint32_t i = 0; i < ecl->header->sub_count; i++) {
+        ecl_code_t* code = &ecl->code[i];
+        if(code->stream[d] && op >= code->stream[d] && op <= code->stream[d] + code->stream_map[d][code->count]) {
+            return code;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find a running VM by its id
+ **/
+static ecl_state_t*
+debug_find_vm(ecli_runtime_t* rt, uint32_t id)
+{
+    for(uint32_t i = 0; i < rt->vms.count; i++) {
+        ecl_state_t* vm = vm_table_at(&rt->vms, i);
+        if(!vm_finished(vm) && vm->id == id) {
+            return vm;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Print where an op is, as sub+offset
+ **/
+static void
+debug_print_location(ecli_runtime_t* rt, ecl_op_t* op)
+{
+    ecl_code_t* code = debug_find_code(rt, op);
+    if(code) {
+        printf("%s+%u", code->sub->name, ecl_op_offset(code, op));
+    } else {
+        printf("(unknown)");
+    }
+}
+
+/**
+ * Print where an op is and the instruction it was decoded from
+ **/
+static void
+debug_print_op(ecli_runtime_t* rt, ecl_op_t* op)
+{
+    strbuf_t buf;
+    
+    debug_print_location(rt, op);
+    strbuf_init(&buf);
+    if(op->src) {
+        disasm_format_instruction(&buf, op->src, NULL);
+    } else {
+        strbuf_puts(&buf, "      (end of sub)\n");
+    }
+    printf(":\n");
+    fwrite(buf.data, 1, buf.len, stdout);
+    strbuf_free(&buf);
+}
+
+/**
+ * The VM the dump commands look at: the stopped one, the one picked with
+ * "vm", or else the first
+ **/
+static ecl_state_t*
+debug_current_vm(debug_stop_t* stop)
+{
+    ecli_debugger_t* dbg = stop->rt->debugger;
+    ecl_state_t* vm = debug_find_vm(stop->rt, dbg->vm);
+    
+    for(uint32_t i = 0; vm == NULL && i < stop->rt->vms.count; i++) {
+        vm = vm_table_at(&stop->rt->vms, i);
+        vm = vm_finished(vm) ? NULL : vm;
+    }
+    if(vm == NULL) {
+        printf("No VMs are running.\n");
+    }
+    return vm;
+}
+
+/**
+ * Plant a step trap on an op the VM being stepped may run next
+ **/
+static void
+debug_plant_step(ecli_runtime_t* rt, ecl_op_t* op)
+{
+    ecl_code_t* code = debug_find_code(rt, op);
+    if(code) {
+        debug_add_trap(rt->debugger, code, op)->step = 1;
+    }
+}
+
+static int
+cmd_break(debug_stop_t* stop, char* args)
+{
+    ecli_runtime_t* rt = stop->rt;
+    ecli_debugger_t* dbg = rt->debugger;
+    char* name = strtok(args, " \t+");
+    char* offset = strtok(NULL, " \t+");
+    
+    if(name == NULL) {
+        printf("Usage: break sub[+offset]\n");
+        return 0;
+    }
+    th10_ecl_sub_t* sub = get_th10_ecl_sub_by_name(rt->ecl, name);
+    if(sub == NULL) {
+        printf("Sub \"%s\" does not exist.\n", name);
+        return 0;
+    }
+    
+    // The first op at or after the offset, in the base code
+    ecl_code_t* code = ecl_code_for_sub(rt->ecl, sub);
+    uint32_t at = offset ? strtoul(offset, NULL, 0) : 0;
+    uint32_t i = 0;
+    while(i < code->count && ecl_op_offset(code, &code->ops[i]) < at) {
+        i++;
+    }
+    if(i == code->count) {
+        printf("%s has no instruction at or after offset %u.\n", name, at);
+        return 0;
+    }
+    
+    ecl_op_t* stream = ecl_code_entry(rt->ecl, code, rt->global.difficulty);
+    ecl_op_t* op = &stream[code->stream_map[rt->global.difficulty][i]];
+    debug_trap_t* trap = debug_add_trap(dbg, code, op);
+    if(trap->number == 0) {
+        trap->number = ++dbg->numbers;
+    }
+    printf("Breakpoint %u at ", trap->number);
+    debug_print_op(rt, op);
+    return 0;
+}
+
+static int
+cmd_delete(debug_stop_t* stop, char* args)
+{
+    ecli_debugger_t* dbg = stop->rt->debugger;
+    char* arg = strtok(args, " \t");
+    uint32_t number = arg ? strtoul(arg, NULL, 0) : 0;
+    int found = 0;
+    
+    for(uint32_t i = dbg->trap_count; i-- > 0;) {
+        if(dbg->traps[i].number == 0 || (arg && dbg->traps[i].number != number)) {
+            continue;
+        }
+        found = 1;
+        if(dbg->traps[i].step) {
+            dbg->traps[i].number = 0;
+        } else {
+            debug_drop_trap(dbg, i);
+        }
+    }
+    if(arg && !found) {
+        printf("No breakpoint number %u.\n", number);
+    }
+    return 0;
+}
+
+static int
+cmd_info(debug_stop_t* stop, char* args)
+{
+    ecli_debugger_t* dbg = stop->rt->debugger;
+    int any = 0;
+    (void)args;
+    
+    for(uint32_t n = 1; n <= dbg->numbers; n++) {
+        for(uint32_t i = 0; i < dbg->trap_count; i++) {
+            if(dbg->traps[i].number == n) {
+                printf("%u: ", n);
+                debug_print_op(stop->rt, dbg->traps[i].op);
+                any = 1;
+            }
+        }
+    }
+    if(!any) {
+        printf("No breakpoints.\n");
+    }
+    return 0;
+}
+
+static int
+cmd_continue(debug_stop_t* stop, char* args)
+{
+    (void)args;
+    stop->rt->debugger->stop_frame = DEBUG_NEVER;
+    return 1;
+}
+
+static int
+cmd_next(debug_stop_t* stop, char* args)
+{
+    ecli_debugger_t* dbg = stop->rt->debugger;
+    char* arg = strtok(args, " \t");
+    uint32_t frames = arg ? strtoul(arg, NULL, 0) : 1;
+    
+    debug_clear_steps(dbg);
+    dbg->stop_frame = stop->rt->frame + (frames ? frames : 1);
+    return 1;
+}
+
+static int
+cmd_step(debug_stop_t* stop, char* args)
+{
+    ecli_runtime_t* rt = stop->rt;
+    ecli_debugger_t* dbg = rt->debugger;
+    ecl_state_t* vm = debug_current_vm(stop);
+    (void)args;
+    
+    if(vm == NULL) {
+        return 0;
+    }
+    if(vm == stop->state) {
+        // Wherever the op the VM is stopped at can continue
+        ecl_op_t* op = stop->op;
+        uint16_t id = dbg->current.id;
+        if(id == INS_RET) {
+            if(vm->csp > 0) {
+                debug_plant_step(rt, vm->callstack[vm->csp - 1]);
+            }
+        } else if(id != INS_DELETE && id != INS_INVALID) {
+            debug_plant_step(rt, op + 1);
+            if(op->target) {
+                debug_plant_step(rt, op->target);
+            }
+        }
+    } else {
+        debug_plant_step(rt, vm->ip);
+    }
+    dbg->step_vm = vm->id;
+    dbg->step_depth = DEBUG_NEVER;
+    dbg->stop_frame = DEBUG_NEVER;
+    return 1;
+}
+
+static int
+cmd_finish(debug_stop_t* stop, char* args)
+{
+    ecli_runtime_t* rt = stop->rt;
+    ecli_debugger_t* dbg = rt->debugger;
+    ecl_state_t* vm = debug_current_vm(stop);
+    (void)args;
+    
+    if(vm == NULL) {
+        return 0;
+    }
+    if(vm->csp == 0) {
+        printf("VM %u is in its first sub, running until it ends.\n", vm->id);
+    } else {
+        debug_plant_step(rt, vm->callstack[vm->csp - 1]);
+    }
+    dbg->step_vm = vm->id;
+    dbg->step_depth = vm->csp ? vm->csp - 1 : 0;
+    dbg->stop_frame = DEBUG_NEVER;
+    return 1;
+}
+
+static int
+cmd_where(debug_stop_t* stop, char* args)
+{
+    ecl_state_t* vm = debug_current_vm(stop);
+    (void)args;
+    
+    if(vm) {
+        printf("VM %u (frame %u, time %u, wait %d) at ", vm->id, stop->rt->frame, vm->time, vm->wait);
+        debug_print_op(stop->rt, vm->ip);
+    }
+    return 0;
+}
+
+static int
+cmd_stack(debug_stop_t* stop, char* args)
+{
+    ecl_state_t* vm = debug_current_vm(stop);
+    (void)args;
+    
+    if(vm == NULL) {
+        return 0;
+    }
+    printf("VM %u: sp %u, bp %u, %zu slots\n", vm->id, vm->sp, vm->bp, vm->stack_size);
+    for(uint32_t i = 0; i < vm->sp; i++) {
+        printf("%6u  ", i);
+        if(vm->stack[i].type == ECL_INVALID) {
+            printf("(unset)");
+        } else {
+            value_print(&vm->stack[i]);
+        }
+        printf("%s\n", (i == vm->bp) ? "  <- bp" : "");
+    }
+    return 0;
+}
+
+static int
+cmd_backtrace(debug_stop_t* stop, char* args)
+{
+    ecl_state_t* vm = debug_current_vm(stop);
+    (void)args;
+    
+    if(vm == NULL) {
+        return 0;
+    }
+    printf("#0 ");
+    debug_print_location(stop->rt, vm->ip);
+    printf("\n");
+    for(uint32_t i = vm->csp; i-- > 0;) {
+        printf("#%u ", vm->csp - i);
+        debug_print_location(stop->rt, vm->callstack[i]);
+        printf("\n");
+    }
+    return 0;
+}
+
+static int
+cmd_vms(debug_stop_t* stop, char* args)
+{
+    ecli_runtime_t* rt = stop->rt;
+    ecl_state_t* current = debug_current_vm(stop);
+    (void)args;
+    
+    for(uint32_t i = 0; i < rt->vms.count; i++) {
+        ecl_state_t* vm = vm_table_at(&rt->vms, i);
+        if(vm_finished(vm)) {
+            continue;
+        }
+        printf("%c%5u  ", (vm == current) ? '*' : ' ', vm->id);
+        debug_print_location(rt, vm->ip);
+        printf("  time %u, wait %d, sp %u, csp %u, enemy %u\n",
+               vm->time, vm->wait, vm->sp, vm->csp, enemy_index(vm->enemy));
+    }
+    return 0;
+}
+
+static int
+cmd_vm(debug_stop_t* stop, char* args)
+{
+    char* arg = strtok(args, " \t");
+    uint32_t id = arg ? strtoul(arg, NULL, 0) : 0;
+    
+    if(debug_find_vm(stop->rt, id) == NULL) {
+        printf("No running VM %u.\n", id);
+        return 0;
+    }
+    stop->rt->debugger->vm = id;
+    return cmd_where(stop, NULL);
+}
+
+static int
+cmd_quit(debug_stop_t* stop, char* args)
+{
+    (void)args;
+    debug_remove_traps(stop->rt->debugger);
+    stop->rt->debugger->quit = 1;
+    return 1;
+}
+
+static int cmd_help(debug_stop_t* stop, char* args);
+
+static const debug_command_t commands[] = {
+    {"break", "b", cmd_break, "sub[+offset]", "Stop when any VM reaches an instruction."},
+    {"delete", "d", cmd_delete, "[n]", "Delete a breakpoint, or all of them."},
+    {"info", "i", cmd_info, "", "List the breakpoints."},
+    {"continue", "c", cmd_continue, "", "Run until a breakpoint."},
+    {"step", "s", cmd_step, "", "Run one instruction of the VM."},
+    {"finish", "f", cmd_finish, "", "Run the VM until its current sub returns."},
+    {"next", "n", cmd_next, "[frames]", "Run to the start of the next frame, or frames later."},
+    {"where", "w", cmd_where, "", "Show the VM and the instruction it runs next."},
+    {"stack", "st", cmd_stack, "", "Dump the VM's stack."},
+    {"backtrace", "bt", cmd_backtrace, "", "Dump the VM's call stack."},
+    {"vms", "v", cmd_vms, "", "List the running VMs."},
+    {"vm", NULL, cmd_vm, "id", "Pick the VM the other commands look at."},
+    {"quit", "q", cmd_quit, "", "Stop running at the end of the frame."},
+    {"help", "h", cmd_help, "", "Print this message."},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static int
+cmd_help(debug_stop_t* stop, char* args)
+{
+    (void)stop;
+    (void)args;
+    for(const debug_command_t* c = commands; c->name; c++) {
+        printf("%-10s %-4s %-14s %s\n", c->name, c->abbrev ? c->abbrev : "", c->args, c->help);
+    }
+    printf("An empty line repeats the last command.\n");
+    return 0;
+}
+
+/**
+ * Read and run commands until one resumes the run. At the end of the input
+ * the traps are removed and the run goes on without the debugger.
+ **/
+static void
+debug_prompt(debug_stop_t* stop)
+{
+    ecli_debugger_t* dbg = stop->rt->debugger;
+    char line[sizeof(dbg->last)];
+    
+    for(;;) {
+        printf("(ecli) ");
+        fflush(stdout);
+        if(fgets(line, sizeof(line), dbg->in) == NULL) {
+            printf("\n");
+            debug_remove_traps(dbg);
+            dbg->stop_frame = DEBUG_NEVER;
+            return;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[strspn(line, " \t")] == '\0') {
+            strcpy(line, dbg->last);
+        } else {
+            strcpy(dbg->last, line);
+        }
+        
+        char* name = strtok(line, " \t");
+        char* args = strtok(NULL, "");
+        const debug_command_t* c = commands;
+        while(name && c->name && strcmp(name, c->name) && (!c->abbrev || strcmp(name, c->abbrev))) {
+            c++;
+        }
+        if(name == NULL) {
+            continue;
+        } else if(c->name == NULL) {
+            printf("Unknown command \"%s\", try \"help\".\n", name);
+        } else if(c->run(stop, args ? args : "")) {
+            return;
+        }
+    }
+}
+
+/**
+ * Called by the interpreter loop when a VM reaches a trap. Stops for
+ * breakpoints and for steps of this VM, then gives back the op the trap
+ * replaced, for the loop to run instead. NULL if the debugger has no trap
+ * there.
+ **/
+ecl_op_t*
+debug_trap(ecl_state_t* state, ecl_op_t* op)
+{
+    ecli_runtime_t* rt = state->rt;
+    ecli_debugger_t* dbg = rt->debugger;
+    int32_t i = dbg ? debug_find_trap(dbg, op) : -1;
+    if(i < 0) {
+        fprintf(stderr, "Trap without a breakpoint\n");
+        return NULL;
+    }
+    debug_trap_t* trap = &dbg->traps[i];
+    
+    if(trap->number == 0 && !(trap->step && state->id == dbg->step_vm && state->csp <= dbg->step_depth)) {
+        return &trap->orig;
+    }
+    
+    // The trap may go away while stopped, so run a copy
+    dbg->current = trap->orig;
+    dbg->vm = state->id;
+    output_flush(&rt->output); // so the output so far comes first
+    if(trap->number) {
+        printf("Breakpoint %u, ", trap->number);
+    }
+    debug_clear_steps(dbg);
+    
+    debug_stop_t stop = {rt, state, op};
+    cmd_where(&stop, NULL);
+    debug_prompt(&stop);
+    return &dbg->current;
+}
+
+/**
+ * Called at the start of every frame: stops if the frame was asked for or
+ * the VM being stepped has ended. Returns ECLI_DONE after "quit".
+ **/
+ecli_result_t
+debug_frame(ecli_runtime_t* rt)
+{
+    ecli_debugger_t* dbg = rt->debugger;
+    int stop = (rt->frame == dbg->stop_frame);
+    
+    if(dbg->quit) {
+        return ECLI_DONE;
+    }
+    if(dbg->step_vm && debug_find_vm(rt, dbg->step_vm) == NULL) {
+        output_flush(&rt->output);
+        printf("VM %u has ended.\n", dbg->step_vm);
+        debug_clear_steps(dbg);
+        stop = 1;
+    }
+    if(stop) {
+        output_flush(&rt->output);
+        printf("Frame %u\n", rt->frame);
+        debug_stop_t s = {rt, NULL, NULL};
+        debug_prompt(&s);
+    }
+    return dbg->quit ? ECLI_DONE : ECLI_SUCCESS;
+}
+
+/**
+ * Move the breakpoints to the streams of a new difficulty, before the
+ * runtime switches to it. Steps in progress are dropped.
+ **/
+void
+debug_set_difficulty(ecli_runtime_t* rt, uint8_t difficulty)
+{
+    ecli_debugger_t* dbg = rt->debugger;
+    uint32_t count = dbg->trap_count;
+    debug_trap_t* old = xmalloc(sizeof(debug_trap_t) * (count + 1));
+    
+    memcpy(old, dbg->traps, sizeof(debug_trap_t) * count);
+    debug_remove_traps(dbg);
+    for(uint32_t i = 0; i < count; i++) {
+        if(old[i].number == 0) {
+            continue;
+        }
+        ecl_code_t* code = old[i].code;
+        ecl_op_t* stream = ecl_code_entry(rt->ecl, code, difficulty);
+        ecl_op_t* op = &stream[code->stream_map[difficulty][old[i].index]];
+        debug_trap_t* trap = debug_add_trap(dbg, code, op);
+        if(trap->number == 0 || old[i].number < trap->number) {
+            trap->number = old[i].number; // breakpoints that now share an op keep the first
+        }
+    }
+    xfree(old);
+}
@@ -0,0 +1,493 @@
+/**
+ * ECL disassembler producing thecl-compatible source
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+#include "disasm.h"
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+# include <sys/uio.h>
+#endif
+#include <errno.h>
+
+// Number of subs disassembled per batch, per thread
+#define SUBS_PER_THREAD 16
+#define MAX_IOV 64
+
+/**
+ * Is this a jump instruction whose first parameter is an offset?
+ **/
+static int
+is_jump(uint16_t id)
+{
+    return (id == INS_JMP) || (id == INS_JMPEQ) || (id == INS_JMPNEQ);
+}
+
+/**
+ * Binary search for a label offset
+ **/
+static int
+has_label(disasm_ctx_t* ctx, uint32_t offset)
+{
+    uint32_t left = 0, right = ctx->label_count;
+    while(left < right) {
+        uint32_t mid = left + ((right - left) >> 1);
+        if(ctx->labels[mid] == offset) {
+            return 1;
+        } else if(ctx->labels[mid] < offset) {
+            left = mid + 1;
+        } else {
+            right = mid;
+        }
+    }
+    return 0;
+}
+
+static void
+format_rank(strbuf_t* out, uint8_t rank_mask)
+{
+    strbuf_putc(out, '!');
+    if(rank_mask == 0x0F) {
+        strbuf_putc(out, '*');
+    } else {
+        if(rank_mask & 0x01) strbuf_putc(out, 'E');
+        if(rank_mask & 0x02) strbuf_putc(out, 'N');
+        if(rank_mask & 0x04) strbuf_putc(out, 'H');
+        if(rank_mask & 0x08) strbuf_putc(out, 'L');
+    }
+}
+
+/**
+ * Print a float so that it reads back as the same value
+ **/
+static void
+format_float(strbuf_t* out, float f)
+{
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), "%.9g", f);
+    strbuf_puts(out, tmp);
+    if(strpbrk(tmp, ".eni") == NULL) {
+        strbuf_puts(out, ".0");
+    }
+    strbuf_putc(out, 'f');
+}
+
+static void
+format_string(strbuf_t* out, const char* s)
+{
+    strbuf_putc(out, '"');
+    for(; *s; s++) {
+        switch(*s) {
+            case '"': strbuf_puts(out, "\\\""); break;
+            case '\\': strbuf_puts(out, "\\\\"); break;
+            case '\n': strbuf_puts(out, "\\n"); break;
+            default: strbuf_putc(out, *s); break;
+        }
+    }
+    strbuf_putc(out, '"');
+}
+
+static void
+format_param(strbuf_t* out, ecl_value_t* params, unsigned int i, uint16_t mask)
+{
+    if(mask & (1 << i)) {
+        if(params[i].type == ECL_FLOAT32) {
+            strbuf_putc(out, '%');
+        } else if(params[i].type == ECL_INT32) {
+            strbuf_putc(out, '$');
+        }
+        
+        int32_t id = (params[i].type == ECL_FLOAT32) ? (int32_t)params[i].f : params[i].i;
+        if(id >= 0) { // stack
+            if((id >> 2) < 26) {
+                strbuf_putc(out, 'A' + (id >> 2));
+            } else {
+                strbuf_printf(out, "[%d]", id);
+            }
+        } else { // local/global
+            const char* name = ins_get_variable_name(id);
+            if(name) {
+                strbuf_puts(out, name);
+            } else {
+                strbuf_printf(out, "[%d]", id);
+            }
+        }
+    } else {
+        switch(params[i].type) {
+            case ECL_INT32:
+                strbuf_printf(out, "%d", params[i].i);
+                break;
+            case ECL_UINT32:
+                strbuf_printf(out, "%u", params[i].u);
+                break;
+            case ECL_FLOAT32:
+                format_float(out, params[i].f);
+                break;
+            case ECL_STRING:
+                format_string(out, params[i].s);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/**
+ * Format one instruction. With a context, rank mask and time label changes
+ * are written on their own lines and jump offsets become labels, as thecl
+ * expects. Without one (for tracing), they are written on every line.
+ **/
+void
+disasm_format_instruction(strbuf_t* out, th10_instr_t* ins, disasm_ctx_t* ctx)
+{
+    uint8_t rank_mask = ins->rank_mask & 0x0F;
+    ecl_value_t params[32];
+    uint32_t offset = 0;
+
+    if(ctx) {
+        offset = (uint8_t*)ins - (uint8_t*)ctx->base;
+        if(has_label(ctx, offset)) {
+            strbuf_printf(out, "offset%u:\n", offset);
+        }
+        if(rank_mask != ctx->rank_mask) {
+            format_rank(out, rank_mask);
+            strbuf_putc(out, '\n');
+            ctx->rank_mask = rank_mask;
+        }
+        if(ins->time != ctx->time) {
+            strbuf_printf(out, "%u:\n", ins->time);
+            ctx->time = ins->time;
+        }
+        if(ctx->annotate) {
+            ctx->annotate(out, ins, ctx->user);
+        } else {
+            strbuf_puts(out, "    ");
+        }
+    } else {
+        size_t start = out->len;
+        if(rank_mask != 0x0F) {
+            format_rank(out, rank_mask);
+            strbuf_putc(out, ' ');
+        }
+        if(ins->time != 0) {
+            strbuf_printf(out, "%u:", ins->time);
+        }
+        while(out->len < start + 6) {
+            strbuf_putc(out, ' ');
+        }
+    }
+
+    const ins_format_t* format = ins_get_format(ins->id);
+    if(format == NULL) {
+        strbuf_printf(out, "ins_%d;\n", ins->id);
+        return;
+    }
+
+    strbuf_puts(out, format->opcode);
+    size_t num = ins_get_param_count(ins, format);
+    size_t fixed = strlen(format->format);
+    if((num > 0) && (num <= 32) && SUCCESS(value_get_parameters(params, format->format, &ins->data[0], num))) {
+        strbuf_putc(out, '(');
+        for(unsigned int i = 0; i < num; i++) {
+            if(i > 0) {
+                strbuf_puts(out, ", ");
+            }
+            if((i + 1 >= fixed) && (format->format[fixed - 1] == 'D')) {
+                // thecl casts: _fS passes an int to a float argument
+                uint8_t* d = (uint8_t*)ins + ins->size - 8 * (num - i);
+                strbuf_printf(out, "_%c%c ", (d[0] == 'f') ? 'f' : 'S', (d[1] == 'f') ? 'f' : 'S');
+            }
+            if((i == 0) && ctx && is_jump(ins->id) && has_label(ctx, offset + params[0].i)) {
+                strbuf_printf(out, "offset%u", offset + params[0].i);
+            } else if((i == 0) && ctx && is_jump(ins->id)) {
+                // thecl can't express these, so make them stand out
+                strbuf_printf(out, "%d /* target outside the sub */", params[0].i);
+            } else {
+                format_param(out, params, i, ins->param_mask);
+            }
+        }
+        strbuf_putc(out, ')');
+    }
+    strbuf_puts(out, ";\n");
+}
+
+/**
+ * Check that an instruction lies entirely within its sub
+ **/
+static int
+instruction_fits(th10_instr_t* ins, th10_instr_t* end)
+{
+    return ((uint8_t*)ins + sizeof(th10_instr_t) <= (uint8_t*)end) &&
+           (ins->size >= sizeof(th10_instr_t)) &&
+           ((uint8_t*)ins + ins->size <= (uint8_t*)end);
+}
+
+static int
+compare_offsets(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Disassemble one sub, appending it to out. If annotate is given, it writes
+ * the start of each instruction line.
+ **/
+ecli_result_t
+disasm_sub(th10_ecl_sub_t* sub, strbuf_t* out, disasm_annotate_t annotate, void* user)
+{
+    uint32_t* labels = NULL;
+    uint32_t count = 0, cap = 0;
+    th10_instr_t* ins;
+
+    // Find every jump target first so they can be given labels
+    for(ins = sub->start; instruction_fits(ins, sub->end); ins = (th10_instr_t*)((uint8_t*)ins + ins->size)) {
+        ecl_value_t params[32];
+        if(!is_jump(ins->id) || !SUCCESS(get_ins_params(ins, params, NULL))) {
+            continue;
+        }
+        // A jump to the end of the sub gets a label after the last instruction
+        int64_t target = ((uint8_t*)ins - (uint8_t*)sub->start) + (int64_t)params[0].i;
+        if((target < 0) || (target > (uint8_t*)sub->end - (uint8_t*)sub->start)) {
+            continue;
+        }
+        if(count == cap) {
+            cap = cap ? (cap << 1) : 16;
+            labels = xrealloc(labels, sizeof(uint32_t) * cap);
+        }
+        labels[count++] = target;
+    }
+    qsort(labels, count, sizeof(uint32_t), compare_offsets);
+    uint32_t unique = 0;
+    for(uint32_t i = 0; i < count; i++) {
+        if((unique == 0) || (labels[unique-1] != labels[i])) {
+            labels[unique++] = labels[i];
+        }
+    }
+
+    disasm_ctx_t ctx;
+    ctx.base = sub->start;
+    ctx.labels = labels;
+    ctx.label_count = unique;
+    ctx.rank_mask = 0x0F;
+    ctx.time = 0;
+    ctx.annotate = annotate;
+    ctx.user = user;
+
+    strbuf_printf(out, "void %s()\n{\n", sub->name);
+    for(ins = sub->start; instruction_fits(ins, sub->end); ins = (th10_instr_t*)((uint8_t*)ins + ins->size)) {
+        disasm_format_instruction(out, ins, &ctx);
+    }
+    if((uint8_t*)ins + sizeof(th10_instr_t) <= (uint8_t*)sub->end) {
+        strbuf_printf(out, "    // malformed instruction at offset %u\n",
+                      (uint32_t)((uint8_t*)ins - (uint8_t*)sub->start));
+    }
+    uint32_t end = (uint8_t*)sub->end - (uint8_t*)sub->start;
+    if(has_label(&ctx, end)) {
+        strbuf_printf(out, "offset%u:\n", end);
+    }
+    strbuf_puts(out, "}\n\n");
+
+    free(labels);
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Write buffers to a file descriptor with as few calls as possible
+ **/
+static ecli_result_t
+write_buffers(int fd, strbuf_t* bufs, unsigned int count)
+{
+#ifdef HAVE_UNISTD_H
+    struct iovec iov[MAX_IOV];
+    unsigned int i = 0;
+
+    while(i < count) {
+        int n = 0;
+        for(; (i < count) && (n < MAX_IOV); i++) {
+            if(bufs[i].len) {
+                iov[n].iov_base = bufs[i].data;
+                iov[n].iov_len = bufs[i].len;
+                n++;
+            }
+        }
+        // writev may write only part; finish the batch by hand
+        struct iovec* v = iov;
+        while(n > 0) {
+            ssize_t amt = writev(fd, v, n);
+            if(amt < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return ECLI_FAILURE;
+            }
+            while((n > 0) && ((size_t)amt >= v->iov_len)) {
+                amt -= v->iov_len;
+                v++;
+                n--;
+            }
+            if(n > 0) {
+                v->iov_base = (char*)v->iov_base + amt;
+                v->iov_len -= amt;
+            }
+        }
+    }
+#else
+    FILE* f = (fd == 1) ? stdout : stderr;
+    for(unsigned int i = 0; i < count; i++) {
+        fwrite(bufs[i].data, 1, bufs[i].len, f);
+    }
+    fflush(f);
+#endif
+    return ECLI_SUCCESS;
+}
+
+// Work shared by the disassembly threads for one batch of subs
+typedef struct {
+    th10_ecl_t* ecl;
+    strbuf_t* bufs;
+    uint32_t first; // first sub of the batch
+    uint32_t count; // subs in the batch
+    uint32_t next; // next sub to take, relative to first
+    disasm_annotate_t annotate;
+    void* user;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+} disasm_batch_t;
+
+static void*
+disasm_worker(void* arg)
+{
+    disasm_batch_t* batch = arg;
+    while(1) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&batch->lock);
+#endif
+        uint32_t i = batch->next++;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&batch->lock);
+#endif
+        if(i >= batch->count) {
+            break;
+        }
+        disasm_sub(&batch->ecl->subs[batch->first + i], &batch->bufs[i], batch->annotate, batch->user);
+    }
+    return NULL;
+}
+
+/**
+ * Disassemble a whole ECL file to a file descriptor. Subs are disassembled in
+ * batches, in parallel on the given number of threads, and each batch is
+ * written out in order before the next one starts so memory use stays
+ * bounded. annotate is passed on to disasm_sub().
+ **/
+ecli_result_t
+disasm_ecl(th10_ecl_t* ecl, int fd, unsigned int threads, disasm_annotate_t annotate, void* user)
+{
+    if(threads == 0) {
+        threads = cpu_count();
+    }
+    uint32_t batch_size = SUBS_PER_THREAD * threads;
+    strbuf_t* bufs = xmalloc(sizeof(strbuf_t) * batch_size);
+    for(uint32_t i = 0; i < batch_size; i++) {
+        strbuf_init(&bufs[i]);
+    }
+
+    // Include lists
+    static const char* list_names[INCLUDE_MAX] = {"anim", "ecli"};
+    for(include_t inc = INCLUDE_ANIM; inc < INCLUDE_MAX; inc++) {
+        th10_include_list_t* list = th10_ecl_get_include_list(ecl, inc);
+        if((list == NULL) || (list->count == 0)) {
+            continue;
+        }
+        strbuf_printf(&bufs[0], "%s { ", list_names[inc]);
+        for(unsigned int i = 0; i < list->count; i++) {
+            format_string(&bufs[0], th10_ecl_get_include(list, i));
+            strbuf_puts(&bufs[0], "; ");
+        }
+        strbuf_puts(&bufs[0], "}\n");
+    }
+    if(bufs[0].len) {
+        strbuf_putc(&bufs[0], '\n');
+    }
+    ecli_result_t result = write_buffers(fd, bufs, 1);
+    bufs[0].len = 0;
+
+    disasm_batch_t batch;
+    batch.ecl = ecl;
+    batch.bufs = bufs;
+    batch.annotate = annotate;
+    batch.user = user;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_t* workers = xmalloc(sizeof(pthread_t) * threads);
+#endif
+
+    for(uint32_t first = 0; SUCCESS(result) && (first < ecl->header->sub_count); first += batch_size) {
+        batch.first = first;
+        batch.count = ecl->header->sub_count - first;
+        if(batch.count > batch_size) {
+            batch.count = batch_size;
+        }
+        batch.next = 0;
+
+#ifdef HAVE_PTHREAD
+        unsigned int started = 0;
+        while((started + 1 < threads) && (0 == pthread_create(&workers[started], NULL, disasm_worker, &batch))) {
+            started++;
+        }
+        disasm_worker(&batch);
+        for(unsigned int i = 0; i < started; i++) {
+            pthread_join(workers[i], NULL);
+        }
+#else
+        disasm_worker(&batch);
+#endif
+
+        result = write_buffers(fd, bufs, batch.count);
+        for(uint32_t i = 0; i < batch.count; i++) {
+            bufs[i].len = 0;
+        }
+    }
+
+#ifdef HAVE_PTHREAD
+    xfree(workers);
+    pthread_mutex_destroy(&batch.lock);
+#endif
+    for(uint32_t i = 0; i < batch_size; i++) {
+        strbuf_free(&bufs[i]);
+    }
+    xfree(bufs);
+    return result;
+}
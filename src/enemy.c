@@ -0,0 +1,370 @@
+/**
+ * Enemy manager: the enemies ECL VMs run for
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+
+#define ENEMY_ALIGN (ENEMY_WIDTH * sizeof(float))
+
+typedef float vf __attribute__((vector_size(ENEMY_WIDTH * sizeof(float))));
+
+/**
+ * Set up an empty enemy manager
+ **/
+void
+enemy_init(enemy_manager_t* em)
+{
+    memset(em, 0, sizeof(enemy_manager_t));
+}
+
+/**
+ * Free the pool of an enemy manager. Every VM must have been freed first.
+ **/
+void
+enemy_free(enemy_manager_t* em)
+{
+    for(uint32_t i = 0; i < em->used; i++) {
+        xfree(em->enemies[i].emitters);
+    }
+    xfree(em->mem);
+    xfree(em->enemies);
+    xfree(em->free);
+    memset(em, 0, sizeof(enemy_manager_t));
+}
+
+/**
+ * Double the size of the pool. New slots are zeroed.
+ **/
+static void
+enemy_grow(enemy_manager_t* em)
+{
+    uint32_t capacity = em->capacity ? em->capacity * 2 : 64;
+    void* mem = xmalloc(sizeof(float) * ENEMY_FIELDS * capacity + ENEMY_ALIGN);
+    float* base = (float*)(((uintptr_t)mem + ENEMY_ALIGN - 1) & ~(uintptr_t)(ENEMY_ALIGN - 1));
+    
+    memset(base, 0, sizeof(float) * ENEMY_FIELDS * capacity);
+    for(unsigned int f = 0; f < ENEMY_FIELDS; f++) {
+        if(em->capacity > 0) {
+            memcpy(base + f * capacity, em->field[f], sizeof(float) * em->capacity);
+        }
+        em->field[f] = base + f * capacity;
+    }
+    xfree(em->mem);
+    em->mem = mem;
+    
+    em->enemies = xrealloc(em->enemies, sizeof(enemy_t) * capacity);
+    memset(em->enemies + em->capacity, 0, sizeof(enemy_t) * (capacity - em->capacity));
+    em->free = xrealloc(em->free, sizeof(uint32_t) * capacity);
+    em->capacity = capacity;
+}
+
+/**
+ * Make an enemy at a position, with no VMs yet. Returns ENEMY_NONE once the
+ * handles run out of slots.
+ **/
+enemy_handle_t
+enemy_create(enemy_manager_t* em, float x, float y)
+{
+    uint32_t i;
+    if(em->free_count > 0) {
+        i = em->free[--em->free_count];
+    } else {
+        if(em->used > ENEMY_INDEX_MASK) {
+            fprintf(stderr, "Too many enemies\n");
+            return ENEMY_NONE;
+        }
+        if(em->used == em->capacity) {
+            enemy_grow(em);
+        }
+        i = em->used++;
+    }
+    
+    // Freeing a slot moved its generation on already
+    enemy_t* e = &em->enemies[i];
+    uint16_t generation = e->generation;
+    memset(e, 0, sizeof(enemy_t));
+    e->generation = generation ? generation : 1;
+    e->alive = 1;
+    em->field[ENEMY_ABS_X][i] = x;
+    em->field[ENEMY_ABS_Y][i] = y;
+    em->live++;
+    
+    return ((enemy_handle_t)e->generation << ENEMY_INDEX_BITS) | i;
+}
+
+/**
+ * Get the enemy of a handle, or NULL if its slot has been freed since
+ **/
+enemy_t*
+enemy_get(enemy_manager_t* em, enemy_handle_t handle)
+{
+    uint32_t i = enemy_index(handle);
+    if(i >= em->used || em->enemies[i].generation != (handle >> ENEMY_INDEX_BITS)) {
+        return NULL;
+    }
+    return &em->enemies[i];
+}
+
+/**
+ * Count a VM running for an enemy
+ **/
+void
+enemy_attach(enemy_manager_t* em, enemy_handle_t handle)
+{
+    em->enemies[enemy_index(handle)].vms++;
+}
+
+/**
+ * Stop counting a VM running for an enemy, freeing the enemy with its last
+ **/
+void
+enemy_detach(enemy_manager_t* em, enemy_handle_t handle)
+{
+    uint32_t i = enemy_index(handle);
+    enemy_t* e = &em->enemies[i];
+    if(--e->vms > 0) {
+        return;
+    }
+    
+    // Handles to the enemy go stale now, not when the slot is reused
+    xfree(e->emitters);
+    uint16_t generation = (e->generation + 1) & ENEMY_GENERATION_MASK;
+    memset(e, 0, sizeof(enemy_t));
+    e->generation = generation ? generation : 1;
+    for(unsigned int f = 0; f < ENEMY_FIELDS; f++) {
+        em->field[f][i] = 0.0f;
+    }
+    em->free[em->free_count++] = i;
+    em->live--;
+}
+
+/**
+ * Interpolation curves of the move*Time instructions
+ **/
+static float
+enemy_ease(int32_t mode, float t)
+{
+    float u = 1.0f - t;
+    switch(mode) {
+        case MODE_ACCEL1: return t * t;
+        case MODE_ACCEL2: return t * t * t;
+        case MODE_ACCEL3: return t * t * t * t;
+        case MODE_DECEL1: return 1.0f - u * u;
+        case MODE_DECEL2: return 1.0f - u * u * u;
+        case MODE_DECEL3: return 1.0f - u * u * u * u;
+        default: return t;
+    }
+}
+
+/**
+ * Advance the interpolated movements of an enemy by a frame
+ **/
+static void
+enemy_step_moves(enemy_manager_t* em, uint32_t i)
+{
+    enemy_t* e = &em->enemies[i];
+    
+    for(unsigned int k = 0; k < MOVE_KINDS; k++) {
+        enemy_move_t* m = &e->move[k];
+        if(!(e->moving & (1 << k))) {
+            continue;
+        }
+        
+        m->time++;
+        float t = enemy_ease(m->mode, (float)m->time / m->duration);
+        float a = m->from[0] + (m->to[0] - m->from[0]) * t;
+        float b = m->from[1] + (m->to[1] - m->from[1]) * t;
+        switch(k) {
+            case MOVE_ABS:
+                em->field[ENEMY_ABS_X][i] = a;
+                em->field[ENEMY_ABS_Y][i] = b;
+                break;
+            case MOVE_REL:
+                em->field[ENEMY_REL_X][i] = a;
+                em->field[ENEMY_REL_Y][i] = b;
+                break;
+            case MOVE_VEL: {
+                float s, c;
+                fmath_sincos(a, &s, &c);
+                em->field[ENEMY_VEL_X][i] = c * b;
+                em->field[ENEMY_VEL_Y][i] = s * b;
+            }   break;
+        }
+        if(m->time >= m->duration) {
+            e->moving &= ~(1 << k);
+        }
+    }
+}
+
+/**
+ * Move every enemy by a frame: interpolated movements first, then the
+ * velocities in one vector pass over the pool. Runs after the VMs.
+ **/
+void
+enemy_update(enemy_manager_t* em)
+{
+    for(uint32_t i = 0; i < em->used; i++) {
+        if(em->enemies[i].moving) {
+            enemy_step_moves(em, i);
+        }
+    }
+    
+    // Slots past used are zero, so whole vectors can run to the end
+    float* x = em->field[ENEMY_ABS_X];
+    float* y = em->field[ENEMY_ABS_Y];
+    float* vx = em->field[ENEMY_VEL_X];
+    float* vy = em->field[ENEMY_VEL_Y];
+    for(uint32_t i = 0; i < em->used; i += ENEMY_WIDTH) {
+        *(vf*)&x[i] += *(vf*)&vx[i];
+        *(vf*)&y[i] += *(vf*)&vy[i];
+    }
+}
+
+/**
+ * Start an interpolated movement, or jump to the end if it takes no time
+ **/
+static void
+enemy_start_move(enemy_manager_t* em, uint32_t i, unsigned int kind, ecl_value_t* v, float from0, float from1)
+{
+    enemy_t* e = &em->enemies[i];
+    enemy_move_t* m = &e->move[kind];
+    
+    m->time = 0;
+    m->duration = v[0].i;
+    m->mode = v[1].i;
+    m->from[0] = from0;
+    m->from[1] = from1;
+    m->to[0] = v[2].f;
+    m->to[1] = v[3].f;
+    e->moving |= (1 << kind);
+    if(m->duration <= 0) {
+        m->duration = 1;
+        enemy_step_moves(em, i);
+    }
+}
+
+/**
+ * Make an enemy running a sub, for enmCreate
+ **/
+static ecli_result_t
+enemy_run_create(ecl_state_t* state, ecl_op_t* op, ecl_value_t* v)
+{
+    ecli_runtime_t* rt = state->rt;
+    enemy_manager_t* em = &rt->enemies;
+    uint32_t parent = enemy_index(state->enemy);
+    
+    if(op->callee == NULL) {
+        fprintf(stderr, "%s: sub \"%s\" does not exist\n", ins_get_format(op->id)->opcode, v[0].s);
+        return ECLI_FAILURE;
+    }
+    
+    float x = v[1].f, y = v[2].f;
+    if(op->id == INS_ENMCREATE) { // relative to the parent
+        x += em->field[ENEMY_ABS_X][parent] + em->field[ENEMY_REL_X][parent];
+        y += em->field[ENEMY_ABS_Y][parent] + em->field[ENEMY_REL_Y][parent];
+    }
+    enemy_handle_t handle = enemy_create(em, x, y);
+    if(handle == ENEMY_NONE) {
+        return ECLI_FAILURE;
+    }
+    enemy_t* e = &em->enemies[enemy_index(handle)];
+    e->hp = v[3].i;
+    e->score = v[4].i;
+    e->item = v[5].i;
+    
+    // Runs later this frame, like a callAsync
+    ecl_state_t* child;
+    return allocate_ecl_state(&child, rt, op->callee, handle);
+}
+
+/**
+ * Run one of the enemy instructions: creation, deletion, flags and movement
+ **/
+ecli_result_t
+enemy_run_ins(ecl_state_t* state, ecl_op_t* op, ecl_value_t* v)
+{
+    enemy_manager_t* em = &state->rt->enemies;
+    uint32_t i = enemy_index(state->enemy);
+    float* f[ENEMY_FIELDS];
+    
+    for(unsigned int k = 0; k < ENEMY_FIELDS; k++) {
+        f[k] = &em->field[k][i];
+    }
+    
+    switch(op->id) {
+        case INS_DELETE: // ends every VM of the enemy
+            em->enemies[i].alive = 0;
+            return ECLI_DONE;
+        
+        case INS_ENMCREATE:
+        case INS_ENMCREATEA:
+            return enemy_run_create(state, op, v);
+        
+        case INS_FLAGSET:
+            em->enemies[i].flags = v[0].i;
+            break;
+        
+        case INS_MOVEPOS:
+            *f[ENEMY_ABS_X] = v[0].f;
+            *f[ENEMY_ABS_Y] = v[1].f;
+            em->enemies[i].moving &= ~(1 << MOVE_ABS);
+            break;
+        
+        case INS_MOVEPOSTIME:
+            enemy_start_move(em, i, MOVE_ABS, v, *f[ENEMY_ABS_X], *f[ENEMY_ABS_Y]);
+            break;
+        
+        case INS_MOVEPOSREL:
+            *f[ENEMY_REL_X] = v[0].f;
+            *f[ENEMY_REL_Y] = v[1].f;
+            em->enemies[i].moving &= ~(1 << MOVE_REL);
+            break;
+        
+        case INS_MOVEPOSRELTIME:
+            enemy_start_move(em, i, MOVE_REL, v, *f[ENEMY_REL_X], *f[ENEMY_REL_Y]);
+            break;
+        
+        case INS_MOVEVEL: {
+            float s, c;
+            fmath_sincos(v[0].f, &s, &c);
+            *f[ENEMY_VEL_X] = c * v[1].f;
+            *f[ENEMY_VEL_Y] = s * v[1].f;
+            em->enemies[i].moving &= ~(1 << MOVE_VEL);
+        }   break;
+        
+        case INS_MOVEVELTIME:
+            enemy_start_move(em, i, MOVE_VEL, v, fmath_atan2(*f[ENEMY_VEL_Y], *f[ENEMY_VEL_X]),
+                             fmath_sqrt(*f[ENEMY_VEL_X] * *f[ENEMY_VEL_X] + *f[ENEMY_VEL_Y] * *f[ENEMY_VEL_Y]));
+            break;
+        
+        default:
+            break;
+    }
+    return ECLI_SUCCESS;
+}
@@ -0,0 +1,347 @@
+/**
+ * Deterministic float math for angles and positions
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include <stdint.h>
+#include <math.h>
+
+#include "ecli.h"
+
+// pi/2 in three parts. The first two have 8 and 11 significant bits, so
+// multiplying them by a quadrant below 2^13 loses nothing
+#define PIO2_1 1.5703125f
+#define PIO2_2 4.837512969970703125e-4f
+#define PIO2_3 7.54978995489188216e-8f
+#define TWO_OVER_PI 0.636619772f
+
+// Largest quadrant sincos_core reduces, angles past it go to sincos_wide
+#define QUADRANT_MAX 8191.0f
+
+// Floats this big have no fraction left, so no angle to bring into range
+#define ANGLE_MAX 8388608.0f
+
+// pi/2 over 2^62, turning a 2.62 fixed point quadrant fraction into radians
+#define PIO2_FIX 0x1.921fb54442d18p-62
+
+// The fraction of 2/pi, 32 bits a word, after a word for its integer part
+static const uint32_t two_over_pi_bits[] = {
+    0x00000000, 0xa2f9836e, 0x4e441529, 0xfc2757d1,
+    0xf534ddc0, 0xdb629599, 0x3c439041, 0xfe5163ab
+};
+
+/**
+ * Pick a if the low bit of sel is set, b otherwise, without a branch
+ **/
+static inline float
+select_bit(int32_t sel, float a, float b)
+{
+    union { float f; uint32_t u; } x, y;
+    uint32_t mask = -(uint32_t)(sel & 1);
+    x.f = a;
+    y.f = b;
+    x.u = (x.u & mask) | (y.u & ~mask);
+    return x.f;
+}
+
+/**
+ * Whether sincos_core can reduce an angle, false for NaN too
+ **/
+static inline int
+in_range(float a)
+{
+    float q = a * TWO_OVER_PI;
+    return (q >= -QUADRANT_MAX) & (q <= QUADRANT_MAX);
+}
+
+/**
+ * sin and cos of r in [-pi/4, pi/4] moved to quadrant k, which pick the
+ * polynomial and sign
+ **/
+static inline void
+sincos_poly(float r, int32_t k, float* s, float* c)
+{
+    float z = r * r;
+    
+    float sr = ((-1.9515295891e-4f * z + 8.3321608736e-3f) * z - 1.6666654611e-1f) * z * r + r;
+    float cr = ((2.443315711809948e-5f * z - 1.388731625493765e-3f) * z + 4.166664568298827e-2f) * z * z
+               - 0.5f * z + 1.0f;
+    
+    // Multiplying by -1 or 1 is exact
+    *s = select_bit(k, cr, sr) * (float)(1 - (k & 2));
+    *c = select_bit(k, sr, cr) * (float)(1 - ((k + 1) & 2));
+}
+
+/**
+ * sin and cos of an angle in range. The angle is reduced to r in
+ * [-pi/4, pi/4] and its quadrant k. Written without branches, so that the
+ * batch loops vectorize.
+ **/
+static inline void
+sincos_core(float a, float* s, float* c)
+{
+    float q = a * TWO_OVER_PI;
+    int32_t k = (int32_t)(q + copysignf(0.5f, q));
+    float fk = (float)k;
+    float r = ((a - fk * PIO2_1) - fk * PIO2_2) - fk * PIO2_3;
+    sincos_poly(r, k, s, c);
+}
+
+/**
+ * 32 bits of 2/pi starting after bit o of two_over_pi_bits
+ **/
+static inline uint64_t
+two_over_pi_at(uint32_t o)
+{
+    uint64_t w = ((uint64_t)two_over_pi_bits[o >> 5] << 32) | two_over_pi_bits[(o >> 5) + 1];
+    return (uint32_t)(w >> (32 - (o & 31)));
+}
+
+/**
+ * sin and cos of an angle out of sincos_core's range (Payne-Hanek). For
+ * a = m * 2^(e-23), the bits of 2/pi before 2^(23-e) only add whole turns,
+ * so the 24-bit mantissa times the next 96 bits gives the quadrant and the
+ * fraction into it in 2.62 fixed point, exact for any float.
+ **/
+static void
+sincos_wide(float a, float* s, float* c)
+{
+    union { float f; uint32_t u; } x;
+    x.f = a;
+    int32_t e = (int32_t)((x.u >> 23) & 0xFF) - 127;
+    if(e == 128) {
+        *s = *c = a - a; // NaN and infinities
+        return;
+    }
+    
+    uint64_t m = (x.u & 0x7FFFFF) | 0x800000;
+    uint32_t o = (uint32_t)(e + 7); // e is at least 13 here
+    uint64_t f = ((m * two_over_pi_at(o)) << 32) + m * two_over_pi_at(o + 32)
+                 + ((m * two_over_pi_at(o + 64)) >> 32);
+    uint64_t n = (f + (1ull << 61)) >> 62;
+    f -= n << 62;
+    
+    float r = (float)((double)(int64_t)f * PIO2_FIX);
+    int32_t k = (int32_t)n;
+    if(x.u >> 31) {
+        r = -r;
+        k = -k;
+    }
+    sincos_poly(r, k, s, c);
+}
+
+/**
+ * sin and cos of any angle
+ **/
+static inline void
+sincos_any(float a, float* s, float* c)
+{
+    if(in_range(a)) {
+        sincos_core(a, s, c);
+    } else {
+        sincos_wide(a, s, c);
+    }
+}
+
+/**
+ * Whether sincos_core can reduce all n angles, so that a batch can take
+ * the vectorized loop
+ **/
+static inline int
+all_in_range(const float* a, size_t n)
+{
+    int ok = 1;
+    for(size_t i = 0; i < n; i++) {
+        ok &= in_range(a[i]);
+    }
+    return ok;
+}
+
+/**
+ * atan2, 0 for the origin. atan of |y/x| reduced to [0, tan(pi/8)] around
+ * 0, pi/4 or pi/2, then moved to the quadrant of (x, y).
+ **/
+static inline float
+atan2_core(float y, float x)
+{
+    float t = y / x;
+    float at = fabsf(t);
+    int big = (at > 2.414213562373095f);
+    int mid = (at > 0.4142135623730950f);
+    float base = big ? PI / 2.0f : (mid ? PI / 4.0f : 0.0f);
+    float z = big ? -1.0f / at : (mid ? (at - 1.0f) / (at + 1.0f) : at);
+    float zz = z * z;
+    float a = base + ((((8.05374449538e-2f * zz - 1.38776856032e-1f) * zz + 1.99777106478e-1f) * zz
+                       - 3.33329491539e-1f) * zz * z + z);
+    a = copysignf(a, t);
+    a += (x < 0.0f) ? copysignf(PI, y) : 0.0f;
+    return ((x == 0.0f) & (y == 0.0f)) ? 0.0f : a;
+}
+
+/**
+ * Sine of an angle in radians
+ **/
+float
+fmath_sin(float a)
+{
+    float s, c;
+    sincos_any(a, &s, &c);
+    return s;
+}
+
+/**
+ * Cosine of an angle in radians
+ **/
+float
+fmath_cos(float a)
+{
+    float s, c;
+    sincos_any(a, &s, &c);
+    return c;
+}
+
+/**
+ * Sine and cosine of an angle, for turning it and a speed into a velocity
+ **/
+void
+fmath_sincos(float a, float* s, float* c)
+{
+    sincos_any(a, s, c);
+}
+
+/**
+ * Angle of the vector (x, y), in [-pi, pi]
+ **/
+float
+fmath_atan2(float y, float x)
+{
+    return atan2_core(y, x);
+}
+
+/**
+ * Square root. IEEE 754 requires it to be correctly rounded, so the C
+ * library's is already the same everywhere.
+ **/
+float
+fmath_sqrt(float x)
+{
+    return sqrtf(x);
+}
+
+/**
+ * Bring an angle into [-pi, pi] by whole turns, as validRad does
+ **/
+float
+fmath_norm_rad(float a)
+{
+    if(!(a >= -ANGLE_MAX && a <= ANGLE_MAX)) {
+        return a; // NaN, infinities and angles with no precision left
+    }
+    if(a > 64.0f * PI || a < -64.0f * PI) {
+        a -= (float)(int32_t)(a / (2.0f * PI)) * (2.0f * PI);
+    }
+    while(a > PI) {
+        a -= 2.0f * PI;
+    }
+    while(a < -PI) {
+        a += 2.0f * PI;
+    }
+    return a;
+}
+
+/**
+ * Sines of n angles
+ **/
+void
+fmath_sin_n(const float* a, float* s, size_t n)
+{
+    if(!all_in_range(a, n)) {
+        for(size_t i = 0; i < n; i++) {
+            float c;
+            sincos_any(a[i], &s[i], &c);
+        }
+        return;
+    }
+    for(size_t i = 0; i < n; i++) {
+        float c;
+        sincos_core(a[i], &s[i], &c);
+    }
+}
+
+/**
+ * Cosines of n angles
+ **/
+void
+fmath_cos_n(const float* a, float* c, size_t n)
+{
+    if(!all_in_range(a, n)) {
+        for(size_t i = 0; i < n; i++) {
+            float s;
+            sincos_any(a[i], &s, &c[i]);
+        }
+        return;
+    }
+    for(size_t i = 0; i < n; i++) {
+        float s;
+        sincos_core(a[i], &s, &c[i]);
+    }
+}
+
+/**
+ * Sines and cosines of n angles
+ **/
+void
+fmath_sincos_n(const float* a, float* s, float* c, size_t n)
+{
+    if(!all_in_range(a, n)) {
+        for(size_t i = 0; i < n; i++) {
+            float sv, cv;
+            sincos_any(a[i], &sv, &cv);
+            s[i] = sv;
+            c[i] = cv;
+        }
+        return;
+    }
+    for(size_t i = 0; i < n; i++) {
+        float sv, cv;
+        sincos_core(a[i], &sv, &cv);
+        s[i] = sv;
+        c[i] = cv;
+    }
+}
+
+/**
+ * Angles of n vectors
+ **/
+void
+fmath_atan2_n(const float* y, const float* x, float* a, size_t n)
+{
+    for(size_t i = 0; i < n; i++) {
+        a[i] = atan2_core(y[i], x[i]);
+    }
+}
@@ -0,0 +1,301 @@
+/**
+ * Inlining of small subs into their callers
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+
+/*
+ * A call to a small sub which never waits or calls is replaced by a copy of
+ * the sub. The call becomes an enter op, which writes the arguments and the
+ * saved base pointer exactly where the call and the callee's stackAlloc
+ * would have, and each return becomes a leave op, which drops the frame and
+ * jumps to the op after the call. The copy's locals are shifted by the depth
+ * of the stack at the call, so the base pointer never changes; that depth
+ * has to be the same on every difficulty the call runs on, so only calls in
+ * verified subs are inlined. Subs with an enter are never copied, so copies
+ * don't nest.
+ *
+ * Ops of a copy keep the instruction they were decoded from, for traces and
+ * crash reports, and the offset of the call as their site.
+ */
+
+// Kinds of edges in the call graph
+enum {
+    EDGE_CALL,
+    EDGE_CALLASYNC,
+    EDGE_ENEMY,
+    EDGE_INLINED,
+    EDGE_KINDS
+};
+
+static const char* edge_names[EDGE_KINDS] = {"call", "callAsync", "enmCreate", "inlined"};
+
+/**
+ * Whether a sub can be copied into its callers: verified, no longer than
+ * limit ops, starting with a stackAlloc on every difficulty and neither
+ * waiting nor calling
+ **/
+static int
+inline_candidate(ecl_code_t* code, uint32_t limit)
+{
+    ecl_op_t* entry = &code->ops[0];
+    
+    if(!(code->flags & CODE_VERIFIED) || code->count == 0 || code->count > limit ||
+       entry->id != INS_STACKALLOC || entry->nparams == 0 || (entry->rank_mask & 0x0F) != 0x0F) {
+        return 0;
+    }
+    for(uint32_t i = 1; i < code->count; i++) {
+        ecl_op_t* op = &code->ops[i];
+        const ins_format_t* format = ins_get_format(op->id);
+        
+        switch(op->id) {
+            case INS_WAIT:
+            case INS_CALL:
+            case INS_STACKALLOC:
+            case INS_ENTER:
+            case INS_LEAVE:
+            case INS_TRAP:
+                return 0;
+            
+            case INS_JMP:
+            case INS_JMPEQ:
+            case INS_JMPNEQ:
+            case INS_JMPTIME:
+                if(op->target == NULL || op->target == entry) {
+                    return 0;
+                }
+                break;
+            
+            default:
+                break;
+        }
+        // Ops which fail when run are left to fail in the callee
+        if(format == NULL || (op->nparams == 0 && format->format[0] != '\0')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Stack depth of a sub at a call, or STACK_UNBOUNDED if it isn't the same on
+ * every difficulty or the call is never reached
+ **/
+static uint32_t
+inline_site_depth(ecl_code_t* code, ecl_op_t* op)
+{
+    for(uint32_t i = 0; i < code->site_count; i++) {
+        if(code->sites[i].op == op) {
+            return (code->sites[i].depth == code->sites[i].low) ? code->sites[i].depth : STACK_UNBOUNDED;
+        }
+    }
+    return STACK_UNBOUNDED;
+}
+
+/**
+ * Copy the ops of a sub's inlinable calls into it
+ **/
+static void
+inline_sub(ecl_code_t* code, uint8_t* candidates, ecl_code_t* all, ecl_opt_stats_t* stats)
+{
+    uint32_t* depth = xmalloc(sizeof(uint32_t) * (code->count + 1));
+    uint32_t* at = xmalloc(sizeof(uint32_t) * (code->count + 1));
+    uint32_t count = 0, nparams = 0, sites = 0;
+    
+    // Where each op goes, and how much room the copies need
+    for(uint32_t i = 0; i <= code->count; i++) {
+        ecl_op_t* op = &code->ops[i];
+        depth[i] = STACK_UNBOUNDED;
+        if(op->id == INS_CALL && op->callee && op->callee != code && candidates[op->callee - all]) {
+            depth[i] = inline_site_depth(code, op);
+        }
+        
+        at[i] = count++;
+        nparams += op->nparams;
+        if(depth[i] != STACK_UNBOUNDED) {
+            ecl_code_t* callee = op->callee;
+            for(uint32_t k = 1; k < callee->count; k++) {
+                nparams += (callee->ops[k].id == INS_RET) ? 1 : callee->ops[k].nparams;
+            }
+            count += callee->count - 1;
+            sites++;
+        }
+    }
+    if(sites == 0) {
+        xfree(depth);
+        xfree(at);
+        return;
+    }
+    
+    count--; // the end marker
+    ecl_op_t* ops = xmalloc(sizeof(ecl_op_t) * (count + 1));
+    ecl_value_t* params = xmalloc(sizeof(ecl_value_t) * (nparams ? nparams : 1));
+    ecl_value_t* p = params;
+    
+    for(uint32_t i = 0; i <= code->count; i++) {
+        ecl_op_t* op = &ops[at[i]];
+        *op = code->ops[i];
+        memcpy(p, code->ops[i].params, sizeof(ecl_value_t) * op->nparams);
+        op->params = p;
+        p += op->nparams;
+        if(op->target) {
+            op->target = &ops[at[op->target - code->ops]];
+        }
+        if(depth[i] == STACK_UNBOUNDED) {
+            continue;
+        }
+        
+        // The call makes the callee's frame, its arguments stay where they are
+        ecl_code_t* callee = op->callee;
+        uint32_t site = ecl_op_offset(code, &code->ops[i]) + 1;
+        op->id = INS_ENTER;
+        op->params[0].type = ECL_UINT32;
+        op->params[0].u = callee->ops[0].params[0].u >> 2;
+        
+        for(uint32_t k = 1; k < callee->count; k++) {
+            ecl_op_t* copy = &ops[at[i] + k];
+            *copy = callee->ops[k];
+            copy->rank_mask &= code->ops[i].rank_mask;
+            copy->site = site;
+            if(copy->target) {
+                copy->target = &ops[at[i] + (copy->target - callee->ops)];
+            }
+            if(copy->id == INS_RET) {
+                copy->id = INS_LEAVE;
+                copy->param_mask = 0;
+                copy->nparams = 1;
+                copy->params = p++;
+                copy->params[0].type = ECL_UINT32;
+                copy->params[0].u = depth[i] - 1; // where the call left the stack pointer
+                copy->target = &ops[at[i + 1]];
+                continue;
+            }
+            
+            memcpy(p, callee->ops[k].params, sizeof(ecl_value_t) * copy->nparams);
+            copy->params = p;
+            p += copy->nparams;
+            for(unsigned int j = 0; j < copy->nparams; j++) {
+                if(((copy->param_mask & (1 << j)) || ins_writes_param(copy->id, j)) && copy->params[j].i >= 0) {
+                    copy->params[j].i += depth[i] << 2;
+                }
+            }
+        }
+        stats->inlined++;
+    }
+    
+    xfree(code->ops);
+    xfree(code->params);
+    code->ops = ops;
+    code->params = params;
+    code->count = count;
+    xfree(depth);
+    xfree(at);
+}
+
+/**
+ * Inline the calls to subs of at most limit ops into every verified sub.
+ * The streams must have been freed, and the file has to be verified again
+ * afterwards.
+ **/
+void
+ecl_code_inline(th10_ecl_t* ecl, uint32_t limit, ecl_opt_stats_t* stats)
+{
+    uint32_t count = ecl->header->sub_count;
+    uint8_t* candidates = xmalloc(count ? count : 1);
+    
+    // Candidates don't call, so they are never changed here
+    for(uint32_t i = 0; i < count; i++) {
+        candidates[i] = inline_candidate(&ecl->code[i], limit);
+    }
+    for(uint32_t i = 0; i < count; i++) {
+        if(ecl->code[i].flags & CODE_VERIFIED) {
+            inline_sub(&ecl->code[i], candidates, ecl->code, stats);
+        }
+    }
+    xfree(candidates);
+}
+
+/**
+ * Print the call graph of a file as it will run: one line per pair of subs,
+ * with how many times the first calls, spawns (with callAsync or as an
+ * enemy) and inlined the second. Calls to subs which don't exist are left out.
+ **/
+void
+ecl_code_print_callgraph(th10_ecl_t* ecl, FILE* f)
+{
+    uint32_t count = ecl->header->sub_count;
+    uint32_t* edges = xmalloc(sizeof(uint32_t) * EDGE_KINDS * (count ? count : 1));
+    
+    for(uint32_t i = 0; i < count; i++) {
+        ecl_code_t* code = &ecl->code[i];
+        memset(edges, 0, sizeof(uint32_t) * EDGE_KINDS * count);
+        
+        for(ecl_op_t* op = code->ops; op != code->ops + code->count; op++) {
+            if(op->callee == NULL || op->site) {
+                continue; // the copy of a callee's spawns is counted in the callee
+            }
+            uint32_t callee = op->callee - ecl->code;
+            switch(op->id) {
+                case INS_CALL:
+                    edges[callee * EDGE_KINDS + EDGE_CALL]++;
+                    break;
+                case INS_CALLASYNC:
+                    edges[callee * EDGE_KINDS + EDGE_CALLASYNC]++;
+                    break;
+                case INS_ENMCREATE:
+                case INS_ENMCREATEA:
+                    edges[callee * EDGE_KINDS + EDGE_ENEMY]++;
+                    break;
+                case INS_ENTER:
+                    edges[callee * EDGE_KINDS + EDGE_INLINED]++;
+                    break;
+                default:
+                    break;
+            }
+        }
+        
+        for(uint32_t j = 0; j < count; j++) {
+            const char* sep = ":";
+            for(unsigned int k = 0; k < EDGE_KINDS; k++) {
+                if(edges[j * EDGE_KINDS + k] == 0) {
+                    continue;
+                }
+                if(*sep == ':') {
+                    fprintf(f, "%s -> %s", code->sub->name, ecl->code[j].sub->name);
+                }
+                fprintf(f, "%s %s %u", sep, edge_names[k], edges[j * EDGE_KINDS + k]);
+                sep = ",";
+            }
+            if(*sep == ',') {
+                fputc('\n', f);
+            }
+        }
+    }
+    xfree(edges);
+}
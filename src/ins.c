@@ -1,227 +1,295 @@
-/**
- * Functions for dealing with ECL instructions
- *
- * Redistribution and use in source and binary forms, with
- * or without modification, are permitted provided that the
- * following conditions are met:
- *
- * 1. Redistributions of source code must retain this list
- *    of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce this
- *    list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the
- *    distribution.
- *
- * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
- * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
- * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
- * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
- * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
- * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
- * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
- * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
- * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
- * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
- * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
- * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
- * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
- * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
- * DAMAGE.
- **/
-#include "ecli.h"
-
-#include <stdio.h>
-#include <stdint.h>
-
-static uint8_t last_mask = 0x0F;
-
-// Instruction parameter format strings
-typedef struct {
-    uint16_t id;
-    const char* format;
-    const char* opcode;
-} ins_format_t;
-
-static const ins_format_t instruction_formats[] = {
-    //system instructions
-    {INS_NOP, "", "nop"},
-    {INS_DELETE, "", "delete"},
-    {INS_RET, "", "return"},
-    {INS_CALL, "s", "call"},
-    {INS_JMP, "iu", "jmp"},
-    {INS_JMPEQ, "iu", "jmpEq"},
-    {INS_JMPNEQ, "iu", "jmpNeq"},
-    {INS_CALLASYNC, "s", "callAsync"},
-    {INS_UNKNOWN21, "", "unknown21"},
-    {INS_DEBUG22, "is", "debug22"},
-    {INS_WAIT, "i", "wait"},
-    {INS_UNKNOWN30, "s", "unknown30"},
-    {INS_STACKALLOC, "u", "stackAlloc"},
-    {INS_PUSH, "i", "push"},
-    {INS_PUSHF, "f", "pushf"},
-    {INS_SET, "i", "set"},
-    {INS_SETF, "f", "setf"},
-    {INS_ADDI, "", "addi"},
-    {INS_ADDF, "", "addf"},
-    {INS_SUBF, "", "subf"},
-    {INS_MULI, "", "muli"},
-    {INS_MODI, "", "modi"},
-    {INS_EQI, "", "eqi"},
-    {INS_LEQI, "", "leqi"},
-    {INS_LESSI, "", "lessi"},
-    {INS_GEQI, "", "geqi"},
-    {INS_DECI, "i", "deci"},
-    // Enemy property management and other miscellaneous things
-    {INS_FLAGSET, "i", "flagSet"},
-    {INS_SETCHAPTER, "i", "setChapter"},
-    
-    // Custom instructions for debugging
-    {INS_PUTS, "s", "puts"},
-    {INS_PUTI, "i", "puti"},
-    {INS_PUTF, "f", "putf"},
-    {INS_ENDL, "", "endl"}
-};
-
-typedef struct {
-    int32_t id;
-    const char* name;
-} variable_format_t;
-
-static const variable_format_t variable_formats[] = {
-    {-10000, "RAND"},
-    {-9999, "RANDF"},
-    {-9998, "RANDRAD"},
-    {-9997, "FINAL_X"},
-    {-9996, "FINAL_Y"},
-    {-9995, "ABS_X"},
-    {-9994, "ABS_Y"},
-    {-9993, "REL_X"},
-    {-9992, "REL_Y"},
-    {-9991, "PLAYER_X"},
-    {-9990, "PLAYER_Y"},
-    {-9989, "ANGLE_PLAYER"},
-    {-9988, "TIME"},
-    {-9987, "RANDF2"},
-    {-9986, "TIMEOUT"},
-    {-9985, "I0"},
-    {-9984, "I1"},
-    {-9983, "I2"},
-    {-9982, "I3"},
-    {-9981, "F0"},
-    {-9980, "F1"},
-    {-9979, "F2"},
-    {-9978, "F3"},
-    {-9959, "DIFF"},
-    {-9953, "EASY"},
-    {-9952, "NORMAL"},
-    {-9951, "HARD"},
-    {-9950, "LUNATIC"},
-    {-9907, "SPELL_ID"},
-    
-    // Non-standard variables (for debugging)
-    
-};
-
-ecli_result_t
-get_ins_params(th10_instr_t* ins, ecl_value_t* values, unsigned int* num)
-{
-    for(unsigned int i = 0; i < sizeof(instruction_formats) / sizeof(ins_format_t); i++) {
-        if(instruction_formats[i].id == ins->id) {
-            if(num) {
-                *num = strlen(instruction_formats[i].format);
-            }
-            return value_get_parameters(values, instruction_formats[i].format, &ins->data[0]);
-        }
-    }
-    return ECLI_FAILURE;
-}
-
-void
-print_th10_instruction_raw(th10_instr_t* ins)
-{
-    printf("time: %d, id: %d, size: %d, ", ins->time, ins->id, ins->size);
-    printf("param_mask: %d, rank_mask: %x, param_count: %d\n",
-           ins->param_mask, ins->rank_mask, ins->param_count);
-}
-
-static void
-print_param(ecl_value_t* params, unsigned int i, uint16_t mask)
-{
-    if(mask & (1 << i)) {
-        if(params[i].type == ECL_FLOAT32) {
-            putchar('%');
-        } else if(params[i].type == ECL_INT32) {
-            putchar('$');
-        }
-        
-        if(params[i].i >= 0) { // stack
-            printf("%c", 'A' + (params[i].i >> 2));
-        } else { // local/global
-            int32_t id = (params[i].type == ECL_FLOAT32) ? (int32_t)params[i].f : params[i].i;
-            for(unsigned int i = 0; i < sizeof(variable_formats) / sizeof(variable_format_t); i++) {
-                if(id == variable_formats[i].id) {
-                    printf("%s", variable_formats[i].name);
-                    return;
-                }
-            }
-            printf("%d", id);
-        }
-    } else {
-        value_print(&params[i]);
-    }
-}
-
-void
-print_th10_instruction(th10_instr_t* ins)
-{
-    uint8_t rank_mask = ins->rank_mask & 0x0F;
-    static ecl_value_t params[32];
-
-    // Display difficulty options
-    if(rank_mask != last_mask) {
-        putchar('!');
-        if(rank_mask == 0x0F) {
-            putchar('*');
-        } else {
-            if(rank_mask & 0x08) putchar('L');
-            if(rank_mask & 0x04) putchar('H');
-            if(rank_mask & 0x02) putchar('N');
-            if(rank_mask & 0x01) putchar('E');
-        }
-        putchar('\n');
-        last_mask = rank_mask;
-    }
-
-    // Time label
-    int amt = 6;
-    if(ins->time != 0) {
-        amt -= printf("%d:", ins->time);
-    }
-    for(unsigned int i = 0; i < amt; i++) {
-        putchar(' ');
-    }
-    
-    for(unsigned int i = 0; i < sizeof(instruction_formats) / sizeof(ins_format_t); i++) {
-        if(instruction_formats[i].id == ins->id) {
-            printf("%s", instruction_formats[i].opcode);
-            
-            size_t num = strlen(instruction_formats[i].format);
-            ecli_result_t result = value_get_parameters(params, instruction_formats[i].format, &ins->data[0]);
-            // display parameter list
-            if(SUCCESS(result) && (num > 0)) {
-                putchar('(');
-                print_param(params, 0, ins->param_mask);
-                for(unsigned int j = 1; j < num; j++) {
-                    printf(", ");
-                    print_param(params, j, ins->param_mask);
-                }
-                putchar(')');
-            }
-            
-            printf(";\n");
-            return;
-        }
-    }
-    
-    printf("ins_%d;\n", ins->id);
-}
+/**
+ * Functions for dealing with ECL instructions
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Sorted by id for ins_get_format(). The last two columns are the number of
+// values the instruction pops off the stack and pushes onto it.
+static const ins_format_t instruction_formats[] = {
+    //system instructions
+    {INS_NOP, "", "nop", 0, 0},
+    {INS_DELETE, "", "delete", 0, 0},
+    {INS_RET, "", "return", 0, 0},
+    {INS_CALL, "sD", "call", 0, 0},
+    {INS_JMP, "iu", "jmp", 0, 0},
+    {INS_JMPEQ, "iu", "jmpEq", 1, 0},
+    {INS_JMPNEQ, "iu", "jmpNeq", 1, 0},
+    {INS_CALLASYNC, "sD", "callAsync", 0, 0},
+    {INS_UNKNOWN21, "", "unknown21", 0, 0},
+    {INS_DEBUG22, "is", "debug22", 0, 0},
+    {INS_WAIT, "i", "wait", 0, 0},
+    {INS_UNKNOWN30, "s", "unknown30", 0, 0},
+    {INS_STACKALLOC, "u", "stackAlloc", 0, 0},
+    {INS_PUSH, "i", "push", 0, 1},
+    {INS_SET, "i", "set", 1, 0},
+    {INS_PUSHF, "f", "pushf", 0, 1},
+    {INS_SETF, "f", "setf", 1, 0},
+    {INS_ADDI, "", "addi", 2, 1},
+    {INS_ADDF, "", "addf", 2, 1},
+    {INS_SUBF, "", "subf", 2, 1},
+    {INS_MULI, "", "muli", 2, 1},
+    {INS_MULF, "", "mulf", 2, 1},
+    {INS_DIVF, "", "divf", 2, 1},
+    {INS_MODI, "", "modi", 2, 1},
+    {INS_EQI, "", "eqi", 2, 1},
+    {INS_LESSI, "", "lessi", 2, 1},
+    {INS_LEQI, "", "leqi", 2, 1},
+    {INS_GEQI, "", "geqi", 2, 1},
+    {INS_DECI, "i", "deci", 0, 1},
+    // Float math: the variables written to come first
+    {INS_SIN, "", "sin", 1, 1},
+    {INS_COS, "", "cos", 1, 1},
+    {INS_CIRCLEPOS, "ffff", "circlePos", 0, 0},
+    {INS_VALIDRAD, "f", "validRad", 0, 0},
+    {INS_NEGI, "", "negi", 1, 1},
+    {INS_NEGF, "", "negf", 1, 1},
+    {INS_GETANG, "fffff", "getAng", 0, 0},
+    {INS_SQRT, "ff", "sqrt", 0, 0},
+    // Enemy creation: sub, position, hp, score, item
+    {INS_ENMCREATE, "sffiii", "enmCreate", 0, 0},
+    {INS_ENMCREATEA, "sffiii", "enmCreateA", 0, 0},
+    // Enemy movement: the *Time ones take a duration and an interpolation mode
+    {INS_MOVEPOS, "ff", "movePos", 0, 0},
+    {INS_MOVEPOSTIME, "iiff", "movePosTime", 0, 0},
+    {INS_MOVEPOSREL, "ff", "movePosRel", 0, 0},
+    {INS_MOVEPOSRELTIME, "iiff", "movePosRelTime", 0, 0},
+    {INS_MOVEVEL, "ff", "moveVel", 0, 0},
+    {INS_MOVEVELTIME, "iiff", "moveVelTime", 0, 0},
+    // Enemy property management and other miscellaneous things
+    {INS_FLAGSET, "i", "flagSet", 0, 0},
+    {INS_SETCHAPTER, "i", "setChapter", 0, 0},
+    // Bullet emitters
+    {INS_ETNEW, "i", "etNew", 0, 0},
+    {INS_ETON, "i", "etOn", 0, 0},
+    {INS_ETSPRITE, "iii", "etSprite", 0, 0},
+    {INS_ETOFFSET, "iff", "etOffset", 0, 0},
+    {INS_ETANGLE, "iff", "etAngle", 0, 0},
+    {INS_ETSPEED, "iff", "etSpeed", 0, 0},
+    {INS_ETCOUNT, "iii", "etCount", 0, 0},
+    {INS_ETAIM, "ii", "etAim", 0, 0},
+    {INS_ETSOUND, "iii", "etSound", 0, 0},
+    
+    // Custom instructions for debugging
+    {INS_PUTS, "s", "puts", 0, 0},
+    {INS_PUTI, "i", "puti", 0, 0},
+    {INS_PUTF, "f", "putf", 0, 0},
+    {INS_ENDL, "", "endl", 0, 0},
+    
+    // Internal instructions: the variable set, then the value
+    {INS_JMPTIME, "iu", "jmpTime", 0, 0},
+    {INS_MOVE, "ii", "move", 0, 0},
+    {INS_MOVEF, "if", "movef", 0, 0},
+    {INS_ENTER, "uD", "enter", 0, 0}, // the callee's locals, then the arguments
+    {INS_LEAVE, "u", "leave", 0, 0}, // the stack pointer, from the base pointer
+    {INS_BLOCK, "", "block", 0, 0}, // the stack effect is in the block
+    {INS_SPLIT, "", "split", 0, 0} // runs the op it stands for after splitting
+};
+
+typedef struct {
+    int32_t id;
+    const char* name;
+} variable_format_t;
+
+static const variable_format_t variable_formats[] = {
+    {-10000, "RAND"},
+    {-9999, "RANDF"},
+    {-9998, "RANDRAD"},
+    {-9997, "FINAL_X"},
+    {-9996, "FINAL_Y"},
+    {-9995, "ABS_X"},
+    {-9994, "ABS_Y"},
+    {-9993, "REL_X"},
+    {-9992, "REL_Y"},
+    {-9991, "PLAYER_X"},
+    {-9990, "PLAYER_Y"},
+    {-9989, "ANGLE_PLAYER"},
+    {-9988, "TIME"},
+    {-9987, "RANDF2"},
+    {-9986, "TIMEOUT"},
+    {-9985, "I0"},
+    {-9984, "I1"},
+    {-9983, "I2"},
+    {-9982, "I3"},
+    {-9981, "F0"},
+    {-9980, "F1"},
+    {-9979, "F2"},
+    {-9978, "F3"},
+    {-9959, "DIFF"},
+    {-9953, "EASY"},
+    {-9952, "NORMAL"},
+    {-9951, "HARD"},
+    {-9950, "LUNATIC"},
+    {-9907, "SPELL_ID"},
+    
+    // Non-standard variables (for debugging)
+    
+};
+
+static int
+compare_format_id(const void* key, const void* entry)
+{
+    return (int)*(const uint16_t*)key - (int)((const ins_format_t*)entry)->id;
+}
+
+/**
+ * Look up the parameter format and name of an instruction
+ **/
+const ins_format_t*
+ins_get_format(uint16_t id)
+{
+    return bsearch(&id, instruction_formats, sizeof(instruction_formats) / sizeof(ins_format_t),
+                   sizeof(ins_format_t), compare_format_id);
+}
+
+/**
+ * Number of instructions known to the interpreter
+ **/
+unsigned int
+ins_get_format_count(void)
+{
+    return sizeof(instruction_formats) / sizeof(ins_format_t);
+}
+
+/**
+ * Get the position of an instruction in the format table, for tables indexed
+ * by instruction. Unknown instructions all map to ins_get_format_count().
+ **/
+unsigned int
+ins_get_index(uint16_t id)
+{
+    const ins_format_t* format = ins_get_format(id);
+    return format ? (unsigned int)(format - instruction_formats) : ins_get_format_count();
+}
+
+/**
+ * Get an instruction format by its position in the format table, or NULL
+ * if the index is out of range
+ **/
+const ins_format_t*
+ins_get_format_at(unsigned int index)
+{
+    return (index < ins_get_format_count()) ? &instruction_formats[index] : NULL;
+}
+
+/**
+ * Look up the name of a global/local variable, or NULL if it has none
+ **/
+const char*
+ins_get_variable_name(int32_t id)
+{
+    for(unsigned int i = 0; i < sizeof(variable_formats) / sizeof(variable_format_t); i++) {
+        if(id == variable_formats[i].id) {
+            return variable_formats[i].name;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Whether parameter i of an instruction is a variable it stores a result in
+ **/
+int
+ins_writes_param(uint16_t id, unsigned int i)
+{
+    switch(id) {
+        case INS_SET:
+        case INS_SETF:
+        case INS_DECI:
+        case INS_MOVE:
+        case INS_MOVEF:
+        case INS_VALIDRAD:
+        case INS_GETANG:
+        case INS_SQRT:
+            return i == 0;
+        case INS_CIRCLEPOS:
+            return i < 2;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Number of parameters of an instruction with the given format. Fixed formats
+ * always have as many as they have characters; a final 'D' counts the
+ * arguments which fit in the rest of the instruction.
+ **/
+unsigned int
+ins_get_param_count(th10_instr_t* ins, const ins_format_t* format)
+{
+    size_t len = strlen(format->format);
+    if(len == 0 || format->format[len - 1] != 'D') {
+        return len;
+    }
+    
+    uint8_t* data = &ins->data[0];
+    uint8_t* end = (uint8_t*)ins + ins->size;
+    for(size_t i = 0; i < len - 1 && data + 4 <= end; i++) {
+        data += (format->format[i] == 's') ? 4 + *(uint32_t*)data : 4;
+    }
+    return (data <= end) ? (len - 1) + (end - data) / 8 : len - 1;
+}
+
+ecli_result_t
+get_ins_params(th10_instr_t* ins, ecl_value_t* values, unsigned int* num)
+{
+    const ins_format_t* format = ins_get_format(ins->id);
+    if(format == NULL) {
+        return ECLI_FAILURE;
+    }
+    unsigned int count = ins_get_param_count(ins, format);
+    if(num) {
+        *num = count;
+    }
+    return value_get_parameters(values, format->format, &ins->data[0], count);
+}
+
+void
+print_th10_instruction_raw(th10_instr_t* ins)
+{
+    printf("time: %d, id: %d, size: %d, ", ins->time, ins->id, ins->size);
+    printf("param_mask: %d, rank_mask: %x, param_count: %d\n",
+           ins->param_mask, ins->rank_mask, ins->param_count);
+}
+
+/**
+ * Print a single instruction with its time label and rank mask to STDOUT
+ **/
+void
+print_th10_instruction(th10_instr_t* ins)
+{
+    strbuf_t buf;
+    strbuf_init(&buf);
+    disasm_format_instruction(&buf, ins, NULL);
+    fwrite(buf.data, 1, buf.len, stdout);
+    strbuf_free(&buf);
+}
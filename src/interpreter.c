@@ -1,329 +1,343 @@
-/**
- * Functions for running ECL instructions
- *
- * Redistribution and use in source and binary forms, with
- * or without modification, are permitted provided that the
- * following conditions are met:
- *
- * 1. Redistributions of source code must retain this list
- *    of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce this
- *    list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the
- *    distribution.
- *
- * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
- * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
- * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
- * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
- * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
- * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
- * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
- * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
- * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
- * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
- * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
- * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
- * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
- * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
- * DAMAGE.
- **/
-#include "ecli.h"
-#include "ecl.h"
-#include "state.h"
-
-/**
- * Run a linked-list of ECL VMs
- **/
-ecli_result_t
-run_all_ecl_instances(ecl_state_t* state)
-{
-    ecli_result_t retval = ECLI_SUCCESS;
-    ecl_state_t* cur = state;
-    ecl_state_t* prev = state;
-
-    do {
-        retval = run_interpreter_until_wait(cur);
-        
-        switch(retval) {
-            case ECLI_DONE: // interpreter done, remove it from the list
-                if((cur == state) && (cur->next == NULL)) { 
-                    return ECLI_DONE; // no interpreters remaining
-                }
-                prev->next = cur->next;
-                cur->next = NULL;
-                free_ecl_state(cur);
-                cur = prev;
-                retval = ECLI_SUCCESS;
-                break;
-            
-            case ECLI_FAILURE:
-                return ECLI_FAILURE;
-            
-            default:
-                break;
-        }
-        
-        prev = cur;
-        cur = cur->next;
-    } while(prev->next != NULL);
-    
-    return retval;
-}
-
-/**
- * Run an interpreter until it reaches a wait instruction
- **/
-ecli_result_t
-run_interpreter_until_wait(ecl_state_t* state)
-{
-    ecli_result_t retval = ECLI_SUCCESS;
-    
-    while((state->wait == 0) && (state->time >= state->ip->time)) {
-        if(global.verbose) {
-            print_th10_instruction(state->ip);
-        }
-        if(!SUCCESS(retval = run_th10_instruction(state))) {
-            return retval; // either failure or the interpreter returned from its "main"
-        }
-    }
-    return retval;
-}
-
-/**
- * Run a single ECL instruction
- **/
-ecli_result_t
-run_th10_instruction(ecl_state_t* state)
-{
-    static ecl_value_t params[32];
-    static ecl_value_t values[32];
-    ecl_value_t* value;
-    unsigned int nparam;
-    
-    ecli_result_t retval = ECLI_SUCCESS;
-    
-    th10_instr_t* ins = state->ip;
-    th10_instr_t* next = (th10_instr_t*)(((uint8_t*)ins) + ins->size);
-
-    if(!(global.difficulty & ins->rank_mask)) {
-        state->ip = next;
-        return ECLI_SUCCESS;
-    }
-    
-    retval = get_ins_params(ins, params, &nparam);
-
-    if(!SUCCESS(retval)) {
-        return retval;
-    }
-    
-    // Replace variable references with the corresponding values
-    for(unsigned int i = 0; i < nparam; i++) {
-        if(ins->param_mask & (1 << i)) {
-            int32_t slot = (params[i].type == ECL_FLOAT32) ? (int32_t)params[i].f : params[i].i;
-            retval = state_get_variable(state, slot, &values[i]);
-            if(!SUCCESS(retval)) {
-                return retval;
-            }
-        } else {
-            values[i] = params[i];
-        }
-    }
-
-    // Execute the instruction
-    switch(ins->id) {
-        case INS_NOP:
-        case INS_UNKNOWN21:
-        case INS_DEBUG22:
-            break;
-
-        case INS_RET: // return
-            state->sp = state->bp;
-            state->bp = state_pop(state)->u;
-            if(state->csp == 0) {
-                retval = ECLI_DONE;
-            } else {
-                next = state->callstack[--state->csp];
-            }
-            break;
-
-        case INS_CALL: { // call
-            state->callstack[state->csp++] = next;
-            th10_ecl_sub_t* sub = get_th10_ecl_sub_by_name(state->ecl, params[0].s);
-            if(sub == NULL) {
-                fprintf(stderr, "call: sub \"%s\" does not exist\n", params[0].s);
-                retval = ECLI_FAILURE;
-                break;
-            }
-            next = sub->start;
-        }   break;
-        
-        case INS_CALLASYNC: { // callAsync
-            ecl_state_t* child;
-            retval = allocate_ecl_state(&child, state->ecl); // new VM
-            if(SUCCESS(retval)) {
-                th10_ecl_sub_t* sub = get_th10_ecl_sub_by_name(state->ecl, params[0].s);
-                if(sub == NULL) {
-                    fprintf(stderr, "callAsync: sub \"%s\" does not exist\n", params[0].s);
-                    retval = ECLI_FAILURE;
-                    free_ecl_state(child);
-                    break;
-                }
-                // add new VM to linked list and set its IP to start on the sub
-                ecl_state_t* p = state;
-                while(p->next != NULL) { p = p->next; }
-                p->next = child;
-                child->ip = sub->start;
-            }
-        }   break;
-        
-        case INS_JMP: { // jmp (unconditional goto)
-            uint32_t at_time = params[1].u;
-            
-            next = (th10_instr_t*)(((uint8_t*)ins) + params[0].i);
-        }   break;
-        
-        case INS_JMPEQ: { // jmpEq
-            value = state_pop(state);
-            if(value->i == 0) {
-                state->time = params[1].u;
-                next = (th10_instr_t*)(((uint8_t*)ins) + params[0].i);
-            }
-        }   break;
-        
-        case INS_JMPNEQ:
-            value = state_pop(state);
-            if(value->i != 0) {
-                state->time = params[1].u;
-                next = (th10_instr_t*)(((uint8_t*)ins) + params[0].i);
-            }
-            break;
-        
-        case INS_WAIT: { // wait 
-            int32_t amt = values[0].i;
-            state->wait = amt;
-        }   break;
-
-        case INS_STACKALLOC: { // stackAlloc
-            retval = state_setup_frame(state, params[0].u >> 2);
-        }   break;
-
-        case INS_PUSH: 
-        case INS_PUSHF: { // push
-            retval = state_push(state, &values[0]);
-        }   break;
-
-        case INS_SET: { // set
-            value = state_pop(state);
-            retval = state_set_variable(state, params[0].i, value);
-        }   break;
-        
-        case INS_SETF: {
-            value = state_pop(state);
-            retval = state_set_variable(state, params[0].i, value);
-        }   break;
-        
-        case INS_ADDI: {
-            value = state_pop(state);
-            ecl_value_t* top = state_peek(state);
-            top->i += value->i;
-            top->type = ECL_INT32;
-        }   break;
-
-        case INS_ADDF: {
-            value = state_pop(state);
-            ecl_value_t* top = state_peek(state);
-            top->f += value->f;
-            top->type = ECL_FLOAT32;
-        }   break;
-        
-        case INS_SUBF: {
-            value = state_pop(state);
-            ecl_value_t* top = state_peek(state);
-            top->f -= value->f;
-            top->type = ECL_FLOAT32;
-        }   break;
-        
-        case INS_MULI: {
-            value = state_pop(state);
-            ecl_value_t* top = state_peek(state);
-            top->i *= value->i;
-            top->type = ECL_INT32;
-        }   break;
-        
-        case INS_MODI: {
-            value = state_pop(state); // modulo
-            ecl_value_t* top = state_peek(state);
-            top->i = top->i % value->i;
-            top->type = ECL_INT32;
-        }   break;
-        
-        case INS_EQI: {
-            value = state_pop(state);
-            ecl_value_t* top = state_peek(state);
-            top->type = ECL_INT32;
-            top->i = (top->i == value->i) ? 1 : 0;
-        }   break;
-        
-        case INS_LESSI: {
-            value = state_pop(state);
-            ecl_value_t* top = state_peek(state);
-            top->type = ECL_INT32;
-            top->i = (top->i < value->i) ? 1 : 0;
-        }   break;
-        
-        case INS_LEQI: {
-            value = state_pop(state);
-            ecl_value_t* top = state_peek(state);
-            top->type = ECL_INT32;
-            top->i = (top->i <= value->i) ? 1 : 0;
-        }   break;
-        
-        case INS_GEQI: {
-            value = state_pop(state);
-            ecl_value_t* top = state_peek(state);
-            top->type = ECL_INT32;
-            top->i = (top->i >= value->i) ? 1 : 0;
-        }   break;
-        
-        case INS_DECI: { // deci
-            values[0].type = ECL_INT32;
-            retval = state_push(state, &values[0]);
-            values[0].i = values[0].i - 1;
-            retval = state_set_variable(state, params[0].i, &values[0]);
-        }   break;
-        
-        case INS_FLAGSET: { // flagSet
-            state->flags = values[0].i;
-            break;
-        }
-        
-        case INS_SETCHAPTER: { // setChapter
-            global.chapter = values[0].i;
-        }   break;
-        
-        case INS_PUTS: { // custom - print a string
-            printf("%s", values[0].s);
-        }   break;
-        
-        case INS_PUTI: {
-            printf("%d", values[0].i);
-        }   break;
-        
-        case INS_PUTF: {
-            printf("%f", values[0].f);
-        }   break;
-        
-        case INS_ENDL: {
-            putchar('\n');
-        }   break;
-
-        default:
-            fprintf(stderr, "Unknown instruction id: %d\n", ins->id);
-            retval = ECLI_FAILURE;
-            break;
-    }
-    
-    state->ip = next;
-    return retval;
-}
+/**
+ * Functions for running ECL instructions
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+#include "ecl.h"
+#include "state.h"
+
+#define LOOP_NAME run_until_wait_plain
+#define LOOP_TRACE 0
+#define LOOP_PROFILE 0
+#define LOOP_SAMPLE 0
+#define LOOP_COVERAGE 0
+#define LOOP_CHECKED 0
+#include "interpreter_loop.h"
+
+#define LOOP_NAME run_until_wait_plain_checked
+#define LOOP_TRACE 0
+#define LOOP_PROFILE 0
+#define LOOP_SAMPLE 0
+#define LOOP_COVERAGE 0
+#define LOOP_CHECKED 1
+#include "interpreter_loop.h"
+
+#define LOOP_NAME run_until_wait_trace
+#define LOOP_TRACE 1
+#define LOOP_PROFILE 0
+#define LOOP_SAMPLE 0
+#define LOOP_COVERAGE 0
+#define LOOP_CHECKED 0
+#include "interpreter_loop.h"
+
+#define LOOP_NAME run_until_wait_trace_checked
+#define LOOP_TRACE 1
+#define LOOP_PROFILE 0
+#define LOOP_SAMPLE 0
+#define LOOP_COVERAGE 0
+#define LOOP_CHECKED 1
+#include "interpreter_loop.h"
+
+#define LOOP_NAME run_until_wait_profile
+#define LOOP_TRACE 0
+#define LOOP_PROFILE 1
+#define LOOP_SAMPLE 0
+#define LOOP_COVERAGE 0
+#define LOOP_CHECKED 0
+#include "interpreter_loop.h"
+
+#define LOOP_NAME run_until_wait_profile_checked
+#define LOOP_TRACE 0
+#define LOOP_PROFILE 1
+#define LOOP_SAMPLE 0
+#define LOOP_COVERAGE 0
+#define LOOP_CHECKED 1
+#include "interpreter_loop.h"
+
+#define LOOP_NAME run_until_wait_sample
+#define LOOP_TRACE 0
+#define LOOP_PROFILE 0
+#define LOOP_SAMPLE 1
+#define LOOP_COVERAGE 0
+#define LOOP_CHECKED 0
+#include "interpreter_loop.h"
+
+#define LOOP_NAME run_until_wait_sample_checked
+#define LOOP_TRACE 0
+#define LOOP_PROFILE 0
+#define LOOP_SAMPLE 1
+#define LOOP_COVERAGE 0
+#define LOOP_CHECKED 1
+#include "interpreter_loop.h"
+
+#define LOOP_NAME run_until_wait_coverage
+#define LOOP_TRACE 0
+#define LOOP_PROFILE 0
+#define LOOP_SAMPLE 0
+#define LOOP_COVERAGE 1
+#define LOOP_CHECKED 0
+#include "interpreter_loop.h"
+
+#define LOOP_NAME run_until_wait_coverage_checked
+#define LOOP_TRACE 0
+#define LOOP_PROFILE 0
+#define LOOP_SAMPLE 0
+#define LOOP_COVERAGE 1
+#define LOOP_CHECKED 1
+#include "interpreter_loop.h"
+
+/**
+ * Get the interpreter loop for a mode, with or without stack checks
+ **/
+ecli_loop_t
+get_interpreter_loop(ecli_mode_t mode, int checked)
+{
+    switch(mode) {
+        case ECLI_MODE_TRACE:
+            return checked ? run_until_wait_trace_checked : run_until_wait_trace;
+        case ECLI_MODE_PROFILE:
+            return checked ? run_until_wait_profile_checked : run_until_wait_profile;
+        case ECLI_MODE_SAMPLE:
+            return checked ? run_until_wait_sample_checked : run_until_wait_sample;
+        case ECLI_MODE_COVERAGE:
+            return checked ? run_until_wait_coverage_checked : run_until_wait_coverage;
+        default:
+            return checked ? run_until_wait_plain_checked : run_until_wait_plain;
+    }
+}
+
+/**
+ * Report a VM that ran past the loop budget without waiting, with the sub
+ * and offset it was stopped at
+ **/
+static void
+report_stuck_vm(ecl_state_t* state)
+{
+    th10_ecl_t* ecl = state->rt->ecl;
+    th10_instr_t* src = state->ip->src;
+    
+    fprintf(stderr, "VM %u ran %u instructions without waiting, stopped ", state->id,
+            state->history_pos - state->run_start);
+    for(uint32_t i = 0; src && i < ecl->header->sub_count; i++) {
+        if(src >= ecl->subs[i].start && src < ecl->subs[i].end) {
+            fprintf(stderr, "in %s at offset %u\n", ecl->subs[i].name,
+                    (uint32_t)((uint8_t*)src - (uint8_t*)ecl->subs[i].start));
+            return;
+        }
+    }
+    fprintf(stderr, "at the end of a sub\n");
+}
+
+/**
+ * Give a VM a turn: run it until it waits, or until its slice or what is left
+ * of the frame's budget runs out. ECLI_PREEMPTED leaves it to run again.
+ **/
+static ecli_result_t
+run_turn(ecli_runtime_t* rt, ecl_state_t* cur, uint64_t* left)
+{
+    uint32_t slice = rt->budget.slice ? rt->budget.slice : BUDGET_SLICE_MAX;
+    if(rt->budget.loop && rt->budget.loop < slice) {
+        slice = rt->budget.loop; // so a stuck VM is caught in time
+    }
+    if(*left < slice) {
+        slice = (uint32_t)*left;
+    }
+    
+    // VMs of an enemy which was deleted end without running
+    if(!rt->enemies.enemies[enemy_index(cur->enemy)].alive) {
+        return ECLI_DONE;
+    }
+    // Ops run in a lockstep batch count towards the turn, and were taken
+    // off the frame's budget already
+    uint32_t start = cur->history_pos - cur->batched;
+    if(!cur->preempted) {
+        cur->run_start = start;
+    }
+    cur->budget_end = start + slice;
+    cur->turn_frame = rt->frame + 1;
+    ecli_result_t retval = rt->loop[cur->checked](cur);
+    
+    if(rt->budget.frame) {
+        uint32_t ran = cur->history_pos - start - cur->batched;
+        *left = (ran < *left) ? *left - ran : 0;
+    }
+    cur->batched = 0;
+    cur->preempted = (retval == ECLI_PREEMPTED);
+    return retval;
+}
+
+/**
+ * Act on how a VM's turn ended: free it if it finished, queue it for another
+ * slice if a budget stopped it, report it if it failed or is stuck
+ **/
+static ecli_result_t
+end_turn(ecli_runtime_t* rt, ecl_state_t* cur, ecli_result_t retval, uint32_t* queued)
+{
+    int stuck = (retval == ECLI_PREEMPTED) && rt->budget.loop &&
+                (cur->history_pos - cur->run_start >= rt->budget.loop);
+    
+    if(retval == ECLI_DONE) { // interpreter done, free it
+        free_ecl_state(cur);
+    } else if(retval == ECLI_FAILURE || stuck) {
+        output_flush(&rt->output); // so the report comes after the output
+        if(stuck) {
+            report_stuck_vm(cur);
+        }
+        dump_ecl_state_history(cur, stderr);
+        return ECLI_FAILURE;
+    } else if(retval == ECLI_PREEMPTED && !rt->budget.defer) {
+        if(*queued == rt->requeue_cap) {
+            rt->requeue_cap = rt->requeue_cap ? rt->requeue_cap * 2 : 64;
+            rt->requeue = xrealloc(rt->requeue, sizeof(ecl_state_t*) * rt->requeue_cap);
+        }
+        rt->requeue[(*queued)++] = cur;
+    }
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Run every VM of a runtime for one frame, removing the ones that finish.
+ *
+ * Without budgets every VM runs once, in table order, until it waits. With
+ * them, a VM whose slice runs out goes to the back of the queue and runs
+ * again once the others had their turn, or with budget.defer, in the next
+ * frame. Once the VMs have run the frame's budget, the rest stop where they
+ * are. Stopped VMs are preempted: their clocks don't advance at the end of
+ * the frame, and they go first in the next one so the end of the table
+ * doesn't starve.
+ **/
+ecli_result_t
+run_all_ecl_instances(ecli_runtime_t* rt)
+{
+    ecl_vm_table_t* vms = &rt->vms;
+    int lockstep = rt->lockstep && (rt->mode == ECLI_MODE_PLAIN || rt->mode == ECLI_MODE_SAMPLE);
+    ecli_result_t result = ECLI_SUCCESS;
+    uint64_t left = rt->budget.frame ? rt->budget.frame : UINT64_MAX;
+    uint32_t queued = 0;
+    uint32_t i = 0;
+    
+    // The ones stopped last frame go first; a VM gets one turn a frame
+    for(uint32_t k = 0; rt->preempted && k < vms->count && left > 0 && SUCCESS(result); k++) {
+        ecl_state_t* cur = vm_table_at(vms, k);
+        if(!vm_finished(cur) && cur->preempted) {
+            result = end_turn(rt, cur, run_turn(rt, cur, &left), &queued);
+        }
+    }
+    
+    while(SUCCESS(result)) {
+        // VMs spawned with callAsync are appended to the end and run this frame
+        for(; i < vms->count && left > 0; i++) {
+            ecl_state_t* cur = vm_table_at(vms, i);
+            
+            // The next VM was fetched last time round, start on what it points
+            // to, and fetch the one after it
+            if(i + 1 < vms->count) {
+                ecl_state_t* next = vm_table_at(vms, i + 1);
+                __builtin_prefetch(next->ip);
+                __builtin_prefetch(next->stack + next->sp);
+                if(i + 2 < vms->count) {
+                    __builtin_prefetch(vm_table_at(vms, i + 2));
+                }
+            }
+            
+            if(vm_finished(cur) || cur->turn_frame == rt->frame + 1) {
+                continue;
+            }
+            if(lockstep && cur->lockstep_frame != rt->frame + 1) {
+                lockstep_run(rt, i, &left);
+            }
+            result = end_turn(rt, cur, run_turn(rt, cur, &left), &queued);
+            if(!SUCCESS(result)) {
+                break;
+            }
+        }
+        if(!SUCCESS(result) || queued == 0 || left == 0) {
+            break;
+        }
+        
+        // One round over the preempted VMs. The ones preempted again queue up
+        // behind it, after which any VMs they spawned get their first turn.
+        uint32_t round = queued;
+        for(uint32_t k = 0; k < round && left > 0 && SUCCESS(result); k++) {
+            ecl_state_t* cur = rt->requeue[k];
+            result = end_turn(rt, cur, run_turn(rt, cur, &left), &queued);
+        }
+        queued -= round;
+        memmove(rt->requeue, rt->requeue + round, sizeof(ecl_state_t*) * queued);
+    }
+    
+    // Out of the frame's budget: the VMs that would still run stop here
+    for(uint32_t k = 0; SUCCESS(result) && left == 0 && k < vms->count; k++) {
+        ecl_state_t* cur = vm_table_at(vms, k);
+        if(!vm_finished(cur) && cur->turn_frame != rt->frame + 1 && cur->wait == 0 && cur->time >= cur->ip->time) {
+            cur->preempted = 1;
+            cur->run_start = cur->history_pos;
+            cur->batched = 0;
+        }
+    }
+    
+    vm_table_compact(vms);
+    if(result == ECLI_SUCCESS && vms->live == 0) {
+        result = ECLI_DONE;
+    }
+    return result;
+}
+
+/**
+ * Run an interpreter until it reaches a wait instruction
+ **/
+ecli_result_t
+run_interpreter_until_wait(ecl_state_t* state)
+{
+    return state->rt->loop[state->checked](state);
+}
+
+/**
+ * Print the last instructions run by a VM, oldest first
+ **/
+void
+dump_ecl_state_history(ecl_state_t* state, FILE* f)
+{
+    uint32_t count = (state->history_pos < ECL_HISTORY_SIZE) ? state->history_pos : ECL_HISTORY_SIZE;
+    strbuf_t buf;
+    
+    strbuf_init(&buf);
+    strbuf_printf(&buf, "Last %u instructions (frame %u, time %u):\n",
+                  count, state->rt->frame, state->time);
+    for(uint32_t i = state->history_pos - count; i != state->history_pos; i++) {
+        ecl_op_t* op = state->history[i & (ECL_HISTORY_SIZE - 1)];
+        if(op->src) {
+            disasm_format_instruction(&buf, op->src, NULL);
+        } else {
+            strbuf_puts(&buf, "      (end of sub)\n");
+        }
+    }
+    fwrite(buf.data, 1, buf.len, f);
+    strbuf_free(&buf);
+}
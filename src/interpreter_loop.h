@@ -0,0 +1,555 @@
+/**
+ * Interpreter loop template, included by interpreter.c once per variant
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+
+/*
+ * Before including, define:
+ *   LOOP_NAME     name of the generated function
+ *   LOOP_TRACE    1 to print every instruction to the output before it runs
+ *   LOOP_PROFILE  1 to count the instructions run, per opcode
+ *   LOOP_SAMPLE   1 to publish the VM and op being run for the sampler
+ *   LOOP_COVERAGE 1 to mark the instructions run in the runtime's coverage
+ *                 map
+ *   LOOP_CHECKED  1 to bounds check the stacks, for VMs whose code the
+ *                 verifier couldn't prove safe
+ *
+ * Every variant records the ops it runs in the VM's history ring buffer.
+ * That is a store, not a branch, so the plain loop stays free of
+ * instrumentation tests.
+ */
+
+#if LOOP_CHECKED
+# define LOOP_CHECK(cond, message) \
+    if(!(cond)) { fprintf(stderr, "%s\n", (message)); retval = ECLI_FAILURE; break; }
+#else
+# define LOOP_CHECK(cond, message)
+#endif
+
+// The instruction budget is checked where control can go back or into a
+// call, which any run that never waits keeps passing through. The VM
+// resumes at next.
+#define LOOP_BUDGET() \
+    if((int32_t)(state->history_pos - state->budget_end) >= 0) { retval = ECLI_PREEMPTED; }
+
+// Whether a variable slot can be accessed: -1 pops the stack, >= 0 are locals
+#define LOOP_SLOT_OK(slot) \
+    (((slot) == -1) ? (state->sp > 0) : (((slot) < 0) || (state->bp + ((slot) >> 2) < state->stack_size)))
+
+static ecli_result_t
+LOOP_NAME(ecl_state_t* state)
+{
+    ecli_runtime_t* rt = state->rt;
+    ecl_value_t values[OP_MAX_PARAMS];
+    ecli_result_t retval = ECLI_SUCCESS;
+    
+#if LOOP_SAMPLE
+    rt->sample_vm = state;
+#endif
+#if LOOP_COVERAGE
+    uint16_t* coverage = rt->coverage->hits + difficulty_index(rt->global.difficulty) * rt->coverage->slots;
+    uintptr_t coverage_base = (uintptr_t)rt->ecl->header;
+#endif
+    while((state->wait == 0) && (state->time >= state->ip->time)) {
+        ecl_op_t* op = state->ip;
+        ecl_op_t* next = op + 1;
+        ecl_value_t* v = op->params;
+        ecl_value_t* value;
+        ecl_value_t* top;
+        
+        state->history[state->history_pos++ & (ECL_HISTORY_SIZE - 1)] = op;
+#if LOOP_TRACE
+        // Into the output buffer, so the trace stays in order with the output
+        if(output_enabled(&rt->output) && op->id == INS_BLOCK) {
+            for(uint32_t i = 0; i < op->block->nsrc; i++) {
+                disasm_format_instruction(&rt->output.buf, op->block->src[i], NULL);
+            }
+        } else if(output_enabled(&rt->output) && op->src && op->id != INS_SPLIT) {
+            disasm_format_instruction(&rt->output.buf, op->src, NULL);
+        }
+#endif
+#if LOOP_PROFILE
+        rt->profile[ins_get_index(op->id)]++;
+#endif
+#if LOOP_SAMPLE
+        rt->sample_op = op;
+#endif
+#if LOOP_COVERAGE
+        // The end of a sub has no instruction, and marks the file header
+        size_t offset = ((uintptr_t)op->src - coverage_base) & -(uintptr_t)(op->src != NULL);
+        coverage_hit(coverage, offset);
+#endif
+        
+        // Replace variable references with the corresponding values
+        if(op->param_mask) {
+            for(unsigned int i = 0; i < op->nparams; i++) {
+                if(op->param_mask & (1 << i)) {
+                    LOOP_CHECK(LOOP_SLOT_OK(op->params[i].i), "variable outside of the stack");
+                    retval = state_get_variable(state, op->params[i].i, &values[i]);
+                    if(!SUCCESS(retval)) {
+                        break;
+                    }
+                } else {
+                    values[i] = op->params[i];
+                }
+            }
+            if(!SUCCESS(retval)) {
+                break;
+            }
+            v = values;
+        }
+        
+    dispatch:
+        switch(op->id) {
+            case INS_NOP:
+            case INS_UNKNOWN21:
+            case INS_DEBUG22:
+                break;
+            
+            case INS_RET: // return
+                state->sp = state->bp;
+                LOOP_CHECK(state->sp > 0, "return: no stack frame");
+                state->bp = state->stack[--state->sp].u;
+                if(state->csp == 0) {
+                    retval = ECLI_DONE;
+                } else {
+                    next = state->callstack[--state->csp];
+                    if(state->memo_pending) {
+                        memo_return(state);
+                    }
+                }
+                break;
+            
+            case INS_CALL: // call
+                if(op->callee == NULL) {
+                    fprintf(stderr, "call: sub \"%s\" does not exist\n", op->params[0].s);
+                    retval = ECLI_FAILURE;
+                    break;
+                }
+                LOOP_CHECK(state->csp < state->callstack_size, "call: call stack overflow");
+                LOOP_CHECK(state->sp + op->nargs < state->stack_size, "call: stack overflow");
+                // The arguments go where the callee's stackAlloc puts its
+                // locals, past the slot for the saved base pointer
+                for(unsigned int i = 0; i < op->nargs; i++) {
+                    top = &state->stack[state->sp + 1 + i];
+                    *top = v[i + 1];
+                    if(top->type != op->params[i + 1].type) {
+                        value_convert(top, op->params[i + 1].type);
+                    }
+                }
+                state->args = op->nargs;
+                if(rt->memo && (op->callee->flags & CODE_PURE) && memo_call(state, op)) {
+                    break; // the memo made the call's effects, go on after it
+                }
+                // The sampler's signal handler may read the entry as soon as
+                // csp counts it, so it must be written first
+                state->callstack[state->csp] = next;
+                __atomic_store_n(&state->csp, state->csp + 1, __ATOMIC_RELEASE);
+                next = op->target; // the callee's stream
+                LOOP_BUDGET();
+                break;
+            
+            case INS_ENTER: // inlined call, makes the callee's frame without moving bp
+                LOOP_CHECK(state->sp + 1 + op->params[0].u <= state->stack_size, "enter: stack overflow");
+                for(unsigned int i = 0; i < op->nargs; i++) {
+                    top = &state->stack[state->sp + 1 + i];
+                    *top = v[i + 1];
+                    if(top->type != op->params[i + 1].type) {
+                        value_convert(top, op->params[i + 1].type);
+                    }
+                }
+                state->stack[state->sp].type = ECL_UINT32;
+                state->stack[state->sp].u = state->bp;
+                for(unsigned int i = op->nargs; i < op->params[0].u; i++) {
+                    state->stack[state->sp + 1 + i].type = ECL_INT32;
+                }
+                state->sp += 1 + op->params[0].u;
+                break;
+            
+            case INS_BLOCK: // register ops made from stack ops
+                LOOP_CHECK((int64_t)state->sp + op->block->low >= 0 &&
+                           (int64_t)state->sp + op->block->high <= (int64_t)state->stack_size, "block: stack underflow or overflow");
+                retval = regir_run(state, op->block);
+                break;
+            
+            case INS_SPLIT: // the difficulties of a shared run stop agreeing
+                next = ranks_split(state, op);
+                if(next == NULL) {
+                    next = op;
+                    retval = ECLI_FAILURE;
+                }
+                break;
+            
+            case INS_LEAVE: // return from an inlined call
+                state->sp = state->bp + op->params[0].u;
+                next = op->target;
+                break;
+            
+            case INS_CALLASYNC: { // callAsync
+                if(op->callee == NULL) {
+                    fprintf(stderr, "callAsync: sub \"%s\" does not exist\n", op->params[0].s);
+                    retval = ECLI_FAILURE;
+                    break;
+                }
+                // the new VM goes at the end of the table, it runs later this frame
+                ecl_state_t* child;
+                retval = allocate_ecl_state(&child, rt, op->callee, state->enemy);
+                if(SUCCESS(retval)) {
+                    for(unsigned int i = 0; i < op->nargs; i++) {
+                        top = &child->stack[1 + i];
+                        *top = v[i + 1];
+                        if(top->type != op->params[i + 1].type) {
+                            value_convert(top, op->params[i + 1].type);
+                        }
+                    }
+                    child->args = op->nargs;
+                }
+            }   break;
+            
+            case INS_JMP: // jmp (unconditional goto)
+                LOOP_CHECK(op->target != NULL, "jmp: invalid offset");
+                next = op->target;
+                LOOP_BUDGET();
+                break;
+            
+            case INS_JMPEQ: // jmpEq
+                LOOP_CHECK(state->sp > 0 && op->target != NULL, "jmpEq: stack underflow or invalid offset");
+                value = &state->stack[--state->sp];
+                if(value->i == 0) {
+                    state->time = op->params[1].u;
+                    next = op->target;
+                    LOOP_BUDGET();
+                }
+                break;
+            
+            case INS_JMPNEQ: // jmpNeq
+                LOOP_CHECK(state->sp > 0 && op->target != NULL, "jmpNeq: stack underflow or invalid offset");
+                value = &state->stack[--state->sp];
+                if(value->i != 0) {
+                    state->time = op->params[1].u;
+                    next = op->target;
+                    LOOP_BUDGET();
+                }
+                break;
+            
+            case INS_JMPTIME: // taken jmpEq/jmpNeq with a constant condition
+                LOOP_CHECK(op->target != NULL, "jmpTime: invalid offset");
+                state->time = op->params[1].u;
+                next = op->target;
+                LOOP_BUDGET();
+                break;
+            
+            case INS_WAIT: // wait
+                state->wait = v[0].i;
+                break;
+            
+            case INS_STACKALLOC: // stackAlloc
+                LOOP_CHECK(state->sp + 1 + (op->params[0].u >> 2) <= state->stack_size, "stackAlloc: stack overflow");
+                retval = state_setup_frame(state, op->params[0].u >> 2);
+                break;
+            
+            case INS_PUSH: // push
+            case INS_PUSHF:
+                LOOP_CHECK(state->sp < state->stack_size, "push: stack overflow");
+                state->stack[state->sp++] = v[0];
+                break;
+            
+            case INS_SET: // set
+            case INS_SETF:
+                LOOP_CHECK(state->sp > 0 && LOOP_SLOT_OK(op->params[0].i), "set: stack underflow or variable outside of the stack");
+                value = &state->stack[--state->sp];
+                retval = state_set_variable(state, op->params[0].i, value);
+                break;
+            
+            case INS_MOVE: // push and set in one
+            case INS_MOVEF:
+                LOOP_CHECK(LOOP_SLOT_OK(op->params[0].i), "move: variable outside of the stack");
+                retval = state_set_variable(state, op->params[0].i, &v[1]);
+                break;
+            
+            case INS_ADDI:
+                LOOP_CHECK(state->sp > 1, "addi: stack underflow");
+                value = &state->stack[--state->sp];
+                top = &state->stack[state->sp - 1];
+                top->i += value->i;
+                top->type = ECL_INT32;
+                break;
+            
+            case INS_ADDF:
+                LOOP_CHECK(state->sp > 1, "addf: stack underflow");
+                value = &state->stack[--state->sp];
+                top = &state->stack[state->sp - 1];
+                top->f += value->f;
+                top->type = ECL_FLOAT32;
+                break;
+            
+            case INS_SUBF:
+                LOOP_CHECK(state->sp > 1, "subf: stack underflow");
+                value = &state->stack[--state->sp];
+                top = &state->stack[state->sp - 1];
+                top->f -= value->f;
+                top->type = ECL_FLOAT32;
+                break;
+            
+            case INS_MULI:
+                LOOP_CHECK(state->sp > 1, "muli: stack underflow");
+                value = &state->stack[--state->sp];
+                top = &state->stack[state->sp - 1];
+                top->i *= value->i;
+                top->type = ECL_INT32;
+                break;
+            
+            case INS_MULF:
+                LOOP_CHECK(state->sp > 1, "mulf: stack underflow");
+                value = &state->stack[--state->sp];
+                top = &state->stack[state->sp - 1];
+                top->f *= value->f;
+                top->type = ECL_FLOAT32;
+                break;
+            
+            case INS_DIVF:
+                LOOP_CHECK(state->sp > 1, "divf: stack underflow");
+                value = &state->stack[--state->sp];
+                top = &state->stack[state->sp - 1];
+                top->f /= value->f;
+                top->type = ECL_FLOAT32;
+                break;
+            
+            case INS_MODI:
+                LOOP_CHECK(state->sp > 1, "modi: stack underflow");
+                value = &state->stack[--state->sp];
+                top = &state->stack[state->sp - 1];
+                top->i = top->i % value->i;
+                top->type = ECL_INT32;
+                break;
+            
+            case INS_EQI:
+                LOOP_CHECK(state->sp > 1, "eqi: stack underflow");
+                value = &state->stack[--state->sp];
+                top = &state->stack[state->sp - 1];
+                top->i = (top->i == value->i) ? 1 : 0;
+                top->type = ECL_INT32;
+                break;
+            
+            case INS_LESSI:
+                LOOP_CHECK(state->sp > 1, "lessi: stack underflow");
+                value = &state->stack[--state->sp];
+                top = &state->stack[state->sp - 1];
+                top->i = (top->i < value->i) ? 1 : 0;
+                top->type = ECL_INT32;
+                break;
+            
+            case INS_LEQI:
+                LOOP_CHECK(state->sp > 1, "leqi: stack underflow");
+                value = &state->stack[--state->sp];
+                top = &state->stack[state->sp - 1];
+                top->i = (top->i <= value->i) ? 1 : 0;
+                top->type = ECL_INT32;
+                break;
+            
+            case INS_GEQI:
+                LOOP_CHECK(state->sp > 1, "geqi: stack underflow");
+                value = &state->stack[--state->sp];
+                top = &state->stack[state->sp - 1];
+                top->i = (top->i >= value->i) ? 1 : 0;
+                top->type = ECL_INT32;
+                break;
+            
+            case INS_DECI: { // deci
+                LOOP_CHECK(state->sp < state->stack_size && LOOP_SLOT_OK(op->params[0].i), "deci: stack overflow or variable outside of the stack");
+                ecl_value_t dec = v[0];
+                dec.type = ECL_INT32;
+                state->stack[state->sp++] = dec;
+                dec.i = dec.i - 1;
+                retval = state_set_variable(state, op->params[0].i, &dec);
+            }   break;
+            
+            case INS_SIN:
+                LOOP_CHECK(state->sp > 0, "sin: stack underflow");
+                top = &state->stack[state->sp - 1];
+                top->f = fmath_sin(top->f);
+                top->type = ECL_FLOAT32;
+                break;
+            
+            case INS_COS:
+                LOOP_CHECK(state->sp > 0, "cos: stack underflow");
+                top = &state->stack[state->sp - 1];
+                top->f = fmath_cos(top->f);
+                top->type = ECL_FLOAT32;
+                break;
+            
+            case INS_NEGI:
+                LOOP_CHECK(state->sp > 0, "negi: stack underflow");
+                top = &state->stack[state->sp - 1];
+                top->i = (int32_t)(0u - (uint32_t)top->i);
+                top->type = ECL_INT32;
+                break;
+            
+            case INS_NEGF:
+                LOOP_CHECK(state->sp > 0, "negf: stack underflow");
+                top = &state->stack[state->sp - 1];
+                top->f = -top->f;
+                top->type = ECL_FLOAT32;
+                break;
+            
+            case INS_CIRCLEPOS: { // circlePos: x and y of a point at an angle and distance
+                LOOP_CHECK(LOOP_SLOT_OK(op->params[0].i) && LOOP_SLOT_OK(op->params[1].i), "circlePos: variable outside of the stack");
+                ecl_value_t x, y;
+                x.type = y.type = ECL_FLOAT32;
+                fmath_sincos(v[2].f, &y.f, &x.f);
+                x.f *= v[3].f;
+                y.f *= v[3].f;
+                retval = state_set_variable(state, op->params[0].i, &x);
+                if(SUCCESS(retval)) {
+                    retval = state_set_variable(state, op->params[1].i, &y);
+                }
+            }   break;
+            
+            case INS_VALIDRAD: { // validRad: bring an angle into [-pi, pi]
+                LOOP_CHECK(LOOP_SLOT_OK(op->params[0].i), "validRad: variable outside of the stack");
+                ecl_value_t a = v[0];
+                a.type = ECL_FLOAT32;
+                a.f = fmath_norm_rad(a.f);
+                retval = state_set_variable(state, op->params[0].i, &a);
+            }   break;
+            
+            case INS_GETANG: { // getAng: angle from one point to another
+                LOOP_CHECK(LOOP_SLOT_OK(op->params[0].i), "getAng: variable outside of the stack");
+                ecl_value_t a;
+                a.type = ECL_FLOAT32;
+                a.f = fmath_atan2(v[4].f - v[2].f, v[3].f - v[1].f);
+                retval = state_set_variable(state, op->params[0].i, &a);
+            }   break;
+            
+            case INS_SQRT: {
+                LOOP_CHECK(LOOP_SLOT_OK(op->params[0].i), "sqrt: variable outside of the stack");
+                ecl_value_t r;
+                r.type = ECL_FLOAT32;
+                r.f = fmath_sqrt(v[1].f);
+                retval = state_set_variable(state, op->params[0].i, &r);
+            }   break;
+            
+            case INS_DELETE: // enemies
+            case INS_ENMCREATE:
+            case INS_ENMCREATEA:
+            case INS_FLAGSET:
+            case INS_MOVEPOS:
+            case INS_MOVEPOSTIME:
+            case INS_MOVEPOSREL:
+            case INS_MOVEPOSRELTIME:
+            case INS_MOVEVEL:
+            case INS_MOVEVELTIME:
+                retval = enemy_run_ins(state, op, v);
+                break;
+            
+            case INS_SETCHAPTER: // setChapter
+                rt->global.chapter = v[0].i;
+                break;
+            
+            case INS_ETNEW: // bullet emitters
+            case INS_ETON:
+            case INS_ETSPRITE:
+            case INS_ETOFFSET:
+            case INS_ETANGLE:
+            case INS_ETSPEED:
+            case INS_ETCOUNT:
+            case INS_ETAIM:
+            case INS_ETSOUND:
+                retval = bullet_run_ins(state, op->id, v);
+                break;
+            
+            case INS_PUTS: // custom - print a string
+                if(output_enabled(&rt->output)) {
+                    strbuf_puts(&rt->output.buf, v[0].s);
+                }
+                break;
+            
+            case INS_PUTI:
+                if(output_enabled(&rt->output)) {
+                    strbuf_printf(&rt->output.buf, "%d", v[0].i);
+                }
+                break;
+            
+            case INS_PUTF:
+                if(output_enabled(&rt->output)) {
+                    strbuf_printf(&rt->output.buf, "%f", v[0].f);
+                }
+                break;
+            
+            case INS_ENDL:
+                if(output_enabled(&rt->output)) {
+                    strbuf_putc(&rt->output.buf, '\n');
+                }
+                break;
+            
+            case INS_TRAP: { // run the op the debugger replaced once it resumes
+                ecl_op_t* orig = debug_trap(state, op);
+                if(orig == NULL) {
+                    next = op;
+                    retval = ECLI_FAILURE;
+                    break;
+                }
+                op = orig;
+                goto dispatch;
+            }
+            
+            case INS_INVALID:
+                if(op->src == NULL) {
+                    fprintf(stderr, "Ran off the end of a sub\n");
+                    retval = ECLI_FAILURE;
+                    break;
+                }
+                // fall through
+            
+            default:
+                fprintf(stderr, "Unknown instruction id: %d\n", op->id);
+                retval = ECLI_FAILURE;
+                break;
+        }
+        
+        state->ip = next;
+        if(!SUCCESS(retval)) {
+            break; // failure, preemption or the interpreter returned from its "main"
+        }
+    }
+#if LOOP_SAMPLE
+    rt->sample_op = NULL;
+#endif
+    return retval;
+}
+
+#undef LOOP_CHECK
+#undef LOOP_BUDGET
+#undef LOOP_SLOT_OK
+#undef LOOP_NAME
+#undef LOOP_TRACE
+#undef LOOP_PROFILE
+#undef LOOP_SAMPLE
+#undef LOOP_COVERAGE
+#undef LOOP_CHECKED
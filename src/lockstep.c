@@ -0,0 +1,516 @@
+/**
+ * Lockstep execution of VMs running the same code
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+
+typedef int32_t lane_i __attribute__((vector_size(LOCKSTEP_WIDTH * sizeof(int32_t))));
+typedef float lane_f __attribute__((vector_size(LOCKSTEP_WIDTH * sizeof(float))));
+
+// LOCKSTEP_WIDTH lanes of one stack slot
+typedef union {
+    lane_i i;
+    lane_f f;
+    uint32_t u[LOCKSTEP_WIDTH];
+} lane_t;
+
+typedef struct {
+    ecl_state_t** vms; // one per lane
+    uint32_t count;
+    uint32_t chunks; // vectors per stack slot
+    lane_t* slots; // stack slot s of every lane, from slots[s * chunks]
+    lane_t* scratch; // constant operands broadcast over the lanes
+    ecl_type_t* types; // type of each stack slot, the same in every lane
+    uint32_t low; // lowest stack slot changed
+    
+    // State shared by every lane
+    ecl_op_t* ip;
+    uint32_t sp;
+    uint32_t bp;
+    uint32_t time;
+    int32_t wait;
+    ecl_op_t* history[ECL_HISTORY_SIZE];
+    uint32_t history_pos;
+    uint32_t budget; // ops the batch runs before it stops at a jump
+} batch_t;
+
+#define batch_slot(b, s) (&(b)->slots[(s) * (b)->chunks])
+#define batch_touch(b, s) ((b)->low = ((s) < (b)->low) ? (s) : (b)->low)
+#define FOR_CHUNKS(b, c) for(uint32_t c = 0; c < (b)->chunks; c++)
+
+/**
+ * Whether a batch can run an op at all, before looking at any values
+ **/
+static int
+lockstep_op_ok(ecl_op_t* op)
+{
+    switch(op->id) {
+        case INS_NOP:
+        case INS_UNKNOWN21:
+        case INS_DEBUG22:
+        case INS_JMP:
+        case INS_JMPEQ:
+        case INS_JMPNEQ:
+        case INS_JMPTIME:
+        case INS_WAIT:
+        case INS_PUSH:
+        case INS_PUSHF:
+        case INS_SET:
+        case INS_SETF:
+        case INS_MOVE:
+        case INS_MOVEF:
+        case INS_ADDI:
+        case INS_ADDF:
+        case INS_SUBF:
+        case INS_MULI:
+        case INS_MULF:
+        case INS_DIVF:
+        case INS_MODI:
+        case INS_EQI:
+        case INS_LESSI:
+        case INS_LEQI:
+        case INS_GEQI:
+        case INS_DECI:
+        case INS_SIN:
+        case INS_COS:
+        case INS_NEGI:
+        case INS_NEGF:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Get the lanes of an op's parameter: a stack local, or the constant
+ * broadcast into scratch. NULL if it is any other variable.
+ **/
+static lane_t*
+batch_param(batch_t* b, ecl_op_t* op, unsigned int i, lane_t* scratch, ecl_type_t* type)
+{
+    if(op->param_mask & (1 << i)) {
+        int32_t slot = op->params[i].i;
+        if(slot < 0) {
+            return NULL;
+        }
+        uint32_t s = b->bp + (slot >> 2);
+        if(b->types[s] != ECL_INT32 && b->types[s] != ECL_FLOAT32) {
+            return NULL; // the scalar loop reports it
+        }
+        *type = b->types[s];
+        return batch_slot(b, s);
+    }
+    
+    *type = op->params[i].type;
+    FOR_CHUNKS(b, c) {
+        for(unsigned int l = 0; l < LOCKSTEP_WIDTH; l++) {
+            scratch[c].u[l] = op->params[i].u;
+        }
+    }
+    return scratch;
+}
+
+/**
+ * Copy lanes into a stack slot
+ **/
+static void
+batch_store(batch_t* b, uint32_t s, lane_t* from, ecl_type_t type)
+{
+    lane_t* to = batch_slot(b, s);
+    if(to != from) {
+        memcpy(to, from, sizeof(lane_t) * b->chunks);
+    }
+    b->types[s] = type;
+    batch_touch(b, s);
+}
+
+/**
+ * Whether every lane holds the same value, stored in value if so
+ **/
+static int
+batch_uniform(batch_t* b, lane_t* x, uint32_t* value)
+{
+    for(uint32_t l = 1; l < b->count; l++) {
+        if(x[l / LOCKSTEP_WIDTH].u[l % LOCKSTEP_WIDTH] != x[0].u[0]) {
+            return 0;
+        }
+    }
+    *value = x[0].u[0];
+    return 1;
+}
+
+/**
+ * Run a binary op: pop y, and replace x below it with the result
+ **/
+static int
+batch_binary(batch_t* b, uint16_t id)
+{
+    lane_t* x = batch_slot(b, b->sp - 2);
+    lane_t* y = batch_slot(b, b->sp - 1);
+    ecl_type_t type = ECL_INT32;
+    
+    switch(id) {
+        case INS_ADDI:  FOR_CHUNKS(b, c) { x[c].i += y[c].i; } break;
+        case INS_MULI:  FOR_CHUNKS(b, c) { x[c].i *= y[c].i; } break;
+        case INS_EQI:   FOR_CHUNKS(b, c) { x[c].i = -(x[c].i == y[c].i); } break;
+        case INS_LESSI: FOR_CHUNKS(b, c) { x[c].i = -(x[c].i < y[c].i); } break;
+        case INS_LEQI:  FOR_CHUNKS(b, c) { x[c].i = -(x[c].i <= y[c].i); } break;
+        case INS_GEQI:  FOR_CHUNKS(b, c) { x[c].i = -(x[c].i >= y[c].i); } break;
+        case INS_ADDF:  FOR_CHUNKS(b, c) { x[c].f += y[c].f; } type = ECL_FLOAT32; break;
+        case INS_SUBF:  FOR_CHUNKS(b, c) { x[c].f -= y[c].f; } type = ECL_FLOAT32; break;
+        case INS_MULF:  FOR_CHUNKS(b, c) { x[c].f *= y[c].f; } type = ECL_FLOAT32; break;
+        case INS_DIVF:  FOR_CHUNKS(b, c) { x[c].f /= y[c].f; } type = ECL_FLOAT32; break;
+        
+        case INS_MODI:
+            // Leave division by zero to the scalar loop
+            FOR_CHUNKS(b, c) {
+                for(unsigned int l = 0; l < LOCKSTEP_WIDTH; l++) {
+                    if(y[c].u[l] == 0) {
+                        return 0;
+                    }
+                }
+            }
+            FOR_CHUNKS(b, c) { x[c].i %= y[c].i; }
+            break;
+    }
+    
+    b->sp--;
+    b->types[b->sp - 1] = type;
+    batch_touch(b, b->sp - 1);
+    return 1;
+}
+
+/**
+ * Run a unary op on the top of the stack
+ **/
+static void
+batch_unary(batch_t* b, uint16_t id)
+{
+    lane_t* x = batch_slot(b, b->sp - 1);
+    float* f = (float*)x; // the lanes of a slot are contiguous
+    ecl_type_t type = ECL_FLOAT32;
+    
+    switch(id) {
+        case INS_NEGI:  FOR_CHUNKS(b, c) { x[c].i = -x[c].i; } type = ECL_INT32; break;
+        case INS_NEGF:  FOR_CHUNKS(b, c) { x[c].f = -x[c].f; } break;
+        case INS_SIN:   fmath_sin_n(f, f, b->chunks * LOCKSTEP_WIDTH); break;
+        case INS_COS:   fmath_cos_n(f, f, b->chunks * LOCKSTEP_WIDTH); break;
+    }
+    
+    b->types[b->sp - 1] = type;
+    batch_touch(b, b->sp - 1);
+}
+
+/**
+ * Run the ops every lane agrees on, until one the batch can't run or the
+ * batch has used up the VMs' slice
+ **/
+static void
+batch_execute(batch_t* b)
+{
+    while((b->wait == 0) && (b->time >= b->ip->time) && (b->history_pos < b->budget)) {
+        ecl_op_t* op = b->ip;
+        ecl_op_t* next = op + 1;
+        lane_t* x;
+        ecl_type_t type;
+        uint32_t value;
+        
+        switch(op->id) {
+            case INS_NOP:
+            case INS_UNKNOWN21:
+            case INS_DEBUG22:
+                break;
+            
+            case INS_JMP:
+                next = op->target;
+                break;
+            
+            case INS_JMPEQ:
+            case INS_JMPNEQ:
+                // Split up here if the lanes go different ways
+                x = batch_slot(b, b->sp - 1);
+                if(!batch_uniform(b, x, &value)) {
+                    return;
+                }
+                b->sp--;
+                if((value == 0) == (op->id == INS_JMPEQ)) {
+                    b->time = op->params[1].u;
+                    next = op->target;
+                }
+                break;
+            
+            case INS_JMPTIME:
+                b->time = op->params[1].u;
+                next = op->target;
+                break;
+            
+            case INS_WAIT:
+                x = batch_param(b, op, 0, b->scratch, &type);
+                if(x == NULL || !batch_uniform(b, x, &value)) {
+                    return;
+                }
+                b->wait = (int32_t)value;
+                break;
+            
+            case INS_PUSH:
+            case INS_PUSHF:
+                x = batch_param(b, op, 0, b->scratch, &type);
+                if(x == NULL) {
+                    return;
+                }
+                batch_store(b, b->sp++, x, type);
+                break;
+            
+            case INS_SET:
+            case INS_SETF:
+                type = b->types[b->sp - 1];
+                if(op->params[0].i < 0 || (type != ECL_INT32 && type != ECL_FLOAT32)) {
+                    return;
+                }
+                b->sp--;
+                batch_store(b, b->bp + (op->params[0].i >> 2), batch_slot(b, b->sp), type);
+                break;
+            
+            case INS_MOVE:
+            case INS_MOVEF:
+                x = batch_param(b, op, 1, b->scratch, &type);
+                if(op->params[0].i < 0 || x == NULL) {
+                    return;
+                }
+                batch_store(b, b->bp + (op->params[0].i >> 2), x, type);
+                break;
+            
+            case INS_DECI:
+                x = batch_param(b, op, 0, b->scratch, &type);
+                if(!(op->param_mask & 1) || x == NULL) {
+                    return;
+                }
+                batch_store(b, b->sp++, x, ECL_INT32);
+                FOR_CHUNKS(b, c) { x[c].i -= 1; }
+                batch_store(b, b->bp + (op->params[0].i >> 2), x, ECL_INT32);
+                break;
+            
+            case INS_ADDI:
+            case INS_ADDF:
+            case INS_SUBF:
+            case INS_MULI:
+            case INS_MULF:
+            case INS_DIVF:
+            case INS_MODI:
+            case INS_EQI:
+            case INS_LESSI:
+            case INS_LEQI:
+            case INS_GEQI:
+                if(!batch_binary(b, op->id)) {
+                    return;
+                }
+                break;
+            
+            case INS_SIN:
+            case INS_COS:
+            case INS_NEGI:
+            case INS_NEGF:
+                batch_unary(b, op->id);
+                break;
+            
+            default:
+                return;
+        }
+        
+        b->history[b->history_pos++ & (ECL_HISTORY_SIZE - 1)] = op;
+        b->ip = next;
+    }
+}
+
+/**
+ * Run a batch of VMs at the same op, with the same clock and stack layout,
+ * for at most budget ops. Returns the ops run over all of them.
+ **/
+static uint64_t
+batch_run(ecli_lockstep_t* ls, ecl_state_t** vms, uint32_t count, uint32_t budget)
+{
+    ecl_state_t* first = vms[0];
+    batch_t b;
+    
+    // Every lane must have the same type in every slot
+    uint32_t n = 1;
+    for(uint32_t i = 1; i < count; i++) {
+        uint32_t s;
+        for(s = 0; s < first->sp && vms[i]->stack[s].type == first->stack[s].type; s++);
+        if(s == first->sp) {
+            vms[n++] = vms[i];
+        }
+    }
+    if(n < LOCKSTEP_MIN_LANES) {
+        return 0;
+    }
+    
+    memset(&b, 0, sizeof(batch_t));
+    b.vms = vms;
+    b.count = n;
+    b.chunks = (n + LOCKSTEP_WIDTH - 1) / LOCKSTEP_WIDTH;
+    b.ip = first->ip;
+    b.sp = first->sp;
+    b.bp = first->bp;
+    b.time = first->time;
+    b.low = first->sp;
+    b.budget = budget;
+    
+    size_t size = sizeof(lane_t) * b.chunks * (first->stack_size + 1) + sizeof(ecl_type_t) * first->stack_size;
+    if(ls->mem_size < size + sizeof(lane_t)) {
+        xfree(ls->mem);
+        ls->mem_size = size + sizeof(lane_t);
+        ls->mem = xmalloc(ls->mem_size);
+    }
+    b.slots = (lane_t*)(((uintptr_t)ls->mem + sizeof(lane_t) - 1) & ~(uintptr_t)(sizeof(lane_t) - 1));
+    b.scratch = batch_slot(&b, first->stack_size);
+    b.types = (ecl_type_t*)(b.scratch + b.chunks);
+    
+    // Gather the stacks, padding the last vector with copies of the first lane
+    for(uint32_t s = 0; s < first->stack_size; s++) {
+        b.types[s] = (s < first->sp) ? first->stack[s].type : ECL_INVALID;
+    }
+    for(uint32_t s = 0; s < first->sp; s++) {
+        lane_t* x = batch_slot(&b, s);
+        for(uint32_t l = 0; l < b.chunks * LOCKSTEP_WIDTH; l++) {
+            x[l / LOCKSTEP_WIDTH].u[l % LOCKSTEP_WIDTH] = vms[(l < n) ? l : 0]->stack[s].u;
+        }
+    }
+    
+    batch_execute(&b);
+    if(b.history_pos == 0) {
+        return 0;
+    }
+    
+    // Scatter what changed back into the VMs
+    uint32_t ran = (b.history_pos < ECL_HISTORY_SIZE) ? b.history_pos : ECL_HISTORY_SIZE;
+    for(uint32_t l = 0; l < n; l++) {
+        ecl_state_t* state = vms[l];
+        for(uint32_t s = b.low; s < b.sp; s++) {
+            state->stack[s].type = b.types[s];
+            state->stack[s].u = batch_slot(&b, s)[l / LOCKSTEP_WIDTH].u[l % LOCKSTEP_WIDTH];
+        }
+        state->ip = b.ip;
+        state->sp = b.sp;
+        state->time = b.time;
+        state->wait = b.wait;
+        state->history_pos += b.history_pos - ran; // it counts the ops run
+        state->batched += b.history_pos;
+        for(uint32_t k = b.history_pos - ran; k < b.history_pos; k++) {
+            state->history[state->history_pos++ & (ECL_HISTORY_SIZE - 1)] = b.history[k & (ECL_HISTORY_SIZE - 1)];
+        }
+    }
+    return (uint64_t)b.history_pos * n;
+}
+
+/**
+ * Order VMs so the ones which can share a batch are next to each other
+ **/
+static int
+compare_vms(const void* a, const void* b)
+{
+    const ecl_state_t* x = *(ecl_state_t* const*)a;
+    const ecl_state_t* y = *(ecl_state_t* const*)b;
+    
+    if(x->ip != y->ip) {
+        return (x->ip < y->ip) ? -1 : 1;
+    }
+    if(x->time != y->time) {
+        return (x->time < y->time) ? -1 : 1;
+    }
+    if(x->sp != y->sp) {
+        return (x->sp < y->sp) ? -1 : 1;
+    }
+    if(x->bp != y->bp) {
+        return (x->bp < y->bp) ? -1 : 1;
+    }
+    if(x->stack_size != y->stack_size) {
+        return (x->stack_size < y->stack_size) ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Run batches of the VMs from the given index to the end of the table,
+ * before they get their turn. VMs added later in the frame are batched when
+ * the interpreter reaches them. The ops run come off left, the frame's
+ * budget, and count towards each VM's slice and loop budgets when it gets
+ * its turn (see run_turn()).
+ **/
+void
+lockstep_run(ecli_runtime_t* rt, uint32_t from, uint64_t* left)
+{
+    ecli_lockstep_t* ls = &rt->lockstep_mem;
+    uint32_t count = 0;
+    
+    for(uint32_t i = from; i < rt->vms.count; i++) {
+        ecl_state_t* p = vm_table_at(&rt->vms, i);
+        p->lockstep_frame = rt->frame + 1;
+        if(vm_finished(p) || p->turn_frame == rt->frame + 1 || p->checked || p->wait != 0 || p->time < p->ip->time || !lockstep_op_ok(p->ip)) {
+            continue;
+        }
+        if(count == ls->cap) {
+            ls->cap = ls->cap ? ls->cap * 2 : 64;
+            ls->vms = xrealloc(ls->vms, sizeof(ecl_state_t*) * ls->cap);
+        }
+        ls->vms[count++] = p;
+    }
+    if(count < LOCKSTEP_MIN_LANES) {
+        return;
+    }
+    
+    // The same bound as a turn, so no VM gets further ahead than it would alone
+    uint32_t budget = rt->budget.slice ? rt->budget.slice : BUDGET_SLICE_MAX;
+    if(rt->budget.loop && rt->budget.loop < budget) {
+        budget = rt->budget.loop;
+    }
+    
+    qsort(ls->vms, count, sizeof(ecl_state_t*), compare_vms);
+    for(uint32_t i = 0, j; i < count && *left > 0; i = j) {
+        for(j = i + 1; j < count && compare_vms(&ls->vms[i], &ls->vms[j]) == 0; j++);
+        if(j - i >= LOCKSTEP_MIN_LANES) {
+            uint64_t ran = batch_run(ls, &ls->vms[i], j - i, (*left < budget) ? (uint32_t)*left : budget);
+            if(rt->budget.frame) {
+                *left = (ran < *left) ? *left - ran : 0;
+            }
+        }
+    }
+}
+
+/**
+ * Free the memory kept for batches
+ **/
+void
+lockstep_free(ecli_lockstep_t* ls)
+{
+    xfree(ls->vms);
+    xfree(ls->mem);
+    ls->cap = 0;
+    ls->mem_size = 0;
+}
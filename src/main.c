@@ -1,186 +1,573 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <time.h>
-
-#include "ecli.h"
-
-#ifndef max
-#define max(a,b) ((a) > (b) ? (a) : (b))
-#endif
-
-static int show_header, show_includes;
-
-param_t params[] = {
-    {'h', "help", NULL, 0, "Print this message."},
-    {'d', "difficulty", NULL, 1, "Set the difficulty (easy, normal, hard, lunatic)"},
-    {'H', "dump-header", &show_header, 0, "Dump the ECL header."},
-    {'I', "dump-includes", &show_includes, 0, "Dump the ECL ANIM/ECLI includes."},
-    {'v', "verbose", &global.verbose, 0, "Print a lot of useful debug information."},
-    {0, NULL, NULL, 0, NULL}
-};
-
-const char* desc = "ECL Interpreter for the newest Touhou games";
-const char* pos = "eclfile";
-const char* longdesc = NULL;
-
-int
-main(int argc, char** argv)
-{
-    srand(time(0));
-
-    /* Parse command-line arguments */
-    args_set(argc, argv);
-    const char* fname = NULL;
-    int c;
-    
-    global.difficulty = DIFF_LUNATIC;
-
-    while((c = arg_get(params)) != 0) {
-        fflush(stdout);
-        switch(c) {
-            case -1:
-                arg_print_usage(desc, pos, params, longdesc);
-                return EXIT_FAILURE;
-                break;
-            // difficulty setting
-            case 'd': {
-                const char* arg = arg_get_param();
-                if(strcmp(arg, "easy") == 0) {
-                    global.difficulty = DIFF_EASY;
-                } else if(strcmp(arg, "normal") == 0) {
-                    global.difficulty = DIFF_NORMAL;
-                } else if(strcmp(arg, "hard") == 0) {
-                    global.difficulty = DIFF_HARD;
-                } else if(strcmp(arg, "lunatic") == 0) {
-                    global.difficulty = DIFF_LUNATIC;
-                } else {
-                    fprintf(stderr, "Unknown difficulty: %s\n\n", arg);
-                    arg_print_usage(desc, pos, params, longdesc);
-                }
-            }   break;
-
-            case 'h':
-                arg_print_usage(desc, pos, params, longdesc);
-                return EXIT_SUCCESS;
-                break;
-
-            case 1: // ECL file (positional arg)
-                if(fname != NULL) {
-                    fprintf(stderr, "Multiple files given on command line.\n");
-                    return EXIT_FAILURE;
-                }
-                
-                fname = arg_get_param();
-                break;
-
-            default:
-                break;
-        }
-    }
-    
-    if(fname == NULL) {
-        fprintf(stderr, "No ECL file given.\n");
-        return EXIT_FAILURE;
-    }
-    
-    FILE* f = fopen(fname, "rb");
-
-    if(f == NULL) {
-        fprintf(stderr, "Failed to open file %s\n", fname);
-        return EXIT_FAILURE;
-    }
-    
-    /* Read in ECL file */
-    th10_ecl_t ecl;
-    ecli_result_t result = load_th10_ecl_from_file_object(&ecl, f);
-    fclose(f);
-    
-    if(result != ECLI_SUCCESS) {
-        fprintf(stderr, "Failed to load ECL file %s\n", fname);
-        return EXIT_FAILURE;
-    }
-    
-    if(!verify_th10_ecl_header(&ecl)) {
-        fprintf(stderr, "Invalid magic number.\n");
-        return EXIT_FAILURE;
-    }
-    
-    /* Dump some information about the file */
-    if(show_header) {
-        print_th10_ecl_header(&ecl);
-    }
-    
-    if(show_includes) {
-        for(include_t i = INCLUDE_ANIM; i < INCLUDE_MAX; i++) {
-            th10_include_list_t* list = th10_ecl_get_include_list(&ecl, i);
-            printf("Include type: %s\n", &list->name[0]);
-            if(list->count < 1) {
-                continue;
-            }
-            
-            char* s = th10_ecl_get_include(list, 0);
-            printf("Include list: %s", s);
-            
-            for(unsigned int j = 1; j < list->count; j++) {
-                s = th10_ecl_get_include(list, j);
-                printf(", %s", s);
-            }
-            printf("\n");
-        }
-        
-        printf("Subs: %s", ecl.subs[0].name);
-        for(unsigned int i = 1; i < ecl.header->sub_count; i++) {
-            printf(", %s", ecl.subs[i].name);
-        }
-        printf("\n");
-    }
-    
-    /* Initialize interpreter */
-    if(!SUCCESS(initialize_globals())) {
-        fprintf(stderr, "Failed to initialize global variables.\n");
-        free_th10_ecl(&ecl);
-        return EXIT_FAILURE;
-    }
-
-    ecl_state_t* main;
-    result = allocate_ecl_state(&main, &ecl);
-    if(result != ECLI_SUCCESS) {
-        fprintf(stderr, "Failed to initialize interpreter state.\n");
-        free_th10_ecl(&ecl);
-        return EXIT_FAILURE;
-    }
-    
-    /* Find main sub and execute */
-    th10_ecl_sub_t* sub = get_th10_ecl_sub_by_name(&ecl, "main");
-    if(sub == NULL) {
-        fprintf(stderr, "ECL file has no main sub.\n");
-        free_ecl_state(main);
-        free_th10_ecl(&ecl);
-        return EXIT_FAILURE;
-    }
-    
-    /* Current interpeter loop - get next instruction and execute */
-    main->ip = sub->start;
-    
-    while(1) {
-        result = run_all_ecl_instances(main);
-        if(result == ECLI_DONE) {
-            break;
-        } else if(result == ECLI_FAILURE) {
-            fprintf(stderr, "Interpretation failed.\n");
-            break;
-        }
-        
-        for(ecl_state_t* p = main; p != NULL; p = p->next) {
-            p->wait = max(p->wait - 1, 0);
-            if(p->wait == 0) {
-                p->time++;
-            }
-        }
-    }
-
-    free_ecl_state(main);
-    free_th10_ecl(&ecl);
-
-    return EXIT_SUCCESS;
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "ecli.h"
+#include "libecli.h"
+#include "server.h"
+
+// Samples a second for -p
+#define SAMPLE_HZ 1000
+
+static int show_header, show_includes, verbose, profile, sample, serve, disasm, quiet, writer, verify, stats, lockstep, bullets, debug, summary, callgraph;
+static const char** merges; // coverage files given with -M
+static unsigned int merge_count;
+
+param_t params[] = {
+    {'h', "help", NULL, 0, "Print this message."},
+    {'d', "difficulty", NULL, 1, "Set the difficulty (easy, normal, hard, lunatic). Several separated by commas, or all, run in one shared run."},
+    {'H', "dump-header", &show_header, 0, "Dump the ECL header."},
+    {'I', "dump-includes", &show_includes, 0, "Dump the ECL ANIM/ECLI includes."},
+    {'D', "disasm", &disasm, 0, "Disassemble the ECL file to thecl source instead of running it."},
+    {'O', "optimize", NULL, 1, "Optimization level: -O0 runs the code as written, -O1 (default) optimizes it, -O2 also inlines small subs and runs stack arithmetic on registers."},
+    {'i', "inline", NULL, 1, "Inline subs of up to this many instructions at -O2 (default 16)."},
+    {'G', "callgraph", &callgraph, 0, "Print which subs call which, and how many calls were inlined, instead of running."},
+    {'T', "stats", &stats, 0, "Print what the optimizer did to stderr, and how the memo did with -m."},
+    {'m', "memo", NULL, 1, "Memoize calls to pure subs, keeping the effects of up to this many calls."},
+    {'V', "verify", &verify, 0, "Check the stack use of every sub and report problems."},
+    {'v', "verbose", &verbose, 0, "Print a lot of useful debug information."},
+    {'P', "profile", &profile, 0, "Count the instructions run and print a profile to stderr."},
+    {'p', "sample", &sample, 0, "Sample where the VMs spend their time and print the hot subs and instructions to stderr."},
+    {'F', "folded", NULL, 1, "Write the sampled call stacks in folded format to a file (implies -p)."},
+    {'c', "coverage", NULL, 1, "Add the instructions run to a coverage file (implies -O0). With -D, annotate the disassembly with it."},
+    {'C', "coverage-summary", &summary, 0, "Print how many instructions of each sub ran on each difficulty, from the -c file, instead of running."},
+    {'M', "merge-coverage", NULL, 1, "Merge a coverage file into the -c file instead of running. Can be given several times."},
+    {'b', "bullets", &bullets, 0, "Print how many bullets were fired, culled and hit the player to stderr."},
+    {'L', "lockstep", &lockstep, 0, "Run VMs at the same instruction together with vector instructions."},
+    {'g', "debug", &debug, 0, "Run under the debugger, reading commands from stdin."},
+    {'B', "budget", NULL, 1, "Instruction budgets as slice=n,frame=n,loop=n,defer: per VM turn, per frame, and without waiting before a VM is reported as stuck."},
+    {'a', "archive", NULL, 1, "Read the ECL file out of a .dat archive. Without a file name, unpack every ECL file in it and list them."},
+    {'o', "output", NULL, 1, "Write the output of the print instructions to a file."},
+    {'q', "quiet", &quiet, 0, "Discard the output of the print instructions."},
+    {'W', "writer-thread", &writer, 0, "Write the output from a separate thread."},
+    {'s', "seed", NULL, 1, "Seed the random number generator (default: current time)."},
+    {'S', "serve", &serve, 0, "Serve run requests on stdin, or on a socket with -U."},
+    {'U', "socket", NULL, 1, "Unix domain socket to listen on in server mode."},
+    {'j', "jobs", NULL, 1, "Number of threads for server mode and disassembly (default: one per CPU)."},
+    {'k', "cache", NULL, 1, "Number of ECL files kept loaded in server mode (default 64)."},
+    {0, NULL, NULL, 0, NULL}
+};
+
+static const char* difficulty_names[DIFFICULTY_COUNT] = {"easy", "normal", "hard", "lunatic"};
+
+const char* desc = "ECL Interpreter for the newest Touhou games";
+const char* pos = "eclfile";
+const char* longdesc = NULL;
+
+/**
+ * Unpack every ECL file of an archive and list them with their sizes
+ **/
+static int
+list_archive(const char* path, unsigned int threads)
+{
+    ecli_dat_t* dat = dat_open(path);
+    if(dat == NULL) {
+        return EXIT_FAILURE;
+    }
+    
+    int status = SUCCESS(dat_read_all(dat, ".ecl", threads)) ? EXIT_SUCCESS : EXIT_FAILURE;
+    for(uint32_t i = 0; i < dat->count; i++) {
+        dat_entry_t* e = &dat->entries[i];
+        th10_ecl_t ecl;
+        if(!dat_is_ecl(e)) {
+            continue;
+        }
+        if(e->data && SUCCESS(load_th10_ecl_from_memory(&ecl, e->data, e->size))) {
+            printf("%s: %u bytes, %u subs\n", e->name, e->size, ecl.header->sub_count);
+            free_th10_ecl(&ecl);
+        } else {
+            printf("%s: %u bytes, unreadable\n", e->name, e->size);
+            status = EXIT_FAILURE;
+        }
+    }
+    dat_close(dat);
+    return status;
+}
+
+/**
+ * Parse a difficulty, a list of them separated by commas or "all" into a set
+ * of DIFF_* flags. Returns 0 for an unknown difficulty.
+ **/
+static uint8_t
+parse_difficulties(const char* arg)
+{
+    uint8_t set = 0;
+    
+    if(strcmp(arg, "all") == 0) {
+        return DIFF_EASY | DIFF_NORMAL | DIFF_HARD | DIFF_LUNATIC;
+    }
+    while(*arg) {
+        size_t len = strcspn(arg, ",");
+        unsigned int d;
+        for(d = 0; d < DIFFICULTY_COUNT; d++) {
+            if(strlen(difficulty_names[d]) == len && strncmp(arg, difficulty_names[d], len) == 0) {
+                break;
+            }
+        }
+        if(d == DIFFICULTY_COUNT) {
+            return 0;
+        }
+        set |= 1 << d;
+        arg += len + (arg[len] == ',');
+    }
+    return set;
+}
+
+/**
+ * Write what the run found out, as asked for on the command line, to f.
+ * Returns the exit status of the run.
+ **/
+static int
+report_run(ecli_runtime_t* rt, ecli_result_t result, const char* coverage, const char* folded, int memo, FILE* f)
+{
+    int status = EXIT_SUCCESS;
+    
+    if(result == ECLI_FAILURE) {
+        fprintf(f, "Interpretation failed.\n");
+        status = EXIT_FAILURE;
+    }
+    
+    if(profile) {
+        ecli_print_profile(rt, f);
+    }
+    
+    if(sample) {
+        ecli_print_samples(rt, f);
+    }
+    if(sample && folded) {
+        FILE* ff = fopen(folded, "w");
+        if(ff == NULL) {
+            fprintf(stderr, "Failed to open folded stack file %s\n", folded);
+            status = EXIT_FAILURE;
+        } else {
+            ecli_write_folded(rt, ff);
+            fclose(ff);
+        }
+    }
+    
+    if(coverage) {
+        ecli_coverage_t* cov = ecli_get_coverage(rt);
+        if(!SUCCESS(coverage_merge_file(cov, coverage)) || !SUCCESS(coverage_save_file(cov, coverage))) {
+            status = EXIT_FAILURE;
+        }
+    }
+    
+    if(bullets) {
+        const bullet_stats_t* s = ecli_bullet_stats(rt);
+        fprintf(f, "bullets: %" PRIu64 " fired, %" PRIu64 " culled, %" PRIu64 " hits, at most %u at once\n",
+                s->total_spawned, s->total_culled, s->total_hits, s->peak);
+    }
+    
+    if(stats && memo) {
+        const ecli_memo_stats_t* s = ecli_memo_stats(rt);
+        fprintf(f, "memo: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions, "
+                "%u entries, %u pure subs\n", s->hits, s->misses, s->evictions, s->entries, s->pure);
+    }
+    return status;
+}
+
+/**
+ * Copy a file written during a shared run to another, putting prefix before
+ * every line
+ **/
+static void
+copy_lines(FILE* from, FILE* to, const char* prefix)
+{
+    char line[1024];
+    int start = 1;
+    
+    rewind(from);
+    while(fgets(line, sizeof(line), from)) {
+        if(start && prefix) {
+            fprintf(to, "%s: ", prefix);
+        }
+        fputs(line, to);
+        start = strchr(line, '\n') != NULL;
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    /* Parse command-line arguments */
+    args_set(argc, argv);
+    merges = xmalloc(sizeof(const char*) * argc);
+    const char* fname = NULL;
+    int c;
+    uint8_t ranks = DIFF_LUNATIC;
+    uint32_t seed = time(0);
+    const char* output = NULL;
+    const char* folded = NULL;
+    const char* coverage = NULL;
+    const char* archive = NULL;
+    ecli_server_config_t server_config = {.optimize = 1, .inline_limit = INLINE_DEFAULT_LIMIT};
+
+    while((c = arg_get(params)) != 0) {
+        fflush(stdout);
+        switch(c) {
+            case -1:
+                arg_print_usage(desc, pos, params, longdesc);
+                return EXIT_FAILURE;
+                break;
+            // difficulty setting
+            case 'd': {
+                const char* arg = arg_get_param();
+                uint8_t set = parse_difficulties(arg);
+                if(set) {
+                    ranks = set;
+                } else {
+                    fprintf(stderr, "Unknown difficulty: %s\n\n", arg);
+                    arg_print_usage(desc, pos, params, longdesc);
+                }
+            }   break;
+
+            case 'h':
+                arg_print_usage(desc, pos, params, longdesc);
+                return EXIT_SUCCESS;
+                break;
+
+            case 's':
+                seed = strtoul(arg_get_param(), NULL, 0);
+                break;
+
+            case 'O':
+                server_config.optimize = strtol(arg_get_param(), NULL, 0);
+                break;
+
+            case 'i':
+                server_config.inline_limit = strtoul(arg_get_param(), NULL, 0);
+                break;
+
+            case 'm':
+                server_config.memo = strtoul(arg_get_param(), NULL, 0);
+                break;
+
+            case 'o':
+                output = arg_get_param();
+                break;
+
+            case 'F':
+                folded = arg_get_param();
+                sample = 1;
+                break;
+
+            case 'a':
+                archive = arg_get_param();
+                break;
+
+            case 'B':
+                if(!SUCCESS(ecli_parse_budget(arg_get_param(), &server_config.budget))) {
+                    fprintf(stderr, "Bad budget: %s\n", arg_get_param());
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'c':
+                coverage = arg_get_param();
+                break;
+
+            case 'M':
+                merges[merge_count++] = arg_get_param();
+                break;
+
+            case 'U':
+                server_config.socket_path = arg_get_param();
+                break;
+
+            case 'j':
+                server_config.workers = strtoul(arg_get_param(), NULL, 0);
+                break;
+
+            case 'k':
+                server_config.cache_size = strtoul(arg_get_param(), NULL, 0);
+                break;
+
+            case 1: // ECL file (positional arg)
+                if(fname != NULL) {
+                    fprintf(stderr, "Multiple files given on command line.\n");
+                    return EXIT_FAILURE;
+                }
+                
+                fname = arg_get_param();
+                break;
+
+            default:
+                break;
+        }
+    }
+    
+    if(serve) {
+        return SUCCESS(ecli_serve(&server_config)) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    if(archive != NULL && fname == NULL) {
+        return list_archive(archive, server_config.workers);
+    }
+    if(fname == NULL) {
+        fprintf(stderr, "No ECL file given.\n");
+        return EXIT_FAILURE;
+    }
+    if(coverage == NULL && (summary || merge_count)) {
+        fprintf(stderr, "-C and -M need a coverage file given with -c.\n");
+        return EXIT_FAILURE;
+    }
+    if(coverage != NULL && (profile || verbose || sample)) {
+        fprintf(stderr, "-c can't be combined with -P, -p or -v.\n");
+        return EXIT_FAILURE;
+    }
+    int shared = (ranks & (ranks - 1)) != 0;
+    if(shared && (debug || coverage || sample)) {
+        fprintf(stderr, "Several difficulties can't be combined with -g, -c, -p or -F.\n");
+        return EXIT_FAILURE;
+    }
+    
+    ecli_runtime_t* rt = ecli_runtime_create();
+    if(profile) {
+        ecli_set_mode(rt, ECLI_MODE_PROFILE);
+    } else if(verbose) {
+        ecli_set_mode(rt, ECLI_MODE_TRACE);
+    }
+    ecli_set_lockstep(rt, lockstep);
+    ecli_set_budget(rt, &server_config.budget);
+    ecli_set_difficulty(rt, ranks & -ranks);
+    ecli_set_seed(rt, seed);
+    ecli_set_optimization(rt, coverage ? 0 : server_config.optimize);
+    ecli_set_inline_limit(rt, server_config.inline_limit);
+    ecli_set_memo(rt, server_config.memo);
+    
+    /* Read in ECL file */
+    ecli_result_t loaded = ECLI_FAILURE;
+    if(archive != NULL) {
+        ecli_dat_t* dat = dat_open(archive);
+        if(dat != NULL) {
+            loaded = ecli_load_dat(rt, dat, fname);
+            dat_close(dat);
+        }
+    } else {
+        loaded = ecli_load_file(rt, fname);
+    }
+    if(!SUCCESS(loaded)) {
+        fprintf(stderr, "Failed to load ECL file %s\n", fname);
+        ecli_runtime_free(rt);
+        return EXIT_FAILURE;
+    }
+    th10_ecl_t* ecl = ecli_get_ecl(rt);
+    
+    if(stats) {
+        const ecl_opt_stats_t* s = ecli_optimizer_stats(rt);
+        fprintf(stderr, "optimizer: removed %u of %u instructions (%u folded, %u branches, "
+                "%u jumps, %u nops, %u push/set pairs), %u calls inlined, %u stack ops in %u register blocks "
+                "as %u register ops\n", s->removed, s->ops, s->folded, s->branches, s->jumps, s->nops,
+                s->moves, s->inlined, s->block_ops, s->blocks, s->regs);
+    }
+    
+    /* Dump some information about the file */
+    if(show_header) {
+        print_th10_ecl_header(ecl);
+    }
+    
+    if(show_includes) {
+        for(include_t i = INCLUDE_ANIM; i < INCLUDE_MAX; i++) {
+            th10_include_list_t* list = th10_ecl_get_include_list(ecl, i);
+            printf("Include type: %s\n", &list->name[0]);
+            if(list->count < 1) {
+                continue;
+            }
+            
+            char* s = th10_ecl_get_include(list, 0);
+            printf("Include list: %s", s);
+            
+            for(unsigned int j = 1; j < list->count; j++) {
+                s = th10_ecl_get_include(list, j);
+                printf(", %s", s);
+            }
+            printf("\n");
+        }
+        
+        printf("Subs: %s", ecl->subs[0].name);
+        for(unsigned int i = 1; i < ecl->header->sub_count; i++) {
+            printf(", %s", ecl->subs[i].name);
+        }
+        printf("\n");
+    }
+    
+    /* Work on the coverage recorded by earlier runs */
+    if(coverage && (merge_count || summary || disasm)) {
+        ecli_coverage_t* cov = coverage_create(ecl);
+        ecli_result_t result = coverage_merge_file(cov, coverage);
+        for(unsigned int i = 0; i < merge_count && SUCCESS(result); i++) {
+            result = coverage_merge_file(cov, merges[i]);
+        }
+        if(SUCCESS(result) && merge_count) {
+            result = coverage_save_file(cov, coverage);
+        }
+        if(SUCCESS(result) && summary) {
+            coverage_write_summary(cov, ecl, stdout);
+        } else if(SUCCESS(result) && disasm) {
+            result = coverage_annotate(cov, ecl, 1, server_config.workers);
+        }
+        coverage_free(cov);
+        ecli_runtime_free(rt);
+        return SUCCESS(result) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    if(callgraph) {
+        ecl_code_print_callgraph(ecl, stdout);
+        ecli_runtime_free(rt);
+        return EXIT_SUCCESS;
+    }
+    
+    if(disasm) {
+        int status = SUCCESS(disasm_ecl(ecl, 1, server_config.workers, NULL, NULL)) ? EXIT_SUCCESS : EXIT_FAILURE;
+        ecli_runtime_free(rt);
+        return status;
+    }
+    
+    if(verify) {
+        strbuf_t report;
+        strbuf_init(&report);
+        uint32_t failed = ecl_code_verify(ecl, &report);
+        uint32_t unbounded = 0;
+        for(uint32_t i = 0; i < ecl->header->sub_count; i++) {
+            unbounded += (ecl->code[i].stack == STACK_UNBOUNDED) ? 1 : 0;
+        }
+        fwrite(report.data, 1, report.len, stdout);
+        printf("%u subs, %u failed verification, %u run with stack checks\n",
+               ecl->header->sub_count, failed, unbounded);
+        strbuf_free(&report);
+        ecli_runtime_free(rt);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    
+    /* Find main sub and execute */
+    if(get_th10_ecl_sub_by_name(ecl, "main") == NULL) {
+        fprintf(stderr, "ECL file has no main sub.\n");
+        ecli_runtime_free(rt);
+        return EXIT_FAILURE;
+    }
+    
+    /* Where the script output goes */
+    FILE* out = NULL;
+    if(quiet) {
+        ecli_set_output(rt, NULL);
+    } else if(output != NULL && !shared) {
+        out = fopen(output, "w");
+        if(out == NULL) {
+            fprintf(stderr, "Failed to open output file %s\n", output);
+            ecli_runtime_free(rt);
+            return EXIT_FAILURE;
+        }
+        ecli_set_output(rt, out);
+    }
+    
+    /* Each difficulty of a shared run has its own output and report */
+    FILE* outs[DIFFICULTY_COUNT] = {NULL};
+    FILE* reports[DIFFICULTY_COUNT] = {NULL};
+    if(shared) {
+        ecli_result_t opened = ECLI_SUCCESS;
+        for(unsigned int d = 0; d < DIFFICULTY_COUNT; d++) {
+            if(!(ranks & (1 << d))) {
+                continue;
+            }
+            if(output != NULL) {
+                char path[4096];
+                snprintf(path, sizeof(path), "%s.%s", output, difficulty_names[d]);
+                outs[d] = fopen(path, "w");
+                if(outs[d] == NULL) {
+                    fprintf(stderr, "Failed to open output file %s\n", path);
+                    opened = ECLI_FAILURE;
+                }
+            } else if(!quiet) {
+                outs[d] = tmpfile();
+            }
+            reports[d] = tmpfile();
+            if((outs[d] == NULL && !quiet) || reports[d] == NULL) {
+                opened = ECLI_FAILURE;
+            }
+        }
+        if(SUCCESS(opened)) {
+            opened = ecli_set_ranks(rt, ranks, outs);
+        }
+        if(!SUCCESS(opened)) {
+            for(unsigned int d = 0; d < DIFFICULTY_COUNT; d++) {
+                if(outs[d]) {
+                    fclose(outs[d]);
+                }
+                if(reports[d]) {
+                    fclose(reports[d]);
+                }
+            }
+            if(out != NULL) {
+                fclose(out);
+            }
+            ecli_runtime_free(rt);
+            return EXIT_FAILURE;
+        }
+    }
+    if(writer && !SUCCESS(ecli_set_output_thread(rt, 1))) {
+        fprintf(stderr, "Failed to start the output writer thread.\n");
+    }
+    
+    ecli_result_t result = ecli_spawn(rt, "main");
+    if(debug) {
+        ecli_set_debugger(rt, stdin);
+    }
+    
+    if(coverage) {
+        ecli_set_coverage(rt, 1);
+    }
+    if(sample && !SUCCESS(ecli_set_sampling(rt, SAMPLE_HZ))) {
+        fprintf(stderr, "Failed to start sampling.\n");
+        sample = 0;
+    }
+    
+    /* Run frames until every VM is done */
+    while(result == ECLI_SUCCESS) {
+        result = ecli_step(rt);
+    }
+    ecli_set_sampling(rt, 0);
+    
+    int status;
+    if(!shared) {
+        status = report_run(rt, result, coverage, folded, server_config.memo, stderr);
+    } else {
+        /* Every process of a shared run reports for the difficulties it ran,
+           and the one which started it waits for the others and prints it all */
+        uint8_t mine = ecli_get_ranks(rt);
+        int failed;
+        status = EXIT_SUCCESS;
+        for(unsigned int d = 0; d < DIFFICULTY_COUNT; d++) {
+            if(mine & (1 << d)) {
+                status |= report_run(rt, result, NULL, NULL, server_config.memo, reports[d]);
+            }
+        }
+        ecli_set_output(rt, NULL);
+        int root = ecli_ranks_wait(rt, &failed);
+        if(failed) {
+            status = EXIT_FAILURE;
+        }
+        for(unsigned int d = 0; d < DIFFICULTY_COUNT; d++) {
+            if(root && outs[d] && output == NULL) {
+                printf("== %s ==\n", difficulty_names[d]);
+                copy_lines(outs[d], stdout, NULL);
+            }
+            if(root && reports[d]) {
+                copy_lines(reports[d], stderr, difficulty_names[d]);
+            }
+            if(outs[d]) {
+                fclose(outs[d]);
+            }
+            if(reports[d]) {
+                fclose(reports[d]);
+            }
+        }
+    }
+    
+    ecli_runtime_free(rt);
+    if(out != NULL) {
+        fclose(out);
+    }
+
+    return status;
+}
@@ -0,0 +1,609 @@
+/**
+ * Purity analysis and memoization of pure subs
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+// Work arrays of the purity analysis, sized for the longest sub
+typedef struct {
+    uint64_t* written; // before each op, what was written on every path to it
+    uint8_t* reached;
+    uint8_t* queued;
+    uint32_t* work;
+} purity_ctx_t;
+
+/**
+ * Record an I or F variable a sub writes. Returns 0 if it writes too many.
+ **/
+static int
+purity_add_var(ecl_code_t* code, int32_t slot)
+{
+    for(uint32_t i = 0; i < code->pure_var_count; i++) {
+        if(code->pure_vars[i] == slot) {
+            return 1;
+        }
+    }
+    if(code->pure_var_count == MEMO_MAX_VARS) {
+        return 0;
+    }
+    code->pure_vars[code->pure_var_count++] = slot;
+    return 1;
+}
+
+/**
+ * Check the ops of a sub one by one, collecting the variables it writes:
+ * only the stack, arithmetic and jumps are allowed, without time labels
+ **/
+static int
+purity_scan(ecl_code_t* code)
+{
+    ecl_op_t* entry = &code->ops[0];
+    
+    if(!(code->flags & CODE_VERIFIED) || code->count == 0 || entry->id != INS_STACKALLOC ||
+       entry->nparams == 0 || (entry->rank_mask & 0x0F) != 0x0F ||
+       (entry->params[0].u >> 2) > MEMO_MAX_LOCALS) {
+        return 0;
+    }
+    for(uint32_t i = 0; i < code->count; i++) {
+        ecl_op_t* op = &code->ops[i];
+        const ins_format_t* format = ins_get_format(op->id);
+        
+        if(op->time != 0 || format == NULL || (op->nparams == 0 && format->format[0] != '\0')) {
+            return 0;
+        }
+        switch(op->id) {
+            case INS_STACKALLOC:
+                if(op != entry) {
+                    return 0;
+                }
+                break;
+            
+            case INS_JMPEQ:
+            case INS_JMPNEQ:
+            case INS_JMPTIME:
+                if(op->params[1].u == MEMO_TIME_UNSET) {
+                    return 0;
+                }
+                // fallthrough
+            case INS_JMP:
+                if(op->target == NULL || op->target == entry) {
+                    return 0;
+                }
+                break;
+            
+            case INS_BLOCK:
+                for(uint32_t j = 0; j < op->block->count; j++) {
+                    ecl_reg_operand_t* dst = &op->block->ops[j].dst;
+                    if(dst->kind == REG_VAR && state_variable_purity(dst->index) == PURITY_VM &&
+                       !purity_add_var(code, dst->index)) {
+                        return 0;
+                    }
+                }
+                break;
+            
+            case INS_NOP:
+            case INS_UNKNOWN21:
+            case INS_DEBUG22:
+            case INS_RET:
+            case INS_PUSH:
+            case INS_SET:
+            case INS_PUSHF:
+            case INS_SETF:
+            case INS_MOVE:
+            case INS_MOVEF:
+            case INS_ADDI:
+            case INS_ADDF:
+            case INS_SUBF:
+            case INS_MULI:
+            case INS_MULF:
+            case INS_DIVF:
+            case INS_MODI:
+            case INS_EQI:
+            case INS_LESSI:
+            case INS_LEQI:
+            case INS_GEQI:
+            case INS_DECI:
+            case INS_SIN:
+            case INS_COS:
+            case INS_CIRCLEPOS:
+            case INS_VALIDRAD:
+            case INS_NEGI:
+            case INS_NEGF:
+            case INS_GETANG:
+            case INS_SQRT:
+                break;
+            
+            default:
+                return 0;
+        }
+        for(unsigned int j = 0; j < op->nparams; j++) {
+            int32_t slot = op->params[j].i;
+            if(ins_writes_param(op->id, j) && slot < -1 && state_variable_purity(slot) == PURITY_VM &&
+               !purity_add_var(code, slot)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Follow a read or write of a variable slot through the written mask. A
+ * local read before it is written raises needs to the locals the arguments
+ * have to fill in. Returns 0 if the access isn't pure.
+ **/
+static int
+purity_access(ecl_code_t* code, int32_t slot, int write, uint64_t* written, uint32_t* needs)
+{
+    uint64_t bit;
+    
+    if(slot == -1) {
+        return 1; // the stack
+    } else if(slot >= 0) {
+        if((slot >> 2) >= MEMO_MAX_LOCALS) {
+            return 0;
+        }
+        bit = (uint64_t)1 << (slot >> 2);
+        if(!write && !(*written & bit) && (uint32_t)(slot >> 2) + 1 > *needs) {
+            *needs = (slot >> 2) + 1;
+        }
+    } else {
+        variable_purity_t purity = state_variable_purity(slot);
+        if(purity != PURITY_VM) {
+            return (purity == PURITY_DIFFICULTY) && !write;
+        }
+        uint32_t i = 0;
+        while(i < code->pure_var_count && code->pure_vars[i] != slot) {
+            i++;
+        }
+        if(i == code->pure_var_count) {
+            return 0; // read but never written
+        }
+        bit = (uint64_t)1 << (MEMO_MAX_LOCALS + i);
+        if(!write && !(*written & bit)) {
+            return 0; // the caller's value
+        }
+    }
+    if(write) {
+        *written |= bit;
+    }
+    return 1;
+}
+
+/**
+ * Follow the variables an op reads and writes, reads first
+ **/
+static int
+purity_op(ecl_code_t* code, ecl_op_t* op, uint64_t* written, uint32_t* needs)
+{
+    if(op->id == INS_BLOCK) {
+        for(uint32_t i = 0; i < op->block->count; i++) {
+            ecl_reg_op_t* r = &op->block->ops[i];
+            ecl_reg_operand_t* operands[3] = {&r->a, &r->b, &r->dst};
+            for(unsigned int j = 0; j < 3; j++) {
+                ecl_reg_operand_t* o = operands[j];
+                int32_t slot = (o->kind == REG_LOCAL) ? (o->index << 2) : o->index;
+                if((o->kind == REG_LOCAL || o->kind == REG_VAR) &&
+                   !purity_access(code, slot, j == 2, written, needs)) {
+                    return 0;
+                }
+            }
+        }
+        return 1;
+    }
+    
+    for(int write = 0; write <= 1; write++) {
+        for(unsigned int i = 0; i < op->nparams; i++) {
+            int writes = ins_writes_param(op->id, i);
+            int reads = (op->param_mask & (1 << i)) &&
+                        (!writes || op->id == INS_DECI || op->id == INS_VALIDRAD);
+            if((write ? writes : reads) && !purity_access(code, op->params[i].i, write, written, needs)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Queue an op with what was written on the way to it, keeping only what
+ * was written on every way
+ **/
+static void
+purity_merge(purity_ctx_t* ctx, uint32_t* nwork, uint32_t idx, uint64_t written)
+{
+    if(ctx->reached[idx] && (ctx->written[idx] & written) == ctx->written[idx]) {
+        return;
+    }
+    ctx->written[idx] = ctx->reached[idx] ? (ctx->written[idx] & written) : written;
+    ctx->reached[idx] = 1;
+    if(!ctx->queued[idx]) {
+        ctx->queued[idx] = 1;
+        ctx->work[(*nwork)++] = idx;
+    }
+}
+
+/**
+ * Run the analysis of what is written before it is read over one sub for
+ * one difficulty. The mask only shrinks, so the reads seen on the last
+ * visit of each op are the ones that count, and they need the most.
+ **/
+static int
+purity_flow(ecl_code_t* code, uint8_t difficulty, purity_ctx_t* ctx, uint32_t* needs)
+{
+    uint32_t nwork = 0;
+    
+    memset(ctx->reached, 0, code->count + 1);
+    memset(ctx->queued, 0, code->count + 1);
+    purity_merge(ctx, &nwork, 0, 0);
+    
+    while(nwork > 0) {
+        uint32_t idx = ctx->work[--nwork];
+        ecl_op_t* op = &code->ops[idx];
+        uint64_t written = ctx->written[idx];
+        ecl_op_t* succ[2] = {op + 1, NULL};
+        
+        ctx->queued[idx] = 0;
+        if(op->src == NULL) {
+            continue; // never reached in verified subs
+        }
+        if(difficulty & op->rank_mask) {
+            if(!purity_op(code, op, &written, needs)) {
+                return 0;
+            }
+            switch(op->id) {
+                case INS_RET:
+                    succ[0] = NULL;
+                    break;
+                case INS_JMP:
+                case INS_JMPTIME:
+                    succ[0] = op->target;
+                    break;
+                case INS_JMPEQ:
+                case INS_JMPNEQ:
+                    succ[1] = op->target;
+                    break;
+                default:
+                    break;
+            }
+        }
+        for(unsigned int i = 0; i < 2; i++) {
+            if(succ[i]) {
+                purity_merge(ctx, &nwork, succ[i] - code->ops, written);
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Find the pure subs of a verified file, whose calls can be memoized
+ **/
+void
+ecl_code_purity(th10_ecl_t* ecl)
+{
+    uint32_t count = ecl->header->sub_count;
+    uint32_t max_ops = 0;
+    purity_ctx_t ctx;
+    
+    for(uint32_t i = 0; i < count; i++) {
+        if(ecl->code[i].count > max_ops) {
+            max_ops = ecl->code[i].count;
+        }
+    }
+    ctx.written = xmalloc(sizeof(uint64_t) * (max_ops + 1));
+    ctx.reached = xmalloc(max_ops + 1);
+    ctx.queued = xmalloc(max_ops + 1);
+    ctx.work = xmalloc(sizeof(uint32_t) * (max_ops + 1));
+    
+    for(uint32_t i = 0; i < count; i++) {
+        ecl_code_t* code = &ecl->code[i];
+        uint32_t needs = 0;
+        int pure;
+        
+        code->flags &= ~CODE_PURE;
+        code->pure_var_count = 0;
+        pure = purity_scan(code);
+        for(uint8_t d = DIFF_EASY; pure && d <= DIFF_LUNATIC; d <<= 1) {
+            pure = purity_flow(code, d, &ctx, &needs);
+        }
+        if(pure) {
+            code->flags |= CODE_PURE;
+            code->pure_args = needs;
+        }
+    }
+    
+    xfree(ctx.written);
+    xfree(ctx.reached);
+    xfree(ctx.queued);
+    xfree(ctx.work);
+}
+
+/**
+ * Create an empty memo keeping at most capacity entries
+ **/
+ecli_memo_t*
+memo_create(uint32_t capacity)
+{
+    ecli_memo_t* memo = xmalloc(sizeof(ecli_memo_t));
+    memset(memo, 0, sizeof(ecli_memo_t));
+    memo->capacity = capacity ? capacity : 1;
+    
+    uint32_t buckets = 16;
+    while(buckets < memo->capacity && buckets < 0x40000000) {
+        buckets <<= 1;
+    }
+    memo->buckets = xmalloc(sizeof(memo_entry_t*) * buckets);
+    memset(memo->buckets, 0, sizeof(memo_entry_t*) * buckets);
+    memo->bucket_mask = buckets - 1;
+    return memo;
+}
+
+/**
+ * Drop every entry, for a new file. The counters are kept.
+ **/
+void
+memo_clear(ecli_memo_t* memo)
+{
+    memo_entry_t* e = memo->head;
+    while(e) {
+        memo_entry_t* next = e->next;
+        xfree(e);
+        e = next;
+    }
+    memset(memo->buckets, 0, sizeof(memo_entry_t*) * (memo->bucket_mask + 1));
+    memo->head = NULL;
+    memo->tail = NULL;
+    memo->count = 0;
+}
+
+/**
+ * Free a memo and its entries
+ **/
+void
+memo_free(ecli_memo_t* memo)
+{
+    memo_clear(memo);
+    xfree(memo->buckets);
+    xfree(memo);
+}
+
+static uint32_t
+memo_hash(ecl_code_t* code, uint8_t difficulty, const ecl_value_t* args, uint32_t nargs)
+{
+    uint64_t p = (uintptr_t)code;
+    uint32_t h = FNV_OFFSET;
+    
+    h = (h ^ (uint32_t)p) * FNV_PRIME;
+    h = (h ^ (uint32_t)(p >> 32)) * FNV_PRIME;
+    h = (h ^ (difficulty | (nargs << 8))) * FNV_PRIME;
+    for(uint32_t i = 0; i < nargs; i++) {
+        h = (h ^ args[i].type) * FNV_PRIME;
+        h = (h ^ args[i].u) * FNV_PRIME;
+    }
+    return h;
+}
+
+/**
+ * Find the entry of a call, NULL if there is none
+ **/
+static memo_entry_t*
+memo_find(ecli_memo_t* memo, uint32_t hash, ecl_code_t* code, uint8_t difficulty,
+          const ecl_value_t* args, uint32_t nargs)
+{
+    for(memo_entry_t* e = memo->buckets[hash & memo->bucket_mask]; e; e = e->chain) {
+        if(e->hash != hash || e->code != code || e->difficulty != difficulty || e->nargs != nargs) {
+            continue;
+        }
+        uint32_t i;
+        for(i = 0; i < nargs; i++) {
+            if(e->values[i].type != args[i].type || e->values[i].u != args[i].u) {
+                break;
+            }
+        }
+        if(i == nargs) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void
+memo_unlink(ecli_memo_t* memo, memo_entry_t* e)
+{
+    if(e->prev) {
+        e->prev->next = e->next;
+    } else {
+        memo->head = e->next;
+    }
+    if(e->next) {
+        e->next->prev = e->prev;
+    } else {
+        memo->tail = e->prev;
+    }
+}
+
+static void
+memo_push_front(ecli_memo_t* memo, memo_entry_t* e)
+{
+    e->prev = NULL;
+    e->next = memo->head;
+    if(memo->head) {
+        memo->head->prev = e;
+    } else {
+        memo->tail = e;
+    }
+    memo->head = e;
+}
+
+/**
+ * Drop the least recently used entry
+ **/
+static void
+memo_evict(ecli_memo_t* memo)
+{
+    memo_entry_t* e = memo->tail;
+    memo_entry_t** link = &memo->buckets[e->hash & memo->bucket_mask];
+    
+    while(*link != e) {
+        link = &(*link)->chain;
+    }
+    *link = e->chain;
+    memo_unlink(memo, e);
+    xfree(e);
+    memo->count--;
+    memo->stats.evictions++;
+}
+
+/**
+ * Look up a call to a pure sub, whose arguments are written. On a hit, make
+ * the effects of the call and return 1: the caller goes on after the call.
+ * On a miss, start recording the call and return 0: it runs as usual.
+ **/
+int
+memo_call(ecl_state_t* state, ecl_op_t* op)
+{
+    ecli_memo_t* memo = state->rt->memo;
+    ecl_code_t* code = op->callee;
+    uint8_t difficulty = state->rt->global.difficulty;
+    ecl_value_t* args = &state->stack[state->sp + 1];
+    
+    if(op->nargs < code->pure_args || state->sp + code->depth > state->stack_size || state->memo_pending) {
+        return 0;
+    }
+    
+    uint32_t hash = memo_hash(code, difficulty, args, op->nargs);
+    memo_entry_t* e = memo_find(memo, hash, code, difficulty, args, op->nargs);
+    if(e) {
+        ecl_value_t* vars = e->values + e->nargs + code->depth;
+        memcpy(&state->stack[state->sp], e->values + e->nargs, sizeof(ecl_value_t) * code->depth);
+        state->stack[state->sp].type = ECL_UINT32; // the saved base pointer
+        state->stack[state->sp].u = state->bp;
+        for(uint32_t i = 0; i < code->pure_var_count; i++) {
+            state_set_variable(state, code->pure_vars[i], &vars[i]);
+        }
+        if(e->time_set) {
+            state->time = e->time;
+        }
+        state->args = 0;
+        if(e != memo->head) {
+            memo_unlink(memo, e);
+            memo_push_front(memo, e);
+        }
+        memo->stats.hits++;
+        return 1;
+    }
+    
+    memo->stats.misses++;
+    e = xmalloc(sizeof(memo_entry_t) + sizeof(ecl_value_t) * (op->nargs + code->depth + code->pure_var_count));
+    e->values = (ecl_value_t*)(e + 1);
+    memcpy(e->values, args, sizeof(ecl_value_t) * op->nargs);
+    e->hash = hash;
+    e->code = code;
+    e->difficulty = difficulty;
+    e->nargs = op->nargs;
+    e->csp = state->csp;
+    e->caller_time = state->time;
+    state->time = MEMO_TIME_UNSET;
+    state->memo_pending = e;
+    return 0;
+}
+
+/**
+ * Move every entry, and the calls being recorded, to another difficulty.
+ * When a shared run splits (see ranks.h) what was recorded for the lowest
+ * difficulty of the set holds for each difficulty split off from it.
+ **/
+void
+memo_rekey(ecli_runtime_t* rt, uint8_t difficulty)
+{
+    ecli_memo_t* memo = rt->memo;
+    
+    memset(memo->buckets, 0, sizeof(memo_entry_t*) * (memo->bucket_mask + 1));
+    for(memo_entry_t* e = memo->head; e; e = e->next) {
+        e->difficulty = difficulty;
+        e->hash = memo_hash(e->code, difficulty, e->values, e->nargs);
+        e->chain = memo->buckets[e->hash & memo->bucket_mask];
+        memo->buckets[e->hash & memo->bucket_mask] = e;
+    }
+    for(uint32_t n = 0; n < rt->vms.count; n++) {
+        memo_entry_t* e = vm_table_at(&rt->vms, n)->memo_pending;
+        if(e) {
+            e->difficulty = difficulty;
+            e->hash = memo_hash(e->code, difficulty, e->values, e->nargs);
+        }
+    }
+}
+
+/**
+ * Finish recording a call when the sub returns, and put it in the memo
+ **/
+void
+memo_return(ecl_state_t* state)
+{
+    memo_entry_t* e = state->memo_pending;
+    ecli_memo_t* memo = state->rt->memo;
+    ecl_code_t* code = e->code;
+    
+    if(state->csp != e->csp) {
+        return;
+    }
+    state->memo_pending = NULL;
+    e->time_set = (state->time != MEMO_TIME_UNSET);
+    e->time = state->time;
+    if(!e->time_set) {
+        state->time = e->caller_time;
+    }
+    
+    // Memoization was turned off or the difficulty changed during the call,
+    // or another VM recorded the same call first
+    if(memo == NULL || state->rt->global.difficulty != e->difficulty ||
+       memo_find(memo, e->hash, code, e->difficulty, e->values, e->nargs)) {
+        xfree(e);
+        return;
+    }
+    
+    ecl_value_t* vars = e->values + e->nargs + code->depth;
+    memcpy(e->values + e->nargs, &state->stack[state->sp], sizeof(ecl_value_t) * code->depth);
+    for(uint32_t i = 0; i < code->pure_var_count; i++) {
+        state_get_variable(state, code->pure_vars[i], &vars[i]);
+    }
+    
+    if(memo->count == memo->capacity) {
+        memo_evict(memo);
+    }
+    memo_entry_t** bucket = &memo->buckets[e->hash & memo->bucket_mask];
+    e->chain = *bucket;
+    *bucket = e;
+    memo_push_front(memo, e);
+    memo->count++;
+}
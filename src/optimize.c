@@ -0,0 +1,395 @@
+/**
+ * Peephole optimizer for decoded subs
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+
+/*
+ * The optimizer marks ops as removed or rewrites them in place until nothing
+ * changes, then compacts each sub. An op is only removed when the op after it
+ * runs at the same time or later, so waiting for the later op also waits for
+ * the removed one and every time label keeps its effect. Ops are only merged
+ * when they share a time and rank mask, and only the first of them may be a
+ * jump target. Jumps to removed ops move to the next op that is left.
+ */
+
+typedef struct {
+    ecl_code_t* code;
+    uint8_t* removed;
+    uint8_t* target; // op is the target of a jump
+    ecl_value_t** moved; // value of the push merged into a move
+    ecl_opt_stats_t* stats;
+} opt_ctx_t;
+
+/**
+ * Index of the next op which hasn't been removed, or of the end marker
+ **/
+static uint32_t
+next_live(opt_ctx_t* c, uint32_t i)
+{
+    do {
+        i++;
+    } while(i < c->code->count && c->removed[i]);
+    return i;
+}
+
+/**
+ * Whether an op can be removed without changing when its successor runs
+ **/
+static int
+removable(opt_ctx_t* c, uint32_t i)
+{
+    return c->code->ops[next_live(c, i)].time >= c->code->ops[i].time;
+}
+
+/**
+ * Remove an op, passing on its jump target status
+ **/
+static void
+remove_op(opt_ctx_t* c, uint32_t i)
+{
+    c->removed[i] = 1;
+    if(c->target[i]) {
+        c->target[next_live(c, i)] = 1;
+    }
+    c->stats->removed++;
+}
+
+/**
+ * Whether two ops run together: same time and same difficulties, with the
+ * second not reachable by a jump
+ **/
+static int
+same_group(opt_ctx_t* c, uint32_t i, uint32_t j)
+{
+    ecl_op_t* ops = c->code->ops;
+    return (j < c->code->count) && !c->target[j] &&
+           (ops[i].time == ops[j].time) && (ops[i].rank_mask == ops[j].rank_mask);
+}
+
+/**
+ * Whether an op pushes an immediate value
+ **/
+static int
+is_constant_push(ecl_op_t* op)
+{
+    return (op->id == INS_PUSH || op->id == INS_PUSHF) && op->nparams == 1 && op->param_mask == 0;
+}
+
+/**
+ * Compute a binary operation on two constants exactly as the interpreter
+ * would. Returns 0 if it can't be folded.
+ **/
+static int
+fold_binary(uint16_t id, ecl_value_t* a, ecl_value_t* b, ecl_value_t* result)
+{
+    ecl_value_t top = *a;
+    
+    switch(id) {
+        case INS_ADDI:
+            top.i = (int32_t)((uint32_t)top.i + (uint32_t)b->i);
+            top.type = ECL_INT32;
+            break;
+        case INS_MULI:
+            top.i = (int32_t)((uint32_t)top.i * (uint32_t)b->i);
+            top.type = ECL_INT32;
+            break;
+        case INS_MODI:
+            if(b->i == 0 || b->i == -1) {
+                return 0; // leave the runtime behaviour alone
+            }
+            top.i = top.i % b->i;
+            top.type = ECL_INT32;
+            break;
+        case INS_EQI:
+            top.i = (top.i == b->i) ? 1 : 0;
+            top.type = ECL_INT32;
+            break;
+        case INS_LESSI:
+            top.i = (top.i < b->i) ? 1 : 0;
+            top.type = ECL_INT32;
+            break;
+        case INS_LEQI:
+            top.i = (top.i <= b->i) ? 1 : 0;
+            top.type = ECL_INT32;
+            break;
+        case INS_GEQI:
+            top.i = (top.i >= b->i) ? 1 : 0;
+            top.type = ECL_INT32;
+            break;
+        case INS_ADDF:
+            top.f += b->f;
+            top.type = ECL_FLOAT32;
+            break;
+        case INS_SUBF:
+            top.f -= b->f;
+            top.type = ECL_FLOAT32;
+            break;
+        case INS_MULF:
+            top.f *= b->f;
+            top.type = ECL_FLOAT32;
+            break;
+        case INS_DIVF:
+            top.f /= b->f;
+            top.type = ECL_FLOAT32;
+            break;
+        default:
+            return 0;
+    }
+    
+    *result = top;
+    return 1;
+}
+
+/**
+ * Compute a unary operation on a constant, like fold_binary()
+ **/
+static int
+fold_unary(uint16_t id, ecl_value_t* a, ecl_value_t* result)
+{
+    ecl_value_t top = *a;
+    
+    switch(id) {
+        case INS_NEGI:
+            top.i = (int32_t)(0u - (uint32_t)top.i);
+            top.type = ECL_INT32;
+            break;
+        case INS_NEGF:
+            top.f = -top.f;
+            top.type = ECL_FLOAT32;
+            break;
+        case INS_SIN:
+            top.f = fmath_sin(top.f);
+            top.type = ECL_FLOAT32;
+            break;
+        case INS_COS:
+            top.f = fmath_cos(top.f);
+            top.type = ECL_FLOAT32;
+            break;
+        default:
+            return 0;
+    }
+    
+    *result = top;
+    return 1;
+}
+
+/**
+ * Try every rewrite on the op at i. Returns 1 if something changed.
+ **/
+static int
+optimize_op(opt_ctx_t* c, uint32_t i)
+{
+    ecl_op_t* ops = c->code->ops;
+    ecl_op_t* op = &ops[i];
+    uint32_t j = next_live(c, i);
+    uint32_t k = (j < c->code->count) ? next_live(c, j) : j;
+    
+    // nop, and jumps to where execution would go anyway (jmp doesn't set the time)
+    if(op->id == INS_NOP && removable(c, i)) {
+        remove_op(c, i);
+        c->stats->nops++;
+        return 1;
+    }
+    if(op->id == INS_JMP && op->target != NULL) {
+        uint32_t t = op->target - ops;
+        if(t < c->code->count && c->removed[t]) {
+            t = next_live(c, t);
+        }
+        if(t == j && removable(c, i)) {
+            remove_op(c, i);
+            c->stats->jumps++;
+            return 1;
+        }
+    }
+    
+    if(is_constant_push(op) && same_group(c, i, j)) {
+        // Conditional branch on a constant
+        if((ops[j].id == INS_JMPEQ || ops[j].id == INS_JMPNEQ) && ops[j].target != NULL) {
+            int taken = (op->params[0].i == 0) == (ops[j].id == INS_JMPEQ);
+            if(taken) {
+                ops[j].id = INS_JMPTIME;
+                remove_op(c, i);
+            } else if(removable(c, j)) {
+                remove_op(c, i);
+                remove_op(c, j);
+            } else {
+                return 0;
+            }
+            c->stats->branches++;
+            return 1;
+        }
+        
+        // Arithmetic or comparison on two constants
+        ecl_value_t result;
+        if(fold_unary(ops[j].id, &op->params[0], &result)) {
+            op->params[0] = result;
+            op->id = (result.type == ECL_FLOAT32) ? INS_PUSHF : INS_PUSH;
+            remove_op(c, j);
+            c->stats->folded++;
+            return 1;
+        }
+        if(is_constant_push(&ops[j]) && same_group(c, j, k) &&
+           fold_binary(ops[k].id, &op->params[0], &ops[j].params[0], &result)) {
+            op->params[0] = result;
+            op->id = (result.type == ECL_FLOAT32) ? INS_PUSHF : INS_PUSH;
+            remove_op(c, j);
+            remove_op(c, k);
+            c->stats->folded++;
+            return 1;
+        }
+    }
+    
+    // push followed by set
+    if((op->id == INS_PUSH || op->id == INS_PUSHF) && op->nparams == 1 && same_group(c, i, j) &&
+       (ops[j].id == INS_SET || ops[j].id == INS_SETF) && ops[j].nparams == 1) {
+        ops[j].id = (ops[j].id == INS_SET) ? INS_MOVE : INS_MOVEF;
+        ops[j].param_mask = (op->param_mask & 1) << 1;
+        c->moved[j] = &op->params[0];
+        remove_op(c, i);
+        c->stats->moves++;
+        return 1;
+    }
+    
+    return 0;
+}
+
+/**
+ * Build the sub's new op and parameter arrays without the removed ops
+ **/
+static void
+optimize_compact(opt_ctx_t* c)
+{
+    ecl_code_t* code = c->code;
+    uint32_t* map = xmalloc(sizeof(uint32_t) * (code->count + 1));
+    uint32_t live = 0, nparams = 0;
+    
+    // Removed ops map to the next op that is left
+    for(uint32_t i = 0; i <= code->count; i++) {
+        map[i] = live;
+        if(i == code->count || !c->removed[i]) {
+            live++;
+            nparams += code->ops[i].nparams + (c->moved[i] ? 1 : 0);
+        }
+    }
+    live--; // the end marker
+    
+    ecl_op_t* ops = xmalloc(sizeof(ecl_op_t) * (live + 1));
+    ecl_value_t* params = xmalloc(sizeof(ecl_value_t) * (nparams ? nparams : 1));
+    ecl_value_t* p = params;
+    
+    for(uint32_t i = 0; i <= code->count; i++) {
+        if(i < code->count && c->removed[i]) {
+            continue;
+        }
+        ecl_op_t* op = &ops[map[i]];
+        *op = code->ops[i];
+        memcpy(p, code->ops[i].params, sizeof(ecl_value_t) * op->nparams);
+        op->params = p;
+        if(c->moved[i]) {
+            p[1] = *c->moved[i];
+            op->nparams = 2;
+        }
+        p += op->nparams;
+        if(op->target) {
+            op->target = &ops[map[op->target - code->ops]];
+        }
+    }
+    
+    xfree(code->ops);
+    xfree(code->params);
+    code->ops = ops;
+    code->params = params;
+    code->count = live;
+    xfree(map);
+}
+
+/**
+ * Optimize one sub
+ **/
+static void
+optimize_sub(ecl_code_t* code, ecl_opt_stats_t* stats)
+{
+    opt_ctx_t c;
+    c.code = code;
+    c.stats = stats;
+    c.removed = xmalloc(code->count + 1);
+    c.target = xmalloc(code->count + 1);
+    c.moved = xmalloc(sizeof(ecl_value_t*) * (code->count + 1));
+    memset(c.removed, 0, code->count + 1);
+    memset(c.target, 0, code->count + 1);
+    memset(c.moved, 0, sizeof(ecl_value_t*) * (code->count + 1));
+    
+    for(uint32_t i = 0; i < code->count; i++) {
+        if(code->ops[i].target) {
+            c.target[code->ops[i].target - code->ops] = 1;
+        }
+    }
+    
+    int changed;
+    do {
+        changed = 0;
+        for(uint32_t i = 0; i < code->count; i = next_live(&c, i)) {
+            if(!c.removed[i]) {
+                changed |= optimize_op(&c, i);
+            }
+        }
+    } while(changed);
+    
+    stats->ops += code->count;
+    optimize_compact(&c);
+    
+    xfree(c.removed);
+    xfree(c.target);
+    xfree(c.moved);
+}
+
+/**
+ * Run the peephole optimizer over every sub of a file, then verify it again
+ * so the stack sizes match the new code. Level 2 first inlines calls to subs
+ * of up to inline_limit ops (none if 0), and afterwards translates the stack
+ * arithmetic into register blocks.
+ **/
+void
+ecl_code_optimize(th10_ecl_t* ecl, int level, uint32_t inline_limit, ecl_opt_stats_t* stats)
+{
+    memset(stats, 0, sizeof(ecl_opt_stats_t));
+    ecl_code_free_streams(ecl);
+    if(level > 1 && inline_limit > 0) {
+        ecl_code_inline(ecl, inline_limit, stats);
+    }
+    for(uint32_t i = 0; i < ecl->header->sub_count; i++) {
+        optimize_sub(&ecl->code[i], stats);
+    }
+    ecl_code_verify(ecl, NULL);
+    if(level > 1) {
+        ecl_code_regir(ecl, stats);
+        ecl_code_verify(ecl, NULL);
+    }
+}
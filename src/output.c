@@ -0,0 +1,278 @@
+/**
+ * Buffered sink for the output of the debug print instructions
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_SETITIMER)
+# include <signal.h>
+#endif
+
+/**
+ * Initialize a sink which discards its output
+ **/
+void
+output_init(ecli_output_t* o)
+{
+    memset(o, 0, sizeof(ecli_output_t));
+    o->kind = OUTPUT_NULL;
+    strbuf_init(&o->buf);
+}
+
+/**
+ * Write a buffer to the files of a sink and empty it
+ **/
+static void
+output_write(ecli_output_t* o, strbuf_t* buf)
+{
+    if(buf->len > 0) {
+        fwrite(buf->data, 1, buf->len, o->f);
+        fflush(o->f);
+        for(unsigned int i = 0; i < o->more_count; i++) {
+            fwrite(buf->data, 1, buf->len, o->more[i]);
+            fflush(o->more[i]);
+        }
+        buf->len = 0;
+    }
+}
+
+#ifdef HAVE_PTHREAD
+
+/**
+ * Writer thread: write each buffer handed over until told to stop
+ **/
+static void*
+output_thread(void* arg)
+{
+    ecli_output_t* o = arg;
+    
+#ifdef HAVE_SETITIMER
+    // The sampler's signal belongs to the thread running the VMs
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+#endif
+    pthread_mutex_lock(&o->lock);
+    for(;;) {
+        while(!o->busy && !o->stop) {
+            pthread_cond_wait(&o->cond, &o->lock);
+        }
+        if(!o->busy) {
+            break; // stopping with nothing left to write
+        }
+        
+        // The interpreter doesn't touch pending or f while busy is set
+        pthread_mutex_unlock(&o->lock);
+        output_write(o, &o->pending);
+        pthread_mutex_lock(&o->lock);
+        
+        o->busy = 0;
+        pthread_cond_broadcast(&o->cond);
+    }
+    pthread_mutex_unlock(&o->lock);
+    
+    return NULL;
+}
+
+/**
+ * Wait until the writer thread has written everything handed to it
+ **/
+static void
+output_wait_idle(ecli_output_t* o)
+{
+    pthread_mutex_lock(&o->lock);
+    while(o->busy) {
+        pthread_cond_wait(&o->cond, &o->lock);
+    }
+    pthread_mutex_unlock(&o->lock);
+}
+
+/**
+ * Hand the current buffer to the writer thread, waiting for the previous one
+ * to be written first
+ **/
+static void
+output_hand_over(ecli_output_t* o)
+{
+    pthread_mutex_lock(&o->lock);
+    while(o->busy) {
+        pthread_cond_wait(&o->cond, &o->lock);
+    }
+    strbuf_t tmp = o->pending;
+    o->pending = o->buf;
+    o->buf = tmp;
+    o->busy = 1;
+    pthread_cond_broadcast(&o->cond);
+    pthread_mutex_unlock(&o->lock);
+}
+
+#endif
+
+/**
+ * Start or stop a thread which writes the output to its file, so the
+ * interpreter doesn't wait for the writes
+ **/
+ecli_result_t
+output_set_threaded(ecli_output_t* o, int threaded)
+{
+#ifdef HAVE_PTHREAD
+    if(!threaded == !o->threaded) {
+        return ECLI_SUCCESS;
+    }
+    
+    if(threaded) {
+        strbuf_init(&o->pending);
+        o->busy = 0;
+        o->stop = 0;
+        pthread_mutex_init(&o->lock, NULL);
+        pthread_cond_init(&o->cond, NULL);
+        if(pthread_create(&o->thread, NULL, output_thread, o) != 0) {
+            pthread_mutex_destroy(&o->lock);
+            pthread_cond_destroy(&o->cond);
+            return ECLI_FAILURE;
+        }
+        o->threaded = 1;
+    } else {
+        output_flush(o);
+        pthread_mutex_lock(&o->lock);
+        o->stop = 1;
+        pthread_cond_broadcast(&o->cond);
+        pthread_mutex_unlock(&o->lock);
+        pthread_join(o->thread, NULL);
+        pthread_mutex_destroy(&o->lock);
+        pthread_cond_destroy(&o->cond);
+        strbuf_free(&o->pending);
+        o->threaded = 0;
+    }
+    return ECLI_SUCCESS;
+#else
+    return threaded ? ECLI_FAILURE : ECLI_SUCCESS;
+#endif
+}
+
+/**
+ * Write out everything buffered so far and wait until it has been written.
+ * Output kept in memory stays where it is.
+ **/
+void
+output_flush(ecli_output_t* o)
+{
+    switch(o->kind) {
+        case OUTPUT_FILE:
+#ifdef HAVE_PTHREAD
+            if(o->threaded) {
+                if(o->buf.len > 0) {
+                    output_hand_over(o);
+                }
+                output_wait_idle(o);
+                break;
+            }
+#endif
+            output_write(o, &o->buf);
+            break;
+        
+        case OUTPUT_NULL:
+            o->buf.len = 0;
+            break;
+        
+        default:
+            break;
+    }
+}
+
+/**
+ * Called at the end of each frame: write the buffer out once it is large
+ * enough to be worth it
+ **/
+void
+output_end_frame(ecli_output_t* o)
+{
+    if(o->kind != OUTPUT_FILE || o->buf.len < OUTPUT_FLUSH_SIZE) {
+        return;
+    }
+#ifdef HAVE_PTHREAD
+    if(o->threaded) {
+        output_hand_over(o);
+        return;
+    }
+#endif
+    output_write(o, &o->buf);
+}
+
+/**
+ * Send the output to a file, or discard it if f is NULL
+ **/
+void
+output_set_file(ecli_output_t* o, FILE* f)
+{
+    output_flush(o);
+    o->buf.len = 0;
+    o->kind = f ? OUTPUT_FILE : OUTPUT_NULL;
+    o->f = f;
+    o->more_count = 0;
+}
+
+/**
+ * Send the same output to several files, at most OUTPUT_MAX_FILES. The
+ * output is discarded if count is 0.
+ **/
+void
+output_set_files(ecli_output_t* o, FILE** files, unsigned int count)
+{
+    output_set_file(o, count ? files[0] : NULL);
+    for(unsigned int i = 1; i < count && i < OUTPUT_MAX_FILES; i++) {
+        o->more[o->more_count++] = files[i];
+    }
+}
+
+/**
+ * Keep the output in memory, starting empty
+ **/
+void
+output_set_memory(ecli_output_t* o)
+{
+    output_flush(o);
+    o->buf.len = 0;
+    o->kind = OUTPUT_MEMORY;
+    o->f = NULL;
+    o->more_count = 0;
+}
+
+/**
+ * Flush the sink, stop its writer thread and free its buffers
+ **/
+void
+output_close(ecli_output_t* o)
+{
+    output_flush(o);
+    output_set_threaded(o, 0);
+    strbuf_free(&o->buf);
+    o->kind = OUTPUT_NULL;
+}
@@ -0,0 +1,193 @@
+/**
+ * Shared runs over several difficulties
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+
+#ifdef HAVE_FORK
+# include <errno.h>
+# include <sys/types.h>
+# include <sys/wait.h>
+# include <unistd.h>
+#endif
+
+/**
+ * Whether an op reads a variable which differs between two difficulties
+ **/
+static int
+ranks_read_differs(int32_t slot, uint8_t a, uint8_t b)
+{
+    int32_t va, vb;
+    return state_difficulty_variable(slot, a, &va) && state_difficulty_variable(slot, b, &vb) && va != vb;
+}
+
+/**
+ * Whether two difficulties run an op the same way: both or neither run it,
+ * and it reads nothing which tells them apart
+ **/
+int
+ranks_agree(ecl_op_t* op, uint8_t a, uint8_t b)
+{
+    if(!(op->rank_mask & a) != !(op->rank_mask & b)) {
+        return 0;
+    }
+    for(unsigned int i = 0; i < op->nparams; i++) {
+        if((op->param_mask & (1 << i)) && ranks_read_differs(op->params[i].i, a, b)) {
+            return 0;
+        }
+    }
+    if(op->id == INS_BLOCK) {
+        for(uint32_t i = 0; i < op->block->count; i++) {
+            ecl_reg_op_t* r = &op->block->ops[i];
+            if((r->a.kind == REG_VAR && ranks_read_differs(r->a.index, a, b)) ||
+               (r->b.kind == REG_VAR && ranks_read_differs(r->b.index, a, b))) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Make the runtime stand for the difficulties of its ranks: the lowest is
+ * the difficulty, the VMs move to the streams of the set and the output goes
+ * to the files of each
+ **/
+void
+ranks_apply(ecli_runtime_t* rt)
+{
+    ecli_ranks_t* ranks = rt->ranks;
+    FILE* files[DIFFICULTY_COUNT];
+    unsigned int count = 0;
+    
+    for(unsigned int d = 0; d < DIFFICULTY_COUNT; d++) {
+        if((ranks->ranks & (1 << d)) && ranks->files[d]) {
+            files[count++] = ranks->files[d];
+        }
+    }
+    output_set_files(&rt->output, files, count);
+    runtime_remap(rt, ranks->ranks);
+    rt->global.difficulty = ranks->ranks & -ranks->ranks;
+}
+
+/**
+ * Run a split op: fork a process for each group of difficulties which agree
+ * on the op but the first, and carry on with this process's group. Returns
+ * the op the VM goes on at, NULL if the run can't be split.
+ **/
+ecl_op_t*
+ranks_split(ecl_state_t* state, ecl_op_t* op)
+{
+    ecli_runtime_t* rt = state->rt;
+    ecli_ranks_t* ranks = rt->ranks;
+    
+#ifdef HAVE_FORK
+    ecl_op_t* split = op->target;
+    uint8_t groups[DIFFICULTY_COUNT];
+    unsigned int count = 0, mine = 0;
+    
+    for(uint8_t left = rt->streams; left; ) {
+        uint8_t first = left & -left;
+        uint8_t group = 0;
+        for(uint8_t d = first; d <= left; d <<= 1) {
+            if((left & d) && ranks_agree(split, first, d)) {
+                group |= d;
+            }
+        }
+        groups[count++] = group;
+        left &= ~group;
+    }
+    
+    // Everything written so far belongs to every group, and the writer
+    // thread doesn't survive a fork
+#ifdef HAVE_PTHREAD
+    int threaded = rt->output.threaded;
+#endif
+    output_set_threaded(&rt->output, 0);
+    output_flush(&rt->output);
+    fflush(NULL);
+    
+    for(unsigned int i = 1; i < count; i++) {
+        pid_t pid = fork();
+        if(pid < 0) {
+            fprintf(stderr, "Failed to split the run: %s\n", strerror(errno));
+            return NULL;
+        }
+        if(pid == 0) {
+            mine = i;
+            ranks->child = 1;
+            ranks->pid_count = 0;
+            break;
+        }
+        ranks->pids[ranks->pid_count++] = pid;
+    }
+    
+    uint8_t difficulty = rt->global.difficulty;
+    ranks->ranks = groups[mine];
+    ranks_apply(rt);
+    if(rt->memo && rt->global.difficulty != difficulty) {
+        memo_rekey(rt, rt->global.difficulty);
+    }
+#ifdef HAVE_PTHREAD
+    output_set_threaded(&rt->output, threaded);
+#endif
+    
+    // The split isn't an instruction of the file, the op runs next
+    state->history_pos--;
+    if(rt->mode == ECLI_MODE_PROFILE) {
+        rt->profile[ins_get_index(INS_SPLIT)]--;
+    }
+    return state->ip;
+#else
+    (void)state;
+    (void)op;
+    (void)ranks;
+    return NULL;
+#endif
+}
+
+/**
+ * Wait for the processes split from this one. failed is set if any of them
+ * failed. Returns 1 in the process which started the run, 0 in the others.
+ **/
+int
+ranks_wait(ecli_ranks_t* ranks, int* failed)
+{
+    *failed = 0;
+#ifdef HAVE_FORK
+    for(unsigned int i = 0; i < ranks->pid_count; i++) {
+        int status;
+        if(waitpid((pid_t)ranks->pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            *failed = 1;
+        }
+    }
+    ranks->pid_count = 0;
+#endif
+    return !ranks->child;
+}
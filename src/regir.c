@@ -0,0 +1,575 @@
+/**
+ * Register blocks translated from stack code
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+
+/*
+ * A run of ops which only move values between the stack and variables and
+ * compute on them (push, set, deci and the arithmetic, compare and math ops
+ * working on the stack), in a verified sub, with one time and rank mask and
+ * no jump into its middle, becomes one INS_BLOCK op.
+ *
+ * The translation runs the stack ops on a virtual stack of operands. A push
+ * of a constant or a local only records it, an op computing on the stack
+ * writes its result to the stack slot it would have been pushed to, and a
+ * set writes straight from the operand, or from the op whose result it
+ * takes. Other variables are read when they are pushed, so variables with
+ * side effects (like the random numbers) are read in the same order, and a
+ * recorded local is copied to its stack slot before the local is written.
+ * Whatever is left on the virtual stack at the end is written to its slot,
+ * so the stack looks the same after the block as after the stack ops.
+ */
+
+typedef struct {
+    ecl_reg_op_t* ops; // register ops of the whole sub
+    uint32_t count;
+    uint32_t cap;
+    ecl_reg_operand_t* stack; // virtual stack, slot 0 at bias
+    int32_t bias;
+    int32_t top;
+    int32_t low;
+    int32_t high;
+    uint32_t start; // first register op of the block being made
+} regir_ctx_t;
+
+/**
+ * Whether an op can be part of a block
+ **/
+static int
+regir_translatable(ecl_op_t* op)
+{
+    unsigned int need = 0;
+    
+    switch(op->id) {
+        case INS_PUSH:
+        case INS_PUSHF:
+        case INS_SET:
+        case INS_SETF:
+        case INS_DECI:
+            need = 1;
+            break;
+        case INS_MOVE:
+        case INS_MOVEF:
+            need = 2;
+            break;
+        case INS_ADDI:
+        case INS_ADDF:
+        case INS_SUBF:
+        case INS_MULI:
+        case INS_MULF:
+        case INS_DIVF:
+        case INS_MODI:
+        case INS_EQI:
+        case INS_LESSI:
+        case INS_LEQI:
+        case INS_GEQI:
+        case INS_NEGI:
+        case INS_NEGF:
+        case INS_SIN:
+        case INS_COS:
+            break;
+        default:
+            return 0;
+    }
+    if(op->nparams < need) {
+        return 0; // fails when run
+    }
+    // Variables of slot -1 pop the stack, that is left to the interpreter
+    for(unsigned int i = 0; i < op->nparams; i++) {
+        if(((op->param_mask & (1 << i)) || ins_writes_param(op->id, i)) && op->params[i].i == -1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Number of stack values an op computing on the stack takes, 0 for the rest
+ **/
+static unsigned int
+regir_arity(uint16_t id)
+{
+    switch(id) {
+        case INS_NEGI:
+        case INS_NEGF:
+        case INS_SIN:
+        case INS_COS:
+            return 1;
+        case INS_ADDI:
+        case INS_ADDF:
+        case INS_SUBF:
+        case INS_MULI:
+        case INS_MULF:
+        case INS_DIVF:
+        case INS_MODI:
+        case INS_EQI:
+        case INS_LESSI:
+        case INS_LEQI:
+        case INS_GEQI:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+static ecl_reg_operand_t
+regir_temp(int32_t slot)
+{
+    ecl_reg_operand_t o;
+    memset(&o, 0, sizeof(o));
+    o.kind = REG_TEMP;
+    o.index = slot;
+    return o;
+}
+
+static ecl_reg_operand_t
+regir_const(int32_t i)
+{
+    ecl_reg_operand_t o;
+    memset(&o, 0, sizeof(o));
+    o.kind = REG_CONST;
+    o.value.type = ECL_INT32;
+    o.value.i = i;
+    return o;
+}
+
+/**
+ * Operand for a variable slot, a local if it is >= 0
+ **/
+static ecl_reg_operand_t
+regir_slot(int32_t slot, char format)
+{
+    ecl_reg_operand_t o;
+    memset(&o, 0, sizeof(o));
+    o.kind = (slot >= 0) ? REG_LOCAL : REG_VAR;
+    o.index = (slot >= 0) ? (slot >> 2) : slot;
+    o.format = format;
+    return o;
+}
+
+/**
+ * Operand for parameter i of an op, read with the given format
+ **/
+static ecl_reg_operand_t
+regir_param(ecl_op_t* op, unsigned int i, char format)
+{
+    if(op->param_mask & (1 << i)) {
+        return regir_slot(op->params[i].i, format);
+    }
+    ecl_reg_operand_t o;
+    memset(&o, 0, sizeof(o));
+    o.kind = REG_CONST;
+    o.value = op->params[i];
+    return o;
+}
+
+static void
+regir_emit(regir_ctx_t* c, uint16_t id, ecl_reg_operand_t dst, ecl_reg_operand_t a, ecl_reg_operand_t b)
+{
+    if(c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->ops = xrealloc(c->ops, sizeof(ecl_reg_op_t) * c->cap);
+    }
+    ecl_reg_op_t* op = &c->ops[c->count++];
+    op->id = id;
+    op->dst = dst;
+    op->a = a;
+    op->b = b;
+}
+
+/**
+ * Put an operand on the virtual stack. Variables other than locals are read
+ * right away.
+ **/
+static void
+regir_push(regir_ctx_t* c, ecl_reg_operand_t o)
+{
+    int32_t slot = c->top++;
+    if(o.kind == REG_VAR) {
+        regir_emit(c, INS_SET, regir_temp(slot), o, regir_const(0));
+        o = regir_temp(slot);
+    }
+    c->stack[c->bias + slot] = o;
+    if(c->top > c->high) {
+        c->high = c->top;
+    }
+}
+
+static ecl_reg_operand_t
+regir_pop(regir_ctx_t* c)
+{
+    int32_t slot = --c->top;
+    if(slot < c->low) {
+        c->low = slot;
+    }
+    return c->stack[c->bias + slot];
+}
+
+/**
+ * Copy the stack values which still are a local to their slots, before the
+ * local changes
+ **/
+static void
+regir_clobber(regir_ctx_t* c, ecl_reg_operand_t dst)
+{
+    if(dst.kind != REG_LOCAL) {
+        return;
+    }
+    for(int32_t slot = c->low; slot < c->top; slot++) {
+        ecl_reg_operand_t* o = &c->stack[c->bias + slot];
+        if(o->kind == REG_LOCAL && o->index == dst.index) {
+            regir_emit(c, INS_SET, regir_temp(slot), *o, regir_const(0));
+            *o = regir_temp(slot);
+        }
+    }
+}
+
+/**
+ * Store a value taken off the stack into a variable. If the op just made
+ * computed it, that op writes the variable instead of the stack slot.
+ **/
+static void
+regir_store(regir_ctx_t* c, ecl_reg_operand_t dst, ecl_reg_operand_t value)
+{
+    ecl_reg_op_t* last = (c->count > c->start) ? &c->ops[c->count - 1] : NULL;
+    
+    if(value.kind == REG_TEMP && last && last->dst.kind == REG_TEMP && last->dst.index == value.index) {
+        // Values the clobber copies are further down the stack than the ones
+        // the op reads, so it can move after the copies
+        ecl_reg_op_t op = *last;
+        c->count--;
+        regir_clobber(c, dst);
+        regir_emit(c, op.id, dst, op.a, op.b);
+    } else {
+        regir_clobber(c, dst);
+        regir_emit(c, INS_SET, dst, value, regir_const(0));
+    }
+}
+
+/**
+ * Translate one stack op onto the virtual stack
+ **/
+static void
+regir_translate(regir_ctx_t* c, ecl_op_t* op)
+{
+    ecl_reg_operand_t a, b, dst;
+    
+    switch(op->id) {
+        case INS_PUSH:
+        case INS_PUSHF:
+            regir_push(c, regir_param(op, 0, (op->id == INS_PUSH) ? 'i' : 'f'));
+            break;
+        
+        case INS_SET:
+        case INS_SETF:
+            a = regir_pop(c);
+            regir_store(c, regir_slot(op->params[0].i, (op->id == INS_SET) ? 'i' : 'f'), a);
+            break;
+        
+        case INS_MOVE:
+        case INS_MOVEF:
+            a = regir_param(op, 1, (op->id == INS_MOVE) ? 'i' : 'f');
+            dst = regir_slot(op->params[0].i, (op->id == INS_MOVE) ? 'i' : 'f');
+            regir_clobber(c, dst);
+            regir_emit(c, INS_SET, dst, a, regir_const(0));
+            break;
+        
+        case INS_DECI: // the value as an int goes on the stack, one less into the variable
+            b = regir_temp(c->top);
+            regir_emit(c, INS_ADDI, b, regir_param(op, 0, 'i'), regir_const(0));
+            regir_push(c, b);
+            dst = regir_slot(op->params[0].i, 'i');
+            regir_clobber(c, dst);
+            regir_emit(c, INS_ADDI, dst, b, regir_const(-1));
+            break;
+        
+        default:
+            b = (regir_arity(op->id) == 2) ? regir_pop(c) : regir_const(0);
+            a = regir_pop(c);
+            dst = regir_temp(c->top);
+            regir_emit(c, op->id, dst, a, b);
+            regir_push(c, dst);
+            break;
+    }
+}
+
+/**
+ * Write what is left on the virtual stack to the real one
+ **/
+static void
+regir_flush(regir_ctx_t* c)
+{
+    for(int32_t slot = c->low; slot < c->top; slot++) {
+        ecl_reg_operand_t* o = &c->stack[c->bias + slot];
+        if(o->kind != REG_TEMP || o->index != slot) {
+            regir_emit(c, INS_SET, regir_temp(slot), *o, regir_const(0));
+        }
+    }
+}
+
+/**
+ * Translate the runs of stack ops of a verified sub into blocks
+ **/
+static void
+regir_sub(ecl_code_t* code, ecl_opt_stats_t* stats)
+{
+    uint8_t* target = xmalloc(code->count + 1);
+    uint32_t* end = xmalloc(sizeof(uint32_t) * (code->count + 1));
+    uint32_t* map = xmalloc(sizeof(uint32_t) * (code->count + 1));
+    uint32_t nblocks = 0, nsrc = 0, live = 0;
+    
+    memset(target, 0, code->count + 1);
+    for(uint32_t i = 0; i < code->count; i++) {
+        if(code->ops[i].target) {
+            target[code->ops[i].target - code->ops] = 1;
+        }
+    }
+    
+    // Where each run ends, 0 if no run starts at an op
+    for(uint32_t i = 0; i <= code->count; i++) {
+        ecl_op_t* op = &code->ops[i];
+        uint32_t j = i;
+        if(i < code->count && regir_translatable(op)) {
+            for(j = i + 1; j < code->count && !target[j] && regir_translatable(&code->ops[j]) &&
+                code->ops[j].time == op->time && code->ops[j].rank_mask == op->rank_mask; j++) {
+            }
+        }
+        map[i] = live++;
+        if(j - i < 2) {
+            end[i] = 0;
+            continue;
+        }
+        end[i] = j;
+        for(uint32_t k = i + 1; k < j; k++) {
+            map[k] = map[i];
+        }
+        nblocks++;
+        nsrc += j - i;
+        i = j - 1;
+    }
+    if(nblocks == 0) {
+        xfree(target);
+        xfree(end);
+        xfree(map);
+        return;
+    }
+    
+    regir_ctx_t c;
+    memset(&c, 0, sizeof(c));
+    c.bias = 2 * code->count;
+    c.stack = xmalloc(sizeof(ecl_reg_operand_t) * 3 * code->count);
+    
+    ecl_op_t* ops = xmalloc(sizeof(ecl_op_t) * live);
+    ecl_block_t* blocks = xmalloc(sizeof(ecl_block_t) * nblocks);
+    th10_instr_t** src = xmalloc(sizeof(th10_instr_t*) * nsrc);
+    uint32_t b = 0, s = 0;
+    
+    for(uint32_t i = 0; i <= code->count; i++) {
+        ecl_op_t* op = &ops[map[i]];
+        *op = code->ops[i];
+        if(op->target) {
+            op->target = &ops[map[op->target - code->ops]];
+        }
+        if(end[i] == 0) {
+            continue;
+        }
+        
+        // Slots below the start are the values on the stack before it; an
+        // op takes at most two
+        c.top = c.low = c.high = 0;
+        c.start = c.count;
+        for(int32_t slot = -2 * (int32_t)(end[i] - i); slot < 0; slot++) {
+            c.stack[c.bias + slot] = regir_temp(slot);
+        }
+        ecl_block_t* block = &blocks[b];
+        block->src = &src[s];
+        block->nsrc = end[i] - i;
+        for(uint32_t k = i; k < end[i]; k++) {
+            regir_translate(&c, &code->ops[k]);
+            src[s++] = code->ops[k].src;
+        }
+        regir_flush(&c);
+        
+        block->ops = (ecl_reg_op_t*)(uintptr_t)c.start; // an index until c.ops stops moving
+        block->count = c.count - c.start;
+        block->low = c.low;
+        block->high = c.high;
+        block->delta = c.top;
+        op->id = INS_BLOCK;
+        op->param_mask = 0;
+        op->nparams = 0;
+        op->block = block;
+        stats->block_ops += block->nsrc;
+        stats->regs += block->count;
+        b++;
+        i = end[i] - 1;
+    }
+    for(b = 0; b < nblocks; b++) {
+        blocks[b].ops = c.ops + (uintptr_t)blocks[b].ops;
+    }
+    stats->blocks += nblocks;
+    
+    xfree(code->ops);
+    code->ops = ops;
+    code->count = live - 1;
+    code->blocks = blocks;
+    code->block_count = nblocks;
+    code->regs = c.ops;
+    code->block_src = src;
+    xfree(c.stack);
+    xfree(target);
+    xfree(end);
+    xfree(map);
+}
+
+/**
+ * Translate the stack arithmetic of every verified sub into register blocks.
+ * The streams must have been freed, and the file has to be verified again
+ * afterwards.
+ **/
+void
+ecl_code_regir(th10_ecl_t* ecl, ecl_opt_stats_t* stats)
+{
+    for(uint32_t i = 0; i < ecl->header->sub_count; i++) {
+        if((ecl->code[i].flags & CODE_VERIFIED) && ecl->code[i].blocks == NULL) {
+            regir_sub(&ecl->code[i], stats);
+        }
+    }
+}
+
+/**
+ * Get an operand of a register op: constants and stack slots in place,
+ * other variables read into v. NULL if the variable can't be read.
+ **/
+static inline const ecl_value_t*
+regir_operand(ecl_state_t* state, const ecl_reg_operand_t* o, ecl_value_t** bases, ecl_value_t* v)
+{
+    if(o->kind == REG_CONST) {
+        return &o->value;
+    } else if(o->kind != REG_VAR) {
+        return bases[o->kind] + o->index;
+    }
+    return SUCCESS(state_get_variable(state, o->index, v)) ? v : NULL;
+}
+
+/**
+ * Run the register ops of a block. The stack pointer ends up where the stack
+ * ops would have left it.
+ **/
+ecli_result_t
+regir_run(ecl_state_t* state, const ecl_block_t* block)
+{
+    ecl_value_t* bases[REG_VAR] = {NULL, &state->stack[state->bp], &state->stack[state->sp]};
+    ecl_value_t va, vb, vr;
+    
+    for(const ecl_reg_op_t* op = block->ops; op != block->ops + block->count; op++) {
+        const ecl_value_t* a = regir_operand(state, &op->a, bases, &va);
+        const ecl_value_t* b = regir_operand(state, &op->b, bases, &vb);
+        ecl_value_t* r = (op->dst.kind == REG_VAR) ? &vr : bases[op->dst.kind] + op->dst.index;
+        if(a == NULL || b == NULL) {
+            return ECLI_FAILURE;
+        }
+        
+        // Both operands are read before r is written, it may be one of them
+        switch(op->id) {
+            case INS_SET:
+                *r = *a;
+                break;
+            case INS_ADDI:
+                r->i = a->i + b->i;
+                r->type = ECL_INT32;
+                break;
+            case INS_ADDF:
+                r->f = a->f + b->f;
+                r->type = ECL_FLOAT32;
+                break;
+            case INS_SUBF:
+                r->f = a->f - b->f;
+                r->type = ECL_FLOAT32;
+                break;
+            case INS_MULI:
+                r->i = a->i * b->i;
+                r->type = ECL_INT32;
+                break;
+            case INS_MULF:
+                r->f = a->f * b->f;
+                r->type = ECL_FLOAT32;
+                break;
+            case INS_DIVF:
+                r->f = a->f / b->f;
+                r->type = ECL_FLOAT32;
+                break;
+            case INS_MODI:
+                r->i = a->i % b->i;
+                r->type = ECL_INT32;
+                break;
+            case INS_EQI:
+                r->i = (a->i == b->i) ? 1 : 0;
+                r->type = ECL_INT32;
+                break;
+            case INS_LESSI:
+                r->i = (a->i < b->i) ? 1 : 0;
+                r->type = ECL_INT32;
+                break;
+            case INS_LEQI:
+                r->i = (a->i <= b->i) ? 1 : 0;
+                r->type = ECL_INT32;
+                break;
+            case INS_GEQI:
+                r->i = (a->i >= b->i) ? 1 : 0;
+                r->type = ECL_INT32;
+                break;
+            case INS_NEGI:
+                r->i = (int32_t)(0u - (uint32_t)a->i);
+                r->type = ECL_INT32;
+                break;
+            case INS_NEGF:
+                r->f = -a->f;
+                r->type = ECL_FLOAT32;
+                break;
+            case INS_SIN:
+                r->f = fmath_sin(a->f);
+                r->type = ECL_FLOAT32;
+                break;
+            case INS_COS:
+                r->f = fmath_cos(a->f);
+                r->type = ECL_FLOAT32;
+                break;
+            default:
+                return ECLI_FAILURE;
+        }
+        
+        if(r == &vr && !SUCCESS(state_set_variable(state, op->dst.index, r))) {
+            return ECLI_FAILURE;
+        }
+    }
+    state->sp += block->delta;
+    return ECLI_SUCCESS;
+}
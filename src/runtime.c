@@ -0,0 +1,883 @@
+/**
+ * The libecli runtime: loading, stepping and inspecting ECL VMs
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include <inttypes.h>
+
+#include "ecli.h"
+#include "libecli.h"
+
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+/**
+ * Create an empty runtime with default globals (lunatic difficulty)
+ **/
+ecli_runtime_t*
+ecli_runtime_create(void)
+{
+    ecli_runtime_t* rt = xmalloc(sizeof(ecli_runtime_t));
+    memset(rt, 0, sizeof(ecli_runtime_t));
+    initialize_globals(&rt->global);
+    rt->global.difficulty = DIFF_LUNATIC;
+    rt->streams = DIFF_LUNATIC;
+    output_init(&rt->output);
+    output_set_file(&rt->output, stdout);
+    enemy_init(&rt->enemies);
+    bullet_init(&rt->bullets);
+    rt->loop[0] = get_interpreter_loop(ECLI_MODE_PLAIN, 0);
+    rt->loop[1] = get_interpreter_loop(ECLI_MODE_PLAIN, 1);
+    rt->optimize = 1;
+    rt->inline_limit = INLINE_DEFAULT_LIMIT;
+    return rt;
+}
+
+/**
+ * Free every VM of a runtime, leaving the ECL loaded
+ **/
+static void
+runtime_free_vms(ecli_runtime_t* rt)
+{
+    for(uint32_t i = 0; i < rt->vms.count; i++) {
+        ecl_state_t* vm = vm_table_at(&rt->vms, i);
+        if(!vm_finished(vm)) {
+            free_ecl_state(vm);
+        }
+    }
+    vm_table_free(&rt->vms);
+}
+
+/**
+ * Unload the ECL of a runtime, freeing it if the runtime owns it
+ **/
+static void
+runtime_unload(ecli_runtime_t* rt)
+{
+    runtime_free_vms(rt);
+    if(rt->debugger) {
+        debug_remove_traps(rt->debugger); // they are in the streams freed here
+    }
+    if(rt->ecl == &rt->ecl_storage) {
+        free_th10_ecl(&rt->ecl_storage);
+    }
+    rt->ecl = NULL;
+    rt->frame = 0;
+    rt->preempted = 0;
+    bullet_clear(&rt->bullets);
+    if(rt->memo) {
+        memo_clear(rt->memo); // the entries point into the file
+    }
+    if(rt->sampler) {
+        sampler_reset(rt->sampler); // the samples point into the file
+    }
+    if(rt->coverage) {
+        coverage_free(rt->coverage); // the map is for the file
+        rt->coverage = NULL;
+        if(rt->mode == ECLI_MODE_COVERAGE) {
+            ecli_set_mode(rt, ECLI_MODE_PLAIN);
+        }
+    }
+}
+
+/**
+ * Free a runtime along with its VMs and (owned) ECL file
+ **/
+void
+ecli_runtime_free(ecli_runtime_t* rt)
+{
+    runtime_unload(rt);
+    ecli_set_debugger(rt, NULL);
+    if(rt->sampler) {
+        sampler_free(rt->sampler);
+    }
+    if(rt->memo) {
+        memo_free(rt->memo);
+    }
+    xfree(rt->ranks);
+    output_close(&rt->output);
+    lockstep_free(&rt->lockstep_mem);
+    xfree(rt->requeue);
+    enemy_free(&rt->enemies);
+    bullet_free(&rt->bullets);
+    xfree(rt->profile);
+    xfree(rt);
+}
+
+/**
+ * Start using a file the runtime just loaded, optimizing it first
+ **/
+static void
+runtime_loaded(ecli_runtime_t* rt)
+{
+    rt->ecl = &rt->ecl_storage;
+    memset(&rt->opt_stats, 0, sizeof(ecl_opt_stats_t));
+    if(rt->optimize > 0) {
+        ecl_code_optimize(rt->ecl, rt->optimize, rt->inline_limit, &rt->opt_stats);
+    }
+}
+
+/**
+ * Load an ECL file from a path
+ **/
+ecli_result_t
+ecli_load_file(ecli_runtime_t* rt, const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) {
+        fprintf(stderr, "Failed to open file %s\n", path);
+        return ECLI_FAILURE;
+    }
+    
+    runtime_unload(rt);
+    ecli_result_t result = load_th10_ecl_from_file_object(&rt->ecl_storage, f);
+    fclose(f);
+    
+    if(SUCCESS(result)) {
+        runtime_loaded(rt);
+    }
+    return result;
+}
+
+/**
+ * Load an ECL file from memory. The data is copied.
+ **/
+ecli_result_t
+ecli_load_memory(ecli_runtime_t* rt, const void* data, size_t size)
+{
+    runtime_unload(rt);
+    ecli_result_t result = load_th10_ecl_from_memory(&rt->ecl_storage, data, size);
+    
+    if(SUCCESS(result)) {
+        runtime_loaded(rt);
+    }
+    return result;
+}
+
+/**
+ * Load an ECL file out of a .dat archive. The archive keeps the unpacked
+ * file, so loading it again (in this or another runtime) only copies it.
+ **/
+ecli_result_t
+ecli_load_dat(ecli_runtime_t* rt, ecli_dat_t* dat, const char* name)
+{
+    dat_entry_t* entry = dat_find(dat, name);
+    if(entry == NULL) {
+        fprintf(stderr, "No file %s in the archive\n", name);
+        return ECLI_FAILURE;
+    }
+    const uint8_t* data = dat_read(dat, entry);
+    if(data == NULL) {
+        return ECLI_FAILURE;
+    }
+    return ecli_load_memory(rt, data, entry->size);
+}
+
+/**
+ * Run an ECL file loaded elsewhere. The runtime does not take ownership, so
+ * the ECL can be shared by several runtimes and must outlive them. It is run
+ * as it is; the owner decides whether to optimize it.
+ **/
+ecli_result_t
+ecli_attach_ecl(ecli_runtime_t* rt, th10_ecl_t* ecl)
+{
+    runtime_unload(rt);
+    rt->ecl = ecl;
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Get the ECL file currently loaded in a runtime
+ **/
+th10_ecl_t*
+ecli_get_ecl(ecli_runtime_t* rt)
+{
+    return rt->ecl;
+}
+
+/**
+ * Start a new VM at the given sub, for a new enemy at (0, 0). It runs from
+ * the next call to ecli_step().
+ **/
+ecli_result_t
+ecli_spawn(ecli_runtime_t* rt, const char* name)
+{
+    if(rt->ecl == NULL) {
+        fprintf(stderr, "No ECL file loaded.\n");
+        return ECLI_FAILURE;
+    }
+    
+    th10_ecl_sub_t* sub = get_th10_ecl_sub_by_name(rt->ecl, name);
+    if(sub == NULL) {
+        fprintf(stderr, "Sub \"%s\" does not exist.\n", name);
+        return ECLI_FAILURE;
+    }
+    
+    ecl_state_t* vm;
+    enemy_handle_t enemy = enemy_create(&rt->enemies, 0.0f, 0.0f);
+    if(enemy == ENEMY_NONE) {
+        return ECLI_FAILURE;
+    }
+    return allocate_ecl_state(&vm, rt, ecl_code_for_sub(rt->ecl, sub), enemy);
+}
+
+/**
+ * Run one frame: every VM runs until it waits or a budget stops it, then the
+ * clocks of the ones that waited advance. Returns ECLI_DONE once no VMs are
+ * left.
+ **/
+ecli_result_t
+ecli_step(ecli_runtime_t* rt)
+{
+    if(rt->vms.live == 0) {
+        return ECLI_DONE;
+    }
+    if(rt->debugger && debug_frame(rt) != ECLI_SUCCESS) {
+        return ECLI_DONE;
+    }
+    
+    ecli_result_t result = run_all_ecl_instances(rt);
+    if(result != ECLI_SUCCESS) {
+        output_flush(&rt->output);
+        return result;
+    }
+    enemy_update(&rt->enemies);
+    bullet_update(&rt->bullets, rt->global.player_x, rt->global.player_y);
+    if(rt->sampler) {
+        sampler_drain(rt->sampler);
+    }
+    
+    // The table was compacted at the end of the run, every VM in it is live.
+    // VMs a budget stopped are still in this frame's turn.
+    rt->preempted = 0;
+    for(uint32_t i = 0; i < rt->vms.count; i++) {
+        ecl_state_t* p = vm_table_at(&rt->vms, i);
+        if(p->preempted) {
+            rt->preempted++;
+            continue;
+        }
+        p->wait = max(p->wait - 1, 0);
+        if(p->wait == 0) {
+            p->time++;
+        }
+    }
+    rt->frame++;
+    output_end_frame(&rt->output);
+    
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Run up to the given number of frames, stopping early if every VM finishes
+ * or one fails. The number of frames run is stored in done if it is given.
+ **/
+ecli_result_t
+ecli_step_frames(ecli_runtime_t* rt, uint32_t frames, uint32_t* done)
+{
+    ecli_result_t result = ECLI_SUCCESS;
+    uint32_t i;
+    
+    for(i = 0; i < frames; i++) {
+        result = ecli_step(rt);
+        if(result != ECLI_SUCCESS) {
+            break;
+        }
+    }
+    
+    if(done) {
+        *done = i;
+    }
+    return result;
+}
+
+/**
+ * Number of frames the runtime has run
+ **/
+uint32_t
+ecli_frame(ecli_runtime_t* rt)
+{
+    return rt->frame;
+}
+
+/**
+ * Global variables of a runtime, which the host may read and write between
+ * frames
+ **/
+ecl_global_state_t*
+ecli_globals(ecli_runtime_t* rt)
+{
+    return &rt->global;
+}
+
+/**
+ * Move the running VMs to the streams of another difficulty or set
+ **/
+void
+runtime_remap(ecli_runtime_t* rt, uint8_t streams)
+{
+    for(uint32_t n = 0; n < rt->vms.count && streams != rt->streams; n++) {
+        ecl_state_t* p = vm_table_at(&rt->vms, n);
+        if(vm_finished(p)) {
+            continue;
+        }
+        p->ip = ecl_code_remap(rt->ecl, p->ip, rt->streams, streams);
+        for(uint32_t i = 0; i < p->csp; i++) {
+            p->callstack[i] = ecl_code_remap(rt->ecl, p->callstack[i], rt->streams, streams);
+        }
+    }
+    rt->streams = streams;
+}
+
+/**
+ * Set the difficulty, which must be one of the DIFF_* values: the verifier
+ * only proves the stack use of single difficulties safe. Running VMs move to
+ * the new difficulty's streams, so it must not be changed through
+ * ecli_globals().
+ **/
+ecli_result_t
+ecli_set_difficulty(ecli_runtime_t* rt, uint8_t difficulty)
+{
+    if(difficulty == 0 || difficulty > DIFF_LUNATIC || (difficulty & (difficulty - 1))) {
+        fprintf(stderr, "Invalid difficulty: %u\n", difficulty);
+        return ECLI_FAILURE;
+    }
+    if(rt->ranks) {
+        fprintf(stderr, "A shared run can't change its difficulty.\n");
+        return ECLI_FAILURE;
+    }
+    if(rt->debugger && difficulty != rt->global.difficulty) {
+        debug_set_difficulty(rt, difficulty);
+    }
+    runtime_remap(rt, difficulty);
+    rt->global.difficulty = difficulty;
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Run the difficulties in ranks (DIFF_* flags) in one shared run, see
+ * ranks.h. files holds the output file of each difficulty by index, NULL to
+ * discard it. Must be set before any VM is spawned, and excludes the
+ * debugger, coverage and the sampler, which keep per-difficulty state.
+ **/
+ecli_result_t
+ecli_set_ranks(ecli_runtime_t* rt, uint8_t ranks, FILE** files)
+{
+#ifdef HAVE_FORK
+    if(ranks == 0 || ranks >= RANK_SETS) {
+        fprintf(stderr, "Invalid difficulties: %u\n", ranks);
+        return ECLI_FAILURE;
+    }
+    if(rt->vms.live || rt->ranks) {
+        fprintf(stderr, "A shared run must be set up before it starts.\n");
+        return ECLI_FAILURE;
+    }
+    if(rt->debugger || rt->sampler || rt->mode == ECLI_MODE_COVERAGE || rt->mode == ECLI_MODE_SAMPLE) {
+        fprintf(stderr, "A shared run can't be debugged, sampled or covered.\n");
+        return ECLI_FAILURE;
+    }
+    rt->ranks = xmalloc(sizeof(ecli_ranks_t));
+    memset(rt->ranks, 0, sizeof(ecli_ranks_t));
+    rt->ranks->ranks = ranks;
+    memcpy(rt->ranks->files, files, sizeof(rt->ranks->files));
+    ranks_apply(rt);
+    return ECLI_SUCCESS;
+#else
+    (void)rt;
+    (void)ranks;
+    (void)files;
+    fprintf(stderr, "Shared runs need fork().\n");
+    return ECLI_FAILURE;
+#endif
+}
+
+/**
+ * The difficulties this process runs, just the difficulty outside of a
+ * shared run
+ **/
+uint8_t
+ecli_get_ranks(ecli_runtime_t* rt)
+{
+    return rt->ranks ? rt->ranks->ranks : rt->global.difficulty;
+}
+
+/**
+ * Wait for the processes a shared run split into. failed is set if any of
+ * them failed. Returns 1 in the process which started the run and 0 in the
+ * others, which should exit once done with their difficulties.
+ **/
+int
+ecli_ranks_wait(ecli_runtime_t* rt, int* failed)
+{
+    if(rt->ranks == NULL) {
+        *failed = 0;
+        return 1;
+    }
+    return ranks_wait(rt->ranks, failed);
+}
+
+/**
+ * Seed the random number generator used by the RAND* variables
+ **/
+void
+ecli_set_seed(ecli_runtime_t* rt, uint32_t seed)
+{
+    state_seed_random(&rt->global, seed);
+}
+
+/**
+ * Send the output of the debug print instructions to a file, or discard it
+ * if f is NULL. Output is buffered and written at the end of frames.
+ **/
+void
+ecli_set_output(ecli_runtime_t* rt, FILE* f)
+{
+    output_set_file(&rt->output, f);
+}
+
+/**
+ * Keep the output of the debug print instructions in memory, to be read
+ * with ecli_get_output()
+ **/
+void
+ecli_set_output_memory(ecli_runtime_t* rt)
+{
+    output_set_memory(&rt->output);
+}
+
+/**
+ * Get the output kept in memory since the last ecli_clear_output(). The data
+ * is not null-terminated and is valid until the runtime runs again.
+ **/
+const char*
+ecli_get_output(ecli_runtime_t* rt, size_t* size)
+{
+    *size = (rt->output.kind == OUTPUT_MEMORY) ? rt->output.buf.len : 0;
+    return rt->output.buf.data;
+}
+
+/**
+ * Discard the output kept in memory
+ **/
+void
+ecli_clear_output(ecli_runtime_t* rt)
+{
+    if(rt->output.kind == OUTPUT_MEMORY) {
+        rt->output.buf.len = 0;
+    }
+}
+
+/**
+ * Write file output from a separate thread. Fails if threads aren't
+ * available.
+ **/
+ecli_result_t
+ecli_set_output_thread(ecli_runtime_t* rt, int enable)
+{
+    return output_set_threaded(&rt->output, enable);
+}
+
+/**
+ * Write out all buffered output now
+ **/
+void
+ecli_flush_output(ecli_runtime_t* rt)
+{
+    output_flush(&rt->output);
+}
+
+/**
+ * Set the optimization level for files loaded from now on: 0 for none, 1 for
+ * the peephole optimizer, 2 to also inline small subs
+ **/
+void
+ecli_set_optimization(ecli_runtime_t* rt, int level)
+{
+    rt->optimize = level;
+}
+
+/**
+ * Set the size in ops of the largest sub inlined at level 2, 0 for none
+ **/
+void
+ecli_set_inline_limit(ecli_runtime_t* rt, uint32_t ops)
+{
+    rt->inline_limit = ops;
+}
+
+/**
+ * What the optimizer did to the file loaded last
+ **/
+const ecl_opt_stats_t*
+ecli_optimizer_stats(ecli_runtime_t* rt)
+{
+    return &rt->opt_stats;
+}
+
+/**
+ * Memoize calls to pure subs, keeping the effects of up to entries of them.
+ * 0 stops memoizing and drops the memo.
+ **/
+void
+ecli_set_memo(ecli_runtime_t* rt, uint32_t entries)
+{
+    if(rt->memo) {
+        memo_free(rt->memo);
+    }
+    rt->memo = entries ? memo_create(entries) : NULL;
+}
+
+/**
+ * How the memo did since it was made, NULL unless memoizing
+ **/
+const ecli_memo_stats_t*
+ecli_memo_stats(ecli_runtime_t* rt)
+{
+    if(rt->memo == NULL) {
+        return NULL;
+    }
+    rt->memo->stats.entries = rt->memo->count;
+    rt->memo->stats.pure = 0;
+    if(rt->ecl) {
+        for(uint32_t i = 0; i < rt->ecl->header->sub_count; i++) {
+            rt->memo->stats.pure += (rt->ecl->code[i].flags & CODE_PURE) != 0;
+        }
+    }
+    return &rt->memo->stats;
+}
+
+/**
+ * Select the interpreter loop: plain, tracing or profiling. Switching to
+ * profiling starts counting from zero; coverage needs a loaded file, see
+ * ecli_set_coverage().
+ **/
+void
+ecli_set_mode(ecli_runtime_t* rt, ecli_mode_t mode)
+{
+    if(mode == ECLI_MODE_COVERAGE && rt->coverage == NULL) {
+        if(rt->ecl == NULL) {
+            mode = ECLI_MODE_PLAIN;
+        } else {
+            rt->coverage = coverage_create(rt->ecl);
+            coverage_record(rt->coverage);
+        }
+    }
+    if(mode == ECLI_MODE_PROFILE) {
+        size_t size = sizeof(uint64_t) * (ins_get_format_count() + 1);
+        if(rt->profile == NULL) {
+            rt->profile = xmalloc(size);
+        }
+        memset(rt->profile, 0, size);
+    }
+    rt->mode = mode;
+    rt->loop[0] = get_interpreter_loop(mode, 0);
+    rt->loop[1] = get_interpreter_loop(mode, 1);
+}
+
+/**
+ * Sample where the VMs spend their time hz times a second of CPU time, or
+ * stop sampling if hz is 0. Sampling switches to the ECLI_MODE_SAMPLE loop,
+ * and back to the plain one when it stops; the samples are kept until the
+ * runtime is freed or loads another file.
+ **/
+ecli_result_t
+ecli_set_sampling(ecli_runtime_t* rt, unsigned int hz)
+{
+    if(hz == 0) {
+        if(rt->sampler) {
+            sampler_stop(rt->sampler);
+            if(rt->mode == ECLI_MODE_SAMPLE) {
+                ecli_set_mode(rt, ECLI_MODE_PLAIN);
+            }
+        }
+        return ECLI_SUCCESS;
+    }
+    
+    if(rt->sampler == NULL) {
+        rt->sampler = sampler_create(rt);
+    }
+    if(!SUCCESS(sampler_start(rt->sampler, hz))) {
+        return ECLI_FAILURE;
+    }
+    ecli_set_mode(rt, ECLI_MODE_SAMPLE);
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Print the subs and instructions the samples fell in, see sampler.h
+ **/
+void
+ecli_print_samples(ecli_runtime_t* rt, FILE* f)
+{
+    if(rt->sampler) {
+        sampler_print(rt->sampler, f);
+    }
+}
+
+/**
+ * Write the sampled call stacks in the folded format of flame graph tools
+ **/
+void
+ecli_write_folded(ecli_runtime_t* rt, FILE* f)
+{
+    if(rt->sampler) {
+        sampler_write_folded(rt->sampler, f);
+    }
+}
+
+/**
+ * Record which instructions run on which difficulty, or stop recording if
+ * enable is 0. Recording switches to the ECLI_MODE_COVERAGE loop, and back
+ * to the plain one when it stops; the map is kept until the runtime is freed
+ * or loads another file, which also stops recording.
+ **/
+ecli_result_t
+ecli_set_coverage(ecli_runtime_t* rt, int enable)
+{
+    if(!enable) {
+        if(rt->mode == ECLI_MODE_COVERAGE) {
+            ecli_set_mode(rt, ECLI_MODE_PLAIN);
+        }
+        return ECLI_SUCCESS;
+    }
+    
+    if(rt->ecl == NULL) {
+        fprintf(stderr, "No ECL file loaded.\n");
+        return ECLI_FAILURE;
+    }
+    ecli_set_mode(rt, ECLI_MODE_COVERAGE);
+    return ECLI_SUCCESS;
+}
+
+/**
+ * The instructions run while recording coverage, NULL if it never was for
+ * the loaded file
+ **/
+ecli_coverage_t*
+ecli_get_coverage(ecli_runtime_t* rt)
+{
+    if(rt->coverage) {
+        coverage_pack(rt->coverage);
+    }
+    return rt->coverage;
+}
+
+/**
+ * Number of live enemies
+ **/
+uint32_t
+ecli_enemy_count(ecli_runtime_t* rt)
+{
+    return rt->enemies.live;
+}
+
+/**
+ * Call a function for every enemy, in pool order, with its position. Returns
+ * the value which stopped the iteration, or 0.
+ **/
+int
+ecli_foreach_enemy(ecli_runtime_t* rt, ecli_enemy_callback_t callback, void* user)
+{
+    enemy_manager_t* em = &rt->enemies;
+    for(uint32_t i = 0; i < em->used; i++) {
+        enemy_t* e = &em->enemies[i];
+        if(!e->alive) {
+            continue;
+        }
+        enemy_handle_t handle = ((enemy_handle_t)e->generation << ENEMY_INDEX_BITS) | i;
+        int stop = callback(handle, e, em->field[ENEMY_ABS_X][i] + em->field[ENEMY_REL_X][i],
+                            em->field[ENEMY_ABS_Y][i] + em->field[ENEMY_REL_Y][i], user);
+        if(stop) {
+            return stop;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Get the bullet counts of the last frame and of the whole run
+ **/
+const bullet_stats_t*
+ecli_bullet_stats(ecli_runtime_t* rt)
+{
+    return &rt->bullets.stats;
+}
+
+/**
+ * Bound the instructions VMs run per turn and per frame, and report VMs
+ * that run too long without waiting as stuck. See ecli_budget_t and
+ * run_all_ecl_instances(); a zeroed budget runs every VM until it waits.
+ **/
+void
+ecli_set_budget(ecli_runtime_t* rt, const ecli_budget_t* budget)
+{
+    rt->budget = *budget;
+}
+
+/**
+ * Parse a budget given as a comma-separated list of slice=n, frame=n, loop=n
+ * and defer, as taken by the -B option
+ **/
+ecli_result_t
+ecli_parse_budget(const char* spec, ecli_budget_t* budget)
+{
+    const char* p = spec;
+    
+    while(*p) {
+        size_t len = strcspn(p, ",");
+        char* end;
+        if(len == 5 && strncmp(p, "defer", 5) == 0) {
+            budget->defer = 1;
+        } else if(strncmp(p, "slice=", 6) == 0) {
+            budget->slice = strtoul(p + 6, &end, 0);
+            if(end != p + len || budget->slice > BUDGET_SLICE_MAX) {
+                return ECLI_FAILURE;
+            }
+        } else if(strncmp(p, "frame=", 6) == 0) {
+            budget->frame = strtoull(p + 6, &end, 0);
+            if(end != p + len) {
+                return ECLI_FAILURE;
+            }
+        } else if(strncmp(p, "loop=", 5) == 0) {
+            budget->loop = strtoul(p + 5, &end, 0);
+            if(end != p + len || budget->loop > BUDGET_SLICE_MAX) {
+                return ECLI_FAILURE;
+            }
+        } else {
+            return ECLI_FAILURE;
+        }
+        p += len;
+        if(*p == ',') {
+            p++;
+        }
+    }
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Run VMs which are at the same op with the same stack layout together, as
+ * batches over vector instructions. Only used in plain mode, where the order
+ * ops run in across VMs can't be seen.
+ **/
+void
+ecli_set_lockstep(ecli_runtime_t* rt, int enable)
+{
+    rt->lockstep = enable;
+}
+
+/**
+ * Debug the runtime interactively with commands read from a file, see
+ * debugger.h, or stop debugging if in is NULL. The debugger first stops at
+ * the start of the next frame.
+ **/
+void
+ecli_set_debugger(ecli_runtime_t* rt, FILE* in)
+{
+    if(rt->debugger) {
+        debug_free(rt->debugger);
+        rt->debugger = NULL;
+    }
+    if(in) {
+        rt->debugger = debug_create(in, rt->frame);
+    }
+}
+
+/**
+ * Print the instruction counts gathered in profiling mode, most frequent
+ * first
+ **/
+void
+ecli_print_profile(ecli_runtime_t* rt, FILE* f)
+{
+    if(rt->profile == NULL) {
+        return;
+    }
+    
+    unsigned int count = ins_get_format_count() + 1;
+    unsigned int* order = xmalloc(sizeof(unsigned int) * count);
+    uint64_t total = 0;
+    
+    // Insertion sort, the table is small
+    for(unsigned int i = 0; i < count; i++) {
+        unsigned int j = i;
+        while(j > 0 && rt->profile[order[j - 1]] < rt->profile[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+        total += rt->profile[i];
+    }
+    
+    fprintf(f, "%12s %7s  %s\n", "count", "share", "instruction");
+    for(unsigned int i = 0; i < count && rt->profile[order[i]] != 0; i++) {
+        const ins_format_t* format = ins_get_format_at(order[i]);
+        fprintf(f, "%12" PRIu64 " %6.2f%%  %s\n", rt->profile[order[i]],
+                100.0 * rt->profile[order[i]] / total, format ? format->opcode : "(unknown)");
+    }
+    fprintf(f, "%12" PRIu64 "          total\n", total);
+    xfree(order);
+}
+
+/**
+ * Set the player position seen by the scripts
+ **/
+void
+ecli_set_player_position(ecli_runtime_t* rt, float x, float y)
+{
+    rt->global.player_x = x;
+    rt->global.player_y = y;
+}
+
+/**
+ * Number of running VMs
+ **/
+uint32_t
+ecli_vm_count(ecli_runtime_t* rt)
+{
+    return rt->vms.live;
+}
+
+/**
+ * Call a function for every running VM, in execution order. Returns the
+ * value which stopped the iteration, or 0.
+ **/
+int
+ecli_foreach_vm(ecli_runtime_t* rt, ecli_vm_callback_t callback, void* user)
+{
+    for(uint32_t i = 0; i < rt->vms.count; i++) {
+        ecl_state_t* p = vm_table_at(&rt->vms, i);
+        if(vm_finished(p)) {
+            continue;
+        }
+        int stop = callback(p, user);
+        if(stop) {
+            return stop;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,434 @@
+/**
+ * Sampling profiler
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "ecli.h"
+
+#ifdef HAVE_SETITIMER
+# include <signal.h>
+# include <sys/time.h>
+#endif
+
+// Subs and instructions listed by sampler_print()
+#define SAMPLE_TOP 20
+
+static ecli_sampler_t* volatile sampler_active; // the one the signal handler writes to
+
+#ifdef HAVE_SETITIMER
+static struct sigaction sampler_old_action;
+
+/**
+ * SIGPROF handler: copy the op being run and the calls it is in into the
+ * ring. Only reads memory and never blocks, so it is safe anywhere.
+ **/
+static void
+sampler_signal(int sig)
+{
+    ecli_sampler_t* s = sampler_active;
+    (void)sig;
+    
+    if(s == NULL) {
+        return;
+    }
+    uint32_t head = s->head;
+    if(head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) >= SAMPLE_RING) {
+        __atomic_store_n(&s->dropped, s->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    ecl_sample_t* sample = &s->ring[head & (SAMPLE_RING - 1)];
+    ecl_op_t* op = s->rt->sample_op;
+    ecl_state_t* vm = s->rt->sample_vm;
+    sample->depth = 0;
+    if(op != NULL && vm != NULL) {
+        sample->frames[sample->depth++] = op->src;
+        uint32_t csp = __atomic_load_n(&vm->csp, __ATOMIC_ACQUIRE); // pairs with CALL
+        if(csp > vm->callstack_size) {
+            csp = 0; // caught in the middle of a call
+        }
+        // A return address follows its call in the stream
+        while(csp > 0 && sample->depth < SAMPLE_DEPTH) {
+            sample->frames[sample->depth++] = (vm->callstack[--csp] - 1)->src;
+        }
+    }
+    __atomic_store_n(&s->head, head + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+/**
+ * Create a stopped sampler for a runtime
+ **/
+ecli_sampler_t*
+sampler_create(ecli_runtime_t* rt)
+{
+    ecli_sampler_t* s = xmalloc(sizeof(ecli_sampler_t));
+    memset(s, 0, sizeof(ecli_sampler_t));
+    s->rt = rt;
+    s->table_size = 256;
+    s->table = xmalloc(sizeof(sample_bucket_t) * s->table_size);
+    memset(s->table, 0, sizeof(sample_bucket_t) * s->table_size);
+    return s;
+}
+
+/**
+ * Stop a sampler and free it
+ **/
+void
+sampler_free(ecli_sampler_t* s)
+{
+    sampler_stop(s);
+    xfree(s->table);
+    xfree(s);
+}
+
+/**
+ * Start taking samples hz times a second of CPU time. Fails if the platform
+ * has no interval timers or another runtime is sampling.
+ **/
+ecli_result_t
+sampler_start(ecli_sampler_t* s, unsigned int hz)
+{
+#ifdef HAVE_SETITIMER
+    if(hz == 0 || hz > 10000) {
+        fprintf(stderr, "sampler: rate must be 1 to 10000 Hz\n");
+        return ECLI_FAILURE;
+    }
+    if(sampler_active != NULL && sampler_active != s) {
+        fprintf(stderr, "sampler: another runtime is already sampling\n");
+        return ECLI_FAILURE;
+    }
+    if(!s->running) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = sampler_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if(sigaction(SIGPROF, &action, &sampler_old_action) != 0) {
+            fprintf(stderr, "sampler: failed to install the SIGPROF handler\n");
+            return ECLI_FAILURE;
+        }
+    }
+    
+    sampler_active = s;
+    s->hz = hz;
+    s->running = 1;
+    
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    if(setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        fprintf(stderr, "sampler: failed to start the profiling timer\n");
+        sampler_stop(s);
+        return ECLI_FAILURE;
+    }
+    return ECLI_SUCCESS;
+#else
+    (void)s;
+    (void)hz;
+    fprintf(stderr, "sampler: not supported on this platform\n");
+    return ECLI_FAILURE;
+#endif
+}
+
+/**
+ * Stop taking samples, keeping the ones taken
+ **/
+void
+sampler_stop(ecli_sampler_t* s)
+{
+#ifdef HAVE_SETITIMER
+    if(!s->running) {
+        return;
+    }
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sampler_active = NULL;
+    sigaction(SIGPROF, &sampler_old_action, NULL);
+    s->running = 0;
+#endif
+    sampler_drain(s);
+}
+
+/**
+ * Hash of a call stack
+ **/
+static uint32_t
+sampler_hash(ecl_sample_t* sample)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for(uint32_t i = 0; i < sample->depth; i++) {
+        h = (h ^ (uint64_t)(uintptr_t)sample->frames[i]) * 1099511628211ULL;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+/**
+ * Find the bucket of a call stack, or the free one it would go in
+ **/
+static sample_bucket_t*
+sampler_bucket(ecli_sampler_t* s, ecl_sample_t* sample)
+{
+    uint32_t mask = s->table_size - 1;
+    for(uint32_t i = sampler_hash(sample) & mask;; i = (i + 1) & mask) {
+        sample_bucket_t* b = &s->table[i];
+        if(b->count == 0 || (b->stack.depth == sample->depth &&
+           memcmp(b->stack.frames, sample->frames, sizeof(th10_instr_t*) * sample->depth) == 0)) {
+            return b;
+        }
+    }
+}
+
+/**
+ * Count one sample
+ **/
+static void
+sampler_count(ecli_sampler_t* s, ecl_sample_t* sample)
+{
+    s->total++;
+    if(sample->depth == 0) {
+        s->outside++;
+        return;
+    }
+    
+    // Keep the table at most half full
+    if(2 * (s->table_count + 1) > s->table_size) {
+        sample_bucket_t* old = s->table;
+        uint32_t old_size = s->table_size;
+        s->table_size *= 2;
+        s->table = xmalloc(sizeof(sample_bucket_t) * s->table_size);
+        memset(s->table, 0, sizeof(sample_bucket_t) * s->table_size);
+        for(uint32_t i = 0; i < old_size; i++) {
+            if(old[i].count) {
+                *sampler_bucket(s, &old[i].stack) = old[i];
+            }
+        }
+        xfree(old);
+    }
+    
+    sample_bucket_t* b = sampler_bucket(s, sample);
+    if(b->count == 0) {
+        b->stack = *sample;
+        s->table_count++;
+    }
+    b->count++;
+}
+
+/**
+ * Move the samples taken since the last call from the ring into the table
+ **/
+void
+sampler_drain(ecli_sampler_t* s)
+{
+    uint32_t head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+    for(uint32_t t = s->tail; t != head; t++) {
+        sampler_count(s, &s->ring[t & (SAMPLE_RING - 1)]);
+    }
+    __atomic_store_n(&s->tail, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Forget every sample, as when the instructions they point to go away
+ **/
+void
+sampler_reset(ecli_sampler_t* s)
+{
+    __atomic_store_n(&s->tail, __atomic_load_n(&s->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    memset(s->table, 0, sizeof(sample_bucket_t) * s->table_size);
+    s->table_count = 0;
+    s->total = 0;
+    s->outside = 0;
+    __atomic_store_n(&s->dropped, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Index of the sub an instruction belongs to, or -1
+ **/
+static int32_t
+sampler_find_sub(th10_ecl_t* ecl, th10_instr_t* src)
+{
+    if(ecl == NULL || src == NULL) {
+        return -1;
+    }
+    for(uint32_t i = 0; i < ecl->header->sub_count; i++) {
+        if(src >= ecl->subs[i].start && src < ecl->subs[i].end) {
+            return (int32_t)i;
+        }
+    }
+    return -1;
+}
+
+typedef struct {
+    th10_instr_t* src;
+    uint64_t count;
+} sample_hotspot_t;
+
+static int
+compare_hotspot_src(const void* a, const void* b)
+{
+    uintptr_t x = (uintptr_t)((const sample_hotspot_t*)a)->src;
+    uintptr_t y = (uintptr_t)((const sample_hotspot_t*)b)->src;
+    return (x > y) - (x < y);
+}
+
+static int
+compare_hotspot_count(const void* a, const void* b)
+{
+    uint64_t x = ((const sample_hotspot_t*)a)->count;
+    uint64_t y = ((const sample_hotspot_t*)b)->count;
+    return (x < y) - (x > y);
+}
+
+/**
+ * Print the subs the samples fell in most, by the samples taken in the sub
+ * itself and in it or anything it called, then the hottest instructions
+ **/
+void
+sampler_print(ecli_sampler_t* s, FILE* f)
+{
+    th10_ecl_t* ecl = s->rt->ecl;
+    uint32_t subs = ecl ? ecl->header->sub_count : 0;
+    
+    sampler_drain(s);
+    fprintf(f, "sampler: %" PRIu64 " samples at %u Hz, %" PRIu64 " outside the VMs, %u dropped\n",
+            s->total, s->hz, s->outside, __atomic_load_n(&s->dropped, __ATOMIC_RELAXED));
+    if(s->total == s->outside) {
+        return;
+    }
+    
+    // Per sub, counting a sub once per stack even if it recursed
+    uint64_t* self = xmalloc(sizeof(uint64_t) * (subs + 1));
+    uint64_t* total = xmalloc(sizeof(uint64_t) * (subs + 1));
+    uint32_t* seen = xmalloc(sizeof(uint32_t) * (subs + 1));
+    sample_hotspot_t* spots = xmalloc(sizeof(sample_hotspot_t) * (s->table_count + 1));
+    uint32_t nspots = 0;
+    memset(self, 0, sizeof(uint64_t) * (subs + 1));
+    memset(total, 0, sizeof(uint64_t) * (subs + 1));
+    memset(seen, 0, sizeof(uint32_t) * (subs + 1));
+    
+    for(uint32_t i = 0, stamp = 0; i < s->table_size; i++) {
+        sample_bucket_t* b = &s->table[i];
+        if(b->count == 0) {
+            continue;
+        }
+        stamp++;
+        for(uint32_t k = 0; k < b->stack.depth; k++) {
+            int32_t sub = sampler_find_sub(ecl, b->stack.frames[k]);
+            uint32_t j = (sub < 0) ? subs : (uint32_t)sub; // the last one counts unknown code
+            if(k == 0) {
+                self[j] += b->count;
+            }
+            if(seen[j] != stamp) {
+                seen[j] = stamp;
+                total[j] += b->count;
+            }
+        }
+        spots[nspots].src = b->stack.frames[0];
+        spots[nspots++].count = b->count;
+    }
+    
+    fprintf(f, "%12s %7s %12s %7s  %s\n", "self", "share", "total", "share", "sub");
+    for(unsigned int listed = 0; listed < SAMPLE_TOP; listed++) {
+        uint32_t best = subs + 1;
+        for(uint32_t j = 0; j <= subs; j++) {
+            if(total[j] && (best > subs || self[j] > self[best] ||
+                            (self[j] == self[best] && total[j] > total[best]))) {
+                best = j;
+            }
+        }
+        if(best > subs) {
+            break;
+        }
+        fprintf(f, "%12" PRIu64 " %6.2f%% %12" PRIu64 " %6.2f%%  %s\n", self[best], 100.0 * self[best] / s->total,
+                total[best], 100.0 * total[best] / s->total, (best < subs) ? ecl->subs[best].name : "(unknown)");
+        total[best] = 0;
+    }
+    
+    // Merge the stacks ending at the same instruction
+    qsort(spots, nspots, sizeof(sample_hotspot_t), compare_hotspot_src);
+    uint32_t n = 0;
+    for(uint32_t i = 0; i < nspots; i++) {
+        if(n > 0 && spots[n - 1].src == spots[i].src) {
+            spots[n - 1].count += spots[i].count;
+        } else {
+            spots[n++] = spots[i];
+        }
+    }
+    qsort(spots, n, sizeof(sample_hotspot_t), compare_hotspot_count);
+    
+    fprintf(f, "%12s %7s  %s\n", "samples", "share", "instruction");
+    for(uint32_t i = 0; i < n && i < SAMPLE_TOP; i++) {
+        th10_instr_t* src = spots[i].src;
+        int32_t sub = sampler_find_sub(ecl, src);
+        const ins_format_t* format = src ? ins_get_format(src->id) : NULL;
+        fprintf(f, "%12" PRIu64 " %6.2f%%  ", spots[i].count, 100.0 * spots[i].count / s->total);
+        if(sub >= 0) {
+            fprintf(f, "%s+%u", ecl->subs[sub].name, (uint32_t)((uint8_t*)src - (uint8_t*)ecl->subs[sub].start));
+        } else {
+            fprintf(f, "(unknown)");
+        }
+        fprintf(f, "  %s\n", format ? format->opcode : "(end of sub)");
+    }
+    
+    xfree(self);
+    xfree(total);
+    xfree(seen);
+    xfree(spots);
+}
+
+/**
+ * Write the samples as folded stacks, one "main;caller;sub count" line per
+ * distinct stack, which flame graph tools read
+ **/
+void
+sampler_write_folded(ecli_sampler_t* s, FILE* f)
+{
+    th10_ecl_t* ecl = s->rt->ecl;
+    
+    sampler_drain(s);
+    for(uint32_t i = 0; i < s->table_size; i++) {
+        sample_bucket_t* b = &s->table[i];
+        if(b->count == 0) {
+            continue;
+        }
+        for(uint32_t k = b->stack.depth; k-- > 0;) {
+            int32_t sub = sampler_find_sub(ecl, b->stack.frames[k]);
+            fprintf(f, "%s%s", (sub >= 0) ? ecl->subs[sub].name : "(unknown)", k ? ";" : "");
+        }
+        fprintf(f, " %" PRIu64 "\n", b->count);
+    }
+    if(s->outside) {
+        fprintf(f, "(outside the VMs) %" PRIu64 "\n", s->outside);
+    }
+}
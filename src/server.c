@@ -0,0 +1,771 @@
+/**
+ * Persistent server mode for running many short ECL jobs
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "ecli.h"
+#include "libecli.h"
+#include "server.h"
+
+#ifdef HAVE_PTHREAD
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_SYS_UN_H)
+# include <sys/socket.h>
+# include <sys/un.h>
+# define SERVER_SOCKETS
+#endif
+
+#define DEFAULT_CACHE_SIZE 64
+#define DEFAULT_LOOP_BUDGET 100000000 // a job stuck in a loop fails instead of holding its worker
+#define RESPONSE_SIZE 512
+
+// A loaded ECL file kept in the cache
+typedef struct _cache_entry {
+    char* path;
+    time_t mtime;
+    off_t size;
+    th10_ecl_t ecl;
+    unsigned int refs; // jobs currently running this file
+    int stale; // the file changed on disk; free once unreferenced
+    struct _cache_entry* prev; // more recently used
+    struct _cache_entry* next; // less recently used
+} cache_entry_t;
+
+// LRU cache of loaded ECL files, shared by the workers
+typedef struct {
+    pthread_mutex_t lock;
+    cache_entry_t* head;
+    cache_entry_t* tail;
+    unsigned int count;
+    unsigned int capacity;
+    int optimize; // optimization level for loaded files
+    uint32_t inline_limit; // largest sub inlined at level 2
+} ecl_cache_t;
+
+// A client connection (or stdin/stdout)
+typedef struct {
+    int in_fd;
+    int out_fd;
+    int owns_fds;
+    pthread_mutex_t write_lock;
+    unsigned int refs; // reader plus queued/running jobs, under the server lock
+} server_conn_t;
+
+typedef struct _server_job {
+    char id[32];
+    char* path;
+    char sub[64];
+    uint8_t difficulty;
+    uint32_t seed;
+    uint32_t frames;
+    char* coverage; // file the instructions run are added to, NULL for none
+    server_conn_t* conn;
+    struct _server_job* next;
+} server_job_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    server_job_t* head;
+    server_job_t* tail;
+    int stopping;
+    int listen_fd;
+    ecl_cache_t cache;
+    pthread_mutex_t coverage_lock; // held while a job adds to a coverage file
+    ecli_budget_t budget; // for every worker's runtime
+    uint32_t memo; // memo entries of every worker's runtime, 0 for none
+} server_t;
+
+/**
+ * Unlink a cache entry from the LRU list
+ **/
+static void
+cache_unlink(ecl_cache_t* cache, cache_entry_t* e)
+{
+    if(e->prev) { e->prev->next = e->next; } else { cache->head = e->next; }
+    if(e->next) { e->next->prev = e->prev; } else { cache->tail = e->prev; }
+    e->prev = e->next = NULL;
+    cache->count--;
+}
+
+/**
+ * Link a cache entry at the most recently used end
+ **/
+static void
+cache_push_front(ecl_cache_t* cache, cache_entry_t* e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if(cache->head) { cache->head->prev = e; } else { cache->tail = e; }
+    cache->head = e;
+    cache->count++;
+}
+
+static void
+cache_free_entry(cache_entry_t* e)
+{
+    free_th10_ecl(&e->ecl);
+    xfree(e->path);
+    xfree(e);
+}
+
+/**
+ * Drop least recently used, unreferenced entries until the cache fits
+ **/
+static void
+cache_evict(ecl_cache_t* cache)
+{
+    cache_entry_t* e = cache->tail;
+    while((cache->count > cache->capacity) && (e != NULL)) {
+        cache_entry_t* prev = e->prev;
+        if(e->refs == 0) {
+            cache_unlink(cache, e);
+            cache_free_entry(e);
+        }
+        e = prev;
+    }
+}
+
+/**
+ * Get a loaded ECL file from the cache, loading it if needed. Files which
+ * changed on disk since they were loaded are loaded again.
+ **/
+static cache_entry_t*
+cache_acquire(ecl_cache_t* cache, const char* path)
+{
+    struct stat st;
+    if(0 != stat(path, &st)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for(cache_entry_t* e = cache->head; e != NULL; e = e->next) {
+        if(strcmp(e->path, path) != 0) {
+            continue;
+        }
+        cache_unlink(cache, e);
+        if((e->mtime == st.st_mtime) && (e->size == st.st_size)) {
+            e->refs++;
+            cache_push_front(cache, e);
+            pthread_mutex_unlock(&cache->lock);
+            return e;
+        }
+        if(e->refs == 0) {
+            cache_free_entry(e);
+        } else {
+            e->stale = 1;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    // Load without holding the lock so other workers aren't held up
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) {
+        return NULL;
+    }
+    cache_entry_t* e = xmalloc(sizeof(cache_entry_t));
+    memset(e, 0, sizeof(cache_entry_t));
+    ecli_result_t result = load_th10_ecl_from_file_object(&e->ecl, f);
+    fclose(f);
+    if(!SUCCESS(result)) {
+        xfree(e);
+        return NULL;
+    }
+    if(cache->optimize > 0) {
+        ecl_opt_stats_t stats;
+        ecl_code_optimize(&e->ecl, cache->optimize, cache->inline_limit, &stats);
+    }
+    e->path = xmalloc(strlen(path) + 1);
+    strcpy(e->path, path);
+    e->mtime = st.st_mtime;
+    e->size = st.st_size;
+    e->refs = 1;
+
+    // Another worker may have loaded the same file meanwhile
+    pthread_mutex_lock(&cache->lock);
+    for(cache_entry_t* other = cache->head; other != NULL; other = other->next) {
+        if(strcmp(other->path, path) != 0) {
+            continue;
+        }
+        cache_unlink(cache, other);
+        if((other->mtime == st.st_mtime) && (other->size == st.st_size)) {
+            other->refs++;
+            cache_push_front(cache, other);
+            pthread_mutex_unlock(&cache->lock);
+            cache_free_entry(e);
+            return other;
+        }
+        if(other->refs == 0) {
+            cache_free_entry(other);
+        } else {
+            other->stale = 1;
+        }
+        break;
+    }
+    cache_push_front(cache, e);
+    cache_evict(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return e;
+}
+
+/**
+ * Give back an entry obtained from cache_acquire()
+ **/
+static void
+cache_release(ecl_cache_t* cache, cache_entry_t* e)
+{
+    pthread_mutex_lock(&cache->lock);
+    e->refs--;
+    if(e->stale) {
+        if(e->refs == 0) {
+            cache_free_entry(e);
+        }
+    } else {
+        cache_evict(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Free every entry of the cache. No jobs may be running.
+ **/
+static void
+cache_clear(ecl_cache_t* cache)
+{
+    while(cache->head != NULL) {
+        cache_entry_t* e = cache->head;
+        cache_unlink(cache, e);
+        cache_free_entry(e);
+    }
+}
+
+/**
+ * Write one response line to a connection
+ **/
+static void
+server_respond(server_conn_t* conn, const char* format, ...)
+{
+    char buf[RESPONSE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf) - 1, format, args);
+    va_end(args);
+    if(len < 0) {
+        return;
+    }
+    if(len > (int)sizeof(buf) - 2) {
+        len = sizeof(buf) - 2;
+    }
+    buf[len++] = '\n';
+
+    pthread_mutex_lock(&conn->write_lock);
+    for(char* p = buf; len > 0; ) {
+        ssize_t amt = write(conn->out_fd, p, len);
+        if(amt < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        p += amt;
+        len -= amt;
+    }
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+/**
+ * Drop a reference to a connection, closing it after the last one
+ **/
+static void
+server_conn_release(server_t* server, server_conn_t* conn)
+{
+    pthread_mutex_lock(&server->lock);
+    unsigned int refs = --conn->refs;
+    pthread_mutex_unlock(&server->lock);
+
+    if(refs == 0) {
+        if(conn->owns_fds) {
+            close(conn->in_fd);
+        }
+        pthread_mutex_destroy(&conn->write_lock);
+        xfree(conn);
+    }
+}
+
+static server_conn_t*
+server_conn_create(int in_fd, int out_fd, int owns_fds)
+{
+    server_conn_t* conn = xmalloc(sizeof(server_conn_t));
+    conn->in_fd = in_fd;
+    conn->out_fd = out_fd;
+    conn->owns_fds = owns_fds;
+    conn->refs = 1;
+    pthread_mutex_init(&conn->write_lock, NULL);
+    return conn;
+}
+
+/**
+ * Run a single job on a worker's runtime and answer it
+ **/
+static void
+server_run_job(server_t* server, ecli_runtime_t* rt, server_job_t* job)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    cache_entry_t* e = cache_acquire(&server->cache, job->path);
+    if(e == NULL) {
+        server_respond(job->conn, "%s error cannot load %s", job->id, job->path);
+        return;
+    }
+
+    ecli_attach_ecl(rt, &e->ecl);
+    initialize_globals(&rt->global);
+    ecli_set_difficulty(rt, job->difficulty);
+    ecli_set_seed(rt, job->seed);
+    ecli_set_output(rt, NULL);
+    if(job->coverage) {
+        ecli_set_coverage(rt, 1);
+    }
+
+    ecli_result_t result = ecli_spawn(rt, job->sub);
+    if(!SUCCESS(result)) {
+        ecli_attach_ecl(rt, NULL);
+        cache_release(&server->cache, e);
+        server_respond(job->conn, "%s error no sub %s", job->id, job->sub);
+        return;
+    }
+
+    uint32_t frames = 0;
+    if(job->frames == 0) {
+        while((result = ecli_step(rt)) == ECLI_SUCCESS) {
+            frames++;
+        }
+    } else {
+        result = ecli_step_frames(rt, job->frames, &frames);
+    }
+    uint32_t vms = ecli_vm_count(rt);
+
+    // Jobs on other workers may be adding to the same file
+    ecli_result_t saved = ECLI_SUCCESS;
+    if(job->coverage) {
+        ecli_coverage_t* cov = ecli_get_coverage(rt);
+        pthread_mutex_lock(&server->coverage_lock);
+        saved = coverage_merge_file(cov, job->coverage);
+        if(SUCCESS(saved)) {
+            saved = coverage_save_file(cov, job->coverage);
+        }
+        pthread_mutex_unlock(&server->coverage_lock);
+    }
+
+    ecli_attach_ecl(rt, NULL);
+    cache_release(&server->cache, e);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long usec = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    if(result == ECLI_FAILURE) {
+        server_respond(job->conn, "%s error interpretation failed frames=%u", job->id, frames);
+    } else if(!SUCCESS(saved)) {
+        server_respond(job->conn, "%s error cannot add coverage to %s", job->id, job->coverage);
+    } else {
+        server_respond(job->conn, "%s ok status=%s frames=%u vms=%u usec=%ld", job->id,
+                       (result == ECLI_DONE) ? "done" : "limit", frames, vms, usec);
+    }
+}
+
+/**
+ * Free a job and the strings it holds
+ **/
+static void
+server_job_free(server_job_t* job)
+{
+    xfree(job->path);
+    xfree(job->coverage);
+    xfree(job);
+}
+
+/**
+ * Worker thread: take jobs off the queue until the server stops
+ **/
+static void*
+server_worker(void* arg)
+{
+    server_t* server = arg;
+    ecli_runtime_t* rt = ecli_runtime_create();
+    ecli_set_budget(rt, &server->budget);
+    ecli_set_memo(rt, server->memo);
+
+    while(1) {
+        pthread_mutex_lock(&server->lock);
+        while((server->head == NULL) && !server->stopping) {
+            pthread_cond_wait(&server->ready, &server->lock);
+        }
+        server_job_t* job = server->head;
+        if(job == NULL) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        server->head = job->next;
+        if(server->head == NULL) {
+            server->tail = NULL;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        server_run_job(server, rt, job);
+        server_conn_release(server, job->conn);
+        server_job_free(job);
+    }
+
+    ecli_runtime_free(rt);
+    return NULL;
+}
+
+/**
+ * Parse a difficulty name or number
+ **/
+static int
+server_parse_difficulty(const char* s, uint8_t* difficulty)
+{
+    static const char* names[] = {"easy", "normal", "hard", "lunatic"};
+    for(int i = 0; i < 4; i++) {
+        if((strcmp(s, names[i]) == 0) || ((s[0] == '0' + i) && (s[1] == '\0'))) {
+            *difficulty = 1 << i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parse a run request and queue it
+ **/
+static void
+server_queue_run(server_t* server, server_conn_t* conn, char* save)
+{
+    const char* id = strtok_r(NULL, " \t\r\n", &save);
+    const char* path = strtok_r(NULL, " \t\r\n", &save);
+    if((id == NULL) || (path == NULL)) {
+        server_respond(conn, "%s error usage: run <id> <file> [key=value...]", id ? id : "-");
+        return;
+    }
+
+    server_job_t* job = xmalloc(sizeof(server_job_t));
+    memset(job, 0, sizeof(server_job_t));
+    snprintf(job->id, sizeof(job->id), "%s", id);
+    snprintf(job->sub, sizeof(job->sub), "main");
+    job->path = xmalloc(strlen(path) + 1);
+    strcpy(job->path, path);
+    job->difficulty = DIFF_LUNATIC;
+    job->seed = 1;
+    job->conn = conn;
+
+    for(char* opt; (opt = strtok_r(NULL, " \t\r\n", &save)) != NULL; ) {
+        char* value = strchr(opt, '=');
+        int ok = (value != NULL);
+        if(ok) {
+            *value++ = '\0';
+            if(strcmp(opt, "sub") == 0) {
+                snprintf(job->sub, sizeof(job->sub), "%s", value);
+            } else if(strcmp(opt, "difficulty") == 0) {
+                ok = server_parse_difficulty(value, &job->difficulty);
+            } else if(strcmp(opt, "seed") == 0) {
+                job->seed = strtoul(value, NULL, 0);
+            } else if(strcmp(opt, "frames") == 0) {
+                job->frames = strtoul(value, NULL, 0);
+            } else if(strcmp(opt, "coverage") == 0) {
+                xfree(job->coverage);
+                job->coverage = xmalloc(strlen(value) + 1);
+                strcpy(job->coverage, value);
+            } else {
+                ok = 0;
+            }
+        }
+        if(!ok) {
+            server_respond(conn, "%s error bad option %s", job->id, opt);
+            server_job_free(job);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&server->lock);
+    if(server->stopping) {
+        pthread_mutex_unlock(&server->lock);
+        server_respond(conn, "%s error shutting down", job->id);
+        server_job_free(job);
+        return;
+    }
+    conn->refs++;
+    if(server->tail) { server->tail->next = job; } else { server->head = job; }
+    server->tail = job;
+    pthread_cond_signal(&server->ready);
+    pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * Set the stopping flag and wake everything up
+ **/
+static void
+server_stop(server_t* server)
+{
+    pthread_mutex_lock(&server->lock);
+    server->stopping = 1;
+    pthread_cond_broadcast(&server->ready);
+    pthread_mutex_unlock(&server->lock);
+#ifdef SERVER_SOCKETS
+    if(server->listen_fd >= 0) {
+        shutdown(server->listen_fd, SHUT_RDWR);
+    }
+#endif
+}
+
+/**
+ * Read requests from a connection until it is closed
+ **/
+static void
+server_read_requests(server_t* server, server_conn_t* conn)
+{
+    FILE* in = fdopen(dup(conn->in_fd), "r");
+    char* line = NULL;
+    size_t cap = 0;
+
+    while((in != NULL) && (getline(&line, &cap, in) >= 0)) {
+        char* save;
+        char* cmd = strtok_r(line, " \t\r\n", &save);
+        if(cmd == NULL) {
+            continue;
+        } else if(strcmp(cmd, "run") == 0) {
+            server_queue_run(server, conn, save);
+        } else if(strcmp(cmd, "quit") == 0) {
+            break;
+        } else if(strcmp(cmd, "shutdown") == 0) {
+            server_stop(server);
+            break;
+        } else {
+            server_respond(conn, "- error unknown command %s", cmd);
+        }
+    }
+
+    free(line);
+    if(in != NULL) {
+        fclose(in);
+    }
+    server_conn_release(server, conn);
+}
+
+#ifdef SERVER_SOCKETS
+// A connection's reader thread, joined by the listener
+typedef struct _server_reader {
+    server_t* server;
+    server_conn_t* conn;
+    int fd;
+    int done; // the connection is closed, under the server lock
+    pthread_t thread;
+    struct _server_reader* next;
+} server_reader_t;
+
+static void*
+server_reader(void* p)
+{
+    server_reader_t* reader = p;
+    server_t* server = reader->server;
+    
+    // The second reference keeps the fd open until the reader is marked
+    // done, after which the listener doesn't shut it down any more
+    server_read_requests(server, reader->conn);
+    pthread_mutex_lock(&server->lock);
+    reader->done = 1;
+    pthread_mutex_unlock(&server->lock);
+    server_conn_release(server, reader->conn);
+    return NULL;
+}
+
+/**
+ * Join the reader threads which are done, or all of them once the server
+ * stops, waking those still reading by shutting down their connections
+ **/
+static void
+server_join_readers(server_t* server, server_reader_t** readers, int all)
+{
+    for(server_reader_t** link = readers; *link != NULL; ) {
+        server_reader_t* reader = *link;
+        pthread_mutex_lock(&server->lock);
+        int done = reader->done;
+        if(all && !done) {
+            shutdown(reader->fd, SHUT_RD);
+        }
+        pthread_mutex_unlock(&server->lock);
+        if(!all && !done) {
+            link = &reader->next;
+            continue;
+        }
+        pthread_join(reader->thread, NULL);
+        *link = reader->next;
+        xfree(reader);
+    }
+}
+
+/**
+ * Accept connections on a Unix domain socket until shut down
+ **/
+static ecli_result_t
+server_listen(server_t* server, const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return ECLI_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if((server->listen_fd < 0) ||
+       (0 != bind(server->listen_fd, (struct sockaddr*)&addr, sizeof(addr))) ||
+       (0 != listen(server->listen_fd, 64))) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        return ECLI_FAILURE;
+    }
+
+    server_reader_t* readers = NULL;
+    while(1) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if(fd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break; // shut down
+        }
+        server_join_readers(server, &readers, 0);
+
+        server_reader_t* reader = xmalloc(sizeof(server_reader_t));
+        memset(reader, 0, sizeof(server_reader_t));
+        reader->server = server;
+        reader->conn = server_conn_create(fd, fd, 1);
+        reader->conn->refs++; // dropped by server_reader() once done
+        reader->fd = fd;
+        if(0 != pthread_create(&reader->thread, NULL, server_reader, reader)) {
+            server_conn_release(server, reader->conn);
+            server_conn_release(server, reader->conn);
+            xfree(reader);
+            continue;
+        }
+        reader->next = readers;
+        readers = reader;
+    }
+
+    // The readers use the server, which goes away when ecli_serve() returns
+    server_join_readers(server, &readers, 1);
+    close(server->listen_fd);
+    unlink(path);
+    return ECLI_SUCCESS;
+}
+#endif
+
+/**
+ * Serve run requests until told to stop (or stdin is closed)
+ **/
+ecli_result_t
+ecli_serve(ecli_server_config_t* config)
+{
+    server_t server;
+    memset(&server, 0, sizeof(server_t));
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+    pthread_mutex_init(&server.cache.lock, NULL);
+    pthread_mutex_init(&server.coverage_lock, NULL);
+    server.cache.capacity = config->cache_size ? config->cache_size : DEFAULT_CACHE_SIZE;
+    server.cache.optimize = config->optimize;
+    server.cache.inline_limit = config->inline_limit;
+    server.budget = config->budget;
+    server.memo = config->memo;
+    if(server.budget.loop == 0) {
+        server.budget.loop = DEFAULT_LOOP_BUDGET;
+    }
+    server.listen_fd = -1;
+
+    unsigned int nworkers = config->workers;
+    if(nworkers == 0) {
+        nworkers = cpu_count();
+    }
+    pthread_t* workers = xmalloc(sizeof(pthread_t) * nworkers);
+    unsigned int started = 0;
+    while((started < nworkers) && (0 == pthread_create(&workers[started], NULL, server_worker, &server))) {
+        started++;
+    }
+
+    ecli_result_t result = ECLI_SUCCESS;
+    if(started == 0) {
+        fprintf(stderr, "Failed to start worker threads.\n");
+        result = ECLI_FAILURE;
+    } else if(config->socket_path) {
+#ifdef SERVER_SOCKETS
+        result = server_listen(&server, config->socket_path);
+#else
+        fprintf(stderr, "Unix domain sockets are not supported on this platform.\n");
+        result = ECLI_FAILURE;
+#endif
+    } else {
+        server_read_requests(&server, server_conn_create(STDIN_FILENO, STDOUT_FILENO, 0));
+    }
+
+    server_stop(&server);
+    for(unsigned int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    xfree(workers);
+
+    cache_clear(&server.cache);
+    pthread_mutex_destroy(&server.cache.lock);
+    pthread_mutex_destroy(&server.coverage_lock);
+    pthread_cond_destroy(&server.ready);
+    pthread_mutex_destroy(&server.lock);
+    return result;
+}
+
+#else
+
+ecli_result_t
+ecli_serve(ecli_server_config_t* config)
+{
+    fprintf(stderr, "Server mode needs threads, which are not available on this platform.\n");
+    return ECLI_FAILURE;
+}
+
+#endif
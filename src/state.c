@@ -1,236 +1,530 @@
-/**
- * Functions for handling the ECL interpreter state
- *
- * Redistribution and use in source and binary forms, with
- * or without modification, are permitted provided that the
- * following conditions are met:
- *
- * 1. Redistributions of source code must retain this list
- *    of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce this
- *    list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the
- *    distribution.
- *
- * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
- * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
- * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
- * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
- * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
- * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
- * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
- * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
- * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
- * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
- * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
- * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
- * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
- * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
- * DAMAGE.
- **/
-#include "ecli.h"
-
-#define STACK_SIZE 1024
-
-ecl_global_state_t global;
-
-/**
- * Allocate a new ECL VM
- **/
-ecli_result_t 
-allocate_ecl_state(ecl_state_t** statep, th10_ecl_t* ecl)
-{
-    ecl_state_t* state = xmalloc(sizeof(ecl_state_t));
-    *statep = state;
-    ecli_result_t retval = initialize_ecl_state(state, ecl);
-    
-    if(FAILURE(retval)) {
-        xfree(state);
-        *statep = NULL;
-    }
-    
-    return retval;
-}
-
-/**
- * Initialize a fresh ECL interpreter state
- **/
-ecli_result_t 
-initialize_ecl_state(ecl_state_t* state, th10_ecl_t* ecl)
-{
-    memset(state, 0, sizeof(ecl_state_t));
-    state->stack_size = STACK_SIZE;
-    state->ecl = ecl;
-    state->stack = xmalloc(sizeof(ecl_value_t)*STACK_SIZE);
-    state->callstack = xmalloc(sizeof(th10_instr_t*)*STACK_SIZE);
-    
-    memset(state->stack, 0, sizeof(ecl_value_t)*STACK_SIZE);
-    memset(state->callstack, 0, sizeof(th10_instr_t*)*STACK_SIZE);
-    
-    return ECLI_SUCCESS;
-}
-
-/**
- * Initialize global variables
- **/
-ecli_result_t
-initialize_globals()
-{
-    global.player_x = 0.0;
-    global.player_y = 0.0;
-    global.timeout = 0;
-    
-    return ECLI_SUCCESS;
-}
-
-/**
- * Free the ECL interpreter state
- **/
-void
-free_ecl_state(ecl_state_t* state)
-{
-    xfree(state->stack);
-    xfree(state->callstack);
-    memset(state, 0, sizeof(ecl_state_t));
-    xfree(state);
-}
-
-/**
- * Setup a stack frame
- **/
-ecli_result_t
-state_setup_frame(ecl_state_t* state, uint32_t nvars)
-{
-    state->stack[state->sp].type = ECL_UINT32;
-    state->stack[state->sp++].u = state->bp;
-    state->bp = state->sp;
-    state->sp += nvars;
-    for(unsigned int i = 0; i < nvars; i++) {
-        state->stack[state->bp + i].type = ECL_INT32;
-    }
-    
-    return ECLI_SUCCESS;
-}
-
-/**
- * Push a value on the ECL stack
- **/
-ecli_result_t
-state_push(ecl_state_t* state, ecl_value_t* value)
-{
-    state->stack[state->sp++] = *value;
-    return ECLI_SUCCESS;
-}
-
-/**
- * Pop a value from the ECL stack
- **/
-ecl_value_t*
-state_pop(ecl_state_t* state)
-{
-    return &state->stack[--state->sp];
-}
-
-/**
- * Peek a value from the top of the ECL stack
- **/
-ecl_value_t*
-state_peek(ecl_state_t* state)
-{
-    return &state->stack[state->sp - 1];
-}
-
-ecli_result_t
-state_get_variable(ecl_state_t* state, int32_t slot, ecl_value_t* result)
-{
-    if(slot >= 0) { // stack
-        ecl_value_t* v = &state->stack[state->bp + (slot >> 2)];
-        result->type = v->type;
-
-        switch(v->type) {
-            case ECL_INT32:
-                result->i = v->i;
-                break;
-            case ECL_FLOAT32:
-                result->f = v->f;
-                break;
-            default:
-                return ECLI_FAILURE; // unsupported type
-                break;
-        }
-    } else { // global/local
-        switch(slot) {
-            case -10000: // RAND
-                result->type = ECL_INT32;
-                result->i = rand();
-                break;
-            case -9988: // TIME
-                result->type = ECL_INT32;
-                result->i = state->time;
-                break;
-
-            case -9959: // DIFF
-                result->type = ECL_INT32;
-                result->i = 0;
-                if(global.difficulty == DIFF_EASY) { result->i = 0; }
-                if(global.difficulty == DIFF_NORMAL) { result->i = 1; }
-                if(global.difficulty == DIFF_HARD) { result->i = 2; }
-                if(global.difficulty == DIFF_LUNATIC) { result->i = 3; }
-                break;
-                
-            case -9953: // EASY
-                result->type = ECL_INT32;
-                result->i = (global.difficulty == DIFF_EASY) ? 1 : 0;
-                break;
-                
-            case -9952: // NORMAL
-                result->type = ECL_INT32;
-                result->i = (global.difficulty == DIFF_NORMAL) ? 1 : 0;
-                break;
-
-            case -9951: // HARD
-                result->type = ECL_INT32;
-                result->i = (global.difficulty == DIFF_HARD) ? 1 : 0;
-                break;
-            
-            case -9907: // SPELL_ID
-                result->type = ECL_INT32;
-                result->i = -1;
-                break;
-            
-            case -9550: // LUNATIC
-                result->type = ECL_INT32;
-                result->i = (global.difficulty == DIFF_LUNATIC) ? 1 : 0;
-                break;
-            
-            case -1: // from top of stack
-                *result = *state_pop(state);
-                break;
-        }
-    }
-    return ECLI_SUCCESS;
-}
-
-ecli_result_t
-state_set_variable(ecl_state_t* state, int32_t slot, ecl_value_t* value)
-{
-    if(slot >= 0) { // stack
-        slot = slot >> 2;
-        ecl_value_t* v = &state->stack[state->bp + slot];
-        v->type = value->type;
-        
-        switch(v->type) {
-            case ECL_INT32:
-                v->i = value->i;
-                break;
-            case ECL_FLOAT32:
-                v->f = value->f;
-                break;
-            default:
-                return ECLI_FAILURE;
-                break;
-        }
-    } else { // global/local
-    }
-    return ECLI_SUCCESS;
-}
+/**
+ * Functions for handling the ECL interpreter state
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include <stddef.h>
+
+#include "ecli.h"
+
+#define STACK_SIZE 1024
+
+// Where a global or per-VM variable lives
+typedef enum {
+    VAR_NONE=0, // no such variable
+    VAR_GLOBAL, // a cell of ecl_global_state_t
+    VAR_LOCAL, // a cell of ecl_state_t
+    VAR_ENEMY, // a kinematic field of the VM's enemy
+    VAR_COMPUTED // worked out by a getter
+} variable_kind_t;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t type; // ECL_INT32 or ECL_FLOAT32
+    uint8_t writable;
+    uint16_t offset; // of the cell, or the ENEMY_* field
+    void (*get)(ecl_state_t* state, ecl_value_t* result);
+} variable_t;
+
+static void
+var_rand(ecl_state_t* state, ecl_value_t* result)
+{
+    result->i = state_random(&state->rt->global) & 0x7FFFFFFF;
+}
+
+static void
+var_randf(ecl_state_t* state, ecl_value_t* result) // [0, 1)
+{
+    result->f = state_random_float(&state->rt->global);
+}
+
+static void
+var_randf2(ecl_state_t* state, ecl_value_t* result) // [-1, 1)
+{
+    var_randf(state, result);
+    result->f = result->f * 2.0f - 1.0f;
+}
+
+static void
+var_randrad(ecl_state_t* state, ecl_value_t* result) // [-pi, pi)
+{
+    var_randf2(state, result);
+    result->f *= PI;
+}
+
+// A kinematic field of the VM's enemy
+#define enemy_field(state, f) ((state)->rt->enemies.field[(f)][enemy_index((state)->enemy)])
+
+static void
+var_final_x(ecl_state_t* state, ecl_value_t* result)
+{
+    result->f = enemy_field(state, ENEMY_ABS_X) + enemy_field(state, ENEMY_REL_X);
+}
+
+static void
+var_final_y(ecl_state_t* state, ecl_value_t* result)
+{
+    result->f = enemy_field(state, ENEMY_ABS_Y) + enemy_field(state, ENEMY_REL_Y);
+}
+
+static void
+var_angle_player(ecl_state_t* state, ecl_value_t* result)
+{
+    ecl_global_state_t* global = &state->rt->global;
+    ecl_value_t x, y;
+    var_final_x(state, &x);
+    var_final_y(state, &y);
+    result->f = fmath_atan2(global->player_y - y.f, global->player_x - x.f);
+}
+
+static void
+var_diff(ecl_state_t* state, ecl_value_t* result)
+{
+    result->i = difficulty_index(state->rt->global.difficulty);
+}
+
+static void
+var_easy(ecl_state_t* state, ecl_value_t* result)
+{
+    result->i = (state->rt->global.difficulty == DIFF_EASY);
+}
+
+static void
+var_normal(ecl_state_t* state, ecl_value_t* result)
+{
+    result->i = (state->rt->global.difficulty == DIFF_NORMAL);
+}
+
+static void
+var_hard(ecl_state_t* state, ecl_value_t* result)
+{
+    result->i = (state->rt->global.difficulty == DIFF_HARD);
+}
+
+static void
+var_lunatic(ecl_state_t* state, ecl_value_t* result)
+{
+    result->i = (state->rt->global.difficulty == DIFF_LUNATIC);
+}
+
+static void
+var_spell_id(ecl_state_t* state, ecl_value_t* result)
+{
+    (void)state;
+    result->i = -1; // no spell card running
+}
+
+#define VARIABLE_SLOTS (VARIABLE_COUNT + 1) // the last one stands for every slot out of range
+#define VAR(slot) [(slot) + VARIABLE_BASE]
+#define GLOBAL(type, field, w) { VAR_GLOBAL, (type), (w), offsetof(ecl_global_state_t, field), NULL }
+#define LOCAL(type, field, w) { VAR_LOCAL, (type), (w), offsetof(ecl_state_t, field), NULL }
+#define ENEMY(field) { VAR_ENEMY, ECL_FLOAT32, 1, (field), NULL }
+#define COMPUTED(type, fn) { VAR_COMPUTED, (type), 0, 0, (fn) }
+
+// Indexed by slot + VARIABLE_BASE, see ins.c for the names
+static const variable_t variables[VARIABLE_SLOTS] = {
+    VAR(-10000) = COMPUTED(ECL_INT32, var_rand),
+    VAR(-9999) = COMPUTED(ECL_FLOAT32, var_randf),
+    VAR(-9998) = COMPUTED(ECL_FLOAT32, var_randrad),
+    VAR(-9997) = COMPUTED(ECL_FLOAT32, var_final_x),
+    VAR(-9996) = COMPUTED(ECL_FLOAT32, var_final_y),
+    VAR(-9995) = ENEMY(ENEMY_ABS_X),
+    VAR(-9994) = ENEMY(ENEMY_ABS_Y),
+    VAR(-9993) = ENEMY(ENEMY_REL_X),
+    VAR(-9992) = ENEMY(ENEMY_REL_Y),
+    VAR(-9991) = GLOBAL(ECL_FLOAT32, player_x, 0),
+    VAR(-9990) = GLOBAL(ECL_FLOAT32, player_y, 0),
+    VAR(-9989) = COMPUTED(ECL_FLOAT32, var_angle_player),
+    VAR(-9988) = LOCAL(ECL_INT32, time, 0),
+    VAR(-9987) = COMPUTED(ECL_FLOAT32, var_randf2),
+    VAR(-9986) = GLOBAL(ECL_INT32, timeout, 0),
+    VAR(-9985) = LOCAL(ECL_INT32, ivars[0], 1),
+    VAR(-9984) = LOCAL(ECL_INT32, ivars[1], 1),
+    VAR(-9983) = LOCAL(ECL_INT32, ivars[2], 1),
+    VAR(-9982) = LOCAL(ECL_INT32, ivars[3], 1),
+    VAR(-9981) = LOCAL(ECL_FLOAT32, fvars[0], 1),
+    VAR(-9980) = LOCAL(ECL_FLOAT32, fvars[1], 1),
+    VAR(-9979) = LOCAL(ECL_FLOAT32, fvars[2], 1),
+    VAR(-9978) = LOCAL(ECL_FLOAT32, fvars[3], 1),
+    VAR(-9959) = COMPUTED(ECL_INT32, var_diff),
+    VAR(-9953) = COMPUTED(ECL_INT32, var_easy),
+    VAR(-9952) = COMPUTED(ECL_INT32, var_normal),
+    VAR(-9951) = COMPUTED(ECL_INT32, var_hard),
+    VAR(-9950) = COMPUTED(ECL_INT32, var_lunatic),
+    VAR(-9907) = COMPUTED(ECL_INT32, var_spell_id),
+};
+
+/**
+ * Look up a global or per-VM variable, the catch-all entry for slots out of
+ * range
+ **/
+static inline const variable_t*
+lookup_variable(int32_t slot)
+{
+    int64_t index = (int64_t)slot + VARIABLE_BASE;
+    return &variables[(index >= 0 && index < VARIABLE_COUNT) ? index : VARIABLE_COUNT];
+}
+
+/**
+ * Allocate a new ECL VM starting at the given code, running for an enemy. It
+ * goes at the end of the runtime's VM table, so it runs after every VM
+ * already there.
+ **/
+ecli_result_t 
+allocate_ecl_state(ecl_state_t** statep, ecli_runtime_t* rt, ecl_code_t* code, enemy_handle_t enemy)
+{
+    ecl_state_t* state = vm_table_add(&rt->vms);
+    *statep = state;
+    ecli_result_t retval = initialize_ecl_state(state, rt, code, enemy);
+    
+    if(FAILURE(retval)) {
+        // still the last slot, give it back
+        rt->vms.count--;
+        rt->vms.live--;
+        *statep = NULL;
+    }
+    
+    return retval;
+}
+
+/**
+ * Initialize a fresh ECL interpreter state. The stacks get exactly the size
+ * the verifier worked out for the code, or STACK_SIZE with checks enabled if
+ * it couldn't.
+ **/
+ecli_result_t 
+initialize_ecl_state(ecl_state_t* state, ecli_runtime_t* rt, ecl_code_t* code, enemy_handle_t enemy)
+{
+    memset(state, 0, sizeof(ecl_state_t));
+    state->rt = rt;
+    state->ecl = rt->ecl;
+    state->enemy = enemy;
+    state->id = ++rt->vm_ids;
+    state->ip = ecl_code_entry(rt->ecl, code, rt->streams);
+    
+    if(code->stack == STACK_UNBOUNDED) {
+        state->checked = 1;
+        state->stack_size = STACK_SIZE;
+        state->callstack_size = STACK_SIZE;
+    } else {
+        state->stack_size = code->stack;
+        state->callstack_size = code->calls;
+    }
+    
+    // Never zero-sized, so the stacks are always valid allocations
+    state->stack = xmalloc(sizeof(ecl_value_t) * (state->stack_size + 1));
+    state->callstack = xmalloc(sizeof(ecl_op_t*) * (state->callstack_size + 1));
+    memset(state->stack, 0, sizeof(ecl_value_t) * (state->stack_size + 1));
+    enemy_attach(&rt->enemies, enemy);
+    
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Initialize global variables
+ **/
+ecli_result_t
+initialize_globals(ecl_global_state_t* global)
+{
+    global->player_x = 0.0;
+    global->player_y = 0.0;
+    global->timeout = 0;
+    global->chapter = 0;
+    state_seed_random(global, 1);
+    
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Seed the random number generator of a runtime
+ **/
+void
+state_seed_random(ecl_global_state_t* global, uint32_t seed)
+{
+    global->rng = seed ? seed : 0x2545F491; // xorshift can't start at zero
+}
+
+/**
+ * Get the next random number of a runtime (xorshift32), so runs are
+ * reproducible from their seed and runtimes don't share generator state
+ **/
+uint32_t
+state_random(ecl_global_state_t* global)
+{
+    uint32_t x = global->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    global->rng = x;
+    return x;
+}
+
+/**
+ * Get a random float in [0, 1) from the generator of a runtime
+ **/
+float
+state_random_float(ecl_global_state_t* global)
+{
+    return (state_random(global) >> 8) / 16777216.0f;
+}
+
+/**
+ * Free the ECL interpreter state. Its slot is marked finished and reused
+ * once the VM table is compacted.
+ **/
+void
+free_ecl_state(ecl_state_t* state)
+{
+    ecli_runtime_t* rt = state->rt;
+    enemy_detach(&rt->enemies, state->enemy);
+    xfree(state->stack);
+    xfree(state->callstack);
+    if(state->memo_pending) {
+        xfree(state->memo_pending); // one allocation, not in the memo yet
+    }
+    memset(state, 0, sizeof(ecl_state_t));
+    rt->vms.live--;
+}
+
+/**
+ * Get a slot at the end of a VM table, adding a chunk if they are all full
+ **/
+ecl_state_t*
+vm_table_add(ecl_vm_table_t* table)
+{
+    if(table->count == table->chunk_count * VM_CHUNK_SIZE) {
+        if(table->chunk_count == table->chunk_cap) {
+            table->chunk_cap = table->chunk_cap ? table->chunk_cap * 2 : 4;
+            table->chunks = xrealloc(table->chunks, sizeof(ecl_state_t*) * table->chunk_cap);
+        }
+        table->chunks[table->chunk_count++] = xmalloc(sizeof(ecl_state_t) * VM_CHUNK_SIZE);
+    }
+    uint32_t i = table->count++;
+    table->live++;
+    return vm_table_at(table, i);
+}
+
+/**
+ * Move the running VMs of a table down over the finished ones, keeping their
+ * order, and free the chunks left over except for one spare
+ **/
+void
+vm_table_compact(ecl_vm_table_t* table)
+{
+    if(table->live != table->count) {
+        uint32_t to = 0;
+        for(uint32_t from = 0; from < table->count; from++) {
+            ecl_state_t* state = vm_table_at(table, from);
+            if(vm_finished(state)) {
+                continue;
+            }
+            if(to != from) {
+                *vm_table_at(table, to) = *state;
+            }
+            to++;
+        }
+        table->count = to;
+    }
+    
+    uint32_t keep = (table->count + VM_CHUNK_SIZE - 1) / VM_CHUNK_SIZE + 1;
+    while(table->chunk_count > keep) {
+        table->chunk_count--;
+        xfree(table->chunks[table->chunk_count]);
+    }
+}
+
+/**
+ * Free the memory of a VM table, whose VMs must have been freed already
+ **/
+void
+vm_table_free(ecl_vm_table_t* table)
+{
+    while(table->chunk_count > 0) {
+        table->chunk_count--;
+        xfree(table->chunks[table->chunk_count]);
+    }
+    xfree(table->chunks);
+    table->chunk_cap = 0;
+    table->count = 0;
+    table->live = 0;
+}
+
+/**
+ * Setup a stack frame
+ **/
+ecli_result_t
+state_setup_frame(ecl_state_t* state, uint32_t nvars)
+{
+    state->stack[state->sp].type = ECL_UINT32;
+    state->stack[state->sp++].u = state->bp;
+    state->bp = state->sp;
+    state->sp += nvars;
+    for(unsigned int i = state->args; i < nvars; i++) {
+        state->stack[state->bp + i].type = ECL_INT32;
+    }
+    state->args = 0;
+    
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Get a variable of a slot, -1 popping the stack, >= 0 being stack locals
+ * and the rest global or per-VM variables
+ **/
+ecli_result_t
+state_get_variable(ecl_state_t* state, int32_t slot, ecl_value_t* result)
+{
+    if(slot >= 0) { // stack
+        ecl_value_t* v = &state->stack[state->bp + (slot >> 2)];
+        result->type = v->type;
+
+        switch(v->type) {
+            case ECL_INT32:
+                result->i = v->i;
+                break;
+            case ECL_FLOAT32:
+                result->f = v->f;
+                break;
+            default:
+                return ECLI_FAILURE; // unsupported type
+                break;
+        }
+    } else if(slot == -1) { // from top of stack
+        *result = state->stack[--state->sp];
+    } else { // global/local
+        const variable_t* var = lookup_variable(slot);
+        result->type = var->type;
+        switch(var->kind) {
+            case VAR_GLOBAL:
+                result->u = *(uint32_t*)((uint8_t*)&state->rt->global + var->offset);
+                break;
+            case VAR_LOCAL:
+                result->u = *(uint32_t*)((uint8_t*)state + var->offset);
+                break;
+            case VAR_ENEMY:
+                result->f = enemy_field(state, var->offset);
+                break;
+            case VAR_COMPUTED:
+                var->get(state, result);
+                break;
+            default:
+                fprintf(stderr, "Unknown variable %d\n", slot);
+                return ECLI_FAILURE;
+        }
+    }
+    return ECLI_SUCCESS;
+}
+
+/**
+ * Set a variable of a slot, converting the value to the variable's type if
+ * it isn't a stack local
+ **/
+ecli_result_t
+state_set_variable(ecl_state_t* state, int32_t slot, ecl_value_t* value)
+{
+    if(slot >= 0) { // stack
+        slot = slot >> 2;
+        ecl_value_t* v = &state->stack[state->bp + slot];
+        v->type = value->type;
+        
+        switch(v->type) {
+            case ECL_INT32:
+                v->i = value->i;
+                break;
+            case ECL_FLOAT32:
+                v->f = value->f;
+                break;
+            default:
+                return ECLI_FAILURE;
+                break;
+        }
+    } else { // global/local
+        const variable_t* var = lookup_variable(slot);
+        if(!var->writable) {
+            const char* name = ins_get_variable_name(slot);
+            fprintf(stderr, "Variable %s is read-only\n", name ? name : "(unknown)");
+            return ECLI_FAILURE;
+        }
+        
+        ecl_value_t v = *value;
+        value_convert(&v, var->type);
+        if(var->kind == VAR_ENEMY) {
+            enemy_field(state, var->offset) = v.f;
+        } else {
+            void* base = (var->kind == VAR_GLOBAL) ? (void*)&state->rt->global : (void*)state;
+            *(uint32_t*)((uint8_t*)base + var->offset) = v.u;
+        }
+    }
+    return ECLI_SUCCESS;
+}
+
+/**
+ * How a pure sub may use a global or per-VM variable: the I and F variables
+ * are cells of the VM, and the difficulty flags and the spell id only depend
+ * on the difficulty. Everything else changes from one call to the next.
+ **/
+variable_purity_t
+state_variable_purity(int32_t slot)
+{
+    const variable_t* var = lookup_variable(slot);
+    int32_t value;
+    if(var->kind == VAR_LOCAL && var->writable) {
+        return PURITY_VM;
+    }
+    if(var->get == var_spell_id || state_difficulty_variable(slot, DIFF_EASY, &value)) {
+        return PURITY_DIFFICULTY;
+    }
+    return PURITY_NONE;
+}
+
+/**
+ * Get the value a variable has on a difficulty, if it is one of those which
+ * tell the difficulties apart. Returns 0 for every other variable.
+ **/
+int
+state_difficulty_variable(int32_t slot, uint8_t difficulty, int32_t* value)
+{
+    const variable_t* var = lookup_variable(slot);
+    if(slot >= -1 || var->kind != VAR_COMPUTED) {
+        return 0;
+    }
+    if(var->get == var_diff) {
+        *value = difficulty_index(difficulty);
+    } else if(var->get == var_easy) {
+        *value = (difficulty == DIFF_EASY);
+    } else if(var->get == var_normal) {
+        *value = (difficulty == DIFF_NORMAL);
+    } else if(var->get == var_hard) {
+        *value = (difficulty == DIFF_HARD);
+    } else if(var->get == var_lunatic) {
+        *value = (difficulty == DIFF_LUNATIC);
+    } else {
+        return 0;
+    }
+    return 1;
+}
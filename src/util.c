@@ -1,162 +1,261 @@
-/**
- * Utility functions for ECLI
- *
- * Redistribution and use in source and binary forms, with
- * or without modification, are permitted provided that the
- * following conditions are met:
- *
- * 1. Redistributions of source code must retain this list
- *    of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce this
- *    list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the
- *    distribution.
- *
- * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
- * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
- * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
- * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
- * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
- * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
- * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
- * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
- * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
- * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
- * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
- * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
- * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
- * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
- * DAMAGE.
- **/
-#include "util.h"
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <ctype.h>
-
-static int argc;
-static int cur;
-static char** argv;
-static char* param;
-
-void*
-xmalloc(size_t amt)
-{
-    void* p = malloc(amt);
-    if(p == NULL) {
-        fprintf(stderr, "allocation of %d bytes failed!\n", amt);
-        exit(EXIT_FAILURE);
-    }
-    
-    return p;
-}
-
-/**
- * Command-line argument parsing
- **/
-void
-args_set(int _argc, char** _argv)
-{
-    argc = _argc;
-    argv = _argv;
-    cur = 1;
-}
-
-int
-arg_get(param_t* params)
-{
-    if(cur >= argc) {
-        return 0;
-    }
-    
-    char* arg = argv[cur++];
-    char c = arg[0];
-    
-    int is_long = 0;
-    if(c != '\0') {
-        if(c == '-') { /* option */
-            if(arg[1] == '-') { /* long option */
-                is_long = 1;
-            }
-        } else { /* positional argument */
-            param = arg;
-            return 1;
-        }
-        
-        // Look for the option
-        char found = 0;
-        for(param_t* p = params; p->shortname != '\0'; p++) {
-            
-            if(is_long) {
-                if(strcmp(&arg[2], p->longname) == 0) {
-                    found = p->shortname;
-                }
-            } else {
-                if(arg[1] == p->shortname) {
-                    found = p->shortname;
-                }
-            }
-            
-            // Look for the option's parameter, if it needs one
-            if(found) {
-                if(p->flag != NULL) {
-                    *(p->flag) = 1;
-                }
-
-                if(p->has_arg) {
-                    if((cur >= argc) || (argv[cur][0] == '-')) {
-                        fprintf(stderr, "No argument given for %s\n", arg);
-                    }
-                    param = argv[cur++];
-                }
-                break;
-            }
-        }
-        
-        if(!found) {
-            fprintf(stderr, "Unrecognized option: %s\n", arg);
-            return -1;
-        }
-        
-        return found;
-    }
-
-    return 0;
-}
-
-const char*
-arg_get_param()
-{
-    return param;
-}
-
-// Print usage/help string 
-void
-arg_print_usage(const char* description, const char* pos, param_t* params, const char* long_description)
-{
-    printf("%s: %s\n", argv[0], description);
-    printf("Usage: %s", argv[0]);
-    for(param_t* p = &params[0]; p->shortname != 0; p++) {
-        printf(" [-%c]", p->shortname);
-    }
-    
-    if(pos) {
-        printf(" %s", pos);
-    }
-    
-    printf("\n\nCommand-line arguments:\n");
-    for(param_t* p = &params[0]; p->shortname != 0; p++) {
-        printf("-%c", p->shortname);
-        if(p->longname) {
-            printf(",--%s", p->longname);
-        }
-        if(p->has_arg) {
-            printf(" arg");
-        }
-        if(p->desc) {
-            printf("\t\t%s", p->desc);
-        }
-        putchar('\n');
-    }
-}
+/**
+ * Utility functions for ECLI
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+static int argc;
+static int cur;
+static char** argv;
+static char* param;
+
+void*
+xmalloc(size_t amt)
+{
+    void* p = malloc(amt);
+    if(p == NULL) {
+        fprintf(stderr, "allocation of %d bytes failed!\n", amt);
+        exit(EXIT_FAILURE);
+    }
+    
+    return p;
+}
+
+void*
+xrealloc(void* p, size_t amt)
+{
+    p = realloc(p, amt);
+    if(p == NULL) {
+        fprintf(stderr, "reallocation to %zu bytes failed!\n", amt);
+        exit(EXIT_FAILURE);
+    }
+    
+    return p;
+}
+
+/**
+ * Number of online CPUs, or 1 if it can't be determined
+ **/
+unsigned int
+cpu_count(void)
+{
+#ifdef HAVE_UNISTD_H
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return (ncpu > 0) ? ncpu : 1;
+#else
+    return 1;
+#endif
+}
+
+/**
+ * Growable text buffers. The contents are not NUL-terminated.
+ **/
+void
+strbuf_init(strbuf_t* buf)
+{
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+void
+strbuf_free(strbuf_t* buf)
+{
+    xfree(buf->data);
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+// Make room for at least amt more bytes
+void
+strbuf_reserve(strbuf_t* buf, size_t amt)
+{
+    if(buf->len + amt > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 256;
+        while(cap < buf->len + amt) { cap <<= 1; }
+        buf->data = xrealloc(buf->data, cap);
+        buf->cap = cap;
+    }
+}
+
+void
+strbuf_append(strbuf_t* buf, const char* s, size_t len)
+{
+    strbuf_reserve(buf, len);
+    memcpy(buf->data + buf->len, s, len);
+    buf->len += len;
+}
+
+void
+strbuf_puts(strbuf_t* buf, const char* s)
+{
+    strbuf_append(buf, s, strlen(s));
+}
+
+void
+strbuf_printf(strbuf_t* buf, const char* format, ...)
+{
+    va_list args;
+    strbuf_reserve(buf, 64);
+    va_start(args, format);
+    int len = vsnprintf(buf->data + buf->len, buf->cap - buf->len, format, args);
+    va_end(args);
+    if(len < 0) {
+        return;
+    }
+    if((size_t)len >= buf->cap - buf->len) {
+        strbuf_reserve(buf, len + 1);
+        va_start(args, format);
+        vsnprintf(buf->data + buf->len, buf->cap - buf->len, format, args);
+        va_end(args);
+    }
+    buf->len += len;
+}
+
+/**
+ * Command-line argument parsing
+ **/
+void
+args_set(int _argc, char** _argv)
+{
+    argc = _argc;
+    argv = _argv;
+    cur = 1;
+}
+
+int
+arg_get(param_t* params)
+{
+    if(cur >= argc) {
+        return 0;
+    }
+    
+    char* arg = argv[cur++];
+    char c = arg[0];
+    
+    int is_long = 0;
+    if(c != '\0') {
+        if(c == '-') { /* option */
+            if(arg[1] == '-') { /* long option */
+                is_long = 1;
+            }
+        } else { /* positional argument */
+            param = arg;
+            return 1;
+        }
+        
+        // Look for the option
+        char found = 0;
+        for(param_t* p = params; p->shortname != '\0'; p++) {
+            
+            if(is_long) {
+                if(strcmp(&arg[2], p->longname) == 0) {
+                    found = p->shortname;
+                }
+            } else {
+                if(arg[1] == p->shortname) {
+                    found = p->shortname;
+                }
+            }
+            
+            // Look for the option's parameter, if it needs one
+            if(found) {
+                if(p->flag != NULL) {
+                    *(p->flag) = 1;
+                }
+
+                if(p->has_arg) {
+                    if(!is_long && arg[2] != '\0') { /* attached, as in -O1 */
+                        param = &arg[2];
+                        break;
+                    }
+                    if((cur >= argc) || (argv[cur][0] == '-')) {
+                        fprintf(stderr, "No argument given for %s\n", arg);
+                    }
+                    param = argv[cur++];
+                }
+                break;
+            }
+        }
+        
+        if(!found) {
+            fprintf(stderr, "Unrecognized option: %s\n", arg);
+            return -1;
+        }
+        
+        return found;
+    }
+
+    return 0;
+}
+
+const char*
+arg_get_param()
+{
+    return param;
+}
+
+// Print usage/help string 
+void
+arg_print_usage(const char* description, const char* pos, param_t* params, const char* long_description)
+{
+    printf("%s: %s\n", argv[0], description);
+    printf("Usage: %s", argv[0]);
+    for(param_t* p = &params[0]; p->shortname != 0; p++) {
+        printf(" [-%c]", p->shortname);
+    }
+    
+    if(pos) {
+        printf(" %s", pos);
+    }
+    
+    printf("\n\nCommand-line arguments:\n");
+    for(param_t* p = &params[0]; p->shortname != 0; p++) {
+        printf("-%c", p->shortname);
+        if(p->longname) {
+            printf(",--%s", p->longname);
+        }
+        if(p->has_arg) {
+            printf(" arg");
+        }
+        if(p->desc) {
+            printf("\t\t%s", p->desc);
+        }
+        putchar('\n');
+    }
+}
@@ -0,0 +1,204 @@
+/**
+ * Generator for synthetic ECL files, for benchmarking and testing ecli
+ *
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ecli.h"
+#include "builder.h"
+
+// Instructions in a generated sub that are not part of the repeated body
+#define SUB_OVERHEAD 12
+#define BLOCK_SIZE 6
+
+// Stack slots used by generated subs
+#define SLOT_A 0
+#define SLOT_B 4
+
+param_t params[] = {
+    {'h', "help", NULL, 0, "Print this message."},
+    {'s', "subs", NULL, 1, "Number of subs to generate besides main (default 16)."},
+    {'n', "instructions", NULL, 1, "Approximate number of instructions per sub (default 64)."},
+    {'l', "loops", NULL, 1, "Number of times each sub runs its body (default 1)."},
+    {0, NULL, NULL, 0, NULL}
+};
+
+const char* desc = "Synthetic ECL file generator";
+const char* pos = "outfile";
+const char* longdesc = NULL;
+
+static const uint8_t ranks[] = {
+    RANK_ALL, RANK_EASY, RANK_NORMAL, RANK_HARD, RANK_LUNATIC, RANK_EN, RANK_HL
+};
+
+/**
+ * Generate a sub which loops over a block of arithmetic, cycling through the
+ * rank masks:
+ *     stackAlloc(8); $A = 0;
+ *     loop: { $B = ($A * 3) % 7; ... $A = $A + 1; } while($A < loops);
+ *     return;
+ **/
+static ecli_result_t
+generate_sub(ecl_builder_t* b, const char* name, unsigned int blocks, unsigned int loops)
+{
+    ecli_result_t r = ecl_builder_begin_sub(b, name);
+    uint32_t loop = ecl_builder_new_label(b);
+
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_STACKALLOC, 0, "u", 8) : r;
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_PUSH, 0, "i", 0) : r;
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_SET, 1, "i", SLOT_A) : r;
+    r = SUCCESS(r) ? ecl_builder_bind_label(b, loop) : r;
+
+    for(unsigned int i = 0; SUCCESS(r) && (i < blocks); i++) {
+        ecl_builder_set_rank(b, ranks[i % sizeof(ranks)]);
+        r = ecl_builder_ins(b, INS_PUSH, 1, "i", SLOT_A);
+        r = SUCCESS(r) ? ecl_builder_ins(b, INS_PUSH, 0, "i", 3) : r;
+        r = SUCCESS(r) ? ecl_builder_ins(b, INS_MULI, 0, "") : r;
+        r = SUCCESS(r) ? ecl_builder_ins(b, INS_PUSH, 0, "i", 7) : r;
+        r = SUCCESS(r) ? ecl_builder_ins(b, INS_MODI, 0, "") : r;
+        r = SUCCESS(r) ? ecl_builder_ins(b, INS_SET, 1, "i", SLOT_B) : r;
+    }
+    ecl_builder_set_rank(b, RANK_ALL);
+
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_PUSH, 1, "i", SLOT_A) : r;
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_PUSH, 0, "i", 1) : r;
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_ADDI, 0, "") : r;
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_SET, 1, "i", SLOT_A) : r;
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_PUSH, 1, "i", SLOT_A) : r;
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_PUSH, 0, "i", loops) : r;
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_LESSI, 0, "") : r;
+    r = SUCCESS(r) ? ecl_builder_jump(b, INS_JMPNEQ, loop) : r;
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_RET, 0, "") : r;
+
+    return SUCCESS(r) ? ecl_builder_end_sub(b) : r;
+}
+
+/**
+ * Generate main, which calls every other sub in turn
+ **/
+static ecli_result_t
+generate_main(ecl_builder_t* b, const char** names, unsigned int count)
+{
+    ecli_result_t r = ecl_builder_begin_sub(b, "main");
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_STACKALLOC, 0, "u", 0) : r;
+    for(unsigned int i = 0; SUCCESS(r) && (i < count); i++) {
+        r = ecl_builder_ins(b, INS_CALL, 0, "s", names[i]);
+    }
+    r = SUCCESS(r) ? ecl_builder_ins(b, INS_RET, 0, "") : r;
+    return SUCCESS(r) ? ecl_builder_end_sub(b) : r;
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned int nsubs = 16, nins = 64, loops = 1;
+    const char* fname = NULL;
+    int c;
+
+    args_set(argc, argv);
+    while((c = arg_get(params)) != 0) {
+        switch(c) {
+            case -1:
+                arg_print_usage(desc, pos, params, longdesc);
+                return EXIT_FAILURE;
+
+            case 'h':
+                arg_print_usage(desc, pos, params, longdesc);
+                return EXIT_SUCCESS;
+
+            case 's':
+                nsubs = strtoul(arg_get_param(), NULL, 0);
+                break;
+
+            case 'n':
+                nins = strtoul(arg_get_param(), NULL, 0);
+                break;
+
+            case 'l':
+                loops = strtoul(arg_get_param(), NULL, 0);
+                break;
+
+            case 1:
+                if(fname != NULL) {
+                    fprintf(stderr, "Multiple files given on command line.\n");
+                    return EXIT_FAILURE;
+                }
+                fname = arg_get_param();
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if(fname == NULL) {
+        fprintf(stderr, "No output file given.\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE* f = fopen(fname, "wb");
+    if(f == NULL) {
+        fprintf(stderr, "Failed to open file %s\n", fname);
+        return EXIT_FAILURE;
+    }
+
+    // main plus the generated subs
+    const char** names = xmalloc(sizeof(char*) * (nsubs + 1));
+    for(unsigned int i = 0; i < nsubs; i++) {
+        char* name = xmalloc(16);
+        snprintf(name, 16, "sub%05u", i);
+        names[i] = name;
+    }
+    names[nsubs] = "main";
+
+    unsigned int blocks = (nins > SUB_OVERHEAD) ? (nins - SUB_OVERHEAD) / BLOCK_SIZE : 0;
+
+    ecl_builder_t b;
+    ecl_builder_init(&b, f);
+    ecli_result_t r = ecl_builder_begin_subs(&b, names, nsubs + 1);
+    r = SUCCESS(r) ? generate_main(&b, names, nsubs) : r;
+    for(unsigned int i = 0; SUCCESS(r) && (i < nsubs); i++) {
+        r = generate_sub(&b, names[i], blocks, loops);
+    }
+    r = SUCCESS(r) ? ecl_builder_finish(&b) : r;
+
+    ecl_builder_free(&b);
+    fclose(f);
+    for(unsigned int i = 0; i < nsubs; i++) {
+        free((void*)names[i]);
+    }
+    xfree(names);
+
+    if(!SUCCESS(r)) {
+        fprintf(stderr, "Failed to generate %s\n", fname);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}